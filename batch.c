@@ -0,0 +1,589 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "hidapi.h"
+#include "hid_log.h"
+#include "bellwin.h"
+#include "device.h"
+#include "sim.h"
+#include "timeutil.h"
+#include "health.h"
+#include "batch.h"
+#include "devlock.h"
+
+#define BATCH_WINDOW		256	/* results not yet printed */
+#define BATCH_DEV_DEPTH		16	/* status queries in flight per device */
+#define BATCH_LINE_MAX		1024
+#define BATCH_MAX_ARGS		16
+#define BATCH_CYCLE_MS		1000
+#define BATCH_PROBE		UINT64_MAX	/* status query without a result */
+#define BATCH_LOCK_RETRY_MS	10	/* while another process has a device */
+
+struct result {
+	int done;
+	char text[320];
+};
+
+struct bdev {
+	char *name;
+	hid_device *hid;
+	struct bellwin_sim *sim;
+	struct devlock lock;
+	int locked;
+	uint64_t lock_retry;		/* next attempt while it is busy */
+
+	/*
+	 * Replies come back in order, so queries are matched FIFO.  The head
+	 * query is timed from when it was sent or reached the head, whichever
+	 * is later, so queueing behind earlier queries is not counted.
+	 */
+	uint64_t status_seq[BATCH_DEV_DEPTH];
+	uint64_t status_sent[BATCH_DEV_DEPTH];
+	uint64_t head_since;
+	unsigned qhead, qlen;
+	struct rtt_est rtt;
+	struct health health;
+
+	int cycle_pending;
+	int cycle_outlet;
+	uint64_t cycle_seq;
+	uint64_t cycle_due;
+
+	struct bdev *next;
+};
+
+struct batch {
+	const struct batch_opts *opts;
+	int in_fd;
+	int eof;
+	char in[BATCH_LINE_MAX];
+	size_t in_len;
+	char pending[BATCH_LINE_MAX];	/* line that could not run yet */
+	int has_pending;
+	unsigned lineno;
+
+	struct result results[BATCH_WINDOW];
+	uint64_t head, tail;		/* next result to print, next to allocate */
+
+	uint64_t sleep_until;
+	uint64_t sleep_seq;
+
+	struct bdev *devs;
+	struct hid_device_info *enumerated;
+	int failures;
+};
+
+static uint64_t result_new(struct batch *b)
+{
+	struct result *r = &b->results[b->tail % BATCH_WINDOW];
+
+	r->done = 0;
+	r->text[0] = '\0';
+	return b->tail++;
+}
+
+static void result_done(struct batch *b, uint64_t seq, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void result_done(struct batch *b, uint64_t seq, const char *fmt, ...)
+{
+	struct result *r = &b->results[seq % BATCH_WINDOW];
+	va_list ap;
+
+	if (seq == BATCH_PROBE)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(r->text, sizeof(r->text), fmt, ap);
+	va_end(ap);
+	r->done = 1;
+	if (!strncmp(r->text, "err", 3))
+		b->failures++;
+}
+
+static void flush_results(struct batch *b)
+{
+	bool printed = false;
+
+	while (b->head != b->tail && b->results[b->head % BATCH_WINDOW].done) {
+		puts(b->results[b->head % BATCH_WINDOW].text);
+		b->head++;
+		printed = true;
+	}
+	if (printed)
+		fflush(stdout);
+}
+
+static struct bdev *find_device(struct batch *b, const char *name)
+{
+	struct hid_device_info *cur;
+	struct bdev *dev;
+	hid_device *hid = NULL;
+	struct bellwin_sim *sim = NULL;
+	unsigned idx;
+
+	for (dev = b->devs; dev; dev = dev->next)
+		if (!strcmp(dev->name, name))
+			return dev;
+
+	if (b->opts->simulate) {
+		if (sscanf(name, "SIM%u", &idx) == 1 && idx < b->opts->simulate)
+			sim = bellwin_sim_start(0, b->opts->sim_latency_us, &hid);
+	} else if (name[0] == '/') {
+		hid = hid_open_path(name);
+	} else {
+		if (!b->enumerated)
+			b->enumerated = hid_enumerate(BELLWIN_VENDOR, BELLWIN_PRODUCT);
+		for (cur = b->enumerated; cur && !hid; cur = cur->next) {
+			char *serial = wchar_to_utf8(cur->serial_number);
+
+			if (serial && !strcmp(serial, name))
+				hid = hid_open_path(cur->path);
+			free(serial);
+		}
+	}
+	if (!hid)
+		return NULL;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		hid_close(hid);
+		bellwin_sim_stop(sim);
+		return NULL;
+	}
+	dev->name = strdup(name);
+	dev->hid = hid;
+	dev->lock.fd = -1;
+	dev->sim = sim;
+	rtt_init(&dev->rtt);
+	health_init(&dev->health);
+	dev->next = b->devs;
+	b->devs = dev;
+
+	return dev;
+}
+
+/*
+ * Lock @dev before talking to it and keep it until its exchanges are done,
+ * so that other invocations cannot take its replies.  Waiting here would
+ * hold up every other device, and waiting while holding other devices'
+ * locks could deadlock with a fan-out: while somebody else has it, the
+ * command is put off and the lock tried again BATCH_LOCK_RETRY_MS later.
+ */
+static bool device_lock(struct bdev *dev)
+{
+	if (dev->locked)
+		return true;
+	if (devlock_try(&dev->lock, dev->hid, "batch")) {
+		if (errno == EWOULDBLOCK) {
+			dev->lock_retry = now_ns() +
+					  BATCH_LOCK_RETRY_MS * 1000000ull;
+			return false;
+		}
+		hid_log_warn(dev->name, "Unable to lock device: %m");
+	}
+	dev->locked = 1;
+	dev->lock_retry = 0;
+
+	return true;
+}
+
+/* Let other invocations have @dev once nothing is outstanding on it. */
+static void device_unlock_idle(struct bdev *dev)
+{
+	if (!dev->locked || dev->qlen || dev->cycle_pending)
+		return;
+	devlock_release(&dev->lock);
+	dev->locked = 0;
+}
+
+static void send_set(struct bdev *dev, int outlet, bool on)
+{
+	char cmd[BELLWIN_CMD_LEN];
+
+	prepare_cmd(cmd, outlet, on);
+	send_command(dev->hid, cmd, BELLWIN_CMD_LEN);
+}
+
+static void send_status(struct bdev *dev, uint64_t seq)
+{
+	const char cmd[BELLWIN_CMD_LEN] = { BELLWIN_CMD_STATUS };
+	unsigned slot = (dev->qhead + dev->qlen) % BATCH_DEV_DEPTH;
+
+	send_command(dev->hid, cmd, BELLWIN_CMD_LEN);
+	dev->status_seq[slot] = seq;
+	dev->status_sent[slot] = now_ns();
+	if (!dev->qlen)
+		dev->head_since = dev->status_sent[slot];
+	dev->qlen++;
+}
+
+/*
+ * Run one command line.  Returns false when it has to wait for earlier
+ * work to finish, in which case it is retried later.
+ */
+static bool execute(struct batch *b, const char *text, unsigned lineno)
+{
+	char line[BATCH_LINE_MAX];
+	char *argv[BATCH_MAX_ARGS];
+	char *saveptr = NULL;
+	struct bdev *dev;
+	uint64_t seq;
+	int argc = 0;
+	char *tok;
+	int i;
+
+	snprintf(line, sizeof(line), "%s", text);
+	for (tok = strtok_r(line, " \t\r", &saveptr); tok && argc < BATCH_MAX_ARGS;
+	     tok = strtok_r(NULL, " \t\r", &saveptr))
+		argv[argc++] = tok;
+	if (!argc || argv[0][0] == '#')
+		return true;
+
+	if (b->tail - b->head == BATCH_WINDOW)
+		return false;
+
+	if (!strcmp(argv[0], "sleep")) {
+		if (b->head != b->tail)
+			return false;
+		seq = result_new(b);
+		if (argc != 2) {
+			result_done(b, seq, "err %u usage: sleep <ms>", lineno);
+			return true;
+		}
+		b->sleep_seq = seq;
+		b->sleep_until = now_ns() + strtoull(argv[1], NULL, 0) * 1000000ull;
+		return true;
+	}
+
+	if (argc < 2) {
+		seq = result_new(b);
+		result_done(b, seq, "err %u missing command", lineno);
+		return true;
+	}
+
+	dev = find_device(b, argv[0]);
+	if (dev && dev->cycle_pending)
+		return false;
+	if (dev && !strcmp(argv[1], "status") && dev->qlen == BATCH_DEV_DEPTH)
+		return false;
+	if (dev && strcmp(argv[1], "health") && health_usable(&dev->health) &&
+	    !device_lock(dev))
+		return false;
+
+	seq = result_new(b);
+	if (!dev) {
+		result_done(b, seq, "err %u no such device %s", lineno, argv[0]);
+		return true;
+	}
+
+	if (!strcmp(argv[1], "health")) {
+		char buf[sizeof(b->results[0].text) - 32];
+
+		health_format(&dev->health, now_ns(), buf, sizeof(buf));
+		result_done(b, seq, "ok %s %s", dev->name, buf);
+	} else if (!health_usable(&dev->health)) {
+		/* Fail fast instead of waiting out another timeout. */
+		result_done(b, seq, "err %u %s quarantined", lineno, dev->name);
+	} else if (!strcmp(argv[1], "status")) {
+		send_status(dev, seq);
+	} else if (!strcmp(argv[1], "cycle")) {
+		int outlet = argc > 2 ? atoi(argv[2]) : 0;
+		unsigned ms = argc > 3 ? strtoul(argv[3], NULL, 0) : BATCH_CYCLE_MS;
+
+		if (outlet < 1 || outlet > POWER_SWITCH_COUNT) {
+			result_done(b, seq, "err %u invalid outlet", lineno);
+			return true;
+		}
+		send_set(dev, outlet, false);
+		dev->cycle_pending = 1;
+		dev->cycle_outlet = outlet;
+		dev->cycle_seq = seq;
+		dev->cycle_due = now_ns() + ms * 1000000ull;
+	} else {
+		int offset[BATCH_MAX_ARGS], value[BATCH_MAX_ARGS];
+
+		/* Validate the whole line before switching anything. */
+		for (i = 1; i < argc; i++) {
+			if (sscanf(argv[i], "%d=%d", &offset[i], &value[i]) != 2 ||
+			    offset[i] < 1 || offset[i] > POWER_SWITCH_COUNT ||
+			    (value[i] != 0 && value[i] != 1)) {
+				result_done(b, seq, "err %u invalid outlet mapping: %s",
+					    lineno, argv[i]);
+				return true;
+			}
+		}
+		for (i = 1; i < argc; i++)
+			send_set(dev, offset[i], value[i]);
+		result_done(b, seq, "ok %s", dev->name);
+	}
+
+	return true;
+}
+
+/* Run buffered input lines until one has to wait. */
+static void run_input(struct batch *b)
+{
+	char *nl;
+
+	while (!b->sleep_until) {
+		/* Completed results must not hold back sleep or the window. */
+		flush_results(b);
+		if (b->has_pending) {
+			if (!execute(b, b->pending, b->lineno))
+				return;
+			b->has_pending = 0;
+			continue;
+		}
+
+		nl = memchr(b->in, '\n', b->in_len);
+		if (!nl)
+			return;
+		*nl = '\0';
+		b->lineno++;
+		if (!execute(b, b->in, b->lineno)) {
+			strcpy(b->pending, b->in);
+			b->has_pending = 1;
+		}
+		b->in_len -= nl - b->in + 1;
+		memmove(b->in, nl + 1, b->in_len);
+	}
+}
+
+static void read_input(struct batch *b)
+{
+	ssize_t n;
+
+	if (b->in_len == sizeof(b->in)) {
+		/* No newline in a full buffer: drop the line. */
+		result_done(b, result_new(b), "err %u line too long", ++b->lineno);
+		b->in_len = 0;
+		return;
+	}
+
+	n = read(b->in_fd, b->in + b->in_len, sizeof(b->in) - b->in_len);
+	if (n < 0 && errno == EINTR)
+		return;
+	if (n <= 0) {
+		b->eof = 1;
+		/* Terminate a last line without newline. */
+		if (b->in_len && b->in_len < sizeof(b->in))
+			b->in[b->in_len++] = '\n';
+		return;
+	}
+	b->in_len += n;
+}
+
+static uint64_t status_head_start(const struct bdev *dev)
+{
+	uint64_t sent = dev->status_sent[dev->qhead];
+
+	return sent > dev->head_since ? sent : dev->head_since;
+}
+
+static uint64_t status_deadline(const struct bdev *dev)
+{
+	return status_head_start(dev) + rtt_timeout_ns(&dev->rtt);
+}
+
+static void status_pop(struct bdev *dev, uint64_t now)
+{
+	dev->qhead = (dev->qhead + 1) % BATCH_DEV_DEPTH;
+	dev->qlen--;
+	dev->head_since = now;
+}
+
+static void device_readable(struct batch *b, struct bdev *dev)
+{
+	unsigned char buf[BELLWIN_REPORT_SIZE];
+	int res;
+
+	res = hid_read_timeout(dev->hid, buf, sizeof(buf), 0);
+	if (res == 0 || !dev->qlen)
+		return;
+
+	if (res > BELLWIN_STATUS_MASK && buf[0] == BELLWIN_CMD_STATUS) {
+		uint64_t now = now_ns();
+
+		rtt_sample(&dev->rtt, now - status_head_start(dev));
+		health_success(&dev->health, now - status_head_start(dev), now);
+		result_done(b, dev->status_seq[dev->qhead], "ok %s mask=0x%02x",
+			    dev->name, buf[BELLWIN_STATUS_MASK] & POWER_SWITCH_ALL);
+		status_pop(dev, now);
+		return;
+	}
+
+	if (res < 0) {
+		health_failure(&dev->health, false, now_ns());
+		while (dev->qlen) {
+			result_done(b, dev->status_seq[dev->qhead],
+				    "err %s device read failed", dev->name);
+			status_pop(dev, now_ns());
+		}
+	}
+}
+
+static void run_timers(struct batch *b, uint64_t now)
+{
+	struct bdev *dev;
+
+	if (b->sleep_until && b->sleep_until <= now) {
+		b->sleep_until = 0;
+		result_done(b, b->sleep_seq, "ok sleep");
+	}
+
+	for (dev = b->devs; dev; dev = dev->next) {
+		if (dev->cycle_pending && dev->cycle_due <= now) {
+			send_set(dev, dev->cycle_outlet, true);
+			dev->cycle_pending = 0;
+			result_done(b, dev->cycle_seq, "ok %s cycle %d", dev->name,
+				    dev->cycle_outlet);
+		}
+		while (dev->qlen && status_deadline(dev) <= now) {
+			bool usable = health_usable(&dev->health);
+
+			result_done(b, dev->status_seq[dev->qhead], "err %s timeout",
+				    dev->name);
+			rtt_backoff(&dev->rtt);
+			status_pop(dev, now);
+			health_failure(&dev->health, true, now);
+			if (usable && !health_usable(&dev->health)) {
+				hid_log_warn(dev->name, "quarantined");
+				while (dev->qlen) {
+					result_done(b, dev->status_seq[dev->qhead],
+						    "err %s quarantined", dev->name);
+					status_pop(dev, now);
+				}
+			}
+		}
+		if (!dev->qlen && health_probe_due(&dev->health, now) &&
+		    device_lock(dev))
+			send_status(dev, BATCH_PROBE);
+	}
+}
+
+static uint64_t next_deadline(struct batch *b)
+{
+	uint64_t next = b->sleep_until ? b->sleep_until : UINT64_MAX;
+	uint64_t now = now_ns();
+	struct bdev *dev;
+
+	for (dev = b->devs; dev; dev = dev->next) {
+		uint64_t probe = health_next_probe(&dev->health);
+
+		/*
+		 * A command put off by a busy lock is tried again at
+		 * lock_retry; a retry in the past waits for the command.
+		 */
+		if (!dev->locked && dev->lock_retry > now &&
+		    dev->lock_retry < next)
+			next = dev->lock_retry;
+		if (!dev->locked && dev->lock_retry > probe)
+			probe = dev->lock_retry;
+		if (dev->cycle_pending && dev->cycle_due < next)
+			next = dev->cycle_due;
+		if (dev->qlen && status_deadline(dev) < next)
+			next = status_deadline(dev);
+		if (!dev->qlen && probe < next)
+			next = probe;
+	}
+
+	return next;
+}
+
+int batch_run(const char *filename, const struct batch_opts *opts)
+{
+	struct batch *b;
+	struct bdev *dev;
+	int ret;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return 1;
+	b->opts = opts;
+
+	if (!strcmp(filename, "-")) {
+		b->in_fd = STDIN_FILENO;
+	} else {
+		b->in_fd = open(filename, O_RDONLY | O_CLOEXEC);
+		if (b->in_fd < 0) {
+			hid_log_error(filename, "Unable to open batch file: %m");
+			free(b);
+			return 1;
+		}
+	}
+
+	for (;;) {
+		struct pollfd fds[1 + 256];
+		struct bdev *polled[1 + 256];
+		unsigned nfds = 0, i;
+		uint64_t next, now;
+		int timeout = -1;
+
+		run_input(b);
+		flush_results(b);
+
+		if (b->eof && !b->has_pending && !b->in_len && b->head == b->tail)
+			break;
+		for (dev = b->devs; dev; dev = dev->next)
+			device_unlock_idle(dev);
+
+		if (!b->eof && !b->has_pending && !b->sleep_until) {
+			fds[nfds].fd = b->in_fd;
+			fds[nfds].events = POLLIN;
+			polled[nfds++] = NULL;
+		}
+		for (dev = b->devs; dev && nfds < 1 + 256; dev = dev->next) {
+			if (!dev->qlen)
+				continue;
+			fds[nfds].fd = hid_get_fd(dev->hid);
+			fds[nfds].events = POLLIN;
+			polled[nfds++] = dev;
+		}
+
+		next = next_deadline(b);
+		if (next != UINT64_MAX) {
+			now = now_ns();
+			timeout = next > now ? (next - now + 999999) / 1000000 : 0;
+		}
+
+		if (poll(fds, nfds, timeout) < 0 && errno != EINTR) {
+			hid_log_error(NULL, "poll: %m");
+			break;
+		}
+
+		for (i = 0; i < nfds; i++) {
+			if (!fds[i].revents)
+				continue;
+			if (polled[i])
+				device_readable(b, polled[i]);
+			else
+				read_input(b);
+		}
+
+		run_timers(b, now_ns());
+	}
+
+	ret = b->failures ? 1 : 0;
+
+	while ((dev = b->devs)) {
+		b->devs = dev->next;
+		devlock_release(&dev->lock);
+		hid_close(dev->hid);
+		bellwin_sim_stop(dev->sim);
+		free(dev->name);
+		free(dev);
+	}
+	hid_free_enumeration(b->enumerated);
+	if (b->in_fd != STDIN_FILENO)
+		close(b->in_fd);
+	free(b);
+
+	return ret;
+}
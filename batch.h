@@ -0,0 +1,37 @@
+/*
+ * Batch mode: stream commands from a file or stdin over devices that stay
+ * open for the whole run.
+ *
+ * One command per line, one result line per command, in input order:
+ *
+ *   <dev> <outlet>=<0|1> ...   ok <dev>
+ *   <dev> status               ok <dev> mask=0x13
+ *   <dev> cycle <outlet> [ms]  ok <dev> cycle <outlet>   (off, wait, on)
+ *   <dev> health               ok <dev> state=ok err_rate=0.000 ...
+ *   sleep <ms>                 ok sleep
+ *
+ * Failures are reported as "err <line> <reason>".  <dev> is a serial number
+ * or device path.  Blank lines and lines starting with '#' are ignored.
+ *
+ * I/O is pipelined: set reports are written as soon as they are read, status
+ * queries to several devices (or several to one device) are outstanding at
+ * the same time, and a cycle only holds back later commands for its own
+ * device.  "sleep" waits for everything before it.
+ *
+ * A device that keeps timing out is quarantined (health.h): its commands
+ * fail at once with "err <line> <dev> quarantined" while it is probed in the
+ * background, so one dead splitter does not slow down the others.
+ */
+
+#ifndef BATCH_H__
+#define BATCH_H__
+
+struct batch_opts {
+	unsigned simulate;		/* serve SIM<n> devices instead of hardware */
+	unsigned sim_latency_us;
+};
+
+/* Run the commands in @filename ("-" for stdin).  Returns 0 if all succeeded. */
+int batch_run(const char *filename, const struct batch_opts *opts);
+
+#endif
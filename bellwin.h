@@ -0,0 +1,31 @@
+/*
+ * Bellwin UP516EU protocol definitions.
+ *
+ * Every report is 64 bytes, padded with 0x5A.  A status query (0x08) is
+ * answered with a report carrying the outlet mask at byte 5; a set report
+ * (0x0b) carries the zero based outlet index at byte 5 and the new state
+ * at byte 6.
+ */
+
+#ifndef BELLWIN_H__
+#define BELLWIN_H__
+
+#define BELLWIN_VENDOR	0x04d8
+#define BELLWIN_PRODUCT	0xfedc
+#define BIT(x) (1 << (x))
+
+#define POWER_SWITCH_COUNT 5
+#define POWER_SWITCH_ALL ((1 << POWER_SWITCH_COUNT) - 1)
+
+#define BELLWIN_REPORT_SIZE	0x40
+#define BELLWIN_REPORT_PAD	0x5A
+#define BELLWIN_CMD_LEN		7
+
+#define BELLWIN_CMD_STATUS	0x08
+#define BELLWIN_CMD_SET		0x0b
+
+#define BELLWIN_STATUS_MASK	5
+#define BELLWIN_SET_INDEX	5
+#define BELLWIN_SET_VALUE	6
+
+#endif
@@ -0,0 +1,557 @@
+/*
+ * C++20 coroutine API over the Bellwin device layer.
+ *
+ * Header only; link against hidlib (hid.o hid_capture.o hid_log.o -ludev
+ * -pthread, see the tools/coro_example rule).  An executor drives every
+ * device from one thread with epoll on the hidraw descriptors, so thousands
+ * of operations can be in flight while each sequence reads as straight-line
+ * code:
+ *
+ *   bellwin::executor ex;
+ *   auto devs = bellwin::enumerate();
+ *   bellwin::device dev(ex, bellwin::open_path(devs.begin()->path));
+ *
+ *   ex.spawn([&]() -> bellwin::task<> {
+ *       co_await dev.set(3, false);
+ *       co_await dev.cycle(1, std::chrono::seconds(2));
+ *       uint8_t mask = co_await dev.status();
+ *   }());
+ *   ex.run();
+ *
+ * Operations on one device are serialized in submission order; operations
+ * on different devices interleave freely.  Failed writes are retried as
+ * send_command() does, without blocking the executor between tries.
+ * Failures throw bellwin::error, lost replies throw bellwin::timeout_error.
+ */
+
+#ifndef BELLWIN_HPP__
+#define BELLWIN_HPP__
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "hidapi.h"
+#include "bellwin.h"
+#include "device.h"
+
+namespace bellwin {
+
+class error : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+class timeout_error : public error {
+public:
+	using error::error;
+};
+
+/* RAII handles */
+
+struct device_closer {
+	void operator()(hid_device *dev) const { hid_close(dev); }
+};
+
+using device_handle = std::unique_ptr<hid_device, device_closer>;
+
+inline device_handle open_path(const char *path)
+{
+	device_handle h(hid_open_path(path));
+
+	if (!h)
+		throw error(std::string("unable to open ") + path);
+	return h;
+}
+
+class enumeration {
+public:
+	class iterator {
+	public:
+		explicit iterator(hid_device_info *cur) : cur_(cur) {}
+		const hid_device_info &operator*() const { return *cur_; }
+		const hid_device_info *operator->() const { return cur_; }
+		iterator &operator++() { cur_ = cur_->next; return *this; }
+		bool operator==(const iterator &o) const { return cur_ == o.cur_; }
+	private:
+		hid_device_info *cur_;
+	};
+
+	explicit enumeration(hid_device_info *head) : head_(head) {}
+	iterator begin() const { return iterator(head_.get()); }
+	iterator end() const { return iterator(nullptr); }
+	bool empty() const { return !head_; }
+
+private:
+	struct freer {
+		void operator()(hid_device_info *d) const { hid_free_enumeration(d); }
+	};
+	std::unique_ptr<hid_device_info, freer> head_;
+};
+
+inline enumeration enumerate(unsigned short vid = BELLWIN_VENDOR,
+			     unsigned short pid = BELLWIN_PRODUCT)
+{
+	return enumeration(hid_enumerate(vid, pid));
+}
+
+/* Coroutine task */
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+struct final_awaiter {
+	bool await_ready() const noexcept { return false; }
+
+	template <typename P>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+	{
+		if (auto cont = h.promise().continuation)
+			return cont;
+		return std::noop_coroutine();
+	}
+
+	void await_resume() const noexcept {}
+};
+
+struct promise_base {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	final_awaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct promise : promise_base {
+	std::variant<std::monostate, T> value;
+
+	task<T> get_return_object();
+	void return_value(T v) { value.template emplace<1>(std::move(v)); }
+	T result()
+	{
+		if (exception)
+			std::rethrow_exception(exception);
+		return std::move(std::get<1>(value));
+	}
+};
+
+template <>
+struct promise<void> : promise_base {
+	task<void> get_return_object();
+	void return_void() {}
+	void result()
+	{
+		if (exception)
+			std::rethrow_exception(exception);
+	}
+};
+
+} /* namespace detail */
+
+/* A lazily started coroutine; awaiting it runs it to completion. */
+template <typename T>
+class task {
+public:
+	using promise_type = detail::promise<T>;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	explicit task(handle_type h) : coro_(h) {}
+	task(task &&o) noexcept : coro_(std::exchange(o.coro_, {})) {}
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+	~task()
+	{
+		if (coro_)
+			coro_.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+	{
+		coro_.promise().continuation = caller;
+		return coro_;
+	}
+
+	T await_resume() { return coro_.promise().result(); }
+
+private:
+	handle_type coro_;
+};
+
+namespace detail {
+
+template <typename T>
+task<T> promise<T>::get_return_object()
+{
+	return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object()
+{
+	return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+} /* namespace detail */
+
+/* Executor */
+
+class executor {
+public:
+	using clock = std::chrono::steady_clock;
+
+	executor() : epfd_(epoll_create1(EPOLL_CLOEXEC))
+	{
+		if (epfd_ < 0)
+			throw error("epoll_create1 failed");
+	}
+
+	~executor() { close(epfd_); }
+
+	executor(const executor &) = delete;
+	executor &operator=(const executor &) = delete;
+
+	/*
+	 * Run @t in the background; run() returns once all spawned tasks are
+	 * done.  An exception escaping @t terminates the program.
+	 */
+	void spawn(task<> t)
+	{
+		outstanding_++;
+		detach(std::move(t), this);
+	}
+
+	/* Resume @h from the run loop. */
+	void post(std::coroutine_handle<> h) { ready_.push_back(h); }
+
+	/* Process events until every spawned task has finished. */
+	void run()
+	{
+		std::vector<epoll_event> events(64);
+
+		while (outstanding_ || !ready_.empty()) {
+			while (!ready_.empty()) {
+				auto h = ready_.front();
+
+				ready_.pop_front();
+				h.resume();
+			}
+			if (!outstanding_)
+				break;
+
+			int n = epoll_wait(epfd_, events.data(), events.size(),
+					   next_timeout_ms());
+			if (n < 0 && errno != EINTR)
+				throw error("epoll_wait failed");
+
+			for (int i = 0; i < n; i++) {
+				auto *w = static_cast<fd_waiter *>(events[i].data.ptr);
+
+				epoll_ctl(epfd_, EPOLL_CTL_DEL, w->fd, nullptr);
+				timers_.erase(w->timer);
+				w->ready = true;
+				ready_.push_back(w->handle);
+			}
+			expire_timers();
+		}
+	}
+
+	/* Awaitable: true once @fd is readable, false after @timeout. */
+	auto readable(int fd, std::chrono::milliseconds timeout)
+	{
+		return fd_awaiter{this, fd, timeout};
+	}
+
+	/* Awaitable: resume after @d. */
+	auto sleep_for(std::chrono::milliseconds d)
+	{
+		return sleep_awaiter{this, d};
+	}
+
+private:
+	struct fd_waiter;
+	using timer_map = std::multimap<clock::time_point, fd_waiter *>;
+
+	struct fd_waiter {
+		int fd;
+		std::coroutine_handle<> handle;
+		timer_map::iterator timer;
+		bool ready;
+	};
+
+	struct fd_awaiter {
+		executor *ex;
+		int fd;
+		std::chrono::milliseconds timeout;
+		fd_waiter w{};
+
+		bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			epoll_event ev{};
+
+			w.fd = fd;
+			w.handle = h;
+			w.ready = false;
+			w.timer = ex->timers_.emplace(clock::now() + timeout, &w);
+			ev.events = EPOLLIN;
+			ev.data.ptr = &w;
+			if (epoll_ctl(ex->epfd_, EPOLL_CTL_ADD, fd, &ev)) {
+				ex->timers_.erase(w.timer);
+				throw error("fd already awaited");
+			}
+		}
+
+		bool await_resume() const noexcept { return w.ready; }
+	};
+
+	struct sleep_awaiter {
+		executor *ex;
+		std::chrono::milliseconds d;
+		fd_waiter w{};
+
+		bool await_ready() const noexcept { return d.count() <= 0; }
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			w.fd = -1;
+			w.handle = h;
+			w.timer = ex->timers_.emplace(clock::now() + d, &w);
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	struct detached {
+		struct promise_type {
+			detached get_return_object() { return {}; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception() { std::terminate(); }
+		};
+	};
+
+	static detached detach(task<> t, executor *ex)
+	{
+		try {
+			co_await t;
+		} catch (...) {
+			ex->outstanding_--;
+			throw;
+		}
+		ex->outstanding_--;
+	}
+
+	int next_timeout_ms() const
+	{
+		if (!ready_.empty())
+			return 0;
+		if (timers_.empty())
+			return -1;
+
+		auto d = timers_.begin()->first - clock::now();
+		auto ms = std::chrono::ceil<std::chrono::milliseconds>(d).count();
+		return ms > 0 ? ms : 0;
+	}
+
+	void expire_timers()
+	{
+		auto now = clock::now();
+
+		while (!timers_.empty() && timers_.begin()->first <= now) {
+			fd_waiter *w = timers_.begin()->second;
+
+			timers_.erase(timers_.begin());
+			if (w->fd >= 0)
+				epoll_ctl(epfd_, EPOLL_CTL_DEL, w->fd, nullptr);
+			ready_.push_back(w->handle);
+		}
+	}
+
+	int epfd_;
+	unsigned outstanding_ = 0;
+	std::deque<std::coroutine_handle<>> ready_;
+	timer_map timers_;
+};
+
+/* FIFO lock so operations on one device do not interleave. */
+class async_mutex {
+public:
+	explicit async_mutex(executor &ex) : ex_(ex) {}
+
+	class guard {
+	public:
+		explicit guard(async_mutex *m) : m_(m) {}
+		guard(guard &&o) noexcept : m_(std::exchange(o.m_, nullptr)) {}
+		~guard()
+		{
+			if (m_)
+				m_->unlock();
+		}
+	private:
+		async_mutex *m_;
+	};
+
+	auto lock()
+	{
+		struct awaiter {
+			async_mutex *m;
+
+			bool await_ready() noexcept
+			{
+				if (m->locked_)
+					return false;
+				m->locked_ = true;
+				return true;
+			}
+			void await_suspend(std::coroutine_handle<> h) { m->waiters_.push_back(h); }
+			guard await_resume() noexcept { return guard(m); }
+		};
+		return awaiter{this};
+	}
+
+private:
+	/* Ownership passes straight to the next waiter. */
+	void unlock()
+	{
+		if (waiters_.empty()) {
+			locked_ = false;
+			return;
+		}
+		ex_.post(waiters_.front());
+		waiters_.pop_front();
+	}
+
+	executor &ex_;
+	bool locked_ = false;
+	std::deque<std::coroutine_handle<>> waiters_;
+};
+
+/* One splitter driven through an executor. */
+class device {
+public:
+	device(executor &ex, device_handle h,
+	       std::chrono::milliseconds reply_timeout = std::chrono::milliseconds(2500))
+		: ex_(ex), h_(std::move(h)), lock_(ex), reply_timeout_(reply_timeout)
+	{
+	}
+
+	hid_device *get() const { return h_.get(); }
+
+	/* Current outlet mask, bit 0 is outlet 1. */
+	task<uint8_t> status()
+	{
+		auto g = co_await lock_.lock();
+		unsigned char buf[BELLWIN_REPORT_SIZE];
+
+		while (hid_read_timeout(h_.get(), buf, sizeof(buf), 0) > 0)
+			;
+		co_await write(BELLWIN_CMD_STATUS, 0, 0);
+
+		auto deadline = executor::clock::now() + reply_timeout_;
+		for (;;) {
+			auto left = std::chrono::ceil<std::chrono::milliseconds>(
+				deadline - executor::clock::now());
+
+			if (left.count() <= 0 ||
+			    !co_await ex_.readable(hid_get_fd(h_.get()), left))
+				throw timeout_error("no status reply");
+
+			int res = hid_read_timeout(h_.get(), buf, sizeof(buf), 0);
+			if (res < 0)
+				throw error("device read failed");
+			/* Short reports and echoes of sets are not the reply. */
+			if (res > BELLWIN_STATUS_MASK && buf[0] == BELLWIN_CMD_STATUS)
+				co_return buf[BELLWIN_STATUS_MASK] & POWER_SWITCH_ALL;
+		}
+	}
+
+	/* Switch outlet @outlet (1 based). */
+	task<> set(int outlet, bool on)
+	{
+		auto g = co_await lock_.lock();
+
+		co_await set_locked(outlet, on);
+	}
+
+	/* Set every outlet in @care to its bit in @mask. */
+	task<> set_mask(uint8_t mask, uint8_t care = POWER_SWITCH_ALL)
+	{
+		auto g = co_await lock_.lock();
+
+		for (int i = 0; i < POWER_SWITCH_COUNT; i++)
+			if (care & BIT(i))
+				co_await set_locked(i + 1, mask & BIT(i));
+	}
+
+	/* Power @outlet off, wait @off_time, power it back on. */
+	task<> cycle(int outlet, std::chrono::milliseconds off_time)
+	{
+		auto g = co_await lock_.lock();
+
+		co_await set_locked(outlet, false);
+		co_await ex_.sleep_for(off_time);
+		co_await set_locked(outlet, true);
+	}
+
+private:
+	task<> write(uint8_t op, uint8_t idx, uint8_t value)
+	{
+		unsigned char report[BELLWIN_REPORT_SIZE];
+		auto backoff = std::chrono::microseconds(SEND_BACKOFF_US);
+
+		std::memset(report, BELLWIN_REPORT_PAD, sizeof(report));
+		std::memset(report, 0, BELLWIN_CMD_LEN);
+		report[0] = op;
+		if (op == BELLWIN_CMD_SET) {
+			report[BELLWIN_SET_INDEX] = idx;
+			report[BELLWIN_SET_VALUE] = value;
+		}
+		for (int i = 0; i < SEND_TRIES; i++) {
+			if (i) {
+				co_await ex_.sleep_for(
+					std::chrono::ceil<std::chrono::milliseconds>(backoff));
+				backoff *= 4;
+			}
+			if (hid_write(h_.get(), report, sizeof(report)) >= 0)
+				co_return;
+		}
+		throw error("device write failed");
+	}
+
+	task<> set_locked(int outlet, bool on)
+	{
+		if (outlet < 1 || outlet > POWER_SWITCH_COUNT)
+			throw std::out_of_range("invalid outlet");
+		co_await write(BELLWIN_CMD_SET, outlet - 1, on);
+	}
+
+	executor &ex_;
+	device_handle h_;
+	async_mutex lock_;
+	std::chrono::milliseconds reply_timeout_;
+};
+
+} /* namespace bellwin */
+
+#endif
@@ -1,20 +1,48 @@
 #include <stdio.h>
+#include <ctype.h>
 #include <getopt.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "hidapi.h"
-
-#define BELLWIN_VENDOR	0x04d8
-#define BELLWIN_PRODUCT	0xfedc
-#define BIT(x) (1 << (x))
-
-#define POWER_SWITCH_COUNT 5
+#include "hid_capture.h"
+#include "hid_log.h"
+#include "bellwin.h"
+#include "device.h"
+#include "replay.h"
+#include "daemon.h"
+#include "client.h"
+#include "batch.h"
+#include "groups.h"
+#include "fanout.h"
+#include "devlock.h"
 
 #define OP_GET_STATUS 0
 #define OP_SET_POWER 1
 
+enum {
+	OPT_REPLAY_SPEED = 256,
+	OPT_SIM_LATENCY,
+	OPT_DAEMON,
+	OPT_SOCKET,
+	OPT_COALESCE_MS,
+	OPT_SIMULATE,
+	OPT_QUEUE_DEPTH,
+	OPT_CLIENT_DEPTH,
+	OPT_BATCH,
+	OPT_VERIFY,
+	OPT_HEALTH,
+	OPT_CONFIG,
+	OPT_HTTP,
+	OPT_POLL_MS,
+	OPT_TRANSACTION,
+	OPT_MAX_OPEN,
+	OPT_IDLE_CLOSE_MS,
+	OPT_JOURNAL,
+};
+
 static void print_help(FILE *out)
 {
 	fprintf(out, "Usage: bellwin_ctl [OPTIONS] [<outlet1>=<value1> <outlet2>=<value2>] ...\n\n");
@@ -22,8 +50,35 @@ static void print_help(FILE *out)
 	fprintf(out, "  -l, --list\t\t List available bellwin USB devices\n");
 	fprintf(out, "  -h, --help\t\t Display this help and exit\n");
 	fprintf(out, "  -v, --version\t\t Output version information and exit\n");
+	fprintf(out, "  -V, --verbose\t\t Also log every report sent and received, and retries\n");
 	fprintf(out, "  -D, --device\t\t <dev path> Open device by device node (IE. /dev/hidraw3/)\n");
 	fprintf(out, "  -S, --serial\t\t <serial> Open device by serial number\n");
+	fprintf(out, "  -c, --capture\t\t <file> Record all HID traffic to a capture file\n");
+	fprintf(out, "  -r, --replay\t\t <file> Replay a capture against simulated devices\n");
+	fprintf(out, "      --replay-speed\t <factor> Replay timing factor, 0 for back to back (default 1)\n");
+	fprintf(out, "      --sim-latency\t <usec> Reply latency of simulated devices (default 0)\n");
+	fprintf(out, "      --batch\t\t <file|-> Run commands from a file or stdin, see README\n");
+	fprintf(out, "      --daemon\t\t Serve all devices to clients on the daemon socket\n");
+	fprintf(out, "      --socket\t\t <path> Daemon socket (default %s); without --daemon, send the request to the daemon\n",
+		BELLWIN_DEFAULT_SOCKET);
+	fprintf(out, "      --http\t\t <[host:]port|path> Also serve the daemon over HTTP (loopback unless a host is given)\n");
+	fprintf(out, "      --coalesce-ms\t <msec> Window for folding concurrent set requests (default %d)\n",
+		BELLWIN_DEFAULT_COALESCE_MS);
+	fprintf(out, "      --poll-ms\t <msec> Status poll interval for devices with subscribers, 0 for none (default %d)\n",
+		BELLWIN_DEFAULT_POLL_MS);
+	fprintf(out, "      --simulate\t <count> Serve simulated devices instead of hardware\n");
+	fprintf(out, "      --queue-depth\t <count> Queued daemon requests per device (default %d)\n",
+		BELLWIN_DEFAULT_QUEUE_DEPTH);
+	fprintf(out, "      --client-depth\t <count> Queued daemon requests per client and device (default %d)\n",
+		BELLWIN_DEFAULT_CLIENT_DEPTH);
+	fprintf(out, "      --max-open\t <count> Device handles the daemon keeps open, least recently used closed first (default unlimited)\n");
+	fprintf(out, "      --idle-close-ms\t <msec> Close daemon device handles unused this long, 0 for never (default 0)\n");
+	fprintf(out, "      --journal\t <path> Keep the daemon's desired outlet state in this journal and restore it on startup\n");
+	fprintf(out, "      --verify\t\t Read back the outlets after setting them\n");
+	fprintf(out, "      --transaction\t Switch all outlets or, on any failure, put them back\n");
+	fprintf(out, "      --health\t\t Show device health as tracked by the daemon\n");
+	fprintf(out, "      --config\t\t <file> Outlet and group names (default %s)\n",
+		BELLWIN_DEFAULT_CONFIG);
 
 }
 static void print_version(void)
@@ -31,26 +86,6 @@ static void print_version(void)
 	printf("Bellwin USB power control v0.1\n");
 }
 
-static bool verbose = false;
-
-/* The caller must free the returned string with free(). */
-static wchar_t *utf8_to_wchar_t(const char *utf8)
-{
-	wchar_t *ret = NULL;
-
-	if (utf8) {
-		size_t wlen = mbstowcs(NULL, utf8, 0);
-		if ((size_t) -1 == wlen) {
-			return wcsdup(L"");
-		}
-		ret = calloc(wlen+1, sizeof(wchar_t));
-		mbstowcs(ret, utf8, wlen+1);
-		ret[wlen] = 0x0000;
-	}
-
-	return ret;
-}
-
 static int bellwin_list_devices(void)
 {
 	struct hid_device_info *devs, *cur_dev;
@@ -81,114 +116,220 @@ static int bellwin_list_devices(void)
 	return EXIT_SUCCESS;
 }
 
-static int send_command(hid_device *handle, const char *cmd, size_t len)
+static int get_device_status(hid_device *handle)
 {
-	unsigned char buf[0x40];
-	int ret;
-	int i;
+	unsigned char mask;
 
-	memset(buf, 0x5A, 0x40);
+	if (device_read_status(handle, &mask, NULL))
+		return 1;
 
-	if (len > 0x40) {
-		printf("Command is too long\n");
-		exit(EXIT_FAILURE);
-	}
+	for (int i = 1; i < (POWER_SWITCH_COUNT + 1); i++)
+		printf("Power switch %d: %s\n", i,
+		       (mask & BIT(i-1)) ? "ON" : "OFF");
 
-	memcpy(buf, cmd, len);
+	return 0;
+}
 
-	if (verbose) {
-		printf("Sending to device:\n");
-		for (i = 0; i < 0x40; i++)
-			printf("%02hhx ", buf[i]);
-		printf("\n");
+/* Run one status or set operation through the daemon instead of the device. */
+static int bellwin_client(const char *socket_path, const char *dev, int argc,
+			  char **argv)
+{
+	char line[1024];
+	char reply[256];
+	unsigned mask;
+	size_t len;
+	int i;
+
+	len = snprintf(line, sizeof(line), "%s %s", argc ? "set" : "status", dev);
+	for (i = 0; i < argc && len < sizeof(line); i++)
+		len += snprintf(line + len, sizeof(line) - len, " %s", argv[i]);
+
+	if (client_request(socket_path, line, reply, sizeof(reply))) {
+		hid_log_error(socket_path, "Unable to reach daemon: %m");
+		return EXIT_FAILURE;
 	}
 
-	ret = hid_write(handle, buf, 0x40);
-	if (ret < 0) {
-		printf("Unable to write()\n");
-		printf("Error: %ls\n", hid_error(handle));
+	if (sscanf(reply, "ok mask=%x", &mask) != 1) {
+		hid_log_error(dev, "%s", reply);
+		return EXIT_FAILURE;
 	}
 
-	return 0;
+	for (i = 1; i < (POWER_SWITCH_COUNT + 1); i++)
+		printf("Power switch %d: %s\n", i,
+		       (mask & BIT(i-1)) ? "ON" : "OFF");
+
+	return EXIT_SUCCESS;
+}
+
+/* Nothing works without the HID subsystem. */
+static void init_hid(void)
+{
+	if (hid_init()) {
+		hid_log_error(NULL, "Failed initializing HID subsystem");
+		hid_capture_stop();
+		exit(EXIT_FAILURE);
+	}
 }
 
-static void prepare_cmd(char *cmd, int idx, bool on)
+/*
+ * Arguments are either all outlet numbers (3=1) or all outlet and group
+ * names from the config (kitchen=1).  Returns 1 for names, 0 for numbers,
+ * and -1 after reporting the first argument that does not match the rest.
+ */
+static int classify_args(int argc, char **argv)
 {
-	char cmd_template[7] = { 0x0b, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	bool named = argc && !isdigit((unsigned char)argv[0][0]);
+	int i;
 
-	cmd_template[5] = idx - 1;
-	cmd_template[6] = !!on;
+	for (i = 1; i < argc; i++) {
+		if (!isdigit((unsigned char)argv[i][0]) != named) {
+			hid_log_error(NULL, "cannot mix outlet numbers and names: "
+				      "%s and %s", argv[0], argv[i]);
+			return -1;
+		}
+	}
 
-	memcpy(cmd, cmd_template, 7);
+	return named;
 }
 
-static int get_device_status(hid_device *handle)
+/*
+ * Switch named outlets and groups: every name=value argument is resolved to
+ * per-device masks, later arguments overriding earlier ones, and each device
+ * then gets one mask operation, all devices at once.
+ */
+static int bellwin_named_set(const char *config, const char *socket_path,
+			     const struct fanout_opts *opts, int argc,
+			     char **argv)
 {
-	const char cmd1[7] = { 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
-	unsigned char buf[256];
-	int ret;
-	int timeout = 5;
-	send_command(handle, cmd1, 7);
+	struct fanout_target *targets = NULL;
+	unsigned char *value = NULL, *care = NULL;
+	struct groups *groups;
+	char err[256];
+	unsigned i, j, n = 0;
+	int ret = 1;
+
+	groups = groups_load(config, err, sizeof(err));
+	if (!groups) {
+		hid_log_error(config, "%s", err);
+		return 1;
+	}
 
-	/* Wait for response */
-	ret = 0;
-	while (ret == 0 && timeout--) {
-		ret = hid_read(handle, buf, sizeof(buf));
-		if (ret == 0)
-			printf("waiting...\n");
-		if (ret < 0)
-			printf("Unable to read()\n");
-
-		usleep(500*1000);
+	value = calloc(groups->ndevices, 1);
+	care = calloc(groups->ndevices, 1);
+	targets = calloc(groups->ndevices, sizeof(*targets));
+	if (!value || !care || !targets)
+		goto out;
+
+	for (i = 0; i < (unsigned)argc; i++) {
+		const struct group_entry *e;
+		char *eq = strrchr(argv[i], '=');
+		int v;
+
+		if (!eq || (strcmp(eq + 1, "0") && strcmp(eq + 1, "1"))) {
+			hid_log_error(NULL, "invalid name<->value mapping: %s", argv[i]);
+			goto out;
+		}
+		v = eq[1] == '1';
+		*eq = '\0';
+		e = groups_lookup(groups, argv[i]);
+		if (!e) {
+			hid_log_error(NULL, "unknown outlet or group: %s", argv[i]);
+			goto out;
+		}
+		*eq = '=';
+
+		for (j = 0; j < e->ntargets; j++) {
+			const struct group_target *t = &e->targets[j];
+
+			care[t->dev] |= t->mask;
+			value[t->dev] = v ? value[t->dev] | t->mask :
+					    value[t->dev] & ~t->mask;
+		}
 	}
 
-	if (!timeout) {
-		fprintf(stderr, "Timeout occurred while waiting for device reply\n");
-		return 1;
+	for (i = 0; i < groups->ndevices; i++) {
+		if (!care[i])
+			continue;
+		targets[n].device = groups->devices[i];
+		targets[n].value = value[i];
+		targets[n].care = care[i];
+		n++;
 	}
-	for (int i = 1; i < (POWER_SWITCH_COUNT + 1); i++)
-		printf("Power switch %d: %s\n", i,
-		       (buf[5] & BIT(i-1)) ? "ON" : "OFF");
 
-	return 0;
+	if (socket_path)
+		fanout_set_daemon(targets, n, socket_path, opts);
+	else
+		fanout_set(targets, n, opts);
+
+	ret = 0;
+	for (i = 0; i < n; i++) {
+		if (targets[i].result) {
+			hid_log_error(targets[i].device, "%s", targets[i].error);
+			ret = 1;
+			continue;
+		}
+		if (opts->transaction)
+			printf("%s: outlets 0x%02x set to 0x%02x (were 0x%02x)\n",
+			       targets[i].device, targets[i].care, targets[i].value,
+			       targets[i].before & targets[i].care);
+		else
+			printf("%s: outlets 0x%02x set to 0x%02x\n", targets[i].device,
+			       targets[i].care, targets[i].value);
+	}
+out:
+	free(targets);
+	free(care);
+	free(value);
+	groups_free(groups);
+	return ret;
 }
 
-hid_device *device_open_path(const char *path)
+/* Print the daemon's view of one device, or of all of them. */
+static int bellwin_client_health(const char *socket_path, const char *dev)
 {
-	hid_device *handle = NULL;
-	handle = hid_open_path(path);
-	if (!handle) {
-		perror("Unable to open device");
+	char line[256];
+	char reply[512];
+	char *tok, *saveptr = NULL;
+
+	snprintf(line, sizeof(line), "health%s%s", dev ? " " : "", dev ? dev : "");
+	if (client_request(socket_path, line, reply, sizeof(reply))) {
+		hid_log_error(socket_path, "Unable to reach daemon: %m");
+		return EXIT_FAILURE;
+	}
+	if (strncmp(reply, "ok", 2)) {
+		hid_log_error(dev, "%s", reply);
+		return EXIT_FAILURE;
 	}
 
-	return handle;
+	for (tok = strtok_r(reply + 2, " ", &saveptr); tok;
+	     tok = strtok_r(NULL, " ", &saveptr))
+		printf("%s\n", tok);
+
+	return EXIT_SUCCESS;
 }
 
-hid_device *device_open_serial(const char *serial)
+/* Put the outlets in @switched back to their state in @before. */
+static int bellwin_rollback(hid_device *handle, unsigned char before,
+			    unsigned char switched)
 {
-	hid_device *handle = NULL;
-	struct hid_device_info *devs;
-	wchar_t *ret = NULL;
-
-	if (!serial) {
-		devs = hid_enumerate(BELLWIN_VENDOR, BELLWIN_PRODUCT);
-		if (!devs)
-			return NULL;
-		else if (devs->next) {
-			fprintf(stderr,
-				"More than one bellwin device found, please use --serial or --device option\n");
-			hid_free_enumeration(devs);
-			return NULL;
-		}
+	int i, failed = 0;
+
+	for (i = 0; i < POWER_SWITCH_COUNT; i++) {
+		char cmd[BELLWIN_CMD_LEN];
+		bool on = before & BIT(i);
+
+		if (!(switched & BIT(i)))
+			continue;
+		printf("Restoring %d to %s\n", i + 1, on ? "ON" : "OFF");
+		prepare_cmd(cmd, i + 1, on);
+		if (send_command(handle, cmd, BELLWIN_CMD_LEN) < 0)
+			failed++;
 	}
+	if (failed)
+		hid_log_error(hid_get_path(handle),
+			      "Unable to restore %d outlet(s)", failed);
 
-	ret = utf8_to_wchar_t(serial);
-	handle = hid_open(BELLWIN_VENDOR, BELLWIN_PRODUCT, ret);
-	if (!handle)
-		perror("Unable to open device");
-
-	free(ret);
-	return handle;
+	return failed;
 }
 
 int main(int argc, char **argv)
@@ -198,8 +339,32 @@ int main(int argc, char **argv)
 	char *serial = NULL;
 	char *path = NULL;
 	hid_device *handle = NULL;
+	struct devlock lock = { .fd = -1 };
 	int i;
 	int operation = OP_GET_STATUS;
+	int retries;
+	int named;
+	char *capture = NULL;
+	char *replay = NULL;
+	struct replay_opts replay_opts = {
+		.speed = 1.0,
+		.latency_us = 0,
+		.timeout_ms = 1000,
+	};
+	bool daemon = false;
+	bool verify = false;
+	bool health = false;
+	bool transaction = false;
+	char *config = NULL;
+	unsigned char value_mask = 0, care_mask = 0;
+	char *batch = NULL;
+	struct daemon_opts daemon_opts = {
+		.socket_path = NULL,
+		.coalesce_ms = BELLWIN_DEFAULT_COALESCE_MS,
+		.queue_depth = BELLWIN_DEFAULT_QUEUE_DEPTH,
+		.client_depth = BELLWIN_DEFAULT_CLIENT_DEPTH,
+		.poll_ms = BELLWIN_DEFAULT_POLL_MS,
+	};
 
 	while (1) {
 
@@ -210,12 +375,32 @@ int main(int argc, char **argv)
 			{"help", no_argument, 0, 'h'},
 			{"serial", required_argument, 0, 'S'},
 			{"device", required_argument, 0, 'D'},
+			{"capture", required_argument, 0, 'c'},
+			{"replay", required_argument, 0, 'r'},
+			{"replay-speed", required_argument, 0, OPT_REPLAY_SPEED},
+			{"sim-latency", required_argument, 0, OPT_SIM_LATENCY},
+			{"batch", required_argument, 0, OPT_BATCH},
+			{"daemon", no_argument, 0, OPT_DAEMON},
+			{"socket", required_argument, 0, OPT_SOCKET},
+			{"coalesce-ms", required_argument, 0, OPT_COALESCE_MS},
+			{"simulate", required_argument, 0, OPT_SIMULATE},
+			{"queue-depth", required_argument, 0, OPT_QUEUE_DEPTH},
+			{"client-depth", required_argument, 0, OPT_CLIENT_DEPTH},
+			{"verify", no_argument, 0, OPT_VERIFY},
+			{"health", no_argument, 0, OPT_HEALTH},
+			{"config", required_argument, 0, OPT_CONFIG},
+			{"http", required_argument, 0, OPT_HTTP},
+			{"poll-ms", required_argument, 0, OPT_POLL_MS},
+			{"transaction", no_argument, 0, OPT_TRANSACTION},
+			{"max-open", required_argument, 0, OPT_MAX_OPEN},
+			{"idle-close-ms", required_argument, 0, OPT_IDLE_CLOSE_MS},
+			{"journal", required_argument, 0, OPT_JOURNAL},
 			{0, 0, 0, 0}
 		};
 
 		int option_index = 0;
 
-		c = getopt_long(argc, argv, "Vvhls:d:", long_options, &option_index);
+		c = getopt_long(argc, argv, "Vvhls:S:d:D:c:r:", long_options, &option_index);
 		if (c == -1)
 			break;
 
@@ -224,7 +409,7 @@ int main(int argc, char **argv)
 			print_version();
 			exit(EXIT_SUCCESS);
 		case 'V':
-			verbose = true;
+			hid_log_level = HID_LOG_DEBUG;
 			break;
 		case 'h':
 			print_help(stdout);
@@ -232,11 +417,74 @@ int main(int argc, char **argv)
 		case 'l':
 			return bellwin_list_devices();
 		case 's':
+		case 'S':
 			serial = optarg;
 			break;
 		case 'd':
+		case 'D':
 			path = optarg;
 			break;
+		case 'c':
+			capture = optarg;
+			break;
+		case 'r':
+			replay = optarg;
+			break;
+		case OPT_REPLAY_SPEED:
+			replay_opts.speed = atof(optarg);
+			break;
+		case OPT_SIM_LATENCY:
+			replay_opts.latency_us = strtoul(optarg, NULL, 0);
+			daemon_opts.sim_latency_us = replay_opts.latency_us;
+			break;
+		case OPT_BATCH:
+			batch = optarg;
+			break;
+		case OPT_DAEMON:
+			daemon = true;
+			break;
+		case OPT_SOCKET:
+			daemon_opts.socket_path = optarg;
+			break;
+		case OPT_COALESCE_MS:
+			daemon_opts.coalesce_ms = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_SIMULATE:
+			daemon_opts.simulate = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_QUEUE_DEPTH:
+			daemon_opts.queue_depth = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_CLIENT_DEPTH:
+			daemon_opts.client_depth = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_VERIFY:
+			verify = true;
+			break;
+		case OPT_HEALTH:
+			health = true;
+			break;
+		case OPT_CONFIG:
+			config = optarg;
+			break;
+		case OPT_HTTP:
+			daemon_opts.http_addr = optarg;
+			break;
+		case OPT_POLL_MS:
+			daemon_opts.poll_ms = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_TRANSACTION:
+			transaction = true;
+			break;
+		case OPT_MAX_OPEN:
+			daemon_opts.max_open = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_IDLE_CLOSE_MS:
+			daemon_opts.idle_close_ms = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_JOURNAL:
+			daemon_opts.journal_path = optarg;
+			break;
 		case 0:
 		case '?':
 		default:
@@ -251,60 +499,184 @@ int main(int argc, char **argv)
 	if (argc)
 		operation = OP_SET_POWER;
 
-	if (hid_init()) {
-		fprintf(stderr, "Failed initializing HID subsystem\n");
+	if (replay)
+		return replay_run(replay, &replay_opts, stdout) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+	if (health)
+		return bellwin_client_health(daemon_opts.socket_path ?
+					     daemon_opts.socket_path :
+					     BELLWIN_DEFAULT_SOCKET,
+					     serial ? serial : path);
+
+	named = classify_args(argc, argv);
+	if (named < 0)
 		exit(EXIT_FAILURE);
+
+	if (capture && hid_capture_start(capture)) {
+		hid_log_error(capture, "Unable to open capture file: %m");
+		exit(EXIT_FAILURE);
+	}
+
+	/* name=value arguments refer to outlets or groups from the config. */
+	if (named) {
+		struct fanout_opts fanout_opts = {
+			.simulate = daemon_opts.simulate,
+			.sim_latency_us = daemon_opts.sim_latency_us,
+			.transaction = transaction,
+		};
+
+		init_hid();
+		ret = bellwin_named_set(config ? config : BELLWIN_DEFAULT_CONFIG,
+					daemon_opts.socket_path, &fanout_opts,
+					argc, argv);
+		hid_exit();
+		hid_capture_stop();
+		return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (!daemon && daemon_opts.socket_path) {
+		ret = bellwin_client(daemon_opts.socket_path,
+				     serial ? serial : path ? path : "0",
+				     argc, argv);
+		hid_capture_stop();
+		return ret;
+	}
+
+	if (batch) {
+		struct batch_opts batch_opts = {
+			.simulate = daemon_opts.simulate,
+			.sim_latency_us = daemon_opts.sim_latency_us,
+		};
+
+		init_hid();
+		ret = batch_run(batch, &batch_opts);
+		hid_exit();
+		hid_capture_stop();
+		return ret ? EXIT_FAILURE : EXIT_SUCCESS;
 	}
 
+	if (daemon) {
+		if (!daemon_opts.socket_path)
+			daemon_opts.socket_path = BELLWIN_DEFAULT_SOCKET;
+		daemon_opts.serial = serial;
+		daemon_opts.path = path;
+		init_hid();
+		ret = daemon_run(&daemon_opts);
+		hid_exit();
+		hid_capture_stop();
+		return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	init_hid();
+
 	if (path)
 		handle = device_open_path(path);
 	else
 		handle = device_open_serial(serial);
 
 	if (!handle) {
-		fprintf(stderr, "Couldn't open HID device\n");
+		hid_log_error(NULL, "Couldn't open HID device");
+		hid_log_flush();
 		print_help(stderr);
 		exit(EXIT_FAILURE);
 	}
 
 	hid_set_nonblocking(handle, 1);
 
+	/* Other invocations on this device go first, or wait for us. */
+	if (devlock_acquire(&lock, handle,
+			    operation == OP_GET_STATUS ? "status" : "set")) {
+		if (errno != ETIMEDOUT)		/* devlock named the holder */
+			hid_log_error(hid_get_path(handle),
+				      "Unable to lock device: %m");
+		ret = 1;
+		goto out;
+	}
+	devlock_report(&lock, hid_get_path(handle) ? hid_get_path(handle) :
+			      "device");
+
 	if (operation == OP_GET_STATUS) {
 		ret = get_device_status(handle);
 	} else if (operation == OP_SET_POWER) {
+		unsigned char before = 0, switched = 0;
+
+		/* Check every argument before switching anything. */
 		for (i = 0; i < argc; i++) {
-			char cmd[7];
 			int offset;
 			int value;
 
 			ret = sscanf(argv[i], "%u=%d", &offset, &value);
 			if (ret != 2) {
-				fprintf(stderr, "invalid offset<->value mapping: %s", argv[i]);
+				hid_log_error(NULL, "invalid offset<->value mapping: %s",
+					      argv[i]);
 				ret = 1;
 				goto out;
 			}
 			ret = 0;
 
 			if (value != 0 && value != 1) {
-				fprintf(stderr, "value must be 0 or 1: %s", argv[1]);
+				hid_log_error(NULL, "value must be 0 or 1: %s", argv[i]);
 				ret = 1;
 				goto out;
 			}
 			if (offset > POWER_SWITCH_COUNT || offset < 1) {
-				fprintf(stderr,"invalid offset: %s", argv[i]);
+				hid_log_error(NULL, "invalid offset: %s", argv[i]);
 				ret = 1;
 				goto out;
 			}
-			printf("Setting %d to %s\n", offset, value ? "ON" : "OFF");
-			prepare_cmd(cmd, offset, value);
-			send_command(handle, cmd, 7);
+			care_mask |= BIT(offset - 1);
+			value_mask = (value_mask & ~BIT(offset - 1)) |
+				     (value ? BIT(offset - 1) : 0);
+		}
+
+		if (transaction && device_read_status(handle, &before, NULL)) {
+			hid_log_error(hid_get_path(handle),
+				      "Unable to read outlets");
+			ret = 1;
+			goto out;
 		}
 
+		for (i = 0; i < POWER_SWITCH_COUNT; i++) {
+			char cmd[BELLWIN_CMD_LEN];
+			bool on = value_mask & BIT(i);
+
+			if (!(care_mask & BIT(i)))
+				continue;
+			printf("Setting %d to %s\n", i + 1, on ? "ON" : "OFF");
+			prepare_cmd(cmd, i + 1, on);
+			retries = send_command(handle, cmd, BELLWIN_CMD_LEN);
+			if (retries < 0) {
+				ret = 1;
+				if (transaction)
+					bellwin_rollback(handle, before, switched | BIT(i));
+				goto out;
+			}
+			switched |= BIT(i);
+			/* A write that needed retries is worth reading back. */
+			if (retries)
+				verify = true;
+		}
+
+		if (verify) {
+			unsigned char actual;
+
+			ret = device_verify_mask(handle, value_mask, care_mask,
+						 &actual, NULL);
+			if (ret > 0)
+				hid_log_error(hid_get_path(handle),
+					      "Outlets 0x%02x did not switch",
+					      (actual ^ value_mask) & care_mask);
+			else if (ret < 0)
+				hid_log_error(hid_get_path(handle),
+					      "Unable to verify outlets");
+		}
 	}
 
 out:
+	devlock_release(&lock);
 	hid_close(handle);
 	hid_exit();
+	hid_capture_stop();
 	if (!ret)
 		return EXIT_SUCCESS;
 	else
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "client.h"
+
+static int client_connect(const char *socket_path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int client_request(const char *socket_path, const char *line, char *reply,
+		   size_t len)
+{
+	size_t got = 0;
+	ssize_t n;
+	int fd;
+
+	fd = client_connect(socket_path);
+	if (fd < 0)
+		return -1;
+
+	if (dprintf(fd, "%s\n", line) < 0)
+		goto err;
+
+	while (got + 1 < len) {
+		n = read(fd, reply + got, len - got - 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		got += n;
+		if (memchr(reply + got - n, '\n', n))
+			break;
+	}
+	close(fd);
+
+	reply[got] = '\0';
+	reply[strcspn(reply, "\n")] = '\0';
+
+	return got ? 0 : -1;
+err:
+	close(fd);
+	return -1;
+}
+
+int client_pipeline(const char *socket_path, const char *const *lines,
+		    char **replies, unsigned n, size_t len)
+{
+	char buf[4096];
+	size_t used = 0, cur = 0;
+	unsigned i, done = 0;
+	ssize_t r;
+	int fd;
+
+	fd = client_connect(socket_path);
+	if (fd < 0)
+		return -1;
+
+	for (i = 0; i < n; i++)
+		if (dprintf(fd, "%s\n", lines[i]) < 0)
+			goto err;
+
+	while (done < n) {
+		r = read(fd, buf, sizeof(buf));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			goto err;
+
+		for (used = 0; used < (size_t)r && done < n; used++) {
+			if (buf[used] == '\n') {
+				replies[done++][cur] = '\0';
+				cur = 0;
+			} else if (cur + 1 < len) {
+				replies[done][cur++] = buf[used];
+			}
+		}
+	}
+	close(fd);
+
+	return 0;
+err:
+	close(fd);
+	return -1;
+}
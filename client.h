@@ -0,0 +1,26 @@
+/*
+ * Minimal client for the daemon socket, see daemon.h for the protocol.
+ */
+
+#ifndef CLIENT_H__
+#define CLIENT_H__
+
+#include <stddef.h>
+
+/*
+ * Send one request line to the daemon listening on @socket_path and store
+ * its reply, without the trailing newline, in @reply.  Returns 0 when a
+ * reply was received, -1 on connection errors.
+ */
+int client_request(const char *socket_path, const char *line, char *reply,
+		   size_t len);
+
+/*
+ * Send @n request lines over one connection without waiting in between and
+ * store the replies, in order, in @replies (@len bytes each).  Returns 0
+ * when all replies were received.
+ */
+int client_pipeline(const char *socket_path, const char *const *lines,
+		    char **replies, unsigned n, size_t len);
+
+#endif
@@ -0,0 +1,26 @@
+#include <stdbool.h>
+#include "coalesce.h"
+#include "device.h"
+
+int coalesce_flush(struct coalesce *c, unsigned char current,
+		   unsigned char known, unsigned char *final,
+		   char cmds[POWER_SWITCH_COUNT][BELLWIN_CMD_LEN])
+{
+	unsigned char changed;
+	int n = 0;
+	int i;
+
+	*final = coalesce_final(current, c->value, c->care);
+	changed = ((*final ^ current) | ~known) & c->care;
+
+	for (i = 0; i < POWER_SWITCH_COUNT; i++) {
+		if (changed & BIT(i))
+			prepare_cmd(cmds[n++], i + 1, c->value & BIT(i));
+	}
+
+	c->value = 0;
+	c->care = 0;
+	c->deadline_ns = 0;
+
+	return n;
+}
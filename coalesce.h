@@ -0,0 +1,46 @@
+/*
+ * Folding of concurrent set requests into a final outlet mask.
+ *
+ * Requests for one device arriving within a short window are merged
+ * last-writer-wins into (value, care): @care holds the outlets touched by
+ * any request and @value their latest requested state.  When the window
+ * closes only the outlets whose final state differs from the device get a
+ * 0x0b report, so an on followed by an off costs nothing.
+ */
+
+#ifndef COALESCE_H__
+#define COALESCE_H__
+
+#include <stdint.h>
+#include "bellwin.h"
+
+struct coalesce {
+	unsigned char value;
+	unsigned char care;
+	uint64_t deadline_ns;	/* 0 while no window is open */
+};
+
+static inline void coalesce_add(struct coalesce *c, unsigned char value,
+				unsigned char care)
+{
+	c->value = (c->value & ~care) | (value & care);
+	c->care |= care;
+}
+
+static inline unsigned char coalesce_final(unsigned char current,
+					   unsigned char value,
+					   unsigned char care)
+{
+	return (current & ~care) | (value & care);
+}
+
+/*
+ * Close the window: store the resulting mask in *final, encode the set
+ * reports needed to get there from @current into @cmds and return their
+ * number.  Touched outlets missing from @known are always sent.
+ */
+int coalesce_flush(struct coalesce *c, unsigned char current,
+		   unsigned char known, unsigned char *final,
+		   char cmds[POWER_SWITCH_COUNT][BELLWIN_CMD_LEN]);
+
+#endif
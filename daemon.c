@@ -0,0 +1,2785 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <libudev.h>
+
+#include "hidapi.h"
+#include "hid_log.h"
+#include "bellwin.h"
+#include "device.h"
+#include "coalesce.h"
+#include "sched.h"
+#include "hist.h"
+#include "health.h"
+#include "fleet.h"
+#include "pool.h"
+#include "journal.h"
+#include "devlock.h"
+#include "http.h"
+#include "timerwheel.h"
+#include "sim.h"
+#include "timeutil.h"
+#include "daemon.h"
+
+#define MAX_EVENTS		64
+#define MAX_ARGS		16
+#define CLIENT_INBUF		4096
+#define CYCLE_MS		1000
+
+/*
+ * Subscribers get at most SUB_MAX_OUT bytes of events queued; events that
+ * do not fit are dropped and counted.
+ */
+#define SUB_MAX_FILTERS		16
+#define SUB_MAX_OUT		65536
+
+/*
+ * Switched outlets are confirmed by the next status poll, or by a status
+ * read of our own if no poll comes along within VERIFY_PIGGYBACK_MS.
+ */
+#define VERIFY_PIGGYBACK_MS	250
+
+/*
+ * Once HEDGE_MIN_SAMPLES replies have been timed, a status query still
+ * unanswered at the device's p95 is sent a second time.
+ */
+#define HEDGE_MIN_SAMPLES	32
+#define HEDGE_PERCENTILE	0.95
+
+/*
+ * A device that disappears is looked for again on every udev "add" event
+ * for a hidraw node, and every RESCAN_MS in case the event was missed or
+ * udev cannot be monitored.
+ */
+#define RESCAN_MS		1000
+
+/*
+ * The daemon locks a device for each exchange with it, a status read or a
+ * flush of set reports, and lets go once it is idle, so command line
+ * invocations get their turn in between instead of taking its replies; one
+ * waiting for the device is let in before the next exchange starts.  The
+ * event loop cannot wait: work for a device somebody else is using is put
+ * off and the lock tried again every LOCK_POLL_MS, and after LOCK_WAIT_MS
+ * the requests waiting for it fail.  At startup it waits up to LOCK_WAIT_MS.
+ */
+#define LOCK_WAIT_MS		1000
+#define LOCK_POLL_MS		10
+
+/*
+ * A set report that cannot be written is tried again from the timer wheel
+ * after SEND_BACKOFF_US, four times longer after each further failure, up
+ * to SEND_TRIES writes: sleeping between tries would hold up every other
+ * device and client.  The device takes no other work until its flush has
+ * gone out or failed.
+ */
+
+/* Set reports taken from the fleet per reconciliation pass. */
+#define RECONCILE_BATCH		64
+
+enum watch_kind {
+	WATCH_LISTEN,
+	WATCH_HTTP_LISTEN,
+	WATCH_CLIENT,
+	WATCH_DEVICE,
+	WATCH_TIMER,
+	WATCH_UDEV,
+};
+
+enum request_op {
+	REQ_NONE,
+	REQ_STATUS,
+	REQ_SET,
+	REQ_OFF,
+	REQ_CYCLE,
+};
+
+struct client;
+struct ddev;
+
+struct sub_filter {
+	int dev;			/* -1 for every device */
+	unsigned char outlets;
+};
+
+struct request {
+	struct sched_item item;		/* must stay first */
+	struct client *client;
+	struct request *next;		/* in client order */
+	struct request *wait_next;	/* on a device wait list */
+	enum request_op op;
+	unsigned char value;		/* requested outlet states */
+	unsigned char care;		/* outlets this request touches */
+	unsigned cycle_ms;
+	uint64_t cycle_at;		/* cycle: when to switch back on */
+	struct timer cycle_timer;
+	struct ddev *dev;
+	uint64_t arrival_ns;
+	uint64_t dispatch_ns;		/* 0 until the scheduler hands it out */
+	struct hist *devtime;
+	int done;
+	char reply[512];
+};
+
+struct client {
+	enum watch_kind kind;
+	int fd;
+	int dead;
+	int http;
+	int closing;			/* close once all replies are sent */
+	unsigned pending;
+	char in[CLIENT_INBUF];
+	size_t in_len;
+	char *out;
+	size_t out_len;
+	size_t out_alloc;
+	struct request *head, *tail;
+	struct client *reap_next;
+	struct sched_flow *flows;
+
+	struct sub_filter filters[SUB_MAX_FILTERS];
+	unsigned nfilters;		/* subscribed if non-zero */
+	uint64_t dropped;		/* events not sent since the last one */
+	struct client *sub_next;
+};
+
+/* Dead-man switch: the outlet goes off unless heartbeats keep coming. */
+struct watchdog {
+	struct timer timer;
+	struct ddev *dev;
+	unsigned char outlet;		/* 0 based */
+	unsigned timeout_ms;		/* 0 while disarmed */
+	uint64_t expired;
+};
+
+/* A set scheduled with "at". */
+struct at_entry {
+	struct timer timer;
+	struct ddev *dev;
+	unsigned char value;
+	unsigned char care;
+	uint32_t gen;			/* bumped on reuse, part of the id */
+	unsigned idx;
+	int next_free;
+};
+
+struct ddev {
+	enum watch_kind kind;
+	int index;
+	char *serial;
+	char *path;
+	hid_device *hid;
+	struct bellwin_sim *sim;
+	struct devlock lock;		/* held during exchanges */
+	int locked;
+	int lock_listed;		/* on daemon.locked */
+	struct ddev *lock_next;
+	uint64_t lock_since;		/* found in use, 0 if not waiting */
+	struct timer lock_timer;	/* try again */
+	struct timer unlock_timer;	/* stale replies over */
+	int fd;				/* -1 while the pool has it closed */
+	int gone;			/* disconnected, waiting for it */
+	int reconnecting;		/* restore outlets after the next read */
+	uint64_t reconnect_ns;		/* when it came back */
+	uint64_t reconnects;
+	struct pool_entry pool;
+	struct timer close_timer;	/* idle_close_ms after last use */
+
+	int status_inflight;
+	int status_tries;
+	uint64_t status_start;		/* first query of this read */
+	uint64_t status_sent;		/* latest query */
+	uint64_t status_deadline;
+	struct timer status_timer;
+	struct timer hedge_timer;
+	unsigned stale_replies;		/* owed to queries already answered */
+	uint64_t stale_until;
+	struct rtt_est rtt;
+	struct health health;		/* status latency and failures */
+	struct timer probe_timer;
+
+	int verify_pending;
+	unsigned char verify_care;	/* switched outlets to confirm */
+	unsigned verify_repairs;
+	uint64_t verify_deadline;
+	struct timer verify_timer;
+
+	uint64_t write_retries;
+	uint64_t write_failed;
+	uint64_t hedged;
+	uint64_t verified;
+	uint64_t mismatched;
+	struct request *status_waiters;
+
+	struct coalesce co;
+	struct timer co_timer;		/* end of the coalescing window */
+	struct request *set_waiters;
+	struct request **set_tail;
+
+	/* The flush going out, 0 reports while there is none. */
+	char wq[POWER_SWITCH_COUNT][BELLWIN_CMD_LEN];
+	unsigned wq_len;
+	unsigned wq_sent;
+	unsigned wq_tries;		/* failed writes of wq[wq_sent] */
+	int wq_retried;
+	unsigned char wq_final;		/* relay state once written */
+	unsigned char wq_care;
+	struct request *wq_waiters;	/* answered when it has gone out */
+	struct timer retry_timer;
+	struct request *cycle_waiters;	/* outlets off, waiting to go on */
+
+	unsigned watchers;		/* subscriptions covering this device */
+	uint64_t poll_at;
+	struct timer poll_timer;
+
+	struct watchdog wd[POWER_SWITCH_COUNT];
+
+	struct sched sched;
+	struct hist devtime;		/* dispatch to completion, ns */
+};
+
+struct daemon {
+	const struct daemon_opts *opts;
+	int epfd;
+	int listen_fd;
+	int http_fd;
+	struct ddev *devs;
+	unsigned ndevs;
+	struct ddev *locked;	/* devices that may hold their lock */
+	struct fleet fleet;	/* outlet state, indexed like devs */
+	struct pool pool;	/* open device handles */
+	struct journal journal;	/* desired state, if journal_path is set */
+	struct timer journal_timer;	/* snapshot due */
+
+	struct udev *udev;
+	struct udev_monitor *mon;	/* hidraw hotplug, NULL if unavailable */
+	unsigned ngone;		/* devices waiting to come back */
+	struct timer rescan_timer;
+	struct client *reap;	/* closed clients, freed once idle */
+	struct client *subs;	/* clients with subscriptions */
+
+	struct timer_wheel timers;
+	int timer_fd;
+	uint64_t timer_armed;	/* timerfd expiry, UINT64_MAX if disarmed */
+	struct at_entry **at;	/* "at" table, ids index it */
+	unsigned nat;
+	int at_free;		/* free list through next_free, -1 if empty */
+};
+
+static enum watch_kind listen_kind = WATCH_LISTEN;
+static enum watch_kind http_listen_kind = WATCH_HTTP_LISTEN;
+static enum watch_kind timer_kind = WATCH_TIMER;
+static enum watch_kind udev_kind = WATCH_UDEV;
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig __attribute__((unused)))
+{
+	stop = 1;
+}
+
+/* Client output */
+
+static void client_free(struct client *c)
+{
+	while (c->flows) {
+		struct sched_flow *f = c->flows;
+
+		c->flows = f->owner_next;
+		free(f);
+	}
+	free(c->out);
+	free(c);
+}
+
+/*
+ * Closed clients stay allocated until the current batch of events has been
+ * handled and none of their requests is still queued on a device.
+ */
+static void reap_clients(struct daemon *d)
+{
+	struct client **pc = &d->reap;
+
+	while (*pc) {
+		struct client *c = *pc;
+
+		if (c->pending) {
+			pc = &c->reap_next;
+			continue;
+		}
+		*pc = c->reap_next;
+		client_free(c);
+	}
+}
+
+static void client_update_events(struct daemon *d, struct client *c)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | (c->out_len ? EPOLLOUT : 0),
+		.data.ptr = c,
+	};
+
+	epoll_ctl(d->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void unsubscribe(struct daemon *d, struct client *c);
+
+static void client_close(struct daemon *d, struct client *c)
+{
+	unsubscribe(d, c);
+	epoll_ctl(d->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	c->dead = 1;
+	c->reap_next = d->reap;
+	d->reap = c;
+}
+
+static void client_send(struct daemon *d, struct client *c)
+{
+	ssize_t n;
+
+	while (c->out_len) {
+		n = send(c->fd, c->out, c->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n <= 0) {
+			c->out_len = 0;
+			client_close(d, c);
+			return;
+		}
+		memmove(c->out, c->out + n, c->out_len - n);
+		c->out_len -= n;
+	}
+
+	if (c->closing && !c->head && !c->out_len) {
+		client_close(d, c);
+		return;
+	}
+	client_update_events(d, c);
+}
+
+static void client_append(struct client *c, const char *s, size_t len)
+{
+	if (c->out_len + len > c->out_alloc) {
+		size_t alloc = c->out_alloc ? c->out_alloc : 1024;
+		char *tmp;
+
+		while (alloc < c->out_len + len)
+			alloc *= 2;
+		tmp = realloc(c->out, alloc);
+		if (!tmp)
+			return;
+		c->out = tmp;
+		c->out_alloc = alloc;
+	}
+
+	memcpy(c->out + c->out_len, s, len);
+	c->out_len += len;
+}
+
+/* Requests */
+
+static struct request *request_new(struct client *c)
+{
+	struct request *req = calloc(1, sizeof(*req));
+
+	if (!req)
+		return NULL;
+
+	req->client = c;
+	req->arrival_ns = now_ns();
+	if (c->tail)
+		c->tail->next = req;
+	else
+		c->head = req;
+	c->tail = req;
+	c->pending++;
+
+	return req;
+}
+
+/* Complete @req and push every reply that is now in order to the client. */
+static void request_finish(struct daemon *d, struct request *req,
+			   const char *fmt, ...)
+{
+	struct client *c = req->client;
+	bool flushed = false;
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(req->reply, sizeof(req->reply), fmt, ap);
+	va_end(ap);
+	req->done = 1;
+
+	if (req->dispatch_ns) {
+		uint64_t now = now_ns();
+		size_t len = strlen(req->reply);
+
+		snprintf(req->reply + len, sizeof(req->reply) - len,
+			 " qwait_us=%llu dev_us=%llu",
+			 (unsigned long long)(req->dispatch_ns - req->arrival_ns) / 1000,
+			 (unsigned long long)(now - req->dispatch_ns) / 1000);
+		hist_add(req->devtime, now - req->dispatch_ns);
+	}
+
+	while (c->head && c->head->done) {
+		struct request *head = c->head;
+
+		if (!c->dead && c->http) {
+			char buf[3072];
+			size_t len = http_response(head->reply,
+						   c->closing && !head->next,
+						   buf, sizeof(buf));
+
+			client_append(c, buf, len < sizeof(buf) ? len : sizeof(buf) - 1);
+			flushed = true;
+		} else if (!c->dead) {
+			client_append(c, head->reply, strlen(head->reply));
+			client_append(c, "\n", 1);
+			flushed = true;
+		}
+		c->head = head->next;
+		if (!c->head)
+			c->tail = NULL;
+		free(head);
+		c->pending--;
+	}
+
+	if (flushed && !c->dead)
+		client_send(d, c);
+}
+
+static void finish_list(struct daemon *d, struct request **list,
+			const char *fmt, unsigned arg)
+{
+	while (*list) {
+		struct request *req = *list;
+
+		*list = req->wait_next;
+		request_finish(d, req, fmt, arg);
+	}
+}
+
+/* Subscriptions */
+
+static void device_arm_idle(struct daemon *d, struct ddev *dev);
+
+static void update_watchers(struct daemon *d)
+{
+	struct client *c;
+	unsigned i, j;
+
+	for (i = 0; i < d->ndevs; i++)
+		d->devs[i].watchers = 0;
+	for (c = d->subs; c; c = c->sub_next) {
+		for (i = 0; i < d->ndevs; i++) {
+			for (j = 0; j < c->nfilters; j++) {
+				if (c->filters[j].dev < 0 ||
+				    c->filters[j].dev == d->devs[i].index) {
+					d->devs[i].watchers++;
+					break;
+				}
+			}
+		}
+	}
+	for (i = 0; i < d->ndevs; i++) {
+		if (d->devs[i].watchers)
+			device_arm_idle(d, &d->devs[i]);
+		else
+			timer_del(&d->timers, &d->devs[i].poll_timer);
+	}
+}
+
+static int subscribe(struct daemon *d, struct client *c, int dev,
+		     unsigned char outlets)
+{
+	if (c->nfilters == SUB_MAX_FILTERS)
+		return -1;
+	if (!c->nfilters) {
+		c->sub_next = d->subs;
+		d->subs = c;
+	}
+	c->filters[c->nfilters].dev = dev;
+	c->filters[c->nfilters].outlets = outlets;
+	c->nfilters++;
+	update_watchers(d);
+
+	return 0;
+}
+
+static void unsubscribe(struct daemon *d, struct client *c)
+{
+	struct client **pc;
+
+	if (!c->nfilters)
+		return;
+	for (pc = &d->subs; *pc; pc = &(*pc)->sub_next) {
+		if (*pc == c) {
+			*pc = c->sub_next;
+			break;
+		}
+	}
+	c->nfilters = 0;
+	c->dropped = 0;
+	update_watchers(d);
+}
+
+static bool sub_matches(const struct client *c, int dev, unsigned char changed)
+{
+	unsigned i;
+
+	for (i = 0; i < c->nfilters; i++)
+		if ((c->filters[i].dev < 0 || c->filters[i].dev == dev) &&
+		    c->filters[i].outlets & changed)
+			return true;
+	return false;
+}
+
+/* Push one change of device @dev's outlets to every interested subscriber. */
+static void publish(struct daemon *d, struct ddev *dev, unsigned char old,
+		    unsigned char new, unsigned char changed, const char *source)
+{
+	struct timespec ts;
+	struct client *c;
+	char line[160];
+	int len;
+
+	if (!dev->watchers)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	len = snprintf(line, sizeof(line),
+		       "event dev=%d old=0x%02x new=0x%02x changed=0x%02x source=%s time_us=%llu\n",
+		       dev->index, old, new, changed, source,
+		       (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+
+	for (c = d->subs; c; c = c->sub_next) {
+		if (c->dead || !sub_matches(c, dev->index, changed))
+			continue;
+		if (c->dropped) {
+			char note[48];
+			int n = snprintf(note, sizeof(note), "event dropped=%llu\n",
+					 (unsigned long long)c->dropped);
+
+			if (c->out_len + n + len > SUB_MAX_OUT) {
+				c->dropped++;
+				continue;
+			}
+			client_append(c, note, n);
+			c->dropped = 0;
+		} else if (c->out_len + len > SUB_MAX_OUT) {
+			c->dropped++;
+			continue;
+		}
+		client_append(c, line, len);
+		client_send(d, c);
+	}
+}
+
+/* Record a status reply, telling subscribers about outlets that changed. */
+static void device_observed(struct daemon *d, struct ddev *dev,
+			    unsigned char mask, const char *source)
+{
+	struct fleet *f = &d->fleet;
+	unsigned char old = f->cur[dev->index], known = f->known[dev->index];
+	unsigned char changed;
+
+	fleet_observe(f, dev->index, mask, now_ns());
+	changed = ((old ^ f->cur[dev->index]) | ~known) & POWER_SWITCH_ALL;
+	if (changed)
+		publish(d, dev, old, f->cur[dev->index], changed, source);
+}
+
+/* The same for outlets @care just written with @value. */
+static void device_applied(struct daemon *d, struct ddev *dev,
+			   unsigned char value, unsigned char care,
+			   const char *source)
+{
+	struct fleet *f = &d->fleet;
+	unsigned char old = f->cur[dev->index], known = f->known[dev->index];
+	unsigned char changed;
+
+	fleet_applied(f, dev->index, value, care, now_ns());
+	changed = ((old ^ f->cur[dev->index]) | ~known) & care;
+	if (changed)
+		publish(d, dev, old, f->cur[dev->index], changed, source);
+}
+
+/* Devices */
+
+/* What identifies a device across reconnects and restarts. */
+static const char *device_key(const struct ddev *dev)
+{
+	return dev->serial ? dev->serial : dev->path;
+}
+
+/*
+ * Lock @hid, the handle @dev is opened with, trying for up to @wait_ms.
+ * Returns -1 if somebody else still has it.  Only used at startup.
+ */
+static int device_lock(struct ddev *dev, hid_device *hid, unsigned wait_ms)
+{
+	uint64_t until = now_ns() + wait_ms * 1000000ull;
+
+	while (devlock_try(&dev->lock, hid, "daemon")) {
+		if (errno != EWOULDBLOCK) {
+			hid_log_warn(dev->path, "Unable to lock device: %m");
+			return 0;
+		}
+		if (now_ns() >= until) {
+			char why[56];
+
+			devlock_describe(&dev->lock, why, sizeof(why));
+			hid_log_warn(dev->path, "%s", why);
+			return -1;
+		}
+		usleep(LOCK_POLL_MS * 1000);
+	}
+
+	return 0;
+}
+
+static void device_fail(struct daemon *d, struct ddev *dev, const char *why)
+{
+	struct request *req;
+	char msg[64];
+
+	snprintf(msg, sizeof(msg), "err %s", why);
+	dev->status_inflight = 0;
+	timer_del(&d->timers, &dev->status_timer);
+	timer_del(&d->timers, &dev->hedge_timer);
+	fleet_forget(&d->fleet, dev->index, now_ns());
+	dev->verify_pending = 0;
+	finish_list(d, &dev->status_waiters, msg, 0);
+	finish_list(d, &dev->set_waiters, msg, 0);
+	dev->set_tail = &dev->set_waiters;
+	finish_list(d, &dev->wq_waiters, msg, 0);
+	dev->wq_len = 0;
+	timer_del(&d->timers, &dev->retry_timer);
+	for (req = dev->cycle_waiters; req; req = req->wait_next)
+		timer_del(&d->timers, &req->cycle_timer);
+	finish_list(d, &dev->cycle_waiters, msg, 0);
+	dev->co.care = 0;
+	dev->co.deadline_ns = 0;
+	timer_del(&d->timers, &dev->co_timer);
+	dev->lock_since = 0;
+	timer_del(&d->timers, &dev->lock_timer);
+
+	for (;;) {
+		struct sched_item *it = sched_dequeue(&dev->sched, now_ns(), NULL);
+
+		if (!it)
+			break;
+		request_finish(d, (struct request *)it, "%s", msg);
+	}
+}
+
+static void device_kick(struct daemon *d, struct ddev *dev);
+
+/* Handle pool */
+
+static struct ddev *pool_dev(struct pool_entry *e)
+{
+	return (struct ddev *)((char *)e - offsetof(struct ddev, pool));
+}
+
+/* A device waiting for a status reply or a write retry keeps its handle. */
+static bool device_idle(struct pool_entry *e, void *keep)
+{
+	struct ddev *dev = pool_dev(e);
+
+	return dev != keep && !dev->status_inflight && !dev->wq_len;
+}
+
+static void device_unlock(struct daemon *d, struct ddev *dev)
+{
+	if (!dev->locked)
+		return;
+	devlock_release(&dev->lock);
+	dev->locked = 0;
+	timer_del(&d->timers, &dev->unlock_timer);
+}
+
+static void device_close(struct daemon *d, struct ddev *dev, bool evicted)
+{
+	epoll_ctl(d->epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+	device_unlock(d, dev);
+	hid_close(dev->hid);
+	dev->hid = NULL;
+	dev->fd = -1;
+	/* Replies owed to the old handle never reach a new one. */
+	dev->stale_replies = 0;
+	timer_del(&d->timers, &dev->close_timer);
+	pool_closed(&d->pool, &dev->pool, evicted);
+}
+
+/* Close least recently used idle devices while over capacity. */
+static void pool_trim(struct daemon *d, struct ddev *keep)
+{
+	struct pool_entry *e;
+
+	while ((e = pool_victim(&d->pool, device_idle, keep)))
+		device_close(d, pool_dev(e), true);
+}
+
+static void device_touch(struct daemon *d, struct ddev *dev)
+{
+	if (d->pool.idle_ns && !timer_pending(&dev->close_timer))
+		timer_add(&d->timers, &dev->close_timer,
+			  dev->pool.last_used + d->pool.idle_ns);
+}
+
+static void close_fire(void *ctx, void *arg)
+{
+	struct daemon *d = ctx;
+	struct ddev *dev = arg;
+	uint64_t now = now_ns();
+
+	if (!dev->hid)
+		return;
+	if (!pool_expired(&d->pool, &dev->pool, now))
+		timer_add(&d->timers, &dev->close_timer,
+			  dev->pool.last_used + d->pool.idle_ns);
+	else if (!device_idle(&dev->pool, NULL))
+		timer_add(&d->timers, &dev->close_timer, now + d->pool.idle_ns);
+	else
+		device_close(d, dev, false);
+}
+
+/*
+ * The handle of @dev, reopened from its path if the pool has closed it.
+ * NULL if that fails, which callers treat like a failed write.
+ */
+static hid_device *device_hid(struct daemon *d, struct ddev *dev)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = dev };
+	uint64_t start = now_ns();
+
+	if (dev->hid) {
+		pool_hit(&d->pool, &dev->pool, start);
+		device_touch(d, dev);
+		return dev->hid;
+	}
+	if (dev->gone)
+		return NULL;
+
+	dev->hid = dev->sim ? bellwin_sim_reopen(dev->sim) :
+			      device_open_path(dev->path);
+	if (!dev->hid) {
+		hid_log_error(dev->path, "reopen failed");
+		return NULL;
+	}
+	dev->fd = hid_get_fd(dev->hid);
+	if (epoll_ctl(d->epfd, EPOLL_CTL_ADD, dev->fd, &ev)) {
+		hid_log_error(dev->path, "epoll_ctl: %m");
+		hid_close(dev->hid);
+		dev->hid = NULL;
+		dev->fd = -1;
+		return NULL;
+	}
+	pool_opened(&d->pool, &dev->pool, now_ns(), now_ns() - start, true);
+	device_touch(d, dev);
+	pool_trim(d, dev);
+
+	return dev->hid;
+}
+
+/*
+ * Lock @dev for an exchange, unless it holds the lock already.  While
+ * somebody else uses it, lock_timer tries again and resumes the work put
+ * off meanwhile, and after LOCK_WAIT_MS that work fails.  Returns false
+ * while the work is to be put off.
+ */
+static bool device_acquire(struct daemon *d, struct ddev *dev)
+{
+	uint64_t now = now_ns();
+	hid_device *hid;
+	char why[56];
+
+	if (dev->locked)
+		return true;
+	if (timer_pending(&dev->lock_timer))
+		return false;
+	/* A reopen that fails is then handled like a failed write. */
+	hid = device_hid(d, dev);
+	if (!hid)
+		return true;
+
+	if (devlock_try(&dev->lock, hid, "daemon")) {
+		if (errno != EWOULDBLOCK) {
+			hid_log_warn(dev->path, "Unable to lock device: %m");
+			return true;
+		}
+		if (!dev->lock_since)
+			dev->lock_since = now;
+		if (now - dev->lock_since < LOCK_WAIT_MS * 1000000ull) {
+			timer_add(&d->timers, &dev->lock_timer,
+				  now + LOCK_POLL_MS * 1000000ull);
+			return false;
+		}
+		devlock_describe(&dev->lock, why, sizeof(why));
+		hid_log_warn(dev->path, "%s", why);
+		device_fail(d, dev, why);
+		return false;
+	}
+
+	dev->lock_since = 0;
+	dev->locked = 1;
+	if (!dev->lock_listed) {
+		dev->lock_listed = 1;
+		dev->lock_next = d->locked;
+		d->locked = dev;
+	}
+
+	return true;
+}
+
+/* Somebody waits for @dev: no new exchange until they had their turn. */
+static bool device_yielding(struct ddev *dev)
+{
+	return dev->locked && devlock_contended(&dev->lock);
+}
+
+/*
+ * Let go of @dev once its exchanges are over.  Returns true unless it still
+ * holds the lock.
+ */
+static bool device_unlock_idle(struct daemon *d, struct ddev *dev)
+{
+	uint64_t now = now_ns();
+	bool yielding;
+
+	if (!dev->locked)
+		return true;
+	if (dev->status_inflight || dev->wq_len)
+		return false;
+	/* Replies still owed to us would reach whoever locks it next. */
+	if (dev->stale_replies && now < dev->stale_until) {
+		timer_add(&d->timers, &dev->unlock_timer, dev->stale_until);
+		return false;
+	}
+
+	yielding = device_yielding(dev);
+	device_unlock(d, dev);
+	/* Come back for the work device_kick() left queued. */
+	if (yielding && !timer_pending(&dev->lock_timer))
+		timer_add(&d->timers, &dev->lock_timer,
+			  now + LOCK_POLL_MS * 1000000ull);
+
+	return true;
+}
+
+/* Run before every wait for events, startup's locks included. */
+static void unlock_idle(struct daemon *d)
+{
+	struct ddev **pd = &d->locked;
+
+	while (*pd) {
+		struct ddev *dev = *pd;
+
+		if (device_unlock_idle(d, dev)) {
+			*pd = dev->lock_next;
+			dev->lock_listed = 0;
+		} else {
+			pd = &dev->lock_next;
+		}
+	}
+}
+
+/* Write one report, without retrying.  Returns 0 or -1. */
+static int device_write(struct daemon *d, struct ddev *dev, const char *cmd)
+{
+	hid_device *hid = device_hid(d, dev);
+
+	return hid ? send_command_once(hid, cmd, BELLWIN_CMD_LEN) : -1;
+}
+
+static void device_send_status(struct daemon *d, struct ddev *dev)
+{
+	const char cmd[BELLWIN_CMD_LEN] = { BELLWIN_CMD_STATUS };
+
+	/* A failed write is handled like a lost reply. */
+	if (device_write(d, dev, cmd))
+		dev->write_failed++;
+	dev->status_tries++;
+	dev->status_sent = now_ns();
+	dev->status_deadline = dev->status_sent + rtt_timeout_ns(&dev->rtt);
+	timer_add(&d->timers, &dev->status_timer, dev->status_deadline);
+}
+
+static void device_start_status(struct daemon *d, struct ddev *dev)
+{
+	unsigned char buf[BELLWIN_REPORT_SIZE];
+
+	if (!device_acquire(d, dev))
+		return;
+	/* Drop stale reports so the next one read is our reply. */
+	while (dev->hid && hid_read_timeout(dev->hid, buf, sizeof(buf), 0) > 0)
+		if (dev->stale_replies)
+			dev->stale_replies--;
+
+	dev->status_inflight = 1;
+	dev->status_tries = 0;
+	device_send_status(d, dev);
+	dev->status_start = dev->status_sent;
+
+	timer_del(&d->timers, &dev->hedge_timer);
+	if (dev->health.latency.count >= HEDGE_MIN_SAMPLES) {
+		uint64_t at = dev->status_start +
+			hist_percentile(&dev->health.latency, HEDGE_PERCENTILE);
+
+		if (at < dev->status_deadline)
+			timer_add(&d->timers, &dev->hedge_timer, at);
+	}
+}
+
+/* Devices with subscribers are read every poll_ms while otherwise idle. */
+static bool device_poll_due(struct daemon *d, struct ddev *dev)
+{
+	return dev->watchers && d->opts->poll_ms && !dev->status_inflight &&
+	       !dev->wq_len && !dev->gone && !timer_pending(&dev->lock_timer) &&
+	       health_usable(&dev->health);
+}
+
+/*
+ * Arm the timers for work that waits until no status read is in flight:
+ * probes, verification reads and polls.  Their handlers check again, so
+ * arming too often is harmless.
+ */
+static void device_arm_idle(struct daemon *d, struct ddev *dev)
+{
+	if (dev->status_inflight || dev->wq_len || dev->gone ||
+	    timer_pending(&dev->lock_timer))
+		return;
+	if (health_next_probe(&dev->health) != UINT64_MAX)
+		timer_add(&d->timers, &dev->probe_timer,
+			  health_next_probe(&dev->health));
+	if (dev->verify_pending && health_usable(&dev->health))
+		timer_add(&d->timers, &dev->verify_timer, dev->verify_deadline);
+	if (device_poll_due(d, dev))
+		timer_add(&d->timers, &dev->poll_timer, dev->poll_at);
+}
+
+static void device_flush_sets(struct daemon *d, struct ddev *dev);
+static void device_set(struct daemon *d, struct ddev *dev, unsigned char value,
+		       unsigned char care, const char *why);
+
+static void device_quarantine(struct daemon *d, struct ddev *dev)
+{
+	hid_log_warn(dev->path, "quarantined, next probe in %u ms",
+		     dev->health.probe_interval_ms);
+	device_fail(d, dev, "quarantined");
+	device_arm_idle(d, dev);
+}
+
+/*
+ * Compare a fresh status reply with the outlets switched since the last one.
+ * Outlets that did not follow are switched again and read back at once.
+ */
+static void device_check_verify(struct daemon *d, struct ddev *dev)
+{
+	struct fleet *f = &d->fleet;
+	unsigned char diff = fleet_drift(f, dev->index) & dev->verify_care;
+	int i;
+
+	if (!dev->verify_pending)
+		return;
+	if (!diff) {
+		dev->verify_pending = 0;
+		dev->verified++;
+		return;
+	}
+
+	dev->mismatched++;
+	if (dev->verify_repairs++ == VERIFY_REPAIRS) {
+		hid_log_error(dev->path, "outlets 0x%02x did not switch", diff);
+		dev->verify_pending = 0;
+		return;
+	}
+
+	for (i = 0; i < POWER_SWITCH_COUNT; i++) {
+		char cmd[BELLWIN_CMD_LEN];
+
+		if (!(diff & BIT(i)))
+			continue;
+		prepare_cmd(cmd, i + 1, f->desired[dev->index] & BIT(i));
+		/* Not retried: the read back finds it again. */
+		if (device_write(d, dev, cmd))
+			dev->write_failed++;
+	}
+	dev->verify_deadline = now_ns();
+	device_applied(d, dev, f->desired[dev->index], diff, "verify");
+}
+
+/* Reconnect */
+
+static void device_disconnected(struct daemon *d, struct ddev *dev)
+{
+	hid_log_warn(dev->path, "device disconnected, waiting for it to return");
+	epoll_ctl(d->epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+	device_unlock(d, dev);
+	hid_close(dev->hid);
+	dev->hid = NULL;
+	dev->fd = -1;
+	dev->stale_replies = 0;
+	dev->reconnecting = 0;
+	timer_del(&d->timers, &dev->close_timer);
+	pool_drop(&d->pool, &dev->pool);
+	dev->gone = 1;
+	device_fail(d, dev, "device gone");
+
+	d->ngone++;
+	if (!timer_pending(&d->rescan_timer))
+		timer_add(&d->timers, &d->rescan_timer,
+			  now_ns() + RESCAN_MS * 1000000ull);
+}
+
+/*
+ * @hid is @dev back again.  It comes up with its own default relay state,
+ * so read it first; device_restore() then switches what differs.
+ */
+static int device_reattach(struct daemon *d, struct ddev *dev, hid_device *hid)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = dev };
+	const char *path = hid_get_path(hid);
+
+	dev->fd = hid_get_fd(hid);
+	if (epoll_ctl(d->epfd, EPOLL_CTL_ADD, dev->fd, &ev)) {
+		hid_log_error(dev->path, "epoll_ctl: %m");
+		hid_close(hid);
+		dev->fd = -1;
+		return -1;
+	}
+	dev->hid = hid;
+	if (path && (!dev->path || strcmp(path, dev->path))) {
+		free(dev->path);
+		dev->path = strdup(path);
+	}
+	pool_opened(&d->pool, &dev->pool, now_ns(), 0, false);
+	device_touch(d, dev);
+
+	dev->gone = 0;
+	d->ngone--;
+	dev->reconnects++;
+	dev->reconnect_ns = now_ns();
+	dev->reconnecting = 1;
+	timer_del(&d->timers, &dev->probe_timer);
+	health_init(&dev->health);
+	device_start_status(d, dev);
+	pool_trim(d, dev);
+
+	return 0;
+}
+
+/*
+ * Queue the set reports that bring devices @from up to @to back to their
+ * desired state, as computed by one fleet_reconcile() sweep.  Returns the
+ * number of devices that had drifted.
+ */
+static unsigned reconcile(struct daemon *d, unsigned from, unsigned to,
+			  const char *why)
+{
+	struct fleet_report r[RECONCILE_BATCH];
+	unsigned cursor = from, count = 0;
+	size_t n, i = 0;
+
+	do {
+		n = fleet_reconcile(&d->fleet, &cursor, r, RECONCILE_BATCH);
+		for (i = 0; i < n && r[i].dev < to; ) {
+			unsigned idx = r[i].dev;
+			unsigned char value = 0, care = 0;
+
+			for (; i < n && r[i].dev == idx; i++) {
+				care |= BIT(r[i].outlet - 1);
+				if (r[i].on)
+					value |= BIT(r[i].outlet - 1);
+			}
+			device_set(d, &d->devs[idx], value, care, why);
+			count++;
+		}
+	} while (i == n && n && cursor < to);
+
+	return count;
+}
+
+/* Switch the outlets a returning device lost back to their desired state. */
+static void device_restore(struct daemon *d, struct ddev *dev)
+{
+	dev->reconnecting = 0;
+	hid_log_info(dev->path,
+		     "reconnected, restoring outlets 0x%02x, %.1f ms after it returned",
+		     fleet_drift(&d->fleet, dev->index),
+		     (now_ns() - dev->reconnect_ns) / 1e6);
+	if (reconcile(d, dev->index, dev->index + 1, "restore"))
+		device_flush_sets(d, dev);
+}
+
+/* Reopen gone devices that are present again, matched by serial number. */
+static void rescan(struct daemon *d)
+{
+	struct hid_device_info *devs, *cur;
+	unsigned i;
+
+	if (d->opts->simulate) {
+		for (i = 0; i < d->ndevs && d->ngone; i++) {
+			struct ddev *dev = &d->devs[i];
+			hid_device *hid;
+
+			if (!dev->gone || !dev->sim)
+				continue;
+			hid = bellwin_sim_reopen(dev->sim);
+			if (hid)
+				device_reattach(d, dev, hid);
+		}
+		return;
+	}
+
+	devs = hid_enumerate(BELLWIN_VENDOR, BELLWIN_PRODUCT);
+	for (cur = devs; cur && d->ngone; cur = cur->next) {
+		char *serial = wchar_to_utf8(cur->serial_number);
+		const char *key = serial ? serial : cur->path;
+
+		for (i = 0; i < d->ndevs; i++) {
+			struct ddev *dev = &d->devs[i];
+			hid_device *hid;
+
+			if (!dev->gone || strcmp(device_key(dev), key))
+				continue;
+			hid = device_open_path(cur->path);
+			if (hid)
+				device_reattach(d, dev, hid);
+			break;
+		}
+		free(serial);
+	}
+	hid_free_enumeration(devs);
+}
+
+static void rescan_fire(void *ctx, void *arg __attribute__((unused)))
+{
+	struct daemon *d = ctx;
+
+	rescan(d);
+	if (d->ngone)
+		timer_add(&d->timers, &d->rescan_timer,
+			  now_ns() + RESCAN_MS * 1000000ull);
+}
+
+static void udev_readable(struct daemon *d)
+{
+	struct udev_device *ud;
+	bool added = false;
+
+	while ((ud = udev_monitor_receive_device(d->mon))) {
+		const char *action = udev_device_get_action(ud);
+
+		if (action && !strcmp(action, "add"))
+			added = true;
+		udev_device_unref(ud);
+	}
+	if (added && d->ngone)
+		rescan(d);
+}
+
+static void device_readable(struct daemon *d, struct ddev *dev)
+{
+	unsigned char buf[BELLWIN_REPORT_SIZE];
+	uint64_t now;
+	int res;
+
+	/* Closed by the pool earlier in this batch of events. */
+	if (!dev->hid)
+		return;
+
+	/* POLLHUP or POLLERR: unplugged or browned out. */
+	res = hid_read_timeout(dev->hid, buf, sizeof(buf), 0);
+	if (res < 0) {
+		device_disconnected(d, dev);
+		return;
+	}
+	if (res <= BELLWIN_STATUS_MASK || buf[0] != BELLWIN_CMD_STATUS)
+		return;
+
+	/*
+	 * Replies come back in order, so an answer to a resent or hedged
+	 * query that arrives late belongs to a read that already finished.
+	 */
+	now = now_ns();
+	if (dev->stale_replies) {
+		if (now < dev->stale_until) {
+			dev->stale_replies--;
+			return;
+		}
+		dev->stale_replies = 0;
+	}
+	if (!dev->status_inflight)
+		return;
+
+	if (dev->status_tries == 1)
+		rtt_sample(&dev->rtt, now - dev->status_sent);
+	health_success(&dev->health, now - dev->status_start, now);
+	dev->stale_replies = dev->status_tries - 1;
+	dev->stale_until = now + rtt_timeout_ns(&dev->rtt);
+
+	dev->status_inflight = 0;
+	timer_del(&d->timers, &dev->status_timer);
+	timer_del(&d->timers, &dev->hedge_timer);
+	dev->poll_at = now + d->opts->poll_ms * 1000000ull;
+	device_observed(d, dev, buf[BELLWIN_STATUS_MASK],
+			dev->status_waiters ? "status" : "poll");
+	finish_list(d, &dev->status_waiters, "ok mask=0x%02x",
+		    d->fleet.cur[dev->index]);
+	if (dev->reconnecting)
+		device_restore(d, dev);
+	device_check_verify(d, dev);
+	device_kick(d, dev);
+	device_arm_idle(d, dev);
+	/* Kept open past capacity while the reply was due. */
+	pool_trim(d, NULL);
+}
+
+/* Desired-state journal */
+
+static void journal_take_snapshot(struct daemon *d)
+{
+	const char **keys;
+	unsigned i;
+
+	keys = calloc(d->ndevs ? d->ndevs : 1, sizeof(*keys));
+	if (!keys) {
+		hid_log_error(d->journal.path, "snapshot: %m");
+		return;
+	}
+	for (i = 0; i < d->ndevs; i++)
+		keys[i] = device_key(&d->devs[i]);
+	if (journal_snapshot(&d->journal, keys, d->fleet.desired,
+			     d->fleet.want, d->ndevs))
+		hid_log_error(d->journal.snap_path, "snapshot: %m");
+	free(keys);
+}
+
+static void journal_fire(void *ctx, void *arg __attribute__((unused)))
+{
+	journal_take_snapshot(ctx);
+}
+
+/* Log a change of desired state, already made in the fleet. */
+static void journal_note(struct daemon *d, struct ddev *dev,
+			 unsigned char value, unsigned char care)
+{
+	int ret;
+
+	if (!d->opts->journal_path)
+		return;
+	ret = journal_append(&d->journal, dev->index, value, care);
+	/* A full log lost the record, but the snapshot takes it from the fleet. */
+	if (ret < 0)
+		journal_take_snapshot(d);
+	else if (ret > 0 && !timer_pending(&d->journal_timer))
+		timer_add(&d->timers, &d->journal_timer, now_ns());
+}
+
+/* The reports of a flush are out, or @failed: answer its requests. */
+static void device_sets_written(struct daemon *d, struct ddev *dev,
+				bool failed)
+{
+	struct fleet *f = &d->fleet;
+	unsigned char final = dev->wq_final, switched = 0;
+	unsigned i;
+
+	timer_del(&d->timers, &dev->retry_timer);
+	for (i = 0; i < dev->wq_len; i++)
+		switched |= BIT(dev->wq[i][BELLWIN_SET_INDEX]);
+	dev->wq_len = 0;
+
+	if (failed) {
+		dev->write_failed++;
+		fleet_forget(f, dev->index, now_ns());
+		finish_list(d, &dev->wq_waiters, "err write failed", 0);
+		if (health_usable(&dev->health)) {
+			health_failure(&dev->health, false, now_ns());
+			if (!health_usable(&dev->health))
+				device_quarantine(d, dev);
+		}
+		return;
+	}
+
+	device_applied(d, dev, final, dev->wq_care, "set");
+
+	if (switched) {
+		/* A write that needed retries is read back without waiting. */
+		uint64_t due = now_ns() +
+			(dev->wq_retried ? 0 : VERIFY_PIGGYBACK_MS * 1000000ull);
+
+		if (!dev->verify_pending || due < dev->verify_deadline)
+			dev->verify_deadline = due;
+		if (!dev->verify_pending)
+			dev->verify_care = 0;
+		dev->verify_pending = 1;
+		dev->verify_care |= switched;
+		dev->verify_repairs = 0;
+	}
+
+	while (dev->wq_waiters) {
+		struct request *req = dev->wq_waiters;
+		unsigned char overridden = (req->value ^ final) & req->care;
+
+		dev->wq_waiters = req->wait_next;
+		if (req->op == REQ_CYCLE && !req->cycle_at) {
+			req->cycle_at = now_ns() + req->cycle_ms * 1000000ull;
+			req->wait_next = dev->cycle_waiters;
+			dev->cycle_waiters = req;
+			timer_add(&d->timers, &req->cycle_timer, req->cycle_at);
+			continue;
+		}
+		if (overridden)
+			request_finish(d, req, "ok mask=0x%02x overridden=0x%02x",
+				       final, overridden);
+		else
+			request_finish(d, req, "ok mask=0x%02x", final);
+	}
+}
+
+/*
+ * Write the flush's reports from where it stopped.  Returns false while a
+ * failed write waits for its retry, true once the flush is over.
+ */
+static bool device_write_sets(struct daemon *d, struct ddev *dev)
+{
+	while (dev->wq_sent < dev->wq_len) {
+		if (device_write(d, dev, dev->wq[dev->wq_sent])) {
+			if (++dev->wq_tries == SEND_TRIES) {
+				hid_log_error(dev->path, "Unable to write(): %m");
+				device_sets_written(d, dev, true);
+				return true;
+			}
+			dev->write_retries++;
+			dev->wq_retried = 1;
+			timer_add(&d->timers, &dev->retry_timer, now_ns() +
+				  (SEND_BACKOFF_US * 1000ull << 2 * (dev->wq_tries - 1)));
+			return false;
+		}
+		dev->wq_sent++;
+		dev->wq_tries = 0;
+	}
+	device_sets_written(d, dev, false);
+
+	return true;
+}
+
+static void device_flush_sets(struct daemon *d, struct ddev *dev)
+{
+	struct fleet *f = &d->fleet;
+	unsigned char care = dev->co.care;
+	unsigned char desired = f->desired[dev->index];
+	unsigned char want = f->want[dev->index];
+
+	/* Once the flush going out is over, device_resume() comes back. */
+	if (dev->wq_len || !device_acquire(d, dev))
+		return;
+
+	timer_del(&d->timers, &dev->co_timer);
+	fleet_want(f, dev->index, dev->co.value, care, now_ns());
+	/* Restores and repeated requests leave nothing new to log. */
+	if (f->desired[dev->index] != desired || f->want[dev->index] != want)
+		journal_note(d, dev, dev->co.value, care);
+	dev->wq_len = coalesce_flush(&dev->co, f->cur[dev->index],
+				     f->known[dev->index], &dev->wq_final,
+				     dev->wq);
+	dev->wq_care = care;
+	dev->wq_sent = 0;
+	dev->wq_tries = 0;
+	dev->wq_retried = 0;
+	dev->wq_waiters = dev->set_waiters;
+	dev->set_waiters = NULL;
+	dev->set_tail = &dev->set_waiters;
+
+	if (device_write_sets(d, dev))
+		device_arm_idle(d, dev);
+}
+
+/* Timers */
+
+static void queue_set(struct daemon *d, struct ddev *dev, struct request *req);
+
+static void status_timeout(void *ctx, void *arg)
+{
+	struct daemon *d = ctx;
+	struct ddev *dev = arg;
+	uint64_t now = now_ns();
+	bool usable = health_usable(&dev->health);
+
+	if (!dev->status_inflight)
+		return;
+
+	timer_del(&d->timers, &dev->hedge_timer);
+	rtt_backoff(&dev->rtt);
+	/* Every lost reply counts, so one read can quarantine. */
+	health_failure(&dev->health, true, now);
+	if (health_usable(&dev->health) &&
+	    dev->status_tries < DEVICE_STATUS_TRIES) {
+		device_send_status(d, dev);
+		return;
+	}
+
+	dev->status_inflight = 0;
+	dev->stale_replies = dev->status_tries;
+	dev->stale_until = now + rtt_timeout_ns(&dev->rtt);
+	if (dev->verify_pending && dev->verify_repairs++ == VERIFY_REPAIRS)
+		dev->verify_pending = 0;
+	finish_list(d, &dev->status_waiters, "err timeout", 0);
+	if (health_usable(&dev->health))
+		device_kick(d, dev);
+	else if (usable)
+		device_quarantine(d, dev);
+	device_arm_idle(d, dev);
+}
+
+/* Pick up the work put off while a flush was going out or for the lock. */
+static void device_resume(struct daemon *d, struct ddev *dev)
+{
+	if (dev->co.deadline_ns && dev->co.deadline_ns <= now_ns())
+		device_flush_sets(d, dev);
+	if (dev->wq_len)
+		return;
+	if ((dev->status_waiters || dev->reconnecting) && !dev->status_inflight)
+		device_start_status(d, dev);
+	device_kick(d, dev);
+	device_arm_idle(d, dev);
+}
+
+static void retry_fire(void *ctx, void *arg)
+{
+	struct ddev *dev = arg;
+
+	if (dev->wq_len && device_write_sets(ctx, dev))
+		device_resume(ctx, dev);
+}
+
+static void lock_fire(void *ctx, void *arg)
+{
+	struct ddev *dev = arg;
+
+	/* The sets put off may be a barrier for a status read put off too. */
+	if (dev->co.care)
+		device_flush_sets(ctx, dev);
+	device_resume(ctx, dev);
+}
+
+static void unlock_fire(void *ctx, void *arg)
+{
+	device_unlock_idle(ctx, arg);
+}
+
+static void hedge_fire(void *ctx, void *arg)
+{
+	struct ddev *dev = arg;
+
+	if (!dev->status_inflight)
+		return;
+	dev->hedged++;
+	device_send_status(ctx, dev);
+}
+
+static void probe_fire(void *ctx, void *arg)
+{
+	struct ddev *dev = arg;
+
+	if (!dev->status_inflight && !dev->wq_len && !dev->gone &&
+	    health_probe_due(&dev->health, now_ns()))
+		device_start_status(ctx, dev);
+}
+
+static void coalesce_fire(void *ctx, void *arg)
+{
+	struct ddev *dev = arg;
+
+	if (dev->co.deadline_ns)
+		device_flush_sets(ctx, dev);
+}
+
+static void verify_fire(void *ctx, void *arg)
+{
+	struct ddev *dev = arg;
+
+	if (!dev->verify_pending || dev->status_inflight || dev->wq_len ||
+	    dev->gone || !health_usable(&dev->health))
+		return;
+	/* Same barrier as a client status read. */
+	if (dev->co.care)
+		device_flush_sets(ctx, dev);
+	if (!dev->wq_len)
+		device_start_status(ctx, dev);
+}
+
+static void poll_fire(void *ctx, void *arg)
+{
+	struct daemon *d = ctx;
+	struct ddev *dev = arg;
+
+	if (!device_poll_due(d, dev))
+		return;
+	dev->poll_at = now_ns() + d->opts->poll_ms * 1000000ull;
+	if (dev->co.care)
+		device_flush_sets(d, dev);
+	if (!dev->wq_len)
+		device_start_status(d, dev);
+}
+
+/* Switch a cycled outlet back on once its off time is over. */
+static void cycle_fire(void *ctx, void *arg)
+{
+	struct request *req = arg;
+	struct ddev *dev = req->dev;
+	struct request **pr;
+
+	for (pr = &dev->cycle_waiters; *pr; pr = &(*pr)->wait_next) {
+		if (*pr == req) {
+			*pr = req->wait_next;
+			break;
+		}
+	}
+	req->wait_next = NULL;
+	req->value = req->care;
+	queue_set(ctx, dev, req);
+}
+
+static void watchdog_fire(void *ctx, void *arg)
+{
+	struct watchdog *wd = arg;
+
+	hid_log_warn(wd->dev->path,
+		     "no heartbeat for outlet %u in %u ms, switching it off",
+		     wd->outlet + 1, wd->timeout_ms);
+	wd->timeout_ms = 0;
+	wd->expired++;
+	device_set(ctx, wd->dev, 0, BIT(wd->outlet), "watchdog");
+}
+
+static void at_fire(void *ctx, void *arg)
+{
+	struct daemon *d = ctx;
+	struct at_entry *e = arg;
+
+	device_set(d, e->dev, e->value, e->care, "scheduled set");
+
+	/* Recycle the entry; the generation makes the old id stale. */
+	e->gen++;
+	e->next_free = d->at_free;
+	d->at_free = e->idx;
+}
+
+/* Point the timerfd at the wheel's next expiry, if that changed. */
+static void arm_timerfd(struct daemon *d)
+{
+	uint64_t next = timer_wheel_next(&d->timers);
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+	if (next == d->timer_armed)
+		return;
+	d->timer_armed = next;
+	if (next != UINT64_MAX) {
+		its.it_value.tv_sec = next / 1000000000ull;
+		its.it_value.tv_nsec = next % 1000000000ull;
+	}
+	timerfd_settime(d->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static struct ddev *find_device(struct daemon *d, const char *sel)
+{
+	char *end;
+	unsigned long idx;
+	unsigned i;
+
+	idx = strtoul(sel, &end, 10);
+	if (*sel && !*end && idx < d->ndevs)
+		return &d->devs[idx];
+
+	for (i = 0; i < d->ndevs; i++) {
+		if (d->devs[i].serial && !strcmp(d->devs[i].serial, sel))
+			return &d->devs[i];
+		if (d->devs[i].path && !strcmp(d->devs[i].path, sel))
+			return &d->devs[i];
+	}
+
+	return NULL;
+}
+
+/* Command handling */
+
+static void open_window(struct daemon *d, struct ddev *dev)
+{
+	if (dev->co.deadline_ns)
+		return;
+	dev->co.deadline_ns = now_ns() + d->opts->coalesce_ms * 1000000ull;
+	timer_add(&d->timers, &dev->co_timer, dev->co.deadline_ns);
+}
+
+static void queue_set(struct daemon *d, struct ddev *dev, struct request *req)
+{
+	coalesce_add(&dev->co, req->value, req->care);
+	*dev->set_tail = req;
+	dev->set_tail = &req->wait_next;
+	open_window(d, dev);
+}
+
+/* A set of the daemon's own, coalesced like client sets. */
+static void device_set(struct daemon *d, struct ddev *dev, unsigned char value,
+		       unsigned char care, const char *why)
+{
+	if (dev->gone || !health_usable(&dev->health)) {
+		hid_log_warn(dev->path, "%s of outlets 0x%02x dropped, device %s",
+			     why, care, dev->gone ? "gone" : "quarantined");
+		return;
+	}
+	coalesce_add(&dev->co, value, care);
+	open_window(d, dev);
+}
+
+/*
+ * Hand queued requests to the device while it is idle.  Sets only join the
+ * coalescing window, so several can be dispatched in one go; a status query
+ * occupies the device until its reply arrives or times out, and so does a
+ * flush until its reports have gone out.
+ */
+static void device_kick(struct daemon *d, struct ddev *dev)
+{
+	while (!dev->status_inflight && !dev->wq_len && !dev->gone &&
+	       !timer_pending(&dev->lock_timer) && !device_yielding(dev)) {
+		struct sched_item *it;
+		struct request *req;
+		uint64_t now = now_ns();
+
+		it = sched_dequeue(&dev->sched, now, NULL);
+		if (!it)
+			break;
+		req = (struct request *)it;
+		req->dispatch_ns = now;
+
+		switch (req->op) {
+		case REQ_STATUS:
+			/* Reads observe every set dispatched before them. */
+			if (dev->co.care)
+				device_flush_sets(d, dev);
+			req->wait_next = dev->status_waiters;
+			dev->status_waiters = req;
+			/* Or device_resume() once the sets are out. */
+			if (!dev->wq_len)
+				device_start_status(d, dev);
+			break;
+		case REQ_SET:
+		case REQ_CYCLE:
+			queue_set(d, dev, req);
+			break;
+		case REQ_OFF:
+			queue_set(d, dev, req);
+			device_flush_sets(d, dev);
+			break;
+		case REQ_NONE:
+			request_finish(d, req, "err internal");
+			break;
+		}
+	}
+}
+
+static struct sched_flow *client_flow(struct client *c, struct ddev *dev,
+				      enum sched_class cls)
+{
+	struct sched_flow *f;
+
+	for (f = c->flows; f; f = f->owner_next)
+		if (f->sched == &dev->sched && f->cls == cls)
+			return f;
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return NULL;
+	f->sched = &dev->sched;
+	f->cls = cls;
+	f->owner_next = c->flows;
+	c->flows = f;
+
+	return f;
+}
+
+static void submit(struct daemon *d, struct ddev *dev, struct request *req,
+		   enum sched_class cls)
+{
+	struct sched_flow *f = client_flow(req->client, dev, cls);
+
+	req->dev = dev;
+	req->devtime = &dev->devtime;
+	if (!f || sched_enqueue(f, &req->item, req->arrival_ns)) {
+		request_finish(d, req, "err busy");
+		return;
+	}
+
+	device_kick(d, dev);
+}
+
+static void format_stats(struct daemon *d, struct ddev *dev, char *buf,
+			 size_t size)
+{
+	static const char *names[SCHED_CLASSES] = {
+		[SCHED_EMERGENCY] = "emergency",
+		[SCHED_CONTROL] = "control",
+		[SCHED_MONITOR] = "monitor",
+	};
+	size_t len;
+	int i;
+
+	len = snprintf(buf, size, "ok queued=%u rejected=%llu", dev->sched.depth,
+		       (unsigned long long)dev->sched.rejected);
+	for (i = 0; i < SCHED_CLASSES && len < size; i++) {
+		const struct hist *h = &dev->sched.qwait[i];
+
+		len += snprintf(buf + len, size - len,
+				" %s_qwait_us=%llu/%llu/%llu", names[i],
+				(unsigned long long)hist_percentile(h, 0.5) / 1000,
+				(unsigned long long)hist_percentile(h, 0.99) / 1000,
+				(unsigned long long)h->max / 1000);
+	}
+	if (len < size)
+		len += snprintf(buf + len, size - len, " dev_us=%llu/%llu/%llu",
+				(unsigned long long)hist_percentile(&dev->devtime, 0.5) / 1000,
+				(unsigned long long)hist_percentile(&dev->devtime, 0.99) / 1000,
+				(unsigned long long)dev->devtime.max / 1000);
+	if (len < size)
+		len += snprintf(buf + len, size - len,
+				" srtt_us=%u rttvar_us=%u rto_us=%u",
+				dev->rtt.srtt_us, dev->rtt.rttvar_us, dev->rtt.rto_us);
+	if (len < size)
+		snprintf(buf + len, size - len,
+			 " write_retries=%llu write_failed=%llu hedged=%llu verified=%llu mismatched=%llu reconnects=%llu",
+			 (unsigned long long)dev->write_retries,
+			 (unsigned long long)dev->write_failed,
+			 (unsigned long long)dev->hedged,
+			 (unsigned long long)dev->verified,
+			 (unsigned long long)dev->mismatched,
+			 (unsigned long long)dev->reconnects);
+}
+
+/* Devices whose outlets differ from what clients last asked for. */
+static void format_fleet(struct daemon *d, char *buf, size_t size)
+{
+	uint64_t *drifted;
+	size_t len;
+	unsigned i, n;
+
+	drifted = calloc((d->fleet.n + 63) / 64 + 1, sizeof(*drifted));
+	if (!drifted) {
+		snprintf(buf, size, "err out of memory");
+		return;
+	}
+
+	n = fleet_diff(&d->fleet, drifted);
+	len = snprintf(buf, size, "ok devices=%u drifted=%u", d->fleet.n, n);
+	for (i = 0; i < d->fleet.n && len < size; i++)
+		if (drifted[i / 64] & (1ull << (i % 64)))
+			len += snprintf(buf + len, size - len, " %u:0x%02x", i,
+					fleet_drift(&d->fleet, i));
+	free(drifted);
+}
+
+static void format_pool(struct daemon *d, char *buf, size_t size)
+{
+	const struct pool *p = &d->pool;
+	uint64_t uses = p->hits + p->misses;
+
+	snprintf(buf, size,
+		 "ok open=%u capacity=%u idle_ms=%llu hits=%llu misses=%llu "
+		 "hit_rate=%.3f evictions=%llu idle_closes=%llu "
+		 "reopen_us=%llu/%llu/%llu",
+		 p->open, p->capacity,
+		 (unsigned long long)(p->idle_ns / 1000000),
+		 (unsigned long long)p->hits, (unsigned long long)p->misses,
+		 uses ? (double)p->hits / uses : 1.0,
+		 (unsigned long long)p->evictions,
+		 (unsigned long long)p->idle_closes,
+		 (unsigned long long)hist_percentile(&p->reopen, 0.50) / 1000,
+		 (unsigned long long)hist_percentile(&p->reopen, 0.99) / 1000,
+		 (unsigned long long)p->reopen.max / 1000);
+}
+
+static void format_journal(struct daemon *d, char *buf, size_t size)
+{
+	const struct journal *j = &d->journal;
+
+	if (!d->opts->journal_path) {
+		snprintf(buf, size, "err no journal");
+		return;
+	}
+	snprintf(buf, size,
+		 "ok gen=%u records=%u capacity=%u appends=%llu snapshots=%llu "
+		 "snapshot_us=%llu",
+		 j->gen, j->seq, JOURNAL_RECORDS,
+		 (unsigned long long)j->appends,
+		 (unsigned long long)j->snapshots,
+		 (unsigned long long)j->snapshot_ns / 1000);
+}
+
+/* Schedule a set @ms from now; @id names it for "cancel". */
+static int schedule_at(struct daemon *d, struct ddev *dev, unsigned long ms,
+		       unsigned char value, unsigned char care, uint64_t *id)
+{
+	struct at_entry *e;
+
+	if (d->at_free >= 0) {
+		e = d->at[d->at_free];
+		d->at_free = e->next_free;
+	} else {
+		struct at_entry **tab = realloc(d->at, (d->nat + 1) * sizeof(*tab));
+
+		if (!tab)
+			return -1;
+		d->at = tab;
+		e = calloc(1, sizeof(*e));
+		if (!e)
+			return -1;
+		e->idx = d->nat;
+		d->at[d->nat++] = e;
+		timer_init(&e->timer, at_fire, e);
+	}
+
+	e->dev = dev;
+	e->value = value;
+	e->care = care;
+	timer_add(&d->timers, &e->timer, now_ns() + ms * 1000000ull);
+	*id = (uint64_t)e->gen << 32 | e->idx;
+
+	return 0;
+}
+
+static int cancel_at(struct daemon *d, uint64_t id)
+{
+	uint32_t idx = id & 0xffffffff;
+	struct at_entry *e;
+
+	if (idx >= d->nat)
+		return -1;
+	e = d->at[idx];
+	if (e->gen != id >> 32 || !timer_pending(&e->timer))
+		return -1;
+
+	timer_del(&d->timers, &e->timer);
+	e->gen++;
+	e->next_free = d->at_free;
+	d->at_free = idx;
+
+	return 0;
+}
+
+/* Push back the watchdogs of the listed outlets, or of all armed ones. */
+static int heartbeat(struct daemon *d, struct ddev *dev, int argc, char **argv)
+{
+	uint64_t now = now_ns();
+	int i, fed = 0;
+
+	for (i = 0; i < POWER_SWITCH_COUNT; i++) {
+		struct watchdog *wd = &dev->wd[i];
+		int j, listed = !argc;
+
+		for (j = 0; j < argc && !listed; j++)
+			listed = atoi(argv[j]) == i + 1;
+		if (!listed || !wd->timeout_ms)
+			continue;
+		timer_add(&d->timers, &wd->timer,
+			  now + wd->timeout_ms * 1000000ull);
+		fed++;
+	}
+
+	return fed ? 0 : -1;
+}
+
+static int parse_outlets(int argc, char **argv, unsigned char *value,
+			 unsigned char *care)
+{
+	int i;
+
+	*value = 0;
+	*care = 0;
+	for (i = 0; i < argc; i++) {
+		int offset, v;
+
+		if (sscanf(argv[i], "%d=%d", &offset, &v) != 2 ||
+		    offset < 1 || offset > POWER_SWITCH_COUNT ||
+		    (v != 0 && v != 1))
+			return -1;
+		*care |= BIT(offset - 1);
+		if (v)
+			*value |= BIT(offset - 1);
+		else
+			*value &= ~BIT(offset - 1);
+	}
+
+	return *care ? 0 : -1;
+}
+
+static void handle_line(struct daemon *d, struct client *c, char *line)
+{
+	char *argv[MAX_ARGS];
+	char *saveptr = NULL;
+	struct request *req;
+	struct ddev *dev = NULL;
+	int argc = 0;
+	char *tok;
+
+	for (tok = strtok_r(line, " \t\r", &saveptr); tok && argc < MAX_ARGS;
+	     tok = strtok_r(NULL, " \t\r", &saveptr))
+		argv[argc++] = tok;
+	if (!argc)
+		return;
+
+	req = request_new(c);
+	if (!req)
+		return;
+
+	if (!strcmp(argv[0], "list")) {
+		char buf[sizeof(req->reply)];
+		size_t len = 0;
+		unsigned i;
+
+		len += snprintf(buf, sizeof(buf), "ok");
+		for (i = 0; i < d->ndevs && len < sizeof(buf); i++)
+			len += snprintf(buf + len, sizeof(buf) - len, " %d:%s:%s",
+					d->devs[i].index,
+					d->devs[i].serial ? d->devs[i].serial : "",
+					d->devs[i].path ? d->devs[i].path : "");
+		request_finish(d, req, "%s", buf);
+		return;
+	}
+
+	if (!strcmp(argv[0], "subscribe")) {
+		unsigned char outlets = argc > 2 ? 0 : POWER_SWITCH_ALL;
+		int i, idx = -1;
+
+		if (c->http) {
+			request_finish(d, req, "err unknown command");
+			return;
+		}
+		if (argc > 1 && strcmp(argv[1], "*")) {
+			dev = find_device(d, argv[1]);
+			if (!dev) {
+				request_finish(d, req, "err no such device");
+				return;
+			}
+			idx = dev->index;
+		}
+		for (i = 2; i < argc; i++) {
+			int outlet = atoi(argv[i]);
+
+			if (outlet < 1 || outlet > POWER_SWITCH_COUNT) {
+				request_finish(d, req, "err invalid outlet");
+				return;
+			}
+			outlets |= BIT(outlet - 1);
+		}
+		if (subscribe(d, c, idx, outlets))
+			request_finish(d, req, "err too many subscriptions");
+		else
+			request_finish(d, req, "ok subscribed");
+		return;
+	}
+	if (!strcmp(argv[0], "unsubscribe")) {
+		unsubscribe(d, c);
+		request_finish(d, req, "ok");
+		return;
+	}
+
+	if (!strcmp(argv[0], "cancel")) {
+		if (argc != 2 || cancel_at(d, strtoull(argv[1], NULL, 0)))
+			request_finish(d, req, "err no such timer");
+		else
+			request_finish(d, req, "ok");
+		return;
+	}
+
+	if (!strcmp(argv[0], "fleet")) {
+		char buf[sizeof(req->reply)];
+
+		format_fleet(d, buf, sizeof(buf));
+		request_finish(d, req, "%s", buf);
+		return;
+	}
+	if (!strcmp(argv[0], "pool")) {
+		char buf[sizeof(req->reply)];
+
+		format_pool(d, buf, sizeof(buf));
+		request_finish(d, req, "%s", buf);
+		return;
+	}
+	if (!strcmp(argv[0], "journal")) {
+		char buf[sizeof(req->reply)];
+
+		format_journal(d, buf, sizeof(buf));
+		request_finish(d, req, "%s", buf);
+		return;
+	}
+
+	if (strcmp(argv[0], "status") && strcmp(argv[0], "set") &&
+	    strcmp(argv[0], "mask") && strcmp(argv[0], "off") &&
+	    strcmp(argv[0], "cycle") &&
+	    strcmp(argv[0], "stats") && strcmp(argv[0], "health") &&
+	    strcmp(argv[0], "at") && strcmp(argv[0], "watchdog") &&
+	    strcmp(argv[0], "heartbeat")) {
+		request_finish(d, req, "err unknown command");
+		return;
+	}
+	if (!strcmp(argv[0], "health") && argc == 1) {
+		char buf[sizeof(req->reply)];
+		size_t len = 0;
+		unsigned i;
+
+		len += snprintf(buf, sizeof(buf), "ok");
+		for (i = 0; i < d->ndevs && len < sizeof(buf); i++)
+			len += snprintf(buf + len, sizeof(buf) - len, " %d:%s",
+					d->devs[i].index,
+					d->devs[i].gone ? "gone" :
+					health_state_name(d->devs[i].health.state));
+		request_finish(d, req, "%s", buf);
+		return;
+	}
+	if (argc < 2) {
+		request_finish(d, req, "err missing device");
+		return;
+	}
+	dev = find_device(d, argv[1]);
+	if (!dev) {
+		request_finish(d, req, "err no such device");
+		return;
+	}
+	if (dev->gone) {
+		request_finish(d, req, "err device gone");
+		return;
+	}
+
+	if (!strcmp(argv[0], "stats")) {
+		char buf[sizeof(req->reply)];
+
+		format_stats(d, dev, buf, sizeof(buf));
+		request_finish(d, req, "%s", buf);
+		return;
+	}
+	if (!strcmp(argv[0], "health")) {
+		char buf[sizeof(req->reply)];
+
+		health_format(&dev->health, now_ns(), buf, sizeof(buf));
+		request_finish(d, req, "ok %s", buf);
+		return;
+	}
+	if (!strcmp(argv[0], "heartbeat")) {
+		if (heartbeat(d, dev, argc - 2, argv + 2))
+			request_finish(d, req, "err no watchdog");
+		else
+			request_finish(d, req, "ok");
+		return;
+	}
+	if (!strcmp(argv[0], "watchdog")) {
+		struct watchdog *wd;
+		int outlet = argc > 2 ? atoi(argv[2]) : 0;
+
+		if (argc != 4 || outlet < 1 || outlet > POWER_SWITCH_COUNT) {
+			request_finish(d, req, "err usage: watchdog <dev> <outlet> <ms>");
+			return;
+		}
+		wd = &dev->wd[outlet - 1];
+		wd->timeout_ms = strtoul(argv[3], NULL, 0);
+		if (wd->timeout_ms)
+			timer_add(&d->timers, &wd->timer,
+				  now_ns() + wd->timeout_ms * 1000000ull);
+		else
+			timer_del(&d->timers, &wd->timer);
+		request_finish(d, req, "ok");
+		return;
+	}
+	if (!strcmp(argv[0], "at")) {
+		unsigned char value, care;
+		uint64_t id;
+
+		if (argc < 4 || parse_outlets(argc - 3, argv + 3, &value, &care)) {
+			request_finish(d, req, "err usage: at <dev> <ms> <outlet>=<0|1>...");
+			return;
+		}
+		if (schedule_at(d, dev, strtoul(argv[2], NULL, 0), value, care, &id))
+			request_finish(d, req, "err out of memory");
+		else
+			request_finish(d, req, "ok id=%llu", (unsigned long long)id);
+		return;
+	}
+
+	if (!health_usable(&dev->health)) {
+		request_finish(d, req, "err quarantined");
+		return;
+	}
+
+	if (!strcmp(argv[0], "status")) {
+		req->op = REQ_STATUS;
+		submit(d, dev, req, SCHED_MONITOR);
+	} else if (!strcmp(argv[0], "set")) {
+		if (parse_outlets(argc - 2, argv + 2, &req->value, &req->care)) {
+			request_finish(d, req, "err invalid outlet mapping");
+			return;
+		}
+		req->op = REQ_SET;
+		submit(d, dev, req, SCHED_CONTROL);
+	} else if (!strcmp(argv[0], "off")) {
+		int i;
+
+		req->op = REQ_OFF;
+		req->value = 0;
+		req->care = argc > 2 ? 0 : POWER_SWITCH_ALL;
+		for (i = 2; i < argc; i++) {
+			int outlet = atoi(argv[i]);
+
+			if (outlet < 1 || outlet > POWER_SWITCH_COUNT) {
+				request_finish(d, req, "err invalid outlet");
+				return;
+			}
+			req->care |= BIT(outlet - 1);
+		}
+		submit(d, dev, req, SCHED_EMERGENCY);
+	} else if (!strcmp(argv[0], "mask")) {
+		unsigned long value, care = POWER_SWITCH_ALL;
+
+		if (argc < 3 || argc > 4) {
+			request_finish(d, req, "err usage: mask <dev> <mask> [<care>]");
+			return;
+		}
+		value = strtoul(argv[2], NULL, 0);
+		if (argc == 4)
+			care = strtoul(argv[3], NULL, 0);
+		if ((value | care) & ~POWER_SWITCH_ALL || !care) {
+			request_finish(d, req, "err invalid mask");
+			return;
+		}
+		req->value = value;
+		req->care = care;
+		req->op = REQ_SET;
+		submit(d, dev, req, SCHED_CONTROL);
+	} else if (!strcmp(argv[0], "cycle")) {
+		int outlet = argc > 2 ? atoi(argv[2]) : 0;
+
+		if (argc < 3 || argc > 4 || outlet < 1 ||
+		    outlet > POWER_SWITCH_COUNT) {
+			request_finish(d, req, "err usage: cycle <dev> <outlet> [<ms>]");
+			return;
+		}
+		req->op = REQ_CYCLE;
+		req->value = 0;
+		req->care = BIT(outlet - 1);
+		req->cycle_ms = argc == 4 ? strtoul(argv[3], NULL, 0) : CYCLE_MS;
+		timer_init(&req->cycle_timer, cycle_fire, req);
+		submit(d, dev, req, SCHED_CONTROL);
+	}
+}
+
+/* Serve every complete HTTP request in the input buffer. */
+static void http_requests(struct daemon *d, struct client *c)
+{
+	while (c->in_len && !c->closing) {
+		struct http_request hr;
+		struct request *req;
+		char line[CLIENT_INBUF];
+		long n = http_parse(c->in, c->in_len, &hr);
+
+		if (!n && c->in_len < sizeof(c->in))
+			return;
+		if (n <= 0) {
+			c->in_len = 0;
+			c->closing = 1;
+			req = request_new(c);
+			if (req)
+				request_finish(d, req, n ? "err bad request" :
+					       "err request too large");
+			return;
+		}
+
+		if (!hr.keep_alive)
+			c->closing = 1;
+		if (!http_route(&hr, line, sizeof(line))) {
+			handle_line(d, c, line);
+		} else {
+			req = request_new(c);
+			if (req)
+				request_finish(d, req, "%s", line);
+		}
+
+		memmove(c->in, c->in + n, c->in_len - n);
+		c->in_len -= n;
+		if (c->dead)
+			return;
+	}
+}
+
+static void client_readable(struct daemon *d, struct client *c)
+{
+	ssize_t n;
+	char *nl;
+
+	n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (n <= 0) {
+		client_close(d, c);
+		return;
+	}
+	c->in_len += n;
+
+	/* Nothing more is read from a connection on its way out. */
+	if (c->closing) {
+		c->in_len = 0;
+		return;
+	}
+	if (c->http) {
+		http_requests(d, c);
+		return;
+	}
+
+	while ((nl = memchr(c->in, '\n', c->in_len))) {
+		size_t len = nl - c->in + 1;
+
+		*nl = '\0';
+		handle_line(d, c, c->in);
+		memmove(c->in, c->in + len, c->in_len - len);
+		c->in_len -= len;
+		if (c->dead)
+			return;
+	}
+
+	if (c->in_len == sizeof(c->in)) {
+		struct request *req = request_new(c);
+
+		c->in_len = 0;
+		if (req)
+			request_finish(d, req, "err line too long");
+	}
+}
+
+static void accept_clients(struct daemon *d, int listen_fd, int http)
+{
+	for (;;) {
+		struct epoll_event ev = { .events = EPOLLIN };
+		struct client *c;
+		int one = 1;
+		int fd;
+
+		fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+		/* Pipelined replies go out as soon as they are complete. */
+		if (http)
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(fd);
+			continue;
+		}
+		c->kind = WATCH_CLIENT;
+		c->fd = fd;
+		c->http = http;
+		ev.data.ptr = c;
+		if (epoll_ctl(d->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+			close(fd);
+			free(c);
+		}
+	}
+}
+
+/* Setup */
+
+static int add_device(struct daemon *d, hid_device *hid, const char *serial,
+		      struct bellwin_sim *sim)
+{
+	struct ddev *dev = &d->devs[d->ndevs];
+	struct epoll_event ev = { .events = EPOLLIN };
+	int i;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->kind = WATCH_DEVICE;
+	dev->index = d->ndevs;
+	dev->hid = hid;
+	dev->sim = sim;
+	dev->fd = hid_get_fd(hid);
+	dev->path = hid_get_path(hid) ? strdup(hid_get_path(hid)) : NULL;
+	dev->serial = serial ? strdup(serial) : NULL;
+	dev->lock.fd = -1;
+	dev->set_tail = &dev->set_waiters;
+	sched_init(&dev->sched, d->opts->queue_depth, d->opts->client_depth);
+	rtt_init(&dev->rtt);
+	health_init(&dev->health);
+	timer_init(&dev->status_timer, status_timeout, dev);
+	timer_init(&dev->hedge_timer, hedge_fire, dev);
+	timer_init(&dev->probe_timer, probe_fire, dev);
+	timer_init(&dev->co_timer, coalesce_fire, dev);
+	timer_init(&dev->retry_timer, retry_fire, dev);
+	timer_init(&dev->verify_timer, verify_fire, dev);
+	timer_init(&dev->poll_timer, poll_fire, dev);
+	timer_init(&dev->close_timer, close_fire, dev);
+	timer_init(&dev->lock_timer, lock_fire, dev);
+	timer_init(&dev->unlock_timer, unlock_fire, dev);
+	for (i = 0; i < POWER_SWITCH_COUNT; i++) {
+		timer_init(&dev->wd[i].timer, watchdog_fire, &dev->wd[i]);
+		dev->wd[i].dev = dev;
+		dev->wd[i].outlet = i;
+	}
+
+	if (device_lock(dev, hid, LOCK_WAIT_MS))
+		goto err;
+	ev.data.ptr = dev;
+	if (epoll_ctl(d->epfd, EPOLL_CTL_ADD, dev->fd, &ev)) {
+		hid_log_error(dev->path, "epoll_ctl: %m");
+		goto err;
+	}
+	if (fleet_add(&d->fleet) < 0) {
+		epoll_ctl(d->epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+		goto err;
+	}
+	pool_opened(&d->pool, &dev->pool, now_ns(), 0, false);
+
+	/* Kept for initial_status(), then let go by the event loop. */
+	dev->locked = 1;
+	dev->lock_listed = 1;
+	dev->lock_next = d->locked;
+	d->locked = dev;
+	d->ndevs++;
+	return 0;
+
+err:
+	devlock_release(&dev->lock);
+	return -1;
+}
+
+/*
+ * Learn the current relay state of the devices from @first on, so that the
+ * first coalesced set is minimal, then let the pool close what does not
+ * fit.  The queries are pipelined: this takes about one device's round
+ * trip however many devices there are.
+ */
+static void initial_status(struct daemon *d, unsigned first)
+{
+	struct device_status_req *reqs;
+	unsigned i, n = d->ndevs - first;
+
+	if (!n)
+		return;
+	reqs = calloc(n, sizeof(*reqs));
+	if (!reqs)
+		return;
+	for (i = 0; i < n; i++) {
+		reqs[i].handle = d->devs[first + i].hid;
+		reqs[i].rtt = &d->devs[first + i].rtt;
+	}
+
+	/* Also gives the timeout estimators their first sample. */
+	device_read_status_many(reqs, n);
+	for (i = 0; i < n; i++) {
+		struct ddev *dev = &d->devs[first + i];
+
+		if (!reqs[i].result) {
+			fleet_observe(&d->fleet, dev->index, reqs[i].mask,
+				      now_ns());
+		} else {
+			hid_log_warn(dev->path, "no reply to initial status query");
+			health_failure(&dev->health, true, now_ns());
+		}
+		device_touch(d, dev);
+	}
+	free(reqs);
+	pool_trim(d, NULL);
+}
+
+/*
+ * Bring the devices up a wave at a time: a wave is opened by concurrent
+ * threads and then read by one pipelined status sweep, so time to ready is
+ * about one open and one round trip per wave.  Without --max-open all
+ * devices form one wave; with it a wave is max_open devices, and startup
+ * holds at most twice that many handles.
+ */
+static int open_devices(struct daemon *d)
+{
+	const struct daemon_opts *opts = d->opts;
+	struct hid_device_info *devs, *cur;
+	hid_device **handles = NULL;
+	char **paths = NULL, **serials = NULL;
+	unsigned n = 0, m = 0, wave, start, first, i;
+	int ret = -1;
+
+	if (opts->simulate) {
+		wave = opts->max_open ? opts->max_open : opts->simulate;
+		d->devs = calloc(opts->simulate, sizeof(*d->devs));
+		if (!d->devs)
+			return -1;
+		for (i = 0; i < opts->simulate; i++) {
+			struct bellwin_sim *sim;
+			hid_device *hid;
+			char serial[32];
+
+			sim = bellwin_sim_start(0, opts->sim_latency_us, &hid);
+			if (!sim)
+				return -1;
+			snprintf(serial, sizeof(serial), "SIM%04u", i);
+			if (add_device(d, hid, serial, sim))
+				return -1;
+			if (d->ndevs % wave == 0)
+				initial_status(d, d->ndevs - wave);
+		}
+		initial_status(d, d->ndevs - d->ndevs % wave);
+		return 0;
+	}
+
+	devs = hid_enumerate(BELLWIN_VENDOR, BELLWIN_PRODUCT);
+	for (cur = devs; cur; cur = cur->next)
+		n++;
+	d->devs = calloc(n ? n : 1, sizeof(*d->devs));
+	paths = calloc(n ? n : 1, sizeof(*paths));
+	serials = calloc(n ? n : 1, sizeof(*serials));
+	handles = calloc(n ? n : 1, sizeof(*handles));
+	if (!d->devs || !paths || !serials || !handles)
+		goto out;
+
+	for (cur = devs; cur; cur = cur->next) {
+		char *serial = wchar_to_utf8(cur->serial_number);
+
+		if ((opts->path && strcmp(opts->path, cur->path)) ||
+		    (opts->serial && (!serial || strcmp(opts->serial, serial)))) {
+			free(serial);
+			continue;
+		}
+		paths[m] = cur->path;
+		serials[m++] = serial;
+	}
+
+	wave = opts->max_open ? opts->max_open : m;
+	for (start = 0; start < m; start += wave) {
+		unsigned count = m - start < wave ? m - start : wave;
+
+		device_open_paths(paths + start, count, handles);
+		first = d->ndevs;
+		for (i = 0; i < count; i++)
+			if (handles[i] &&
+			    add_device(d, handles[i], serials[start + i], NULL))
+				hid_close(handles[i]);
+		initial_status(d, first);
+	}
+	ret = d->ndevs ? 0 : -1;
+
+out:
+	for (i = 0; i < m; i++)
+		free(serials[i]);
+	free(serials);
+	free(paths);
+	free(handles);
+	hid_free_enumeration(devs);
+
+	return ret;
+}
+
+static int journal_dev_cmp(const void *a, const void *b)
+{
+	return strncmp(((const struct journal_dev *)a)->key,
+		       ((const struct journal_dev *)b)->key, JOURNAL_KEY_LEN);
+}
+
+/*
+ * Take over the desired state an earlier run recorded, matching devices by
+ * serial number, and start a new journal generation for the devices found
+ * now.  The initial status sweep has just read every device, so whatever
+ * differs is known already and switched back right away.
+ */
+static int journal_start(struct daemon *d)
+{
+	const char *path = d->opts->journal_path;
+	struct fleet *f = &d->fleet;
+	struct journal_dev *devs, key = { { 0 } }, *e;
+	uint64_t start = now_ns();
+	unsigned n, i, found = 0, ndrifted;
+
+	if (journal_open(&d->journal, path, &devs, &n)) {
+		hid_log_error(path, "%m");
+		return -1;
+	}
+	timer_init(&d->journal_timer, journal_fire, NULL);
+
+	qsort(devs, n, sizeof(*devs), journal_dev_cmp);
+	for (i = 0; i < d->ndevs; i++) {
+		strncpy(key.key, device_key(&d->devs[i]), JOURNAL_KEY_LEN - 1);
+		e = bsearch(&key, devs, n, sizeof(*devs), journal_dev_cmp);
+		if (!e || !e->want)
+			continue;
+		fleet_want(f, i, e->desired, e->want, now_ns());
+		found++;
+	}
+	free(devs);
+	journal_take_snapshot(d);
+
+	ndrifted = reconcile(d, 0, f->n, "journal");
+
+	hid_log_info(path, "desired state of %u device(s) recovered in %.2f ms "
+		     "(%u log records), %u to reconcile", found,
+		     (now_ns() - start) / 1e6, d->journal.replayed, ndrifted);
+
+	return 0;
+}
+
+/* Hotplug events bring back devices that were unplugged. */
+static void open_udev(struct daemon *d)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &udev_kind };
+
+	d->udev = udev_new();
+	if (d->udev)
+		d->mon = udev_monitor_new_from_netlink(d->udev, "udev");
+	if (!d->mon ||
+	    udev_monitor_filter_add_match_subsystem_devtype(d->mon, "hidraw",
+							    NULL) ||
+	    udev_monitor_enable_receiving(d->mon) ||
+	    epoll_ctl(d->epfd, EPOLL_CTL_ADD, udev_monitor_get_fd(d->mon),
+		      &ev)) {
+		hid_log_warn(NULL, "No udev monitor, looking for unplugged devices every %d ms",
+			     RESCAN_MS);
+		if (d->mon)
+			udev_monitor_unref(d->mon);
+		d->mon = NULL;
+	}
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		hid_log_error(path, "Socket path too long");
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		hid_log_error(NULL, "socket: %m");
+		return -1;
+	}
+
+	unlink(addr.sun_path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, SOMAXCONN)) {
+		hid_log_error(path, "Unable to listen on socket: %m");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int listen_tcp(const char *spec)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int fd;
+
+	if (http_parse_addr(spec, &addr)) {
+		hid_log_error(spec, "Invalid HTTP address");
+		return -1;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		hid_log_error(NULL, "socket: %m");
+		return -1;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, SOMAXCONN)) {
+		hid_log_error(spec, "Unable to listen for HTTP: %m");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int open_socket(struct daemon *d)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_kind };
+	const char *http = d->opts->http_addr;
+
+	d->listen_fd = listen_unix(d->opts->socket_path);
+	if (d->listen_fd < 0 ||
+	    epoll_ctl(d->epfd, EPOLL_CTL_ADD, d->listen_fd, &ev))
+		return -1;
+	if (!http)
+		return 0;
+
+	/* A path serves HTTP on a Unix socket, anything else is [host:]port. */
+	d->http_fd = http[0] == '/' ? listen_unix(http) : listen_tcp(http);
+	ev.data.ptr = &http_listen_kind;
+	if (d->http_fd < 0 ||
+	    epoll_ctl(d->epfd, EPOLL_CTL_ADD, d->http_fd, &ev))
+		return -1;
+
+	return 0;
+}
+
+int daemon_run(const struct daemon_opts *opts)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct daemon d = {
+		.opts = opts,
+		.listen_fd = -1,
+		.http_fd = -1,
+		.timer_fd = -1,
+		.timer_armed = UINT64_MAX,
+		.at_free = -1,
+	};
+	struct epoll_event tev = { .events = EPOLLIN, .data.ptr = &timer_kind };
+	struct sigaction sa = { .sa_handler = on_signal };
+	uint64_t start = now_ns();
+	unsigned i;
+	int ret = 1;
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	d.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (d.epfd < 0) {
+		hid_log_error(NULL, "epoll_create1: %m");
+		return 1;
+	}
+
+	/* Every timeout and scheduled action runs off one timerfd. */
+	timer_wheel_init(&d.timers, now_ns());
+	pool_init(&d.pool, opts->max_open, opts->idle_close_ms);
+	d.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (d.timer_fd < 0 ||
+	    epoll_ctl(d.epfd, EPOLL_CTL_ADD, d.timer_fd, &tev)) {
+		hid_log_error(NULL, "timerfd: %m");
+		goto out;
+	}
+
+	if (open_devices(&d)) {
+		hid_log_error(NULL, "No Bellwin USB devices to manage");
+		goto out;
+	}
+	if (opts->journal_path && journal_start(&d))
+		goto out;
+	timer_init(&d.rescan_timer, rescan_fire, NULL);
+	if (!opts->simulate)
+		open_udev(&d);
+
+	/* Clients can connect once every device has answered or timed out. */
+	if (open_socket(&d))
+		goto out;
+
+	hid_log_info(NULL, "Managing %u device(s), ready in %.1f ms, listening on %s",
+		     d.ndevs, (now_ns() - start) / 1e6, opts->socket_path);
+	if (opts->http_addr)
+		hid_log_info(NULL, "Serving HTTP on %s", opts->http_addr);
+
+	while (!stop) {
+		int n;
+
+		unlock_idle(&d);
+		arm_timerfd(&d);
+		n = epoll_wait(d.epfd, events, MAX_EVENTS, -1);
+		if (n < 0 && errno != EINTR) {
+			hid_log_error(NULL, "epoll_wait: %m");
+			break;
+		}
+
+		for (i = 0; n > 0 && i < (unsigned)n; i++) {
+			enum watch_kind *kind = events[i].data.ptr;
+
+			switch (*kind) {
+			case WATCH_LISTEN:
+				accept_clients(&d, d.listen_fd, 0);
+				break;
+			case WATCH_HTTP_LISTEN:
+				accept_clients(&d, d.http_fd, 1);
+				break;
+			case WATCH_CLIENT: {
+				struct client *c = events[i].data.ptr;
+
+				if (c->dead)
+					break;
+				if (events[i].events & EPOLLOUT)
+					client_send(&d, c);
+				if (!c->dead && events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					client_readable(&d, c);
+				break;
+			}
+			case WATCH_DEVICE:
+				device_readable(&d, events[i].data.ptr);
+				break;
+			case WATCH_UDEV:
+				udev_readable(&d);
+				break;
+			case WATCH_TIMER: {
+				uint64_t expirations;
+
+				if (read(d.timer_fd, &expirations,
+					 sizeof(expirations)) > 0)
+					timer_wheel_run(&d.timers, now_ns(), &d);
+				break;
+			}
+			}
+		}
+
+		reap_clients(&d);
+	}
+
+	ret = 0;
+out:
+	if (d.listen_fd >= 0) {
+		close(d.listen_fd);
+		unlink(opts->socket_path);
+	}
+	if (d.http_fd >= 0) {
+		close(d.http_fd);
+		if (opts->http_addr[0] == '/')
+			unlink(opts->http_addr);
+	}
+	if (d.mon)
+		udev_monitor_unref(d.mon);
+	if (d.udev)
+		udev_unref(d.udev);
+	if (opts->journal_path && d.journal.log) {
+		journal_take_snapshot(&d);
+		journal_close(&d.journal);
+	}
+	for (i = 0; i < d.ndevs; i++) {
+		devlock_release(&d.devs[i].lock);
+		if (d.devs[i].hid)
+			hid_close(d.devs[i].hid);
+		bellwin_sim_stop(d.devs[i].sim);
+		free(d.devs[i].serial);
+		free(d.devs[i].path);
+	}
+	free(d.devs);
+	for (i = 0; i < d.nat; i++)
+		free(d.at[i]);
+	free(d.at);
+	if (d.timer_fd >= 0)
+		close(d.timer_fd);
+	fleet_free(&d.fleet);
+	reap_clients(&d);
+	close(d.epfd);
+
+	return ret;
+}
@@ -0,0 +1,108 @@
+/*
+ * Daemon mode: one process owns the splitters and serves requests from
+ * local clients over a Unix stream socket.
+ *
+ * The protocol is line based.  Each request line gets exactly one reply
+ * line, "ok ..." or "err <reason>", and replies to a client are sent in the
+ * order of its requests, so clients may pipeline.  <dev> is a device index,
+ * serial number or path.
+ *
+ *   list                        ok <idx>:<serial>:<path> ...
+ *   status <dev>                ok mask=0x13
+ *   set <dev> <outlet>=<0|1>... ok mask=0x13 [overridden=0x04]
+ *   mask <dev> <mask> [<care>]  ok mask=0x13 [overridden=0x04]
+ *   off <dev> [<outlet>...]     ok mask=0x00
+ *   stats <dev>                 ok queued=3 rejected=0 ... rto_us=20000
+ *   health [<dev>]              ok state=ok err_rate=0.000 ... / ok 0:ok 1:...
+ *   cycle <dev> <outlet> [<ms>] ok mask=0x13
+ *   at <dev> <ms> <outlet>=<0|1>... ok id=<id>
+ *   cancel <id>                 ok
+ *   watchdog <dev> <outlet> <ms> ok
+ *   heartbeat <dev> [<outlet>...] ok
+ *   subscribe [<dev>|* [<o>...]] ok subscribed
+ *   unsubscribe                 ok
+ *   fleet                       ok devices=12 drifted=1 4:0x06
+ *   pool                        ok open=64 capacity=64 ... reopen_us=...
+ *   journal                     ok gen=3 records=120 ... snapshot_us=85
+ *
+ * Requests go through a per-device scheduler (sched.h): "off" is served
+ * first, then set and mask, then status polls, with clients taking turns
+ * within each class.  Requests that find the queue full get "err busy".
+ * Replies to requests that reached the device end with qwait_us= (time
+ * queued) and dev_us= (time at the device).
+ *
+ * Set requests for a device are coalesced for a short window and only the
+ * outlets whose final state differs from the device are switched.
+ * "overridden" lists outlets of this request that a later request in the
+ * same window changed back.  "off" closes the window immediately.
+ *
+ * "cycle" switches an outlet off and, after <ms> (default 1000), on again;
+ * it is answered once the outlet is back on.
+ *
+ * "at" schedules a set; "watchdog" switches an outlet off unless a
+ * "heartbeat" for it (or for the whole device) arrives every <ms>, and a
+ * timeout of 0 disarms it.  These, like every other deadline in the
+ * daemon, live on one timer wheel (timerwheel.h) behind a single timerfd.
+ *
+ * A subscribed connection also receives unsolicited lines whenever outlets
+ * it watches change, whether through a set, a client's status read or the
+ * daemon's own poll (every poll_ms while a device has subscribers):
+ *
+ *   event dev=2 old=0x03 new=0x07 changed=0x04 source=set time_us=...
+ *
+ * They never start with "ok" or "err", so pipelining clients can skip them.
+ * Events that would take a subscriber past SUB_MAX_OUT queued bytes are
+ * dropped; the next one delivered is preceded by "event dropped=<n>".
+ *
+ * The same commands are offered over HTTP with JSON bodies (http.h) when
+ * http_addr is set.
+ *
+ * With max_open or idle_close_ms set, device handles are pooled (pool.h):
+ * the least recently used idle device is closed once more than max_open
+ * are open, any device unused for idle_close_ms is closed, and closed ones
+ * are reopened by path on their next request.  "pool" reports the open
+ * count, hits, misses, evictions and reopen latency (p50/p99/max).
+ *
+ * A device that disconnects is reopened by serial number when it appears
+ * again (udev hotplug events, or a rescan every RESCAN_MS), and the outlets
+ * whose state differs from the requested one are switched back.
+ *
+ * With journal_path set, every change of desired state is also appended to
+ * a journal (journal.h).  On startup the desired state recorded there is
+ * taken over, matched by serial number, and outlets the initial status
+ * sweep found differing are switched back.
+ *
+ * A device that keeps failing is quarantined (health.h): its queued
+ * requests and any new ones get "err quarantined" until background probes
+ * succeed again.
+ */
+
+#ifndef DAEMON_H__
+#define DAEMON_H__
+
+#define BELLWIN_DEFAULT_SOCKET	"/run/bellwin.sock"
+#define BELLWIN_DEFAULT_COALESCE_MS	5
+#define BELLWIN_DEFAULT_QUEUE_DEPTH	1024
+#define BELLWIN_DEFAULT_CLIENT_DEPTH	64
+#define BELLWIN_DEFAULT_POLL_MS	1000
+
+struct daemon_opts {
+	const char *socket_path;
+	const char *http_addr;		/* [<host>:]<port> or socket path, optional */
+	const char *serial;		/* only manage this device, optional */
+	const char *path;		/* only manage this device, optional */
+	unsigned coalesce_ms;
+	unsigned queue_depth;		/* queued requests per device */
+	unsigned client_depth;		/* queued requests per client and device */
+	unsigned poll_ms;		/* status poll of watched devices, 0 = off */
+	unsigned simulate;		/* simulated devices instead of hardware */
+	unsigned sim_latency_us;
+	unsigned max_open;		/* open device handles, 0 = no limit */
+	unsigned idle_close_ms;		/* close unused handles, 0 = never */
+	const char *journal_path;	/* desired-state journal, optional */
+};
+
+/* Run until SIGINT/SIGTERM.  Returns 0 on clean shutdown. */
+int daemon_run(const struct daemon_opts *opts);
+
+#endif
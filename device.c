@@ -0,0 +1,446 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include "hidapi.h"
+#include "hid_trace.h"
+#include "hid_log.h"
+#include "bellwin.h"
+#include "device.h"
+#include "timeutil.h"
+
+/* The caller must free the returned string with free(). */
+static wchar_t *utf8_to_wchar_t(const char *utf8)
+{
+	wchar_t *ret = NULL;
+
+	if (utf8) {
+		size_t wlen = mbstowcs(NULL, utf8, 0);
+		if ((size_t) -1 == wlen) {
+			return wcsdup(L"");
+		}
+		ret = calloc(wlen+1, sizeof(wchar_t));
+		mbstowcs(ret, utf8, wlen+1);
+		ret[wlen] = 0x0000;
+	}
+
+	return ret;
+}
+
+char *wchar_to_utf8(const wchar_t *ws)
+{
+	size_t len;
+	char *s;
+
+	if (!ws)
+		return NULL;
+	len = wcstombs(NULL, ws, 0);
+	if (len == (size_t)-1)
+		return NULL;
+	s = malloc(len + 1);
+	if (s)
+		wcstombs(s, ws, len + 1);
+
+	return s;
+}
+
+/* Pad @cmd to a full report in @buf. */
+static void pad_command(hid_device *handle, unsigned char *buf,
+			const char *cmd, size_t len)
+{
+	memset(buf, BELLWIN_REPORT_PAD, BELLWIN_REPORT_SIZE);
+
+	if (len > BELLWIN_REPORT_SIZE) {
+		hid_log_error(hid_get_path(handle), "Command is too long");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(buf, cmd, len);
+	hid_log_hex(HID_LOG_DEBUG, hid_get_path(handle), "sent", buf,
+		    BELLWIN_REPORT_SIZE);
+}
+
+int send_command_once(hid_device *handle, const char *cmd, size_t len)
+{
+	unsigned char buf[BELLWIN_REPORT_SIZE];
+	int ret;
+
+	pad_command(handle, buf, cmd, len);
+	BW_PROBE3(send_command_entry, hid_get_path(handle), buf[0], len);
+	ret = hid_write(handle, buf, BELLWIN_REPORT_SIZE);
+	BW_PROBE3(send_command_exit, hid_get_path(handle), buf[0], ret);
+
+	return ret < 0 ? -1 : 0;
+}
+
+int send_command(hid_device *handle, const char *cmd, size_t len)
+{
+	unsigned char buf[BELLWIN_REPORT_SIZE];
+	unsigned backoff_us = SEND_BACKOFF_US;
+	int ret;
+	int i;
+
+	pad_command(handle, buf, cmd, len);
+	BW_PROBE3(send_command_entry, hid_get_path(handle), buf[0], len);
+
+	for (i = 0; i < SEND_TRIES; i++) {
+		if (i) {
+			usleep(backoff_us);
+			backoff_us *= 4;
+		}
+		ret = hid_write(handle, buf, BELLWIN_REPORT_SIZE);
+		if (ret >= 0)
+			break;
+	}
+	BW_PROBE3(send_command_exit, hid_get_path(handle), buf[0], ret);
+
+	if (ret < 0) {
+		hid_log_error(hid_get_path(handle), "Unable to write(): %m");
+		return -1;
+	}
+
+	return i;
+}
+
+void prepare_cmd(char *cmd, int idx, bool on)
+{
+	char cmd_template[BELLWIN_CMD_LEN] = { BELLWIN_CMD_SET, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+	cmd_template[BELLWIN_SET_INDEX] = idx - 1;
+	cmd_template[BELLWIN_SET_VALUE] = !!on;
+
+	memcpy(cmd, cmd_template, BELLWIN_CMD_LEN);
+}
+
+void rtt_init(struct rtt_est *rtt)
+{
+	rtt->srtt_us = 0;
+	rtt->rttvar_us = 0;
+	rtt->rto_us = RTT_INITIAL_US;
+	rtt->samples = 0;
+}
+
+void rtt_sample(struct rtt_est *rtt, uint64_t rtt_ns)
+{
+	uint32_t r = rtt_ns / 1000;
+	uint32_t rto;
+
+	if (!rtt->samples++) {
+		rtt->srtt_us = r;
+		rtt->rttvar_us = r / 2;
+	} else {
+		uint32_t err = r > rtt->srtt_us ? r - rtt->srtt_us : rtt->srtt_us - r;
+
+		/* rttvar = 3/4 rttvar + 1/4 err, srtt = 7/8 srtt + 1/8 r */
+		rtt->rttvar_us = rtt->rttvar_us - rtt->rttvar_us / 4 + err / 4;
+		rtt->srtt_us = rtt->srtt_us - rtt->srtt_us / 8 + r / 8;
+	}
+
+	rto = rtt->srtt_us + 4 * rtt->rttvar_us;
+	if (rto < RTT_MIN_US)
+		rto = RTT_MIN_US;
+	if (rto > RTT_MAX_US)
+		rto = RTT_MAX_US;
+	rtt->rto_us = rto;
+}
+
+void rtt_backoff(struct rtt_est *rtt)
+{
+	rtt->rto_us = rtt->rto_us * 2 > RTT_MAX_US ? RTT_MAX_US : rtt->rto_us * 2;
+}
+
+int device_read_status(hid_device *handle, unsigned char *mask,
+		       struct rtt_est *rtt)
+{
+	const char cmd1[BELLWIN_CMD_LEN] = { BELLWIN_CMD_STATUS, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	unsigned char buf[256];
+	struct rtt_est fresh;
+	uint64_t sent, deadline, now;
+	int ret;
+	int tries;
+
+	if (!rtt) {
+		rtt_init(&fresh);
+		rtt = &fresh;
+	}
+
+	for (tries = 0; tries < DEVICE_STATUS_TRIES; tries++) {
+		if (send_command(handle, cmd1, BELLWIN_CMD_LEN) < 0)
+			return 1;
+		sent = now_ns();
+		deadline = sent + rtt_timeout_ns(rtt);
+
+		/* Wait for response */
+		while ((now = now_ns()) < deadline) {
+			ret = hid_read_timeout(handle, buf, sizeof(buf),
+					       (deadline - now + 999999) / 1000000);
+			if (ret < 0) {
+				hid_log_error(hid_get_path(handle),
+					      "Unable to read(): %m");
+				return 1;
+			}
+			hid_log_hex(HID_LOG_DEBUG, hid_get_path(handle),
+				    "received", buf, ret);
+			/* Short reports and echoes of sets are not the reply. */
+			if (ret <= BELLWIN_STATUS_MASK ||
+			    buf[0] != BELLWIN_CMD_STATUS)
+				continue;
+			/* Karn: a reply to a resent query cannot be timed. */
+			if (!tries)
+				rtt_sample(rtt, now_ns() - sent);
+			*mask = buf[BELLWIN_STATUS_MASK];
+			return 0;
+		}
+
+		hid_log_debug(hid_get_path(handle),
+			      "no reply in %u ms, asking again",
+			      (unsigned)(rtt_timeout_ns(rtt) / 1000000));
+		rtt_backoff(rtt);
+	}
+
+	hid_log_error(hid_get_path(handle),
+		      "Timeout occurred while waiting for device reply");
+	return 1;
+}
+
+struct sweep {
+	struct rtt_est fresh;
+	uint64_t sent;
+	uint64_t deadline;
+	int tries;
+	bool done;
+};
+
+static void sweep_finish(struct device_status_req *r, struct sweep *sw,
+			 int result)
+{
+	r->result = result;
+	sw->done = true;
+}
+
+static void sweep_send(struct device_status_req *r, struct sweep *sw)
+{
+	const char cmd[BELLWIN_CMD_LEN] = { BELLWIN_CMD_STATUS };
+
+	if (send_command(r->handle, cmd, BELLWIN_CMD_LEN) < 0) {
+		sweep_finish(r, sw, 1);
+		return;
+	}
+	sw->sent = now_ns();
+	sw->deadline = sw->sent + rtt_timeout_ns(r->rtt);
+}
+
+static void sweep_read(struct device_status_req *r, struct sweep *sw)
+{
+	unsigned char buf[256];
+	int ret;
+
+	while (!sw->done &&
+	       (ret = hid_read_timeout(r->handle, buf, sizeof(buf), 0))) {
+		if (ret < 0) {
+			sweep_finish(r, sw, 1);
+			break;
+		}
+		/* Short reports and echoes of sets are not the reply. */
+		if (ret <= BELLWIN_STATUS_MASK || buf[0] != BELLWIN_CMD_STATUS)
+			continue;
+		/* Karn: a reply to a resent query cannot be timed. */
+		if (!sw->tries)
+			rtt_sample(r->rtt, now_ns() - sw->sent);
+		r->mask = buf[BELLWIN_STATUS_MASK];
+		sweep_finish(r, sw, 0);
+	}
+}
+
+int device_read_status_many(struct device_status_req *reqs, unsigned n)
+{
+	struct pollfd *pfd;
+	struct sweep *sw;
+	unsigned i, npfd, pending = 0, failed = 0;
+	unsigned *which;
+	uint64_t now, next;
+
+	sw = calloc(n, sizeof(*sw));
+	pfd = calloc(n, sizeof(*pfd));
+	which = calloc(n, sizeof(*which));
+	if (!sw || !pfd || !which) {
+		free(sw);
+		free(pfd);
+		free(which);
+		for (i = 0; i < n; i++)
+			reqs[i].result = 1;
+		return n;
+	}
+
+	/* All queries go out before any reply is waited for. */
+	for (i = 0; i < n; i++) {
+		if (!reqs[i].rtt) {
+			rtt_init(&sw[i].fresh);
+			reqs[i].rtt = &sw[i].fresh;
+		}
+		if (!reqs[i].handle)
+			sweep_finish(&reqs[i], &sw[i], 1);
+		else
+			sweep_send(&reqs[i], &sw[i]);
+	}
+
+	for (;;) {
+		now = now_ns();
+		next = UINT64_MAX;
+		npfd = 0;
+		pending = 0;
+		for (i = 0; i < n; i++) {
+			if (sw[i].done)
+				continue;
+			if (now >= sw[i].deadline) {
+				rtt_backoff(reqs[i].rtt);
+				if (++sw[i].tries == DEVICE_STATUS_TRIES) {
+					sweep_finish(&reqs[i], &sw[i], 1);
+					continue;
+				}
+				sweep_send(&reqs[i], &sw[i]);
+				if (sw[i].done)
+					continue;
+			}
+			if (sw[i].deadline < next)
+				next = sw[i].deadline;
+			pfd[npfd].fd = hid_get_fd(reqs[i].handle);
+			pfd[npfd].events = POLLIN;
+			which[npfd++] = i;
+			pending++;
+		}
+		if (!pending)
+			break;
+
+		if (poll(pfd, npfd, (next - now + 999999) / 1000000) < 0)
+			continue;
+		for (i = 0; i < npfd; i++)
+			if (pfd[i].revents)
+				sweep_read(&reqs[which[i]], &sw[which[i]]);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (reqs[i].rtt == &sw[i].fresh)
+			reqs[i].rtt = NULL;
+		failed += reqs[i].result != 0;
+	}
+	free(sw);
+	free(pfd);
+	free(which);
+
+	return failed;
+}
+
+int device_verify_mask(hid_device *handle, unsigned char expected,
+		       unsigned char care, unsigned char *actual,
+		       struct rtt_est *rtt)
+{
+	unsigned char mask, diff;
+	int repairs = 0;
+	int i;
+
+	for (;;) {
+		if (device_read_status(handle, &mask, rtt))
+			return -1;
+		*actual = mask & POWER_SWITCH_ALL;
+		diff = (*actual ^ expected) & care;
+		if (!diff)
+			return 0;
+		if (repairs++ == VERIFY_REPAIRS)
+			return 1;
+
+		for (i = 0; i < POWER_SWITCH_COUNT; i++) {
+			char cmd[BELLWIN_CMD_LEN];
+
+			if (!(diff & BIT(i)))
+				continue;
+			prepare_cmd(cmd, i + 1, expected & BIT(i));
+			if (send_command(handle, cmd, BELLWIN_CMD_LEN) < 0)
+				return -1;
+		}
+	}
+}
+
+hid_device *device_open_path(const char *path)
+{
+	hid_device *handle = NULL;
+	handle = hid_open_path(path);
+	if (!handle)
+		hid_log_error(path, "Unable to open device: %m");
+
+	return handle;
+}
+
+hid_device *device_open_serial(const char *serial)
+{
+	hid_device *handle = NULL;
+	struct hid_device_info *devs;
+	wchar_t *ret = NULL;
+
+	if (!serial) {
+		devs = hid_enumerate(BELLWIN_VENDOR, BELLWIN_PRODUCT);
+		if (!devs)
+			return NULL;
+		else if (devs->next) {
+			hid_log_error(NULL,
+				      "More than one bellwin device found, please use --serial or --device option");
+			hid_free_enumeration(devs);
+			return NULL;
+		}
+		hid_free_enumeration(devs);
+	}
+
+	ret = utf8_to_wchar_t(serial);
+	handle = hid_open(BELLWIN_VENDOR, BELLWIN_PRODUCT, ret);
+	if (!handle)
+		hid_log_error(serial, "Unable to open device: %m");
+
+	free(ret);
+	return handle;
+}
+
+struct opener {
+	char *const *paths;
+	hid_device **handles;
+	unsigned n;
+	unsigned next;
+};
+
+static void *opener_thread(void *arg)
+{
+	struct opener *o = arg;
+	unsigned i;
+
+	while ((i = __atomic_fetch_add(&o->next, 1, __ATOMIC_RELAXED)) < o->n)
+		o->handles[i] = device_open_path(o->paths[i]);
+
+	return NULL;
+}
+
+unsigned device_open_paths(char *const *paths, unsigned n,
+			   hid_device **handles)
+{
+	struct opener o = { .paths = paths, .handles = handles, .n = n };
+	pthread_t threads[DEVICE_OPEN_THREADS];
+	unsigned i, nthreads = 0, opened = 0;
+
+	memset(handles, 0, n * sizeof(*handles));
+	/* Once here, so that the threads' calls only read its state. */
+	hid_init();
+
+	while (nthreads < DEVICE_OPEN_THREADS && nthreads + 1 < n &&
+	       !pthread_create(&threads[nthreads], NULL, opener_thread, &o))
+		nthreads++;
+	/* This thread takes its share too, and all of it if none started. */
+	opener_thread(&o);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < n; i++)
+		opened += handles[i] != NULL;
+
+	return opened;
+}
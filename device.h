@@ -0,0 +1,124 @@
+/*
+ * Bellwin device layer: report encoding and the blocking request/reply
+ * exchanges used by the command line tool.
+ */
+
+#ifndef DEVICE_H__
+#define DEVICE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "hidapi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Reply timeout estimation, kept per device as in TCP (RFC 6298): the
+ * smoothed round trip time plus four mean deviations gives the timeout, which
+ * doubles on every loss until a reply is timed again.
+ */
+#define RTT_INITIAL_US		500000
+#define RTT_MIN_US		20000
+#define RTT_MAX_US		2500000
+#define DEVICE_STATUS_TRIES	3
+
+struct rtt_est {
+	uint32_t srtt_us;
+	uint32_t rttvar_us;
+	uint32_t rto_us;
+	unsigned samples;
+};
+
+void rtt_init(struct rtt_est *rtt);
+/* Feed one measured round trip.  Never sample a retransmitted query. */
+void rtt_sample(struct rtt_est *rtt, uint64_t rtt_ns);
+/* A reply was lost: back off the timeout. */
+void rtt_backoff(struct rtt_est *rtt);
+
+static inline uint64_t rtt_timeout_ns(const struct rtt_est *rtt)
+{
+	return rtt->rto_us * 1000ull;
+}
+
+/*
+ * Failed writes are retried SEND_TRIES times, sleeping SEND_BACKOFF_US and
+ * four times longer after each further failure (21 ms in total).
+ */
+#define SEND_TRIES		4
+#define SEND_BACKOFF_US		1000
+
+/*
+ * Pad @cmd to a full report and write it.  Returns the number of retries it
+ * took (0 normally), or -1 if the report could not be written.
+ */
+int send_command(hid_device *handle, const char *cmd, size_t len);
+
+/*
+ * send_command() without the retries, for event loops that cannot sleep:
+ * they retry after SEND_BACKOFF_US and so on from their own timers.
+ * Returns 0, or -1 if the report could not be written.
+ */
+int send_command_once(hid_device *handle, const char *cmd, size_t len);
+
+/* Encode a set report for outlet @idx (1 based) into @cmd. */
+void prepare_cmd(char *cmd, int idx, bool on);
+
+/*
+ * Query the outlet mask, resending the query up to DEVICE_STATUS_TRIES times
+ * on the timeout estimated by @rtt (NULL starts from scratch).  Returns 0 on
+ * success, 1 on timeout or error.
+ */
+int device_read_status(hid_device *handle, unsigned char *mask,
+		       struct rtt_est *rtt);
+
+struct device_status_req {
+	hid_device *handle;		/* NULL counts as failed */
+	struct rtt_est *rtt;		/* NULL starts from scratch */
+	unsigned char mask;		/* out */
+	int result;			/* out: 0, or 1 on timeout or error */
+};
+
+/*
+ * device_read_status() for @n devices at once: every query is sent before
+ * any reply is waited for and each device is resent on its own timeout, so
+ * the sweep takes about as long as the slowest device rather than the sum
+ * over all of them.  Returns the number of devices that failed.
+ */
+int device_read_status_many(struct device_status_req *reqs, unsigned n);
+
+/* Outlets that disagree after a set are switched again this many times. */
+#define VERIFY_REPAIRS		2
+
+/*
+ * Read back the outlet mask into @actual and check the outlets in @care
+ * against @expected, resending those that differ.  Returns 0 if they match,
+ * 1 if they still differ after VERIFY_REPAIRS attempts, -1 on I/O error.
+ */
+int device_verify_mask(hid_device *handle, unsigned char expected,
+		       unsigned char care, unsigned char *actual,
+		       struct rtt_est *rtt);
+
+/* Convert a serial number to UTF-8.  The caller must free() the result. */
+char *wchar_to_utf8(const wchar_t *ws);
+
+hid_device *device_open_path(const char *path);
+hid_device *device_open_serial(const char *serial);
+
+/* Threads opening devices at once; the descriptor ioctls dominate. */
+#define DEVICE_OPEN_THREADS	16
+
+/*
+ * Open @n devices by path concurrently into @handles, NULL for those that
+ * fail.  Returns the number opened.
+ */
+unsigned device_open_paths(char *const *paths, unsigned n,
+			   hid_device **handles);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
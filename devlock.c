@@ -0,0 +1,283 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bellwin.h"
+#include "device.h"
+#include "devlock.h"
+#include "hid_log.h"
+#include "timeutil.h"
+
+#define DEVLOCK_MAGIC	0x42574c4b	/* "BWLK" */
+#define HIDRAW_QUEUE	64		/* reports the kernel queues per reader */
+#define DEVLOCK_POLL_MS	2
+
+struct devlock_owner {
+	uint64_t key;			/* devlock_key(), 0 for a free slot */
+	int32_t pid;			/* 0 while nobody holds the device */
+	uint32_t waiters;
+	uint64_t since_ns;		/* CLOCK_MONOTONIC, system wide */
+	char op[DEVLOCK_OP_LEN];
+};
+
+struct devlock_table {
+	uint32_t magic;
+	uint32_t slots;
+	struct devlock_owner owner[DEVLOCK_SLOTS];
+};
+
+static struct devlock_table *table;
+
+/*
+ * Map the owner table, creating it for the first process.  Only tables of
+ * our own user that nobody else can write are used: the table merely names
+ * holders, and the flock() alone decides who has a device, so without one
+ * the locks still work.
+ */
+static struct devlock_table *table_map(void)
+{
+	struct devlock_table *t;
+	struct stat st;
+	uint32_t zero = 0;
+	int fd;
+
+	if (table)
+		return table;
+
+	fd = shm_open(DEVLOCK_SHM, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || st.st_uid != geteuid() || (st.st_mode & 0077) ||
+	    ((size_t)st.st_size < sizeof(*t) && ftruncate(fd, sizeof(*t)))) {
+		close(fd);
+		return NULL;
+	}
+	t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (t == MAP_FAILED)
+		return NULL;
+
+	__atomic_compare_exchange_n(&t->magic, &zero, DEVLOCK_MAGIC, false,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	if (t->magic != DEVLOCK_MAGIC) {
+		munmap(t, sizeof(*t));
+		return NULL;
+	}
+	t->slots = DEVLOCK_SLOTS;
+	table = t;
+
+	return t;
+}
+
+/* Nobody holds or waits for the device of @o, or its holder died. */
+static bool owner_stale(struct devlock_owner *o)
+{
+	pid_t pid = __atomic_load_n(&o->pid, __ATOMIC_ACQUIRE);
+
+	if (__atomic_load_n(&o->waiters, __ATOMIC_ACQUIRE))
+		return false;
+
+	/* kill() would take anything else for a process group. */
+	return pid <= 0 || (kill(pid, 0) && errno == ESRCH);
+}
+
+/*
+ * The slot of device @key, claiming a free one on first use.  When every
+ * slot is taken, one whose device nobody is using is taken over: hidraw
+ * nodes come and go, and a holder that died never released its slot.
+ */
+static struct devlock_owner *find_owner(uint64_t key)
+{
+	struct devlock_table *t = table_map();
+	unsigned i, h;
+	int err = errno;
+
+	if (!t)
+		return NULL;
+
+	h = (key * 0x9e3779b97f4a7c15ull) >> 56;
+	for (i = 0; i < DEVLOCK_SLOTS; i++) {
+		struct devlock_owner *o = &t->owner[(h + i) % DEVLOCK_SLOTS];
+		uint64_t cur = __atomic_load_n(&o->key, __ATOMIC_ACQUIRE);
+
+		if (!cur && __atomic_compare_exchange_n(&o->key, &cur, key,
+							false, __ATOMIC_ACQ_REL,
+							__ATOMIC_ACQUIRE))
+			return o;
+		if (cur == key)
+			return o;
+	}
+
+	for (i = 0; i < DEVLOCK_SLOTS; i++) {
+		struct devlock_owner *o = &t->owner[(h + i) % DEVLOCK_SLOTS];
+		uint64_t cur = __atomic_load_n(&o->key, __ATOMIC_ACQUIRE);
+
+		if (owner_stale(o) &&
+		    __atomic_compare_exchange_n(&o->key, &cur, key, false,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&o->pid, 0, __ATOMIC_RELEASE);
+			o->op[0] = '\0';
+			errno = err;
+			return o;
+		}
+	}
+	errno = err;
+
+	return NULL;
+}
+
+uint64_t devlock_key(hid_device *hid)
+{
+	int fd = hid_get_fd(hid);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) || !S_ISCHR(st.st_mode))
+		return 0;
+
+	return (uint64_t)st.st_rdev + 1;
+}
+
+static void note_holder(struct devlock *l, struct devlock_owner *o)
+{
+	pid_t pid = o ? __atomic_load_n(&o->pid, __ATOMIC_ACQUIRE) : 0;
+
+	if (pid <= 0)
+		return;
+	l->waited_for = pid;
+	memcpy(l->waited_op, o->op, sizeof(l->waited_op));
+	l->waited_op[sizeof(l->waited_op) - 1] = '\0';
+}
+
+static int lock(struct devlock *l, hid_device *hid, const char *op, bool wait)
+{
+	unsigned char buf[BELLWIN_REPORT_SIZE];
+	uint64_t key = devlock_key(hid), start;
+	struct devlock_owner *o;
+	unsigned i;
+
+	memset(l, 0, sizeof(*l));
+	l->fd = -1;
+	if (!key)
+		return 0;
+
+	o = find_owner(key);
+	start = now_ns();
+	if (flock(hid_get_fd(hid), LOCK_EX | LOCK_NB)) {
+		int ret;
+
+		if (errno != EWOULDBLOCK)
+			return -1;
+		note_holder(l, o);
+		if (!wait) {
+			errno = EWOULDBLOCK;
+			return -1;
+		}
+		if (o)
+			__atomic_fetch_add(&o->waiters, 1, __ATOMIC_RELAXED);
+		while ((ret = flock(hid_get_fd(hid), LOCK_EX | LOCK_NB)) &&
+		       (errno == EWOULDBLOCK || errno == EINTR) &&
+		       now_ns() - start < DEVLOCK_WAIT_MS * 1000000ull)
+			usleep(DEVLOCK_POLL_MS * 1000);
+		if (o)
+			__atomic_fetch_sub(&o->waiters, 1, __ATOMIC_RELAXED);
+		/* Polled, not blocked, so that a holder that never lets go is reported. */
+		if (ret && errno == EWOULDBLOCK) {
+			char holder[64];
+
+			note_holder(l, o);
+			devlock_describe(l, holder, sizeof(holder));
+			hid_log_error(hid_get_path(hid) ? hid_get_path(hid) : "device",
+				      "%s for over %u s%s", holder,
+				      DEVLOCK_WAIT_MS / 1000,
+				      strcmp(l->waited_op, "daemon") ? "" :
+				      ", go through its --socket instead");
+			errno = ETIMEDOUT;
+		}
+		if (ret)
+			return -1;
+		l->wait_ns = now_ns() - start;
+		/* The holder may have given its slot back meanwhile. */
+		o = find_owner(key);
+	}
+
+	l->fd = hid_get_fd(hid);
+	if (o) {
+		o->pid = getpid();
+		o->since_ns = now_ns();
+		snprintf(o->op, sizeof(o->op), "%s", op);
+		l->owner = o;
+	}
+
+	/* Replies to the previous holder's queries reached us too. */
+	for (i = 0; i < HIDRAW_QUEUE; i++)
+		if (hid_read_timeout(hid, buf, sizeof(buf), 0) <= 0)
+			break;
+
+	return 0;
+}
+
+int devlock_acquire(struct devlock *l, hid_device *hid, const char *op)
+{
+	return lock(l, hid, op, true);
+}
+
+int devlock_try(struct devlock *l, hid_device *hid, const char *op)
+{
+	return lock(l, hid, op, false);
+}
+
+void devlock_release(struct devlock *l)
+{
+	struct devlock_owner *o = l->owner;
+
+	/* Still holding the flock, so nobody else can take the slot over. */
+	if (o) {
+		uint64_t key = __atomic_load_n(&o->key, __ATOMIC_ACQUIRE);
+
+		o->op[0] = '\0';
+		__atomic_store_n(&o->pid, 0, __ATOMIC_RELEASE);
+		if (!__atomic_load_n(&o->waiters, __ATOMIC_ACQUIRE))
+			__atomic_compare_exchange_n(&o->key, &key, 0, false,
+						    __ATOMIC_ACQ_REL,
+						    __ATOMIC_ACQUIRE);
+		l->owner = NULL;
+	}
+	if (l->fd >= 0)
+		flock(l->fd, LOCK_UN);
+	l->fd = -1;
+}
+
+void devlock_describe(const struct devlock *l, char *buf, size_t len)
+{
+	if (l->waited_for)
+		snprintf(buf, len, "in use by pid %d (%s)", l->waited_for,
+			 l->waited_op[0] ? l->waited_op : "?");
+	else
+		snprintf(buf, len, "in use");
+}
+
+bool devlock_contended(const struct devlock *l)
+{
+	return l->owner &&
+	       __atomic_load_n(&l->owner->waiters, __ATOMIC_ACQUIRE);
+}
+
+void devlock_report(const struct devlock *l, const char *name)
+{
+	int level = l->wait_ns ? HID_LOG_INFO : HID_LOG_DEBUG;
+
+	if (l->waited_for)
+		hid_log(level, name, "waited %.1f ms for pid %d (%s)",
+			l->wait_ns / 1e6, l->waited_for,
+			l->waited_op[0] ? l->waited_op : "?");
+	else
+		hid_log(level, name, "waited %.1f ms for the device lock",
+			l->wait_ns / 1e6);
+}
@@ -0,0 +1,69 @@
+/*
+ * Cross-process arbitration for direct device access.
+ *
+ * Every process that opens a hidraw node receives every input report, so
+ * two invocations exchanging reports with one splitter at the same time
+ * can take each other's replies.  A devlock serializes them: it takes an
+ * exclusive flock() on the node, which the kernel drops if the holder
+ * dies, and records the holder's pid, operation and start time in a
+ * shared memory table (DEVLOCK_SHM), private to one user, so that a
+ * waiter can say whom it waited for.  Different devices are locked
+ * independently.
+ *
+ * Simulated devices are not hidraw nodes and are never locked.
+ */
+
+#ifndef DEVLOCK_H__
+#define DEVLOCK_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "hidapi.h"
+
+#define DEVLOCK_SHM		"/bellwin-devlock"
+#define DEVLOCK_SLOTS		256
+#define DEVLOCK_OP_LEN		20
+#define DEVLOCK_WAIT_MS		10000	/* devlock_acquire() gives up after */
+
+struct devlock_owner;
+
+struct devlock {
+	int fd;				/* locked node, -1 if none */
+	struct devlock_owner *owner;	/* our record, NULL without the table */
+	uint64_t wait_ns;		/* time spent waiting for the lock */
+	pid_t waited_for;		/* holder we waited for, or gave up on */
+	char waited_op[DEVLOCK_OP_LEN];
+};
+
+/* The order devices are to be locked in, 0 for devices never locked. */
+uint64_t devlock_key(hid_device *hid);
+
+/*
+ * Wait for exclusive use of @hid for @op, then drop the input reports that
+ * were queued for it meanwhile.  Processes locking several devices must
+ * lock them in devlock_key() order.  Returns 0, or -1 with errno set:
+ * ETIMEDOUT, logged with the holder, after DEVLOCK_WAIT_MS.
+ */
+int devlock_acquire(struct devlock *l, hid_device *hid, const char *op);
+
+/*
+ * devlock_acquire() without the wait, for event loops serving other
+ * devices meanwhile: fails with EWOULDBLOCK while somebody holds @hid,
+ * leaving the holder in ->waited_for.  Since it never waits it may take
+ * locks in any order.
+ */
+int devlock_try(struct devlock *l, hid_device *hid, const char *op);
+
+void devlock_release(struct devlock *l);
+
+/* "in use by pid N (op)", or just "in use" if the holder is not known. */
+void devlock_describe(const struct devlock *l, char *buf, size_t len);
+
+/* Somebody waits in devlock_acquire() for the device @l holds. */
+bool devlock_contended(const struct devlock *l);
+
+/* Log how long @name was waited for; uncontended locks only when debugging. */
+void devlock_report(const struct devlock *l, const char *name);
+
+#endif
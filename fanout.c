@@ -0,0 +1,485 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "hidapi.h"
+#include "bellwin.h"
+#include "device.h"
+#include "sim.h"
+#include "worker.h"
+#include "client.h"
+#include "fanout.h"
+#include "devlock.h"
+
+#define FANOUT_TIMEOUT_MS	2500
+/* A status read and two rounds of sets, should a device time out. */
+#define FANOUT_DEPTH		(2 * POWER_SWITCH_COUNT + 1)
+#define TAG_STATUS		0x100
+#define REPLY_LEN		256
+
+struct fanout_dev {
+	hid_device *hid;
+	struct bw_worker *w;
+	struct bellwin_sim *sim;
+	struct devlock lock;
+	uint64_t lock_key;
+	unsigned pending;
+	unsigned char mask;		/* from the last status read */
+	unsigned char applied;		/* outlets a transaction switched */
+	int failed;			/* in the last round */
+	char error[64];
+};
+
+static hid_device *fanout_open(const char *device, const struct fanout_opts *opts,
+			       struct bellwin_sim **sim)
+{
+	hid_device *hid = NULL;
+	unsigned idx;
+
+	*sim = NULL;
+	if (opts->simulate && sscanf(device, "SIM%u", &idx) == 1) {
+		if (idx < opts->simulate)
+			*sim = bellwin_sim_start(0, opts->sim_latency_us, &hid);
+		return hid;
+	}
+	if (device[0] == '/')
+		return hid_open_path(device);
+
+	return device_open_serial(device);
+}
+
+static int fanout_start(struct fanout_dev *d)
+{
+	d->w = bw_worker_start(d->hid, FANOUT_DEPTH, FANOUT_TIMEOUT_MS);
+	if (!d->w) {
+		snprintf(d->error, sizeof(d->error), "no worker");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int lock_order(const void *a, const void *b)
+{
+	const struct fanout_dev *x = *(struct fanout_dev *const *)a;
+	const struct fanout_dev *y = *(struct fanout_dev *const *)b;
+
+	return x->lock_key < y->lock_key ? -1 : x->lock_key > y->lock_key;
+}
+
+/*
+ * Lock the opened devices in devlock_key() order, so that fan-outs over
+ * overlapping sets of devices in other processes cannot deadlock.
+ */
+static void fanout_lock(struct fanout_dev *devs, unsigned n,
+			const struct fanout_target *t)
+{
+	struct fanout_dev **order;
+	unsigned i, m = 0;
+
+	order = calloc(n, sizeof(*order));
+	if (!order)
+		return;
+	for (i = 0; i < n; i++) {
+		if (!devs[i].hid)
+			continue;
+		devs[i].lock_key = devlock_key(devs[i].hid);
+		order[m++] = &devs[i];
+	}
+	qsort(order, m, sizeof(*order), lock_order);
+	for (i = 0; i < m; i++) {
+		struct fanout_dev *d = order[i];
+
+		if (devlock_acquire(&d->lock, d->hid, "fanout")) {
+			int err = errno;
+
+			hid_close(d->hid);
+			d->hid = NULL;
+			d->failed = 1;
+			if (err == ETIMEDOUT)
+				devlock_describe(&d->lock, d->error,
+						 sizeof(d->error));
+			else
+				snprintf(d->error, sizeof(d->error),
+					 "unable to lock");
+			continue;
+		}
+		devlock_report(&d->lock, t[d - devs].device);
+	}
+	free(order);
+}
+
+static void fanout_submit(struct fanout_dev *d, const struct bw_op *op)
+{
+	if (bw_worker_submit(d->w, op)) {
+		d->pending++;
+	} else {
+		d->failed = 1;
+		snprintf(d->error, sizeof(d->error), "queue full");
+	}
+}
+
+/* Queue a write for every outlet in @care. */
+static void submit_set(struct fanout_dev *d, unsigned char value,
+		       unsigned char care)
+{
+	struct bw_op op;
+	unsigned j;
+
+	for (j = 0; j < POWER_SWITCH_COUNT; j++) {
+		if (!(care & BIT(j)))
+			continue;
+		bw_op_set(&op, j + 1, value & BIT(j), j);
+		fanout_submit(d, &op);
+	}
+}
+
+static void submit_status(struct fanout_dev *d)
+{
+	struct bw_op op;
+
+	bw_op_status(&op, TAG_STATUS);
+	fanout_submit(d, &op);
+}
+
+/*
+ * Reap until everything queued on the started devices has completed, or
+ * nothing completes for FANOUT_TIMEOUT_MS.  Devices with a failed or
+ * missing completion get ->failed and ->error.  Returns the number of
+ * failed devices.
+ */
+static unsigned fanout_wait(struct fanout_dev *devs, unsigned n)
+{
+	struct pollfd *fds;
+	unsigned i, left = 0, failed = 0;
+
+	fds = calloc(n, sizeof(*fds));
+	for (i = 0; i < n; i++) {
+		if (fds) {
+			fds[i].fd = devs[i].w && devs[i].pending ?
+				    bw_worker_fd(devs[i].w) : -1;
+			fds[i].events = POLLIN;
+		}
+		left += devs[i].pending;
+	}
+
+	while (left && fds) {
+		int res = poll(fds, n, FANOUT_TIMEOUT_MS);
+
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			break;
+
+		for (i = 0; i < n; i++) {
+			struct fanout_dev *d = &devs[i];
+			struct bw_completion c;
+
+			if (!d->w || !fds[i].revents)
+				continue;
+			while (bw_worker_reap(d->w, &c)) {
+				if (c.result) {
+					d->failed = 1;
+					if (c.tag == TAG_STATUS)
+						snprintf(d->error, sizeof(d->error),
+							 "status read failed");
+					else
+						snprintf(d->error, sizeof(d->error),
+							 "outlet %u write failed",
+							 (unsigned)c.tag + 1);
+				} else if (c.tag == TAG_STATUS) {
+					d->mask = c.mask;
+				}
+				d->pending--;
+				left--;
+			}
+			if (!d->pending)
+				fds[i].fd = -1;
+		}
+	}
+	free(fds);
+
+	for (i = 0; i < n; i++) {
+		if (devs[i].pending) {
+			devs[i].failed = 1;
+			snprintf(devs[i].error, sizeof(devs[i].error), "timeout");
+		}
+		failed += devs[i].failed;
+	}
+
+	return failed;
+}
+
+static void fanout_reset(struct fanout_dev *devs, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		devs[i].failed = 0;
+}
+
+/* Mark every target failed, keeping the reason of the ones that were. */
+static void fanout_abort(struct fanout_target *t, struct fanout_dev *devs,
+			 unsigned n, const char *reason)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		t[i].result = -1;
+		snprintf(t[i].error, sizeof(t[i].error), "%s",
+			 devs[i].failed ? devs[i].error : reason);
+	}
+}
+
+/*
+ * All or nothing: read every device's mask in parallel, switch only the
+ * outlets that differ, and if any device fails put back the outlets that
+ * were switched on every device, the failed one included.
+ */
+static void fanout_transaction(struct fanout_target *t, struct fanout_dev *devs,
+			       unsigned n)
+{
+	unsigned i;
+
+	fanout_reset(devs, n);
+	for (i = 0; i < n; i++)
+		submit_status(&devs[i]);
+	if (fanout_wait(devs, n)) {
+		fanout_abort(t, devs, n, "aborted");
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		t[i].before = devs[i].mask;
+		devs[i].applied = (devs[i].mask ^ t[i].value) & t[i].care;
+		submit_set(&devs[i], t[i].value, devs[i].applied);
+	}
+	if (!fanout_wait(devs, n))
+		return;
+
+	for (i = 0; i < n; i++) {
+		t[i].result = -1;
+		snprintf(t[i].error, sizeof(t[i].error), "%s",
+			 devs[i].failed ? devs[i].error : "rolled back");
+	}
+
+	fanout_reset(devs, n);
+	for (i = 0; i < n; i++)
+		submit_set(&devs[i], t[i].before, devs[i].applied);
+	fanout_wait(devs, n);
+	for (i = 0; i < n; i++) {
+		size_t len = strlen(t[i].error);
+
+		if (devs[i].failed)
+			snprintf(t[i].error + len, sizeof(t[i].error) - len,
+				 ", rollback failed");
+	}
+}
+
+int fanout_set(struct fanout_target *t, unsigned n,
+	       const struct fanout_opts *opts)
+{
+	struct fanout_dev *devs;
+	unsigned i;
+	int failed = 0, unopened = 0;
+
+	devs = calloc(n, sizeof(*devs));
+	if (!devs)
+		return n;
+
+	for (i = 0; i < n; i++) {
+		t[i].result = 0;
+		devs[i].lock.fd = -1;
+		devs[i].hid = fanout_open(t[i].device, opts, &devs[i].sim);
+		if (!devs[i].hid)
+			snprintf(devs[i].error, sizeof(devs[i].error),
+				 "unable to open");
+	}
+	fanout_lock(devs, n, t);
+
+	/* Queue every report first so all devices switch at the same time. */
+	for (i = 0; i < n; i++) {
+		if (!devs[i].hid || fanout_start(&devs[i])) {
+			devs[i].failed = 1;
+			unopened++;
+		}
+	}
+
+	if (opts->transaction) {
+		if (unopened)
+			fanout_abort(t, devs, n, "aborted");
+		else
+			fanout_transaction(t, devs, n);
+	} else {
+		for (i = 0; i < n; i++)
+			if (devs[i].w)
+				submit_set(&devs[i], t[i].value, t[i].care);
+		fanout_wait(devs, n);
+		for (i = 0; i < n; i++) {
+			if (!devs[i].failed)
+				continue;
+			t[i].result = -1;
+			snprintf(t[i].error, sizeof(t[i].error), "%s",
+				 devs[i].error);
+		}
+	}
+
+	/*
+	 * A worker may still be in an exchange a timed out wait gave up on:
+	 * stop it before the lock goes, and close the device only after.
+	 */
+	for (i = 0; i < n; i++) {
+		bw_worker_stop(devs[i].w);
+		devlock_release(&devs[i].lock);
+		if (devs[i].hid)
+			hid_close(devs[i].hid);
+		bellwin_sim_stop(devs[i].sim);
+		if (t[i].result)
+			failed++;
+	}
+	free(devs);
+
+	return failed;
+}
+
+enum daemon_round { ROUND_STATUS, ROUND_APPLY, ROUND_ROLLBACK };
+
+/*
+ * Send one request per target, pipelined on one connection, and store
+ * the replies in @replies (@n lines of REPLY_LEN).  Returns the number of
+ * "err" replies, or -1 with errno set if the daemon could not be reached.
+ */
+static int daemon_round(const char *socket_path, const struct fanout_target *t,
+			unsigned n, enum daemon_round round, char **replies)
+{
+	const char **lines;
+	char *buf;
+	unsigned i;
+	int failed = 0;
+
+	lines = calloc(n, sizeof(*lines));
+	buf = calloc(n, REPLY_LEN);
+	if (!lines || !buf) {
+		free(buf);
+		free(lines);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		char *line = buf + REPLY_LEN * i;
+
+		lines[i] = line;
+		if (round == ROUND_STATUS)
+			snprintf(line, REPLY_LEN, "status %s", t[i].device);
+		else
+			snprintf(line, REPLY_LEN, "mask %s 0x%02x 0x%02x",
+				 t[i].device,
+				 round == ROUND_APPLY ? t[i].value : t[i].before,
+				 t[i].care);
+	}
+
+	if (client_pipeline(socket_path, lines, replies, n, REPLY_LEN))
+		failed = -1;
+	else
+		for (i = 0; i < n; i++)
+			failed += !!strncmp(replies[i], "ok", 2);
+
+	free(buf);
+	free(lines);
+	return failed;
+}
+
+static void daemon_transaction(struct fanout_target *t, unsigned n,
+			       const char *socket_path, char **replies)
+{
+	const char *mask, *why;
+	unsigned i;
+	int res;
+
+	res = daemon_round(socket_path, t, n, ROUND_STATUS, replies);
+	why = res < 0 ? strerror(errno) : NULL;
+	for (i = 0; !res && i < n; i++) {
+		mask = strstr(replies[i], " mask=");
+		if (!mask)
+			res = 1;
+		else
+			t[i].before = strtoul(mask + 6, NULL, 16);
+	}
+	if (res) {
+		for (i = 0; i < n; i++) {
+			t[i].result = -1;
+			snprintf(t[i].error, sizeof(t[i].error), "%s",
+				 why ? why :
+				 strncmp(replies[i], "ok", 2) ? replies[i] :
+				 "aborted");
+		}
+		return;
+	}
+
+	res = daemon_round(socket_path, t, n, ROUND_APPLY, replies);
+	if (!res)
+		return;
+	why = res < 0 ? strerror(errno) : NULL;
+
+	/* A failed mask may have switched some outlets: restore them all. */
+	for (i = 0; i < n; i++) {
+		t[i].result = -1;
+		snprintf(t[i].error, sizeof(t[i].error), "%s",
+			 why ? why :
+			 strncmp(replies[i], "ok", 2) ? replies[i] : "rolled back");
+	}
+	if (daemon_round(socket_path, t, n, ROUND_ROLLBACK, replies)) {
+		for (i = 0; i < n; i++) {
+			size_t len = strlen(t[i].error);
+
+			snprintf(t[i].error + len, sizeof(t[i].error) - len,
+				 ", rollback failed");
+		}
+	}
+}
+
+int fanout_set_daemon(struct fanout_target *t, unsigned n,
+		      const char *socket_path, const struct fanout_opts *opts)
+{
+	const char *why;
+	char **replies;
+	char *buf;
+	unsigned i;
+	int failed = 0, res;
+
+	replies = calloc(n, sizeof(*replies));
+	buf = calloc(n, REPLY_LEN);
+	if (!replies || !buf) {
+		free(buf);
+		free(replies);
+		return n;
+	}
+	for (i = 0; i < n; i++) {
+		replies[i] = buf + REPLY_LEN * i;
+		t[i].result = 0;
+	}
+
+	if (opts->transaction) {
+		daemon_transaction(t, n, socket_path, replies);
+	} else {
+		res = daemon_round(socket_path, t, n, ROUND_APPLY, replies);
+		why = res < 0 ? strerror(errno) : NULL;
+		for (i = 0; res && i < n; i++) {
+			if (res > 0 && !strncmp(replies[i], "ok", 2))
+				continue;
+			t[i].result = -1;
+			snprintf(t[i].error, sizeof(t[i].error), "%s",
+				 why ? why : replies[i]);
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		if (t[i].result)
+			failed++;
+	free(buf);
+	free(replies);
+	return failed;
+}
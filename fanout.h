@@ -0,0 +1,41 @@
+/*
+ * Fan-out of one outlet mask per device across many splitters at once.
+ *
+ * Every target is a device (serial number, path or SIM<n>) with the outlets
+ * to switch in @care and their new states in @value.  Locally each device
+ * gets its own worker thread (worker.h), so the splitters are switched in
+ * parallel; through the daemon the requests are pipelined on one
+ * connection and run on the daemon's per-device queues.
+ *
+ * In transaction mode the current masks are read from all devices first
+ * and only differing outlets are switched; if any device fails, every
+ * device is put back to its previous state and all targets fail.
+ */
+
+#ifndef FANOUT_H__
+#define FANOUT_H__
+
+struct fanout_target {
+	const char *device;
+	unsigned char value;
+	unsigned char care;
+	unsigned char before;		/* transaction: mask before the change */
+	int result;			/* 0 on success */
+	char error[64];
+};
+
+struct fanout_opts {
+	unsigned simulate;		/* SIM<n> devices are simulated */
+	unsigned sim_latency_us;
+	int transaction;		/* all targets or none */
+};
+
+/* Switch all targets on local devices.  Returns the number that failed. */
+int fanout_set(struct fanout_target *t, unsigned n,
+	       const struct fanout_opts *opts);
+
+/* Switch all targets through the daemon at @socket_path. */
+int fanout_set_daemon(struct fanout_target *t, unsigned n,
+		      const char *socket_path, const struct fanout_opts *opts);
+
+#endif
@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <string.h>
+#include "fleet.h"
+
+#define BYTES_LO	0x0101010101010101ull
+
+static void fleet_init(struct fleet *f)
+{
+	memset(f, 0, sizeof(*f));
+}
+
+void fleet_free(struct fleet *f)
+{
+	free(f->cur);
+	free(f->known);
+	free(f->desired);
+	free(f->want);
+	free(f->updated_ns);
+	free(f->seq);
+	fleet_init(f);
+}
+
+static int grow(void **p, size_t old, size_t new, size_t size)
+{
+	void *q = realloc(*p, new * size);
+
+	if (!q)
+		return -1;
+	memset((char *)q + old * size, 0, (new - old) * size);
+	*p = q;
+	return 0;
+}
+
+int fleet_add(struct fleet *f)
+{
+	if (f->n == f->cap) {
+		unsigned cap = f->cap ? f->cap * 2 : 64;
+
+		if (grow((void **)&f->cur, f->cap, cap, 1) ||
+		    grow((void **)&f->known, f->cap, cap, 1) ||
+		    grow((void **)&f->desired, f->cap, cap, 1) ||
+		    grow((void **)&f->want, f->cap, cap, 1) ||
+		    grow((void **)&f->updated_ns, f->cap, cap, sizeof(uint64_t)) ||
+		    grow((void **)&f->seq, f->cap, cap, sizeof(uint32_t)))
+			return -1;
+		f->cap = cap;
+	}
+
+	/* Whole-fleet operations may have written to the padding. */
+	f->cur[f->n] = 0;
+	f->known[f->n] = 0;
+	f->desired[f->n] = 0;
+	f->want[f->n] = 0;
+	f->updated_ns[f->n] = 0;
+	f->seq[f->n] = 0;
+
+	return f->n++;
+}
+
+void fleet_want(struct fleet *f, unsigned i, uint8_t value, uint8_t care,
+		uint64_t now)
+{
+	f->desired[i] = (f->desired[i] & ~care) | (value & care);
+	f->want[i] |= care;
+	f->updated_ns[i] = now;
+	f->seq[i]++;
+}
+
+void fleet_observe(struct fleet *f, unsigned i, uint8_t mask, uint64_t now)
+{
+	f->cur[i] = mask & POWER_SWITCH_ALL;
+	f->known[i] = POWER_SWITCH_ALL;
+	f->updated_ns[i] = now;
+	f->seq[i]++;
+}
+
+void fleet_applied(struct fleet *f, unsigned i, uint8_t value, uint8_t care,
+		   uint64_t now)
+{
+	f->cur[i] = (f->cur[i] & ~care) | (value & care);
+	f->known[i] |= care;
+	f->updated_ns[i] = now;
+	f->seq[i]++;
+}
+
+void fleet_forget(struct fleet *f, unsigned i, uint64_t now)
+{
+	f->known[i] = 0;
+	f->updated_ns[i] = now;
+	f->seq[i]++;
+}
+
+/* Drift of eight devices at once, one byte each. */
+static inline uint64_t drift_word(const struct fleet *f, unsigned i)
+{
+	uint64_t c, k, d, w;
+
+	memcpy(&c, f->cur + i, 8);
+	memcpy(&k, f->known + i, 8);
+	memcpy(&d, f->desired + i, 8);
+	memcpy(&w, f->want + i, 8);
+
+	return ((c ^ d) | ~k) & w & (POWER_SWITCH_ALL * BYTES_LO);
+}
+
+unsigned fleet_diff(const struct fleet *f, uint64_t *bitmap)
+{
+	unsigned i, j, count = 0;
+
+	memset(bitmap, 0, (f->n + 63) / 64 * sizeof(*bitmap));
+	for (i = 0; i < f->n; i += 8) {
+		uint64_t x = drift_word(f, i);
+
+		if (!x)
+			continue;
+		for (j = 0; j < 8 && i + j < f->n; j++) {
+			if (x >> (8 * j) & 0xff) {
+				bitmap[(i + j) / 64] |= 1ull << ((i + j) % 64);
+				count++;
+			}
+		}
+	}
+
+	return count;
+}
+
+size_t fleet_reconcile(const struct fleet *f, unsigned *cursor,
+		       struct fleet_report *out, size_t max)
+{
+	size_t n = 0;
+	unsigned i = *cursor;
+
+	while (i < f->n) {
+		uint64_t x = (i % 8) ? 0 : drift_word(f, i);
+		uint8_t drift;
+		int o;
+
+		/* Skip eight converged devices at a time. */
+		if (!(i % 8) && !x && i + 8 <= f->n) {
+			i += 8;
+			continue;
+		}
+
+		drift = fleet_drift(f, i);
+		if (n + __builtin_popcount(drift) > max)
+			break;
+		for (o = 0; o < POWER_SWITCH_COUNT; o++) {
+			if (!(drift & BIT(o)))
+				continue;
+			out[n].dev = i;
+			out[n].outlet = o + 1;
+			out[n].on = !!(f->desired[i] & BIT(o));
+			n++;
+		}
+		i++;
+	}
+	*cursor = i;
+
+	return n;
+}
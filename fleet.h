@@ -0,0 +1,84 @@
+/*
+ * Fleet state store: the outlet state of every managed splitter as a
+ * structure of arrays indexed by device.
+ *
+ *   cur      last known outlet mask
+ *   known    outlets whose bit in cur is trustworthy
+ *   desired  requested outlet mask
+ *   want     outlets that have a requested state at all
+ *
+ * The mask arrays are one byte per device and padded to a multiple of eight
+ * devices, so whole-fleet operations work on 64-bit words (eight devices at
+ * a time) and skip converged stretches of the fleet without looking at
+ * individual devices.  updated_ns and seq record when and how often each
+ * device's entry changed.
+ */
+
+#ifndef FLEET_H__
+#define FLEET_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bellwin.h"
+
+struct fleet {
+	unsigned n;
+	unsigned cap;			/* multiple of 8 */
+	uint8_t *cur;
+	uint8_t *known;
+	uint8_t *desired;
+	uint8_t *want;
+	uint64_t *updated_ns;
+	uint32_t *seq;
+};
+
+/* One 0x0b report to send: switch @outlet (1 based) of device @dev. */
+struct fleet_report {
+	uint32_t dev;
+	uint8_t outlet;
+	uint8_t on;
+};
+
+void fleet_free(struct fleet *f);
+
+/* Append a device with unknown state.  Returns its index or -1. */
+int fleet_add(struct fleet *f);
+
+/* Outlets of device @i whose state differs from the requested one. */
+static inline uint8_t fleet_drift(const struct fleet *f, unsigned i)
+{
+	return ((f->cur[i] ^ f->desired[i]) | ~f->known[i]) & f->want[i] &
+	       POWER_SWITCH_ALL;
+}
+
+/* Request the outlets in @care of device @i to follow @value. */
+void fleet_want(struct fleet *f, unsigned i, uint8_t value, uint8_t care,
+		uint64_t now);
+
+/* A status reply reported @mask for device @i. */
+void fleet_observe(struct fleet *f, unsigned i, uint8_t mask, uint64_t now);
+
+/* Set reports for the outlets in @care were written to device @i. */
+void fleet_applied(struct fleet *f, unsigned i, uint8_t value, uint8_t care,
+		   uint64_t now);
+
+/* Device @i lost track of its state (I/O error, reconnect). */
+void fleet_forget(struct fleet *f, unsigned i, uint64_t now);
+
+/*
+ * Mark every device that has drifted from its requested state in @bitmap
+ * (one bit per device, (n + 63) / 64 words).  Returns their number.
+ */
+unsigned fleet_diff(const struct fleet *f, uint64_t *bitmap);
+
+/*
+ * One sweep over the fleet from device *@cursor: store the reports needed
+ * to bring drifted outlets to their requested state in @out, at most @max.
+ * *@cursor is advanced past the devices fully covered, so a caller with a
+ * small buffer calls again until it returns 0.  @max must be at least
+ * POWER_SWITCH_COUNT so that one device always fits.
+ */
+size_t fleet_reconcile(const struct fleet *f, unsigned *cursor,
+		       struct fleet_report *out, size_t max);
+
+#endif
@@ -0,0 +1,554 @@
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "bellwin.h"
+#include "groups.h"
+
+#define GROUPS_LINE_MAX		4096
+#define GROUPS_MAX_ARGS		256
+#define BUCKET_KEYS		4	/* names per displacement bucket, on average */
+#define MAX_DISP		(1u << 20)
+#define SLOT_EMPTY		UINT32_MAX
+
+/* Parse state of one name until groups are flattened. */
+struct pending {
+	char **members;
+	unsigned nmembers;
+	unsigned line;
+	int state;		/* 0 unresolved, 1 resolving, 2 resolved */
+};
+
+struct loader {
+	struct groups *g;
+	struct pending *pend;
+	unsigned alloc;
+	char *err;
+	size_t errlen;
+};
+
+static void fail(struct loader *l, unsigned line, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void fail(struct loader *l, unsigned line, const char *fmt, ...)
+{
+	size_t len = 0;
+	va_list ap;
+
+	if (line)
+		len = snprintf(l->err, l->errlen, "line %u: ", line);
+	if (len >= l->errlen)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(l->err + len, l->errlen - len, fmt, ap);
+	va_end(ap);
+}
+
+/* FNV-1a; the displacement only remixes this value. */
+static uint64_t name_hash(const char *s)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 0x100000001b3ull;
+	}
+
+	return h;
+}
+
+static uint32_t name_bucket(const struct groups *g, uint64_t h)
+{
+	return (uint32_t)(h >> 32) % g->nbuckets;
+}
+
+static uint32_t name_slot(const struct groups *g, uint64_t h, uint32_t disp)
+{
+	uint64_t x = h ^ (disp * 0x9e3779b97f4a7c15ull);
+
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+
+	return x % g->nslots;
+}
+
+const struct group_entry *groups_lookup(const struct groups *g,
+					const char *name)
+{
+	uint64_t h;
+	uint32_t idx;
+
+	if (!g || !g->nentries)
+		return NULL;
+
+	h = name_hash(name);
+	idx = g->slots[name_slot(g, h, g->disp[name_bucket(g, h)])];
+	if (idx == SLOT_EMPTY || strcmp(g->entries[idx].name, name))
+		return NULL;
+
+	return &g->entries[idx];
+}
+
+static unsigned *bucket_sizes;
+
+static int by_bucket_size(const void *a, const void *b)
+{
+	unsigned sa = bucket_sizes[*(const unsigned *)a];
+	unsigned sb = bucket_sizes[*(const unsigned *)b];
+
+	return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+/*
+ * Place every name: buckets are filled largest first, each trying
+ * displacements until all of its names land in distinct free slots.
+ */
+static int build_hash(struct groups *g, unsigned nslots)
+{
+	unsigned *order = NULL, *first = NULL, *next = NULL, *count = NULL;
+	uint64_t *hash = NULL;
+	unsigned i, b;
+	int ret = -1;
+
+	g->nbuckets = g->nentries / BUCKET_KEYS + 1;
+	g->nslots = nslots;
+	free(g->disp);
+	free(g->slots);
+	g->disp = calloc(g->nbuckets, sizeof(*g->disp));
+	g->slots = malloc(g->nslots * sizeof(*g->slots));
+	hash = malloc(g->nentries * sizeof(*hash));
+	next = malloc(g->nentries * sizeof(*next));
+	first = malloc(g->nbuckets * sizeof(*first));
+	count = calloc(g->nbuckets, sizeof(*count));
+	order = malloc(g->nbuckets * sizeof(*order));
+	if (!g->disp || !g->slots || !hash || !next || !first || !count || !order)
+		goto out;
+
+	for (i = 0; i < g->nslots; i++)
+		g->slots[i] = SLOT_EMPTY;
+	for (b = 0; b < g->nbuckets; b++) {
+		first[b] = SLOT_EMPTY;
+		order[b] = b;
+	}
+	for (i = 0; i < g->nentries; i++) {
+		hash[i] = name_hash(g->entries[i].name);
+		b = name_bucket(g, hash[i]);
+		next[i] = first[b];
+		first[b] = i;
+		count[b]++;
+	}
+
+	bucket_sizes = count;
+	qsort(order, g->nbuckets, sizeof(*order), by_bucket_size);
+
+	for (b = 0; b < g->nbuckets && count[order[b]]; b++) {
+		unsigned bucket = order[b];
+		uint32_t d;
+
+		for (d = 0; d < MAX_DISP; d++) {
+			unsigned placed = 0;
+
+			for (i = first[bucket]; i != SLOT_EMPTY; i = next[i]) {
+				uint32_t s = name_slot(g, hash[i], d);
+
+				if (g->slots[s] != SLOT_EMPTY)
+					break;
+				g->slots[s] = i;
+				placed++;
+			}
+			if (i == SLOT_EMPTY)
+				break;
+
+			/* Undo the partial placement and try the next value. */
+			for (i = first[bucket]; placed--; i = next[i])
+				g->slots[name_slot(g, hash[i], d)] = SLOT_EMPTY;
+		}
+		if (d == MAX_DISP)
+			goto out;
+		g->disp[bucket] = d;
+	}
+	ret = 0;
+out:
+	free(order);
+	free(count);
+	free(first);
+	free(next);
+	free(hash);
+	return ret;
+}
+
+static int intern_device(struct groups *g, const char *name)
+{
+	char **devices;
+	unsigned i;
+
+	for (i = 0; i < g->ndevices; i++)
+		if (!strcmp(g->devices[i], name))
+			return i;
+
+	devices = realloc(g->devices, (g->ndevices + 1) * sizeof(*devices));
+	if (!devices)
+		return -1;
+	g->devices = devices;
+	g->devices[g->ndevices] = strdup(name);
+	if (!g->devices[g->ndevices])
+		return -1;
+
+	return g->ndevices++;
+}
+
+static int parse_outlets(const char *list, unsigned char *mask)
+{
+	const char *p = list;
+	char *end;
+	long outlet;
+
+	*mask = 0;
+	do {
+		outlet = strtol(p, &end, 10);
+		if (end == p || outlet < 1 || outlet > POWER_SWITCH_COUNT ||
+		    (*end && *end != ','))
+			return -1;
+		*mask |= BIT(outlet - 1);
+		p = end + 1;
+	} while (*end);
+
+	return 0;
+}
+
+static struct group_entry *new_entry(struct loader *l, const char *name,
+				     unsigned line)
+{
+	struct groups *g = l->g;
+	struct group_entry *e;
+
+	if (g->nentries == l->alloc) {
+		unsigned alloc = l->alloc ? l->alloc * 2 : 64;
+		struct group_entry *entries;
+		struct pending *pend;
+
+		entries = realloc(g->entries, alloc * sizeof(*entries));
+		if (!entries)
+			return NULL;
+		g->entries = entries;
+		pend = realloc(l->pend, alloc * sizeof(*pend));
+		if (!pend)
+			return NULL;
+		l->pend = pend;
+		l->alloc = alloc;
+	}
+
+	e = &g->entries[g->nentries];
+	memset(e, 0, sizeof(*e));
+	memset(&l->pend[g->nentries], 0, sizeof(l->pend[0]));
+	l->pend[g->nentries].line = line;
+	e->name = strdup(name);
+	if (!e->name)
+		return NULL;
+	g->nentries++;
+
+	return e;
+}
+
+static int parse_line(struct loader *l, char *text, unsigned line)
+{
+	char *argv[GROUPS_MAX_ARGS];
+	char *saveptr = NULL;
+	struct group_entry *e;
+	struct pending *p;
+	int argc = 0;
+	char *tok;
+	int i;
+
+	text[strcspn(text, "#\n")] = '\0';
+	for (tok = strtok_r(text, " \t\r", &saveptr); tok;
+	     tok = strtok_r(NULL, " \t\r", &saveptr)) {
+		if (argc == GROUPS_MAX_ARGS) {
+			fail(l, line, "too many members");
+			return -1;
+		}
+		argv[argc++] = tok;
+	}
+	if (!argc)
+		return 0;
+
+	/* On the command line 3=1 switches outlet 3, never a name. */
+	if (argc > 1 && isdigit((unsigned char)argv[1][0])) {
+		fail(l, line, "name %s starts with a digit", argv[1]);
+		return -1;
+	}
+
+	if (!strcmp(argv[0], "outlet")) {
+		unsigned char mask;
+		int dev;
+
+		if (argc != 4 || parse_outlets(argv[3], &mask)) {
+			fail(l, line, "usage: outlet <name> <device> <outlet>[,<outlet>...]");
+			return -1;
+		}
+		e = new_entry(l, argv[1], line);
+		dev = intern_device(l->g, argv[2]);
+		if (!e || dev < 0)
+			goto nomem;
+		e->targets = malloc(sizeof(*e->targets));
+		if (!e->targets)
+			goto nomem;
+		e->targets[0].dev = dev;
+		e->targets[0].mask = mask;
+		e->ntargets = 1;
+		l->pend[l->g->nentries - 1].state = 2;
+		return 0;
+	}
+
+	if (!strcmp(argv[0], "group")) {
+		if (argc < 3) {
+			fail(l, line, "usage: group <name> <member>...");
+			return -1;
+		}
+		e = new_entry(l, argv[1], line);
+		if (!e)
+			goto nomem;
+		p = &l->pend[l->g->nentries - 1];
+		p->members = calloc(argc - 2, sizeof(*p->members));
+		if (!p->members)
+			goto nomem;
+		for (i = 2; i < argc; i++) {
+			p->members[p->nmembers] = strdup(argv[i]);
+			if (!p->members[p->nmembers])
+				goto nomem;
+			p->nmembers++;
+		}
+		return 0;
+	}
+
+	fail(l, line, "unknown keyword %s", argv[0]);
+	return -1;
+nomem:
+	fail(l, line, "out of memory");
+	return -1;
+}
+
+static int by_name(const void *a, const void *b)
+{
+	return strcmp((*(struct group_entry *const *)a)->name,
+		      (*(struct group_entry *const *)b)->name);
+}
+
+static int check_duplicates(struct loader *l)
+{
+	struct groups *g = l->g;
+	struct group_entry **sorted;
+	unsigned i;
+	int ret = 0;
+
+	sorted = malloc(g->nentries * sizeof(*sorted));
+	if (!sorted) {
+		fail(l, 0, "out of memory");
+		return -1;
+	}
+	for (i = 0; i < g->nentries; i++)
+		sorted[i] = &g->entries[i];
+	qsort(sorted, g->nentries, sizeof(*sorted), by_name);
+	for (i = 1; i < g->nentries; i++) {
+		if (!strcmp(sorted[i - 1]->name, sorted[i]->name)) {
+			unsigned a = sorted[i - 1] - g->entries;
+			unsigned b = sorted[i] - g->entries;
+
+			fail(l, l->pend[a > b ? a : b].line, "%s defined twice",
+			     sorted[i]->name);
+			ret = -1;
+			break;
+		}
+	}
+	free(sorted);
+
+	return ret;
+}
+
+static int by_dev(const void *a, const void *b)
+{
+	const struct group_target *ta = a, *tb = b;
+
+	return ta->dev < tb->dev ? -1 : ta->dev > tb->dev;
+}
+
+/* Add @n targets to the (unsorted) list in @e. */
+static int add_targets(struct group_entry *e, unsigned *alloc,
+		       const struct group_target *t, unsigned n)
+{
+	if (e->ntargets + n > *alloc) {
+		unsigned want = (e->ntargets + n) * 2;
+		struct group_target *targets;
+
+		targets = realloc(e->targets, want * sizeof(*targets));
+		if (!targets)
+			return -1;
+		e->targets = targets;
+		*alloc = want;
+	}
+	memcpy(e->targets + e->ntargets, t, n * sizeof(*t));
+	e->ntargets += n;
+
+	return 0;
+}
+
+/* Flatten group @idx into one mask per device. */
+static int resolve(struct loader *l, unsigned idx)
+{
+	struct groups *g = l->g;
+	struct pending *p = &l->pend[idx];
+	unsigned alloc = 0, i, n;
+
+	if (p->state == 2)
+		return 0;
+	if (p->state == 1) {
+		fail(l, p->line, "group %s is part of a cycle", g->entries[idx].name);
+		return -1;
+	}
+	p->state = 1;
+
+	for (i = 0; i < p->nmembers; i++) {
+		const struct group_entry *m = groups_lookup(g, p->members[i]);
+		struct group_target t;
+		char *colon;
+		int dev;
+
+		if (m) {
+			if (resolve(l, m - g->entries))
+				return -1;
+			/* g->entries does not move during resolution. */
+			if (add_targets(&g->entries[idx], &alloc, m->targets,
+					m->ntargets))
+				goto nomem;
+			continue;
+		}
+
+		colon = strrchr(p->members[i], ':');
+		if (!colon || colon == p->members[i] ||
+		    parse_outlets(colon + 1, &t.mask)) {
+			fail(l, p->line, "unknown outlet or group %s",
+			     p->members[i]);
+			return -1;
+		}
+		*colon = '\0';
+		dev = intern_device(g, p->members[i]);
+		*colon = ':';
+		if (dev < 0)
+			goto nomem;
+		t.dev = dev;
+		if (add_targets(&g->entries[idx], &alloc, &t, 1))
+			goto nomem;
+	}
+
+	/* Sort by device and merge into one mask each. */
+	{
+		struct group_entry *e = &g->entries[idx];
+
+		qsort(e->targets, e->ntargets, sizeof(*e->targets), by_dev);
+		for (i = 0, n = 0; i < e->ntargets; i++) {
+			if (n && e->targets[n - 1].dev == e->targets[i].dev)
+				e->targets[n - 1].mask |= e->targets[i].mask;
+			else
+				e->targets[n++] = e->targets[i];
+		}
+		e->ntargets = n;
+	}
+	p->state = 2;
+
+	return 0;
+nomem:
+	fail(l, p->line, "out of memory");
+	return -1;
+}
+
+struct groups *groups_load(const char *path, char *err, size_t errlen)
+{
+	struct loader l = { .err = err, .errlen = errlen };
+	char text[GROUPS_LINE_MAX];
+	unsigned line = 0, nslots, i, j;
+	FILE *f;
+
+	err[0] = '\0';
+	f = fopen(path, "r");
+	if (!f) {
+		snprintf(err, errlen, "%s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	l.g = calloc(1, sizeof(*l.g));
+	if (!l.g) {
+		fclose(f);
+		snprintf(err, errlen, "out of memory");
+		return NULL;
+	}
+
+	while (fgets(text, sizeof(text), f)) {
+		line++;
+		if (!strchr(text, '\n') && !feof(f)) {
+			fail(&l, line, "line too long");
+			goto err;
+		}
+		if (parse_line(&l, text, line))
+			goto err;
+	}
+
+	if (check_duplicates(&l))
+		goto err;
+
+	for (nslots = l.g->nentries + l.g->nentries / 4 + 1; ; nslots *= 2) {
+		if (!build_hash(l.g, nslots))
+			break;
+		if (!l.g->disp || !l.g->slots) {
+			fail(&l, 0, "out of memory");
+			goto err;
+		}
+	}
+
+	for (i = 0; i < l.g->nentries; i++)
+		if (resolve(&l, i))
+			goto err;
+
+	for (i = 0; i < l.g->nentries; i++) {
+		for (j = 0; j < l.pend[i].nmembers; j++)
+			free(l.pend[i].members[j]);
+		free(l.pend[i].members);
+	}
+	free(l.pend);
+	fclose(f);
+
+	return l.g;
+err:
+	for (i = 0; i < l.g->nentries; i++) {
+		for (j = 0; j < l.pend[i].nmembers; j++)
+			free(l.pend[i].members[j]);
+		free(l.pend[i].members);
+	}
+	free(l.pend);
+	fclose(f);
+	groups_free(l.g);
+	return NULL;
+}
+
+void groups_free(struct groups *g)
+{
+	unsigned i;
+
+	if (!g)
+		return;
+
+	for (i = 0; i < g->nentries; i++) {
+		free(g->entries[i].name);
+		free(g->entries[i].targets);
+	}
+	free(g->entries);
+	for (i = 0; i < g->ndevices; i++)
+		free(g->devices[i]);
+	free(g->devices);
+	free(g->disp);
+	free(g->slots);
+	free(g);
+}
@@ -0,0 +1,65 @@
+/*
+ * Named outlets and groups.
+ *
+ * A configuration file gives names to outlets and groups of outlets that
+ * may span several splitters:
+ *
+ *   # name          device      outlets
+ *   outlet web-1    A1B2C3      1
+ *   outlet web-psu  A1B2C3      2,3
+ *   outlet sw-1     /dev/hidraw4 5
+ *   group  rack-7   web-1 web-psu sw-1 D4E5F6:4
+ *
+ * Group members are outlet names, other groups (in any order, cycles are
+ * rejected) or <device>:<outlet> pairs; devices are serial numbers or paths.
+ * Names do not start with a digit, which is what outlet numbers do.
+ * At load time every name is flattened to one outlet mask per device and
+ * the names are placed in a perfect hash (hash and displace), so a lookup
+ * costs one string hash and one comparison however large the file grows.
+ */
+
+#ifndef GROUPS_H__
+#define GROUPS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BELLWIN_DEFAULT_CONFIG	"/etc/bellwin.conf"
+
+struct group_target {
+	unsigned dev;			/* index into groups->devices */
+	unsigned char mask;
+};
+
+struct group_entry {
+	char *name;
+	unsigned ntargets;		/* one per device, sorted by device */
+	struct group_target *targets;
+};
+
+struct groups {
+	char **devices;
+	unsigned ndevices;
+	struct group_entry *entries;
+	unsigned nentries;
+
+	/* Perfect hash: bucket displacement, then slot to entry index. */
+	uint32_t *disp;
+	unsigned nbuckets;
+	uint32_t *slots;
+	unsigned nslots;
+};
+
+/*
+ * Parse and compile @path.  On failure returns NULL and describes the
+ * problem, with its line number, in @err.
+ */
+struct groups *groups_load(const char *path, char *err, size_t errlen);
+
+/* Look up an outlet or group name, NULL if unknown. */
+const struct group_entry *groups_lookup(const struct groups *g,
+					const char *name);
+
+void groups_free(struct groups *g);
+
+#endif
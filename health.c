@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include "health.h"
+
+#define ERR_FULL	(1000u << HEALTH_EWMA_SHIFT)
+
+void health_init(struct health *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->state = HEALTH_OK;
+	h->probe_interval_ms = HEALTH_PROBE_MS;
+}
+
+static void health_quarantine(struct health *h, uint64_t now)
+{
+	h->state = HEALTH_QUARANTINED;
+	h->probe_ok = 0;
+	h->probe_at = now + h->probe_interval_ms * 1000000ull;
+}
+
+void health_success(struct health *h, uint64_t latency_ns, uint64_t now)
+{
+	h->samples++;
+	h->err_rate -= h->err_rate >> HEALTH_EWMA_SHIFT;
+	h->consec_timeouts = 0;
+	hist_add(&h->latency, latency_ns);
+
+	if (h->state == HEALTH_OK)
+		return;
+
+	if (++h->probe_ok < HEALTH_PROBE_OK) {
+		/* Probe again right away to confirm. */
+		h->state = HEALTH_QUARANTINED;
+		h->probe_at = now;
+		return;
+	}
+
+	h->state = HEALTH_OK;
+	h->err_rate = 0;
+	h->probe_interval_ms = HEALTH_PROBE_MS;
+}
+
+void health_failure(struct health *h, bool timeout, uint64_t now)
+{
+	h->samples++;
+	h->errors++;
+	h->err_rate += (ERR_FULL - h->err_rate) >> HEALTH_EWMA_SHIFT;
+	if (timeout) {
+		h->timeouts++;
+		h->consec_timeouts++;
+	}
+
+	if (h->state != HEALTH_OK) {
+		/* Failed probe: wait longer before the next one. */
+		h->probe_interval_ms *= 2;
+		if (h->probe_interval_ms > HEALTH_PROBE_MAX_MS)
+			h->probe_interval_ms = HEALTH_PROBE_MAX_MS;
+		health_quarantine(h, now);
+		return;
+	}
+
+	if (h->consec_timeouts >= HEALTH_MAX_TIMEOUTS ||
+	    (h->samples >= HEALTH_MIN_SAMPLES &&
+	     h->err_rate >> HEALTH_EWMA_SHIFT > HEALTH_MAX_ERR_RATE)) {
+		h->quarantines++;
+		health_quarantine(h, now);
+	}
+}
+
+bool health_probe_due(struct health *h, uint64_t now)
+{
+	if (h->state != HEALTH_QUARANTINED || h->probe_at > now)
+		return false;
+
+	h->state = HEALTH_PROBING;
+	return true;
+}
+
+const char *health_state_name(enum health_state state)
+{
+	switch (state) {
+	case HEALTH_OK:
+		return "ok";
+	case HEALTH_QUARANTINED:
+		return "quarantined";
+	case HEALTH_PROBING:
+		return "probing";
+	}
+
+	return "unknown";
+}
+
+int health_format(const struct health *h, uint64_t now, char *buf,
+		  size_t size)
+{
+	int len;
+
+	len = snprintf(buf, size,
+		       "state=%s err_rate=%u.%03u consec_timeouts=%u errors=%llu timeouts=%llu quarantines=%llu p50_us=%llu p95_us=%llu p99_us=%llu",
+		       health_state_name(h->state),
+		       (h->err_rate >> HEALTH_EWMA_SHIFT) / 1000,
+		       (h->err_rate >> HEALTH_EWMA_SHIFT) % 1000,
+		       h->consec_timeouts,
+		       (unsigned long long)h->errors,
+		       (unsigned long long)h->timeouts,
+		       (unsigned long long)h->quarantines,
+		       (unsigned long long)hist_percentile(&h->latency, 0.5) / 1000,
+		       (unsigned long long)hist_percentile(&h->latency, 0.95) / 1000,
+		       (unsigned long long)hist_percentile(&h->latency, 0.99) / 1000);
+	if (h->state == HEALTH_QUARANTINED && len >= 0 && (size_t)len < size)
+		len += snprintf(buf + len, size - len, " probe_in_ms=%llu",
+				(unsigned long long)(h->probe_at > now ?
+						     (h->probe_at - now) / 1000000 : 0));
+
+	return len;
+}
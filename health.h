@@ -0,0 +1,78 @@
+/*
+ * Per-device health tracking and quarantine.
+ *
+ * Every exchange with a device is recorded as a success (with its latency)
+ * or a failure.  Failures feed an exponentially weighted error rate and a
+ * count of consecutive timeouts; when either crosses its threshold the
+ * device is quarantined and requests for it fail at once instead of waiting
+ * out a timeout.  A quarantined device is probed, with the interval doubling
+ * after every failed probe, and reinstated after HEALTH_PROBE_OK successful
+ * probes in a row.
+ */
+
+#ifndef HEALTH_H__
+#define HEALTH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "hist.h"
+
+#define HEALTH_EWMA_SHIFT	4	/* error rate weight 1/16 */
+#define HEALTH_MAX_ERR_RATE	500	/* per mille */
+#define HEALTH_MIN_SAMPLES	8
+#define HEALTH_MAX_TIMEOUTS	3	/* consecutive */
+#define HEALTH_PROBE_MS		1000
+#define HEALTH_PROBE_MAX_MS	60000
+#define HEALTH_PROBE_OK		2
+
+enum health_state {
+	HEALTH_OK,
+	HEALTH_QUARANTINED,
+	HEALTH_PROBING,		/* quarantined, probe outstanding */
+};
+
+struct health {
+	enum health_state state;
+	uint32_t err_rate;		/* per mille << HEALTH_EWMA_SHIFT */
+	unsigned consec_timeouts;
+	unsigned probe_ok;
+	uint32_t probe_interval_ms;
+	uint64_t probe_at;
+	uint64_t samples;
+	uint64_t errors;
+	uint64_t timeouts;
+	uint64_t quarantines;
+	struct hist latency;		/* ns, successful exchanges */
+};
+
+void health_init(struct health *h);
+
+void health_success(struct health *h, uint64_t latency_ns, uint64_t now);
+void health_failure(struct health *h, bool timeout, uint64_t now);
+
+/* Whether requests should be sent to the device at all. */
+static inline bool health_usable(const struct health *h)
+{
+	return h->state == HEALTH_OK;
+}
+
+/*
+ * If a probe of a quarantined device is due, mark it outstanding and return
+ * true; the caller then sends one request and reports its outcome.
+ */
+bool health_probe_due(struct health *h, uint64_t now);
+
+/* Time of the next probe, UINT64_MAX if none is pending. */
+static inline uint64_t health_next_probe(const struct health *h)
+{
+	return h->state == HEALTH_QUARANTINED ? h->probe_at : UINT64_MAX;
+}
+
+const char *health_state_name(enum health_state state);
+
+/* "state=ok err_rate=0.012 timeouts=0 p50_us=... p99_us=..." */
+int health_format(const struct health *h, uint64_t now, char *buf,
+		  size_t size);
+
+#endif
@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <locale.h>
 #include <errno.h>
+#include <limits.h>
 
 /* Unix */
 #include <unistd.h>
@@ -35,6 +36,7 @@
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <poll.h>
 
 /* Linux */
@@ -44,6 +46,9 @@
 #include <libudev.h>
 
 #include "hidapi.h"
+#include "hid_trace.h"
+#include "hid_capture.h"
+#include "hid_log.h"
 
 /* Definitions from linux/hidraw.h. Since these are new, some distros
    may not have header files which contain them. */
@@ -75,10 +80,13 @@ struct hid_device_ {
 	int device_handle;
 	int blocking;
 	int uses_numbered_reports;
+	char *path;
+	unsigned capture_id;
 };
 
 
 static __u32 kernel_version = 0;
+static unsigned next_capture_id = 0;
 
 static __u32 detect_kernel_version(void)
 {
@@ -97,7 +105,7 @@ static __u32 detect_kernel_version(void)
 		return KERNEL_VERSION(major, minor, 0);
 	}
 
-	printf("Couldn't determine kernel version from version string \"%s\"\n", name.release);
+	hid_log_warn(NULL, "Couldn't determine kernel version from version string \"%s\"", name.release);
 	return 0;
 }
 
@@ -107,6 +115,8 @@ static hid_device *new_hid_device(void)
 	dev->device_handle = -1;
 	dev->blocking = 1;
 	dev->uses_numbered_reports = 0;
+	dev->path = NULL;
+	dev->capture_id = __atomic_fetch_add(&next_capture_id, 1, __ATOMIC_RELAXED);
 
 	return dev;
 }
@@ -260,7 +270,7 @@ next_line:
 static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t *string, size_t maxlen)
 {
 	struct udev *udev;
-	struct udev_device *udev_dev, *parent, *hid_dev;
+	struct udev_device *udev_dev, *parent = NULL, *hid_dev;
 	struct stat s;
 	int ret = -1;
         char *serial_number_utf8 = NULL;
@@ -269,7 +279,7 @@ static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t
 	/* Create the udev object */
 	udev = udev_new();
 	if (!udev) {
-		printf("Can't create udev\n");
+		hid_log_error(NULL, "Can't create udev");
 		return -1;
 	}
 
@@ -298,7 +308,14 @@ static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t
 			           &serial_number_utf8,
 			           &product_name_utf8);
 
-			if (bus_type == BUS_BLUETOOTH) {
+			/* USB devices without a USB parent are virtual (uhid). */
+			if (bus_type != BUS_BLUETOOTH)
+				parent = udev_device_get_parent_with_subsystem_devtype(
+					   udev_dev,
+					   "usb",
+					   "usb_device");
+
+			if (bus_type == BUS_BLUETOOTH || !parent) {
 				switch (key) {
 					case DEVICE_STRING_MANUFACTURER:
 						wcsncpy(string, L"", maxlen);
@@ -319,29 +336,23 @@ static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t
 				}
 			}
 			else {
-				/* This is a USB device. Find its parent USB Device node. */
-				parent = udev_device_get_parent_with_subsystem_devtype(
-					   udev_dev,
-					   "usb",
-					   "usb_device");
-				if (parent) {
-					const char *str;
-					const char *key_str = NULL;
-
-					if (key >= 0 && key < DEVICE_STRING_COUNT) {
-						key_str = device_string_names[key];
-					} else {
-						ret = -1;
-						goto end;
-					}
+				/* This is a USB device with a parent USB Device node. */
+				const char *str;
+				const char *key_str = NULL;
+
+				if (key >= 0 && key < DEVICE_STRING_COUNT) {
+					key_str = device_string_names[key];
+				} else {
+					ret = -1;
+					goto end;
+				}
 
-					str = udev_device_get_sysattr_value(parent, key_str);
-					if (str) {
-						/* Convert the string from UTF-8 to wchar_t */
-						retm = mbstowcs(string, str, maxlen);
-						ret = (retm == (size_t)-1)? -1: 0;
-						goto end;
-					}
+				str = udev_device_get_sysattr_value(parent, key_str);
+				if (str) {
+					/* Convert the string from UTF-8 to wchar_t */
+					retm = mbstowcs(string, str, maxlen);
+					ret = (retm == (size_t)-1)? -1: 0;
+					goto end;
 				}
 			}
 		}
@@ -380,6 +391,163 @@ int HID_API_EXPORT hid_exit(void)
 }
 
 
+/* Alternate trees for hid_enumerate(), see hid_set_sysfs_root(). */
+static char *sysfs_root;
+static char *devfs_root;
+
+int HID_API_EXPORT hid_set_sysfs_root(const char *sysfs, const char *devfs)
+{
+	char *s = NULL, *d = NULL;
+
+	if (sysfs) {
+		/* Canonical, as the device paths it is compared with. */
+		s = realpath(sysfs, NULL);
+		d = strdup(devfs ? devfs : "/dev");
+		if (!s || !d) {
+			free(s);
+			free(d);
+			return -1;
+		}
+	}
+
+	free(sysfs_root);
+	free(devfs_root);
+	sysfs_root = s;
+	devfs_root = d;
+
+	return 0;
+}
+
+/* Read a sysfs attribute into @buf, without the trailing newline. */
+static const char *read_sysfs_attr(const char *dir, const char *name,
+				   char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	ssize_t n;
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path))
+		return NULL;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	n = read(fd, buf, size - 1);
+	close(fd);
+	if (n < 0)
+		return NULL;
+	while (n && buf[n - 1] == '\n')
+		n--;
+	buf[n] = '\0';
+
+	return buf;
+}
+
+/*
+ * Fill the USB strings of @info from the usb_device above @hid_path, the
+ * way udev_device_get_parent_with_subsystem_devtype() finds it: the first
+ * ancestor with an idVendor attribute.  The interface is the ancestor
+ * below it that has bInterfaceNumber.  Returns -1 if there is none.
+ */
+static int sysfs_usb_strings(char *hid_path, struct hid_device_info *info)
+{
+	size_t stop = strlen(sysfs_root);
+	char buf[256];
+	char *slash;
+
+	while ((slash = strrchr(hid_path, '/')) && (size_t)(slash - hid_path) > stop) {
+		*slash = '\0';
+
+		if (info->interface_number < 0 &&
+		    read_sysfs_attr(hid_path, "bInterfaceNumber", buf, sizeof(buf))) {
+			info->interface_number = strtol(buf, NULL, 16);
+			continue;
+		}
+		if (!read_sysfs_attr(hid_path, "idVendor", buf, sizeof(buf)))
+			continue;
+
+		info->manufacturer_string = utf8_to_wchar_t(
+			read_sysfs_attr(hid_path, "manufacturer", buf, sizeof(buf)));
+		info->product_string = utf8_to_wchar_t(
+			read_sysfs_attr(hid_path, "product", buf, sizeof(buf)));
+		if (read_sysfs_attr(hid_path, "bcdDevice", buf, sizeof(buf)))
+			info->release_number = strtol(buf, NULL, 16);
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * hid_enumerate() against sysfs_root, reading the same attributes udev
+ * would: <sysfs>/class/hidraw/<node>/device is the HID device, whose
+ * uevent carries the ids and strings.  Device paths are <devfs>/<node>.
+ */
+static struct hid_device_info *enumerate_sysfs(unsigned short vendor_id,
+					       unsigned short product_id,
+					       int *count)
+{
+	struct hid_device_info *root = NULL, **tail = &root;
+	char class_dir[PATH_MAX];
+	struct dirent *ent;
+	DIR *dir;
+
+	snprintf(class_dir, sizeof(class_dir), "%s/class/hidraw", sysfs_root);
+	dir = opendir(class_dir);
+	if (!dir)
+		return NULL;
+
+	while ((ent = readdir(dir))) {
+		char link[PATH_MAX], hid_path[PATH_MAX], uevent[4096];
+		char *serial_number_utf8 = NULL;
+		char *product_name_utf8 = NULL;
+		struct hid_device_info *info;
+		unsigned short dev_vid;
+		unsigned short dev_pid;
+		int bus_type;
+
+		if (ent->d_name[0] == '.')
+			continue;
+		if (snprintf(link, sizeof(link), "%s/%s/device", class_dir,
+			     ent->d_name) >= (int)sizeof(link) ||
+		    !realpath(link, hid_path) ||
+		    !read_sysfs_attr(hid_path, "uevent", uevent, sizeof(uevent)))
+			continue;
+
+		if (!parse_uevent_info(uevent, &bus_type, &dev_vid, &dev_pid,
+				       &serial_number_utf8, &product_name_utf8) ||
+		    (bus_type != BUS_USB && bus_type != BUS_BLUETOOTH) ||
+		    (vendor_id && vendor_id != dev_vid) ||
+		    (product_id && product_id != dev_pid))
+			goto next;
+
+		info = calloc(1, sizeof(*info));
+		if (!info)
+			goto next;
+		snprintf(link, sizeof(link), "%s/%s", devfs_root, ent->d_name);
+		info->path = strdup(link);
+		info->vendor_id = dev_vid;
+		info->product_id = dev_pid;
+		info->serial_number = utf8_to_wchar_t(serial_number_utf8);
+		info->interface_number = -1;
+
+		/* Bluetooth, and USB devices without a USB parent (uhid). */
+		if (bus_type != BUS_USB || sysfs_usb_strings(hid_path, info)) {
+			info->manufacturer_string = wcsdup(L"");
+			info->product_string = utf8_to_wchar_t(product_name_utf8);
+		}
+
+		*tail = info;
+		tail = &info->next;
+		(*count)++;
+	next:
+		free(serial_number_utf8);
+		free(product_name_utf8);
+	}
+	closedir(dir);
+
+	return root;
+}
+
 struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
 {
 	struct udev *udev;
@@ -388,14 +556,22 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 
 	struct hid_device_info *root = NULL; /* return object */
 	struct hid_device_info *cur_dev = NULL;
-	struct hid_device_info *prev_dev = NULL; /* previous device */
+	int count = 0;
 
 	hid_init();
 
+	BW_PROBE2(enumerate_start, vendor_id, product_id);
+
+	if (sysfs_root) {
+		root = enumerate_sysfs(vendor_id, product_id, &count);
+		BW_PROBE3(enumerate_end, vendor_id, product_id, count);
+		return root;
+	}
+
 	/* Create the udev object */
 	udev = udev_new();
 	if (!udev) {
-		printf("Can't create udev\n");
+		hid_log_error(NULL, "Can't create udev");
 		return NULL;
 	}
 
@@ -468,8 +644,8 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 			else {
 				root = tmp;
 			}
-			prev_dev = cur_dev;
 			cur_dev = tmp;
+			count++;
 
 			/* Fill out the record */
 			cur_dev->next = NULL;
@@ -502,21 +678,13 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 							"usb_device");
 
 					if (!usb_dev) {
-						/* Free this device */
-						free(cur_dev->serial_number);
-						free(cur_dev->path);
-						free(cur_dev);
-
-						/* Take it off the device list. */
-						if (prev_dev) {
-							prev_dev->next = NULL;
-							cur_dev = prev_dev;
-						}
-						else {
-							cur_dev = root = NULL;
-						}
-
-						goto next;
+						/* A virtual device on the USB bus, such as
+						   one created through /dev/uhid, has no USB
+						   parent: use the uevent strings as for
+						   Bluetooth. */
+						cur_dev->manufacturer_string = wcsdup(L"");
+						cur_dev->product_string = utf8_to_wchar_t(product_name_utf8);
+						break;
 					}
 
 					/* Manufacturer and Product strings */
@@ -565,6 +733,8 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 	udev_enumerate_unref(enumerate);
 	udev_unref(udev);
 
+	BW_PROBE3(enumerate_end, vendor_id, product_id, count);
+
 	return root;
 }
 
@@ -626,6 +796,7 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 	dev = new_hid_device();
 
 	/* OPEN HERE */
+	BW_PROBE1(open_path_start, path);
 	dev->device_handle = open(path, O_RDWR);
 
 	/* If we have a good handle, return it. */
@@ -639,15 +810,17 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 
 		/* Get Report Descriptor Size */
 		res = ioctl(dev->device_handle, HIDIOCGRDESCSIZE, &desc_size);
+		BW_PROBE3(open_path_rdescsize, path, res, desc_size);
 		if (res < 0)
-			perror("HIDIOCGRDESCSIZE");
+			hid_log_warn(path, "HIDIOCGRDESCSIZE: %m");
 
 
 		/* Get Report Descriptor */
 		rpt_desc.size = desc_size;
 		res = ioctl(dev->device_handle, HIDIOCGRDESC, &rpt_desc);
+		BW_PROBE3(open_path_rdesc, path, res, rpt_desc.size);
 		if (res < 0) {
-			perror("HIDIOCGRDESC");
+			hid_log_warn(path, "HIDIOCGRDESC: %m");
 		} else {
 			/* Determine if this device uses numbered reports. */
 			dev->uses_numbered_reports =
@@ -655,6 +828,12 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 				                      rpt_desc.size);
 		}
 
+		dev->path = strdup(path);
+		BW_PROBE2(open_path_end, path, dev->device_handle);
+		if (hid_capture_enabled)
+			hid_capture_record(dev->capture_id, HID_CAPTURE_OPEN,
+					   path, strlen(path));
+
 		return dev;
 	}
 	else {
@@ -664,12 +843,32 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 	}
 }
 
+hid_device * HID_API_EXPORT hid_open_fd(int fd, const char *path)
+{
+	hid_device *dev;
+
+	if (fd < 0)
+		return NULL;
+
+	dev = new_hid_device();
+	dev->device_handle = fd;
+	dev->path = path ? strdup(path) : NULL;
+	if (hid_capture_enabled && path)
+		hid_capture_record(dev->capture_id, HID_CAPTURE_OPEN,
+				   path, strlen(path));
+
+	return dev;
+}
+
 
 int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
 {
 	int bytes_written;
 
 	bytes_written = write(dev->device_handle, data, length);
+	BW_PROBE4(hid_write, dev->path, length ? data[0] : 0, length, bytes_written);
+	if (hid_capture_enabled && bytes_written > 0)
+		hid_capture_record(dev->capture_id, HID_CAPTURE_OUT, data, bytes_written);
 
 	return bytes_written;
 }
@@ -693,6 +892,7 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 		fds.events = POLLIN;
 		fds.revents = 0;
 		ret = poll(&fds, 1, milliseconds);
+		BW_PROBE3(hid_read_poll_wake, dev->path, ret, fds.revents);
 		if (ret == -1 || ret == 0) {
 			/* Error or timeout */
 			return ret;
@@ -718,6 +918,10 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 		bytes_read--;
 	}
 
+	BW_PROBE3(hid_read_done, dev->path, bytes_read > 0 ? data[0] : 0, bytes_read);
+	if (hid_capture_enabled && bytes_read > 0)
+		hid_capture_record(dev->capture_id, HID_CAPTURE_IN, data, bytes_read);
+
 	return bytes_read;
 }
 
@@ -743,7 +947,7 @@ int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char
 
 	res = ioctl(dev->device_handle, HIDIOCSFEATURE(length), data);
 	if (res < 0)
-		perror("ioctl (SFEATURE)");
+		hid_log_error(dev->path, "ioctl (SFEATURE): %m");
 
 	return res;
 }
@@ -754,7 +958,7 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 
 	res = ioctl(dev->device_handle, HIDIOCGFEATURE(length), data);
 	if (res < 0)
-		perror("ioctl (GFEATURE)");
+		hid_log_error(dev->path, "ioctl (GFEATURE): %m");
 
 
 	return res;
@@ -766,6 +970,7 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	if (!dev)
 		return;
 	close(dev->device_handle);
+	free(dev->path);
 	free(dev);
 }
 
@@ -791,6 +996,17 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 }
 
 
+const char * HID_API_EXPORT_CALL hid_get_path(hid_device *dev)
+{
+	return dev->path;
+}
+
+int HID_API_EXPORT_CALL hid_get_fd(hid_device *dev)
+{
+	return dev->device_handle;
+}
+
+
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
 	return NULL;
@@ -0,0 +1,137 @@
+/*
+ * Binary capture of HID traffic, see hid_capture.h for the file format.
+ *
+ * Records go through a large stdio buffer so the cost on the I/O path is a
+ * clock_gettime() and an 80 byte memcpy.  stdio locks the stream internally,
+ * which keeps records intact when several threads drive devices.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "hid_capture.h"
+
+#define CAPTURE_BUFFER_SIZE	(1 << 20)
+
+int hid_capture_enabled;
+
+static FILE *capture_file;
+static char *capture_buffer;
+static uint64_t capture_epoch;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int hid_capture_start(const char *filename)
+{
+	if (capture_file)
+		hid_capture_stop();
+
+	capture_file = fopen(filename, "wb");
+	if (!capture_file)
+		return -1;
+
+	capture_buffer = malloc(CAPTURE_BUFFER_SIZE);
+	if (capture_buffer)
+		setvbuf(capture_file, capture_buffer, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+	if (fwrite(HID_CAPTURE_MAGIC, 8, 1, capture_file) != 1) {
+		fclose(capture_file);
+		capture_file = NULL;
+		free(capture_buffer);
+		capture_buffer = NULL;
+		return -1;
+	}
+
+	capture_epoch = now_ns();
+	hid_capture_enabled = 1;
+
+	return 0;
+}
+
+void hid_capture_stop(void)
+{
+	if (!capture_file)
+		return;
+
+	hid_capture_enabled = 0;
+	fclose(capture_file);
+	capture_file = NULL;
+	free(capture_buffer);
+	capture_buffer = NULL;
+}
+
+void hid_capture_record(unsigned dev_id, enum hid_capture_dir dir,
+			const void *data, size_t len)
+{
+	struct hid_capture_record rec;
+
+	if (!hid_capture_enabled)
+		return;
+
+	if (len > HID_CAPTURE_PAYLOAD)
+		len = HID_CAPTURE_PAYLOAD;
+
+	rec.ts_ns = now_ns() - capture_epoch;
+	rec.dev_id = dev_id;
+	rec.dir = dir;
+	rec.len = len;
+	rec.reserved = 0;
+	memcpy(rec.payload, data, len);
+	memset(rec.payload + len, 0, HID_CAPTURE_PAYLOAD - len);
+
+	fwrite(&rec, sizeof(rec), 1, capture_file);
+}
+
+int hid_capture_load(const char *filename, struct hid_capture_record **records,
+		     size_t *count)
+{
+	char magic[8];
+	struct hid_capture_record *recs = NULL;
+	size_t n = 0, alloc = 0;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (!f)
+		return -1;
+
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	    memcmp(magic, HID_CAPTURE_MAGIC, sizeof(magic))) {
+		fclose(f);
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (;;) {
+		if (n == alloc) {
+			struct hid_capture_record *tmp;
+
+			alloc = alloc ? alloc * 2 : 256;
+			tmp = realloc(recs, alloc * sizeof(*recs));
+			if (!tmp) {
+				free(recs);
+				fclose(f);
+				errno = ENOMEM;
+				return -1;
+			}
+			recs = tmp;
+		}
+		if (fread(&recs[n], sizeof(*recs), 1, f) != 1)
+			break;
+		n++;
+	}
+
+	fclose(f);
+	*records = recs;
+	*count = n;
+
+	return 0;
+}
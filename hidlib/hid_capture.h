@@ -0,0 +1,63 @@
+/*
+ * Binary capture of HID traffic.
+ *
+ * A capture file starts with an 8 byte magic followed by fixed size
+ * records, one per report crossing the device layer.  Timestamps are
+ * CLOCK_MONOTONIC nanoseconds relative to the start of the capture.  Every
+ * device handle gets a small id when it is opened; a HID_CAPTURE_OPEN record
+ * carrying the device path precedes its first report.
+ */
+
+#ifndef HID_CAPTURE_H__
+#define HID_CAPTURE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HID_CAPTURE_MAGIC	"BWCAP001"
+#define HID_CAPTURE_PAYLOAD	64
+
+enum hid_capture_dir {
+	HID_CAPTURE_OPEN = 0,	/* payload holds the device path */
+	HID_CAPTURE_OUT = 1,	/* host to device, hid_write() */
+	HID_CAPTURE_IN = 2,	/* device to host, hid_read_timeout() */
+};
+
+struct hid_capture_record {
+	uint64_t ts_ns;
+	uint16_t dev_id;
+	uint8_t dir;
+	uint8_t len;
+	uint32_t reserved;
+	uint8_t payload[HID_CAPTURE_PAYLOAD];
+};
+
+/* Start recording every report to @filename.  Returns 0 on success. */
+int hid_capture_start(const char *filename);
+
+/* Flush and close the active capture, if any. */
+void hid_capture_stop(void);
+
+/* Called by the device layer; a no-op unless a capture is active. */
+void hid_capture_record(unsigned dev_id, enum hid_capture_dir dir,
+			const void *data, size_t len);
+
+/* Non-zero while a capture is being recorded. */
+extern int hid_capture_enabled;
+
+/*
+ * Load a capture file into memory.  On success *records must be released
+ * with free().  Returns 0 on success, -1 on error with errno set.
+ */
+int hid_capture_load(const char *filename, struct hid_capture_record **records,
+		     size_t *count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
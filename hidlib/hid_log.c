@@ -0,0 +1,322 @@
+/*
+ * Diagnostics ring, see hid_log.h.
+ *
+ * The ring is a bounded multi-producer queue: each slot carries a sequence
+ * number telling producers when it is free for position pos (seq == pos)
+ * and the consumer when it holds the message for pos (seq == pos + 1).  A
+ * producer claims a position with one compare-and-swap on head, fills the
+ * slot and publishes it with a release store, so no producer ever waits for
+ * another or for the writer.  Consuming is serialized by a mutex the
+ * producers never touch, shared by the writer thread and hid_log_flush().
+ *
+ * The writer sleeps on an eventfd; like the device workers it announces
+ * that it is about to sleep, and only a producer that sees the announcement
+ * pays for the eventfd_write().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "hid_log.h"
+
+#define HID_LOG_MASK		(HID_LOG_SLOTS - 1)
+#define WRITE_BUFFER_SIZE	8192
+#define LINE_MAX_LEN		(HID_LOG_CONTEXT + HID_LOG_TEXT * 3 + 4)
+
+struct log_slot {
+	_Alignas(64) atomic_uint seq;
+	uint16_t len;		/* text length */
+	uint16_t hex;		/* raw bytes after the text */
+	char ctx[HID_LOG_CONTEXT];
+	char text[HID_LOG_TEXT];
+};
+
+int hid_log_level = HID_LOG_INFO;
+
+static struct log_slot ring[HID_LOG_SLOTS];
+static _Alignas(64) atomic_uint head;	/* producers */
+static unsigned tail;	/* consumer, under consume_lock */
+static atomic_ulong dropped;
+static unsigned long dropped_reported;
+
+static pthread_mutex_t consume_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+static atomic_bool sleeping;
+static int wake_fd = -1;
+static int have_writer;
+
+static void write_all(const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(STDERR_FILENO, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+static size_t format_slot(const struct log_slot *s, char *out)
+{
+	static const char digits[] = "0123456789abcdef";
+	const unsigned char *hex = (const unsigned char *)s->text + s->len;
+	size_t n = 0;
+	unsigned i;
+
+	if (s->ctx[0]) {
+		n = strlen(s->ctx);
+		memcpy(out, s->ctx, n);
+		out[n++] = ':';
+		out[n++] = ' ';
+	}
+	memcpy(out + n, s->text, s->len);
+	n += s->len;
+	for (i = 0; i < s->hex; i++) {
+		out[n++] = ' ';
+		out[n++] = digits[hex[i] >> 4];
+		out[n++] = digits[hex[i] & 0xf];
+	}
+	out[n++] = '\n';
+
+	return n;
+}
+
+/* Write out every published slot.  Called with consume_lock held. */
+static void drain(void)
+{
+	char buf[WRITE_BUFFER_SIZE];
+	unsigned long lost;
+	size_t len = 0;
+
+	for (;;) {
+		struct log_slot *s = &ring[tail & HID_LOG_MASK];
+
+		if (atomic_load_explicit(&s->seq, memory_order_acquire) != tail + 1)
+			break;
+		if (len + LINE_MAX_LEN > sizeof(buf)) {
+			write_all(buf, len);
+			len = 0;
+		}
+		len += format_slot(s, buf + len);
+		atomic_store_explicit(&s->seq, tail + HID_LOG_SLOTS,
+				      memory_order_release);
+		tail++;
+	}
+
+	lost = atomic_load_explicit(&dropped, memory_order_relaxed);
+	if (lost != dropped_reported) {
+		if (len + 64 > sizeof(buf)) {
+			write_all(buf, len);
+			len = 0;
+		}
+		len += snprintf(buf + len, sizeof(buf) - len,
+				"log: %lu message(s) dropped\n",
+				lost - dropped_reported);
+		dropped_reported = lost;
+	}
+
+	if (len)
+		write_all(buf, len);
+}
+
+/*
+ * Nothing published at tail.  A message claimed but not yet published is
+ * left to its producer, which will see the writer asleep and wake it.
+ */
+static bool ring_empty(void)
+{
+	bool empty;
+
+	pthread_mutex_lock(&consume_lock);
+	empty = atomic_load_explicit(&ring[tail & HID_LOG_MASK].seq,
+				     memory_order_acquire) != tail + 1;
+	pthread_mutex_unlock(&consume_lock);
+
+	return empty;
+}
+
+static void *writer_thread(void *arg)
+{
+	eventfd_t val;
+
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&consume_lock);
+		drain();
+		pthread_mutex_unlock(&consume_lock);
+
+		/* Pairs with the fence in hid_log_publish(). */
+		atomic_store(&sleeping, true);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (ring_empty())
+			eventfd_read(wake_fd, &val);
+		atomic_store(&sleeping, false);
+	}
+
+	return NULL;
+}
+
+static void log_start(void)
+{
+	sigset_t all, old;
+	pthread_attr_t attr;
+	pthread_t thread;
+	unsigned i;
+
+	for (i = 0; i < HID_LOG_SLOTS; i++)
+		atomic_init(&ring[i].seq, i);
+
+	atexit(hid_log_flush);
+
+	wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (wake_fd < 0)
+		return;
+
+	/* The writer must not take signals meant for the rest of the process. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	have_writer = !pthread_create(&thread, &attr, writer_thread, NULL);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Claim the next free slot, or count a drop and return NULL. */
+static struct log_slot *hid_log_claim(unsigned *pos)
+{
+	struct log_slot *s;
+	unsigned p, seq;
+
+	pthread_once(&start_once, log_start);
+
+	p = atomic_load_explicit(&head, memory_order_relaxed);
+	for (;;) {
+		s = &ring[p & HID_LOG_MASK];
+		seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		if (seq == p) {
+			if (atomic_compare_exchange_weak_explicit(&head, &p, p + 1,
+								  memory_order_relaxed,
+								  memory_order_relaxed))
+				break;
+		} else if ((int)(seq - p) < 0) {
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			return NULL;
+		} else {
+			p = atomic_load_explicit(&head, memory_order_relaxed);
+		}
+	}
+
+	*pos = p;
+	return s;
+}
+
+static void hid_log_publish(struct log_slot *s, unsigned pos)
+{
+	atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+
+	if (!have_writer) {
+		hid_log_flush();
+		return;
+	}
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&sleeping, memory_order_relaxed) &&
+	    atomic_exchange(&sleeping, false))
+		eventfd_write(wake_fd, 1);
+}
+
+static void set_context(struct log_slot *s, const char *ctx)
+{
+	size_t n = 0;
+
+	if (ctx) {
+		n = strnlen(ctx, sizeof(s->ctx) - 1);
+		memcpy(s->ctx, ctx, n);
+	}
+	s->ctx[n] = '\0';
+}
+
+void hid_log_write(int level, const char *ctx, const char *fmt, ...)
+{
+	struct log_slot *s;
+	unsigned pos;
+	va_list ap;
+	int n, err = errno;
+
+	if (level > hid_log_level)
+		return;
+
+	s = hid_log_claim(&pos);
+	if (!s)
+		return;
+
+	set_context(s, ctx);
+	errno = err;	/* for %m, starting the writer may have changed it */
+	va_start(ap, fmt);
+	n = vsnprintf(s->text, sizeof(s->text), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		n = 0;
+	if (n >= (int)sizeof(s->text))
+		n = sizeof(s->text) - 1;
+	/* Messages are lines; the writer adds the newline. */
+	while (n && s->text[n - 1] == '\n')
+		n--;
+	s->len = n;
+	s->hex = 0;
+
+	hid_log_publish(s, pos);
+}
+
+void hid_log_hex(int level, const char *ctx, const char *what,
+		 const void *data, size_t len)
+{
+	struct log_slot *s;
+	unsigned pos;
+	size_t n;
+
+	if (level > hid_log_level)
+		return;
+
+	s = hid_log_claim(&pos);
+	if (!s)
+		return;
+
+	set_context(s, ctx);
+	n = strnlen(what, sizeof(s->text) / 4);
+	memcpy(s->text, what, n);
+	if (len > sizeof(s->text) - n)
+		len = sizeof(s->text) - n;
+	memcpy(s->text + n, data, len);
+	s->len = n;
+	s->hex = len;
+
+	hid_log_publish(s, pos);
+}
+
+void hid_log_flush(void)
+{
+	pthread_mutex_lock(&consume_lock);
+	drain();
+	pthread_mutex_unlock(&consume_lock);
+}
+
+unsigned long hid_log_dropped(void)
+{
+	return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
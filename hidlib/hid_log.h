@@ -0,0 +1,68 @@
+/*
+ * Diagnostics that stay off the I/O path.
+ *
+ * A message is formatted into a slot of a fixed size, lock-free ring in
+ * memory and written to stderr later by a background thread, so logging
+ * never waits on a slow terminal or pipe.  Messages filtered out by
+ * hid_log_level cost a compare at the call site; hex dumps copy the raw
+ * bytes and leave the formatting to the writer.  When the ring is full
+ * messages are dropped and counted rather than waited for.
+ *
+ * Every message carries an optional context, usually the device path,
+ * printed in front of it as "<context>: <message>".  Whatever was logged
+ * before exit() is written out by an atexit() handler.
+ */
+
+#ifndef HID_LOG_H__
+#define HID_LOG_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum hid_log_level {
+	HID_LOG_ERROR = 0,
+	HID_LOG_WARN = 1,
+	HID_LOG_INFO = 2,
+	HID_LOG_DEBUG = 3,	/* traffic dumps and retries */
+};
+
+#define HID_LOG_SLOTS		1024	/* ring capacity, a power of two */
+#define HID_LOG_CONTEXT		48	/* longer contexts are truncated */
+#define HID_LOG_TEXT		192	/* message plus hex dump bytes */
+
+/* Messages above this level are dropped.  Default HID_LOG_INFO. */
+extern int hid_log_level;
+
+#define hid_log(level, ctx, ...)					\
+	do {								\
+		if ((level) <= hid_log_level)				\
+			hid_log_write(level, ctx, __VA_ARGS__);		\
+	} while (0)
+
+#define hid_log_error(ctx, ...)	hid_log(HID_LOG_ERROR, ctx, __VA_ARGS__)
+#define hid_log_warn(ctx, ...)	hid_log(HID_LOG_WARN, ctx, __VA_ARGS__)
+#define hid_log_info(ctx, ...)	hid_log(HID_LOG_INFO, ctx, __VA_ARGS__)
+#define hid_log_debug(ctx, ...)	hid_log(HID_LOG_DEBUG, ctx, __VA_ARGS__)
+
+/* Queue a message; @ctx may be NULL.  Use the macros above instead. */
+void hid_log_write(int level, const char *ctx, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/* Queue "<ctx>: <what> xx xx xx ..." for the @len bytes at @data. */
+void hid_log_hex(int level, const char *ctx, const char *what,
+		 const void *data, size_t len);
+
+/* Write out everything queued so far before returning. */
+void hid_log_flush(void);
+
+/* Messages lost to a full ring since startup. */
+unsigned long hid_log_dropped(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,37 @@
+/*
+ * Static tracepoints (USDT) for the bellwin HID path.
+ *
+ * When <sys/sdt.h> (systemtap-sdt-dev) is available each probe compiles to a
+ * single nop plus an ELF note, so the cost with tracing off is negligible.
+ * Without the header, or when built with -DBELLWIN_NO_SDT, the probes vanish
+ * entirely.  All probes live under the "bellwin" provider, eg:
+ *
+ *   bpftrace -e 'usdt:./bellwin:bellwin:hid_write { printf("%s\n", str(arg0)); }'
+ *
+ * Probe arguments must be side-effect free: they are not evaluated when the
+ * probes are compiled out.
+ */
+
+#ifndef HID_TRACE_H__
+#define HID_TRACE_H__
+
+#if !defined(BELLWIN_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BELLWIN_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef BELLWIN_HAVE_SDT
+#define BW_PROBE1(name, a)		DTRACE_PROBE1(bellwin, name, a)
+#define BW_PROBE2(name, a, b)		DTRACE_PROBE2(bellwin, name, a, b)
+#define BW_PROBE3(name, a, b, c)	DTRACE_PROBE3(bellwin, name, a, b, c)
+#define BW_PROBE4(name, a, b, c, d)	DTRACE_PROBE4(bellwin, name, a, b, c, d)
+#else
+#define BW_PROBE1(name, a)		do { } while (0)
+#define BW_PROBE2(name, a, b)		do { } while (0)
+#define BW_PROBE3(name, a, b, c)	do { } while (0)
+#define BW_PROBE4(name, a, b, c, d)	do { } while (0)
+#endif
+
+#endif
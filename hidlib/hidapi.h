@@ -174,6 +174,24 @@ extern "C" {
 		*/
 		HID_API_EXPORT hid_device * HID_API_CALL hid_open_path(const char *path);
 
+		/** @brief Wrap an already open descriptor as a HID device.
+
+			Linux-only extension used for simulated devices: @p fd must
+			preserve report boundaries (a hidraw node or a
+			SOCK_SEQPACKET socket).  No report descriptor is queried,
+			so the device is assumed to use unnumbered reports.
+			hid_close() closes @p fd.
+
+			@ingroup API
+			@param fd The descriptor to wrap.
+			@param path A name for diagnostics, may be NULL.
+
+			@returns
+				This function returns a pointer to a #hid_device object on
+				success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_device * HID_API_CALL hid_open_fd(int fd, const char *path);
+
 		/** @brief Write an Output report to a HID device.
 
 			The first byte of @p data[] must contain the Report ID. For
@@ -383,6 +401,53 @@ extern "C" {
 		*/
 		HID_API_EXPORT const wchar_t* HID_API_CALL hid_error(hid_device *device);
 
+		/** @brief Get the path a device was opened with.
+
+			Linux-only extension, mainly for diagnostics and tracing.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+
+			@returns
+				This function returns the path passed to hid_open_path()
+				or NULL if it is unknown.
+		*/
+		const char * HID_API_EXPORT_CALL hid_get_path(hid_device *device);
+
+		/** @brief Get the file descriptor backing a device.
+
+			Linux-only extension so callers can wait for input reports
+			with poll() or epoll alongside other descriptors.  The
+			descriptor stays owned by the device.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+
+			@returns
+				This function returns the descriptor of the device.
+		*/
+		int HID_API_EXPORT_CALL hid_get_fd(hid_device *device);
+
+		/** @brief Enumerate from an alternate sysfs tree.
+
+			Linux-only extension for testing and benchmarking
+			enumeration without the real devices.  While set,
+			hid_enumerate() and hid_open() read
+			@p sysfs/class/hidraw directly instead of asking udev,
+			and report device paths under @p devfs.  The tree must be
+			laid out like sysfs; see tools/hidraw_tree.c.  The
+			string getters still query udev.
+
+			@ingroup API
+			@param sysfs The sysfs root, or NULL to go back to udev.
+			@param devfs The directory holding the hidraw nodes, or
+				NULL for /dev.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_set_sysfs_root(const char *sysfs, const char *devfs);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,51 @@
+#include "hist.h"
+
+static unsigned hist_index(uint64_t v)
+{
+	unsigned e;
+
+	if (v < (1u << HIST_SUB_BITS))
+		return v;
+
+	e = 63 - __builtin_clzll(v) - HIST_SUB_BITS + 1;
+	return (e << HIST_SUB_BITS) + ((v >> (e - 1)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+static uint64_t hist_value(unsigned idx)
+{
+	unsigned e = idx >> HIST_SUB_BITS;
+	unsigned m = idx & ((1u << HIST_SUB_BITS) - 1);
+
+	if (!e)
+		return idx;
+
+	return (uint64_t)((1u << HIST_SUB_BITS) + m) << (e - 1);
+}
+
+void hist_add(struct hist *h, uint64_t value)
+{
+	h->buckets[hist_index(value)]++;
+	h->count++;
+	if (value > h->max)
+		h->max = value;
+}
+
+uint64_t hist_percentile(const struct hist *h, double p)
+{
+	uint64_t rank, seen = 0;
+	unsigned i;
+
+	if (!h->count)
+		return 0;
+	if (p >= 1.0)
+		return h->max;
+
+	rank = (uint64_t)(p * h->count);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank)
+			return hist_value(i) < h->max ? hist_value(i) : h->max;
+	}
+
+	return h->max;
+}
@@ -0,0 +1,26 @@
+/*
+ * Log-linear latency histogram: exact below 8, then 8 sub-buckets per power
+ * of two, so any recorded value is reported within 12.5%.  Fixed size, no
+ * allocation, cheap enough to update on every request.
+ */
+
+#ifndef HIST_H__
+#define HIST_H__
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS	3
+#define HIST_BUCKETS	(64 << HIST_SUB_BITS)
+
+struct hist {
+	uint64_t count;
+	uint64_t max;
+	uint32_t buckets[HIST_BUCKETS];
+};
+
+void hist_add(struct hist *h, uint64_t value);
+
+/* Value at or below which a fraction @p of the samples lie, 0 if empty. */
+uint64_t hist_percentile(const struct hist *h, double p);
+
+#endif
@@ -0,0 +1,579 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+
+#include "http.h"
+
+#define JSON_MAX_KEYS	16
+#define JSON_MAX_DEPTH	4
+
+/* Request parsing */
+
+static char *find_crlf2(char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 3 < len; i++)
+		if (buf[i] == '\r' && buf[i + 1] == '\n' &&
+		    buf[i + 2] == '\r' && buf[i + 3] == '\n')
+			return buf + i;
+	return NULL;
+}
+
+static int header_has(const char *value, const char *token)
+{
+	size_t n = strlen(token);
+
+	while (*value) {
+		value += strspn(value, " \t,");
+		if (!strncasecmp(value, token, n) &&
+		    (!value[n] || strchr(" \t,", value[n])))
+			return 1;
+		value += strcspn(value, ",");
+	}
+	return 0;
+}
+
+long http_parse(char *buf, size_t len, struct http_request *req)
+{
+	char *end = find_crlf2(buf, len);
+	char *line, *next, *version;
+	unsigned long content_length = 0;
+	size_t head;
+
+	if (!end)
+		return 0;
+	head = end - buf + 4;
+
+	/* Find the body length before touching the buffer. */
+	for (line = memchr(buf, '\n', head) + 1; line < end;
+	     line = memchr(line, '\n', end - line + 2) + 1) {
+		if (!strncasecmp(line, "Content-Length:", 15)) {
+			char *stop;
+
+			content_length = strtoul(line + 15, &stop, 10);
+			if (*stop != '\r' && *stop != ' ')
+				return -1;
+		} else if (!strncasecmp(line, "Transfer-Encoding:", 18)) {
+			return -1;
+		}
+	}
+	if (len - head < content_length)
+		return 0;
+
+	memset(req, 0, sizeof(*req));
+	for (line = buf; line < end + 2; line = next) {
+		next = (char *)memchr(line, '\r', end + 1 - line) + 2;
+		next[-2] = '\0';
+	}
+
+	req->method = buf;
+	req->target = strchr(buf, ' ');
+	if (!req->target)
+		return -1;
+	*req->target++ = '\0';
+	version = strchr(req->target, ' ');
+	if (!version)
+		return -1;
+	*version++ = '\0';
+	if (strncmp(version, "HTTP/1.", 7) || !version[7] || version[8])
+		return -1;
+	req->keep_alive = version[7] != '0';
+
+	for (line = version + strlen(version) + 2; line < end + 2;
+	     line += strlen(line) + 2) {
+		if (!strncasecmp(line, "Connection:", 11)) {
+			if (header_has(line + 11, "close"))
+				req->keep_alive = 0;
+			else if (header_has(line + 11, "keep-alive"))
+				req->keep_alive = 1;
+		}
+	}
+
+	req->body = buf + head;
+	req->body_len = content_length;
+
+	return head + content_length;
+}
+
+/* JSON bodies, flattened to "outlets.1" style keys */
+
+struct json_kv {
+	char key[32];
+	char val[32];
+};
+
+struct json {
+	const char *p, *end;
+	struct json_kv kv[JSON_MAX_KEYS];
+	unsigned n;
+};
+
+static void json_ws(struct json *j)
+{
+	while (j->p < j->end && strchr(" \t\r\n", *j->p))
+		j->p++;
+}
+
+static int json_string(struct json *j, char *out, size_t size)
+{
+	size_t n = 0;
+
+	if (j->p == j->end || *j->p++ != '"')
+		return -1;
+	while (j->p < j->end && *j->p != '"') {
+		char c = *j->p++;
+
+		if (c == '\\') {
+			if (j->p == j->end)
+				return -1;
+			c = *j->p++;
+			if (c == 'n')
+				c = '\n';
+			else if (c == 't')
+				c = '\t';
+			else if (c != '"' && c != '\\' && c != '/')
+				return -1;
+		}
+		if (n + 1 >= size)
+			return -1;
+		out[n++] = c;
+	}
+	if (j->p == j->end)
+		return -1;
+	j->p++;
+	out[n] = '\0';
+
+	return 0;
+}
+
+static int json_add(struct json *j, const char *key, const char *val,
+		    size_t len)
+{
+	struct json_kv *kv = &j->kv[j->n];
+
+	if (j->n == JSON_MAX_KEYS || len >= sizeof(kv->val))
+		return -1;
+	snprintf(kv->key, sizeof(kv->key), "%s", key);
+	memcpy(kv->val, val, len);
+	kv->val[len] = '\0';
+	j->n++;
+
+	return 0;
+}
+
+static int json_value(struct json *j, const char *key, unsigned depth)
+{
+	char sub[sizeof(j->kv[0].key)];
+	char str[sizeof(j->kv[0].val)];
+	const char *start;
+
+	json_ws(j);
+	if (j->p == j->end || depth > JSON_MAX_DEPTH)
+		return -1;
+
+	switch (*j->p) {
+	case '{':
+	case '[': {
+		char close = *j->p == '{' ? '}' : ']';
+		unsigned idx = 0;
+
+		j->p++;
+		json_ws(j);
+		if (j->p < j->end && *j->p == close) {
+			j->p++;
+			return 0;
+		}
+		for (;;) {
+			if (close == '}') {
+				if (json_string(j, str, sizeof(str)))
+					return -1;
+				json_ws(j);
+				if (j->p == j->end || *j->p++ != ':')
+					return -1;
+			} else {
+				snprintf(str, sizeof(str), "%u", idx++);
+			}
+			if (snprintf(sub, sizeof(sub), "%s%s%s", key,
+				     *key ? "." : "", str) >= (int)sizeof(sub))
+				return -1;
+			if (json_value(j, sub, depth + 1))
+				return -1;
+			json_ws(j);
+			if (j->p == j->end)
+				return -1;
+			if (*j->p == close) {
+				j->p++;
+				return 0;
+			}
+			if (*j->p++ != ',')
+				return -1;
+			json_ws(j);
+		}
+	}
+	case '"':
+		if (json_string(j, str, sizeof(str)))
+			return -1;
+		return json_add(j, key, str, strlen(str));
+	case 't':
+		if (j->end - j->p < 4 || strncmp(j->p, "true", 4))
+			return -1;
+		j->p += 4;
+		return json_add(j, key, "1", 1);
+	case 'f':
+		if (j->end - j->p < 5 || strncmp(j->p, "false", 5))
+			return -1;
+		j->p += 5;
+		return json_add(j, key, "0", 1);
+	case 'n':
+		if (j->end - j->p < 4 || strncmp(j->p, "null", 4))
+			return -1;
+		j->p += 4;
+		return 0;
+	}
+
+	start = j->p;
+	while (j->p < j->end && strchr("-+.eE0123456789", *j->p))
+		j->p++;
+	if (j->p == start)
+		return -1;
+
+	return json_add(j, key, start, j->p - start);
+}
+
+static int json_parse(struct json *j, const char *body, size_t len)
+{
+	j->p = body;
+	j->end = body + len;
+	j->n = 0;
+
+	json_ws(j);
+	if (j->p == j->end)
+		return 0;
+	if (*j->p != '{' || json_value(j, "", 0))
+		return -1;
+	json_ws(j);
+
+	return j->p == j->end ? 0 : -1;
+}
+
+static const char *json_get(const struct json *j, const char *key)
+{
+	unsigned i;
+
+	for (i = 0; i < j->n; i++)
+		if (!strcmp(j->kv[i].key, key))
+			return j->kv[i].val;
+	return NULL;
+}
+
+/* Routing */
+
+/* Decode %XX escapes; the result must be a single protocol token. */
+static int url_token(const char *in, size_t len, char *out, size_t size)
+{
+	size_t n = 0, i;
+
+	for (i = 0; i < len; i++) {
+		char c = in[i];
+
+		if (c == '%') {
+			char hex[3], *end;
+
+			if (i + 2 >= len)
+				return -1;
+			hex[0] = in[i + 1];
+			hex[1] = in[i + 2];
+			hex[2] = '\0';
+			c = strtol(hex, &end, 16);
+			if (*end)
+				return -1;
+			i += 2;
+		}
+		if (!c || strchr(" \t\r\n", c) || n + 1 >= size)
+			return -1;
+		out[n++] = c;
+	}
+	out[n] = '\0';
+
+	return n ? 0 : -1;
+}
+
+static int is_token(const char *s)
+{
+	return *s && !strpbrk(s, " \t\r\n");
+}
+
+#define route_err(...)	(snprintf(line, size, __VA_ARGS__), -1)
+
+int http_route(const struct http_request *req, char *line, size_t size)
+{
+	const char *path = req->target, *rest, *action;
+	int get = !strcmp(req->method, "GET");
+	int post = !strcmp(req->method, "POST");
+	size_t path_len = strcspn(path, "?");
+	char dev[128];
+	struct json j;
+	size_t len, alen;
+	unsigned i;
+
+	if (path_len == 8 && !strncmp(path, "/devices", 8)) {
+		if (!get)
+			return route_err("err method not allowed");
+		return snprintf(line, size, "list"), 0;
+	}
+	if (path_len == 6 && !strncmp(path, "/fleet", 6)) {
+		if (!get)
+			return route_err("err method not allowed");
+		return snprintf(line, size, "fleet"), 0;
+	}
+	if (path_len == 5 && !strncmp(path, "/pool", 5)) {
+		if (!get)
+			return route_err("err method not allowed");
+		return snprintf(line, size, "pool"), 0;
+	}
+	if (path_len == 8 && !strncmp(path, "/journal", 8)) {
+		if (!get)
+			return route_err("err method not allowed");
+		return snprintf(line, size, "journal"), 0;
+	}
+	if (strncmp(path, "/devices/", 9))
+		return route_err("err not found");
+
+	rest = path + 9;
+	len = strcspn(rest, "/?");
+	if (url_token(rest, len, dev, sizeof(dev)))
+		return route_err("err not found");
+	action = rest[len] == '/' ? rest + len + 1 : "";
+	alen = strcspn(action, "?");
+
+#define IS(name)	(alen == strlen(name) && !strncmp(action, name, alen))
+	if (!alen || IS("status") || IS("stats") || IS("health")) {
+		if (!get)
+			return route_err("err method not allowed");
+		if (!alen)
+			snprintf(line, size, "status %s", dev);
+		else
+			snprintf(line, size, "%.*s %s", (int)alen, action, dev);
+		return 0;
+	}
+	if (!IS("set") && !IS("mask") && !IS("cycle") && !IS("off"))
+		return route_err("err not found");
+	if (!post)
+		return route_err("err method not allowed");
+	if (json_parse(&j, req->body, req->body_len))
+		return route_err("err invalid json");
+
+	if (IS("mask")) {
+		const char *mask = json_get(&j, "mask");
+		const char *care = json_get(&j, "care");
+
+		if (!mask || !is_token(mask) || (care && !is_token(care)))
+			return route_err("err usage: {\"mask\": <mask>, \"care\": <care>}");
+		snprintf(line, size, "mask %s %s %s", dev, mask, care ? care : "");
+		return 0;
+	}
+	if (IS("cycle")) {
+		const char *outlet = json_get(&j, "outlet");
+		const char *ms = json_get(&j, "ms");
+
+		if (!outlet || !is_token(outlet) || (ms && !is_token(ms)))
+			return route_err("err usage: {\"outlet\": <outlet>, \"ms\": <ms>}");
+		snprintf(line, size, "cycle %s %s %s", dev, outlet, ms ? ms : "");
+		return 0;
+	}
+
+	/* set and off: every "outlets.<n>" key */
+	len = snprintf(line, size, "%s %s", IS("set") ? "set" : "off", dev);
+	for (i = 0; i < j.n && len < size; i++) {
+		const char *key = j.kv[i].key, *val = j.kv[i].val;
+
+		if (strncmp(key, "outlets.", 8) || !is_token(key + 8) ||
+		    !is_token(val))
+			return route_err("err unexpected key %s", key);
+		if (IS("set"))
+			len += snprintf(line + len, size - len, " %s=%s", key + 8, val);
+		else
+			len += snprintf(line + len, size - len, " %s", val);
+	}
+	if (IS("set") && !strchr(line, '='))
+		return route_err("err usage: {\"outlets\": {\"<outlet>\": <0|1>}}");
+#undef IS
+
+	return len < size ? 0 : route_err("err request too large");
+}
+
+/* Responses */
+
+static const struct {
+	const char *reason;
+	int status;
+} err_status[] = {
+	{ "not found", 404 },
+	{ "no such device", 404 },
+	{ "method not allowed", 405 },
+	{ "request too large", 413 },
+	{ "write failed", 502 },
+	{ "busy", 503 },
+	{ "quarantined", 503 },
+	{ "device gone", 503 },
+	{ "timeout", 504 },
+};
+
+static const char *status_text(int status)
+{
+	switch (status) {
+	case 200: return "OK";
+	case 400: return "Bad Request";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 413: return "Payload Too Large";
+	case 502: return "Bad Gateway";
+	case 503: return "Service Unavailable";
+	case 504: return "Gateway Timeout";
+	}
+	return "Error";
+}
+
+struct sbuf {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static void sb_printf(struct sbuf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(b->buf + b->len, b->len < b->size ? b->size - b->len : 0,
+		      fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		b->len += n;
+}
+
+static void sb_string(struct sbuf *b, const char *s, size_t n)
+{
+	size_t i;
+
+	sb_printf(b, "\"");
+	for (i = 0; i < n; i++) {
+		unsigned char c = s[i];
+
+		if (c == '"' || c == '\\')
+			sb_printf(b, "\\%c", c);
+		else if (c < 0x20)
+			sb_printf(b, "\\u%04x", c);
+		else
+			sb_printf(b, "%c", c);
+	}
+	sb_printf(b, "\"");
+}
+
+/* "ok a=1 b=x c" -> {"ok":true,"a":1,"b":"x","items":["c"]} */
+static void reply_json(struct sbuf *b, const char *reply)
+{
+	const char *p = reply + 2;
+	int items = 0;
+
+	sb_printf(b, "{\"ok\":true");
+	while (*(p += strspn(p, " "))) {
+		size_t n = strcspn(p, " ");
+		const char *eq = memchr(p, '=', n);
+
+		if (eq) {
+			size_t vn = n - (eq - p) - 1;
+			char num[32], *end;
+			double v = 0;
+
+			sb_printf(b, ",");
+			sb_string(b, p, eq - p);
+			sb_printf(b, ":");
+			snprintf(num, sizeof(num), "%.*s", (int)vn, eq + 1);
+			if (vn && vn < sizeof(num))
+				v = strtod(num, &end);
+			if (vn && vn < sizeof(num) && !*end)
+				sb_printf(b, "%.17g", v);
+			else
+				sb_string(b, eq + 1, vn);
+		} else if (!items++) {
+			sb_printf(b, ",\"items\":[");
+			sb_string(b, p, n);
+		} else {
+			sb_printf(b, ",");
+			sb_string(b, p, n);
+		}
+		p += n;
+	}
+	sb_printf(b, "%s}\n", items ? "]" : "");
+}
+
+size_t http_response(const char *reply, int close, char *out, size_t size)
+{
+	char body[2048];
+	struct sbuf b = { body, sizeof(body), 0 };
+	struct sbuf r = { out, size, 0 };
+	int status = 200;
+	unsigned i;
+
+	if (!strncmp(reply, "ok", 2)) {
+		reply_json(&b, reply);
+	} else {
+		const char *reason = strncmp(reply, "err ", 4) ? reply : reply + 4;
+
+		status = 400;
+		for (i = 0; i < sizeof(err_status) / sizeof(err_status[0]); i++)
+			if (!strcmp(reason, err_status[i].reason))
+				status = err_status[i].status;
+		sb_printf(&b, "{\"ok\":false,\"error\":");
+		sb_string(&b, reason, strlen(reason));
+		sb_printf(&b, "}\n");
+	}
+	if (b.len >= sizeof(body)) {
+		status = 500;
+		b.len = snprintf(body, sizeof(body),
+				 "{\"ok\":false,\"error\":\"reply too long\"}\n");
+	}
+
+	sb_printf(&r, "HTTP/1.1 %d %s\r\n"
+		  "Content-Type: application/json\r\n"
+		  "Content-Length: %zu\r\n"
+		  "%s\r\n%s", status, status_text(status), b.len,
+		  close ? "Connection: close\r\n" : "", body);
+
+	return r.len;
+}
+
+int http_parse_addr(const char *addr, struct sockaddr_in *sin)
+{
+	const char *colon = strrchr(addr, ':');
+	const char *port = colon ? colon + 1 : addr;
+	char host[INET_ADDRSTRLEN];
+	unsigned long p;
+	char *end;
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	p = strtoul(port, &end, 10);
+	if (!*port || *end || !p || p > 65535)
+		return -1;
+	sin->sin_port = htons(p);
+
+	if (colon) {
+		if ((size_t)(colon - addr) >= sizeof(host))
+			return -1;
+		memcpy(host, addr, colon - addr);
+		host[colon - addr] = '\0';
+		if (inet_pton(AF_INET, host, &sin->sin_addr) != 1)
+			return -1;
+	}
+
+	return 0;
+}
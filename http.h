@@ -0,0 +1,64 @@
+/*
+ * HTTP/1.1 front end for the daemon.
+ *
+ * Requests are parsed straight out of a connection's input buffer and
+ * translated into lines of the daemon protocol (daemon.h); the line replies
+ * are turned back into JSON responses.  Connections are persistent unless
+ * the client asks otherwise, and pipelined requests are answered in order.
+ *
+ *   GET  /devices                    list
+ *   GET  /fleet                      fleet
+ *   GET  /pool                       pool
+ *   GET  /journal                    journal
+ *   GET  /devices/<dev>[/status]     status <dev>
+ *   GET  /devices/<dev>/stats        stats <dev>
+ *   GET  /devices/<dev>/health       health <dev>
+ *   POST /devices/<dev>/set          {"outlets": {"1": true, "3": false}}
+ *   POST /devices/<dev>/mask         {"mask": 19, "care": 31}
+ *   POST /devices/<dev>/cycle        {"outlet": 2, "ms": 1000}
+ *   POST /devices/<dev>/off          {"outlets": [1, 2]} or no body
+ *
+ * Replies "ok a=1 b=x" become {"ok": true, "a": 1, "b": "x"}, "err <reason>"
+ * becomes {"ok": false, "error": "<reason>"} with a matching status code.
+ */
+
+#ifndef HTTP_H__
+#define HTTP_H__
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+struct http_request {
+	char *method;
+	char *target;
+	char *body;
+	size_t body_len;
+	int keep_alive;
+};
+
+/*
+ * Parse one request at the start of @buf.  Returns the number of bytes it
+ * occupies, 0 if it is not complete yet, or -1 if it is malformed.  On
+ * success the request is NUL terminated in place and @req points into @buf.
+ */
+long http_parse(char *buf, size_t len, struct http_request *req);
+
+/*
+ * Translate @req into a daemon command line.  Returns 0, or -1 with an
+ * "err ..." reply in @line.
+ */
+int http_route(const struct http_request *req, char *line, size_t size);
+
+/*
+ * Format the response for daemon reply @reply.  Returns its length,
+ * truncated to @size like snprintf().
+ */
+size_t http_response(const char *reply, int close, char *out, size_t size);
+
+/*
+ * Parse "[<host>:]<port>", an IPv4 address that defaults to 127.0.0.1.
+ * Returns 0 and the address in @sin, -1 if invalid.
+ */
+int http_parse_addr(const char *addr, struct sockaddr_in *sin);
+
+#endif
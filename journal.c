@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "hid_log.h"
+#include "timeutil.h"
+
+#define LOG_MAGIC	"BWJLOG1"
+#define SNAP_MAGIC	"BWJSNP1"
+#define FNV_OFFSET	2166136261u
+#define FNV_PRIME	16777619u
+
+struct journal_record {
+	uint32_t seq;			/* sequence + 1, stored last; 0 = empty */
+	uint32_t gen;
+	uint32_t dev;
+	uint8_t value;
+	uint8_t care;
+	uint16_t check;
+};
+
+struct journal_log {
+	char magic[8];
+	uint32_t capacity;
+	uint32_t gen;
+	uint8_t pad[48];		/* records start on a cache line */
+	struct journal_record rec[];
+};
+
+struct journal_snap {
+	char magic[8];
+	uint32_t gen;
+	uint32_t n;
+	uint32_t check;			/* of the entries */
+	uint32_t pad;
+};
+
+static uint32_t fnv(uint32_t h, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len--)
+		h = (h ^ *p++) * FNV_PRIME;
+	return h;
+}
+
+/* Catches records torn by a crash in the middle of journal_append(). */
+static uint16_t record_check(const struct journal_record *r, uint32_t seq)
+{
+	uint32_t h = FNV_OFFSET;
+
+	h = fnv(h, &seq, sizeof(seq));
+	h = fnv(h, &r->gen, sizeof(r->gen));
+	h = fnv(h, &r->dev, sizeof(r->dev));
+	h = fnv(h, &r->value, 1);
+	h = fnv(h, &r->care, 1);
+	return h ^ h >> 16;
+}
+
+static void apply(struct journal_dev *d, uint8_t value, uint8_t care)
+{
+	d->desired = (d->desired & ~care) | (value & care);
+	d->want |= care;
+}
+
+/* The snapshot's devices into *@devs; none if there is no snapshot yet. */
+static int load_snapshot(struct journal *j, struct journal_dev **devs,
+			 unsigned *n)
+{
+	struct journal_snap hdr;
+	ssize_t len;
+	int fd;
+
+	*devs = NULL;
+	*n = 0;
+	j->gen = 0;
+
+	fd = open(j->snap_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+
+	len = read(fd, &hdr, sizeof(hdr));
+	if (len != sizeof(hdr) || memcmp(hdr.magic, SNAP_MAGIC, 8))
+		goto bad;
+	*devs = calloc(hdr.n ? hdr.n : 1, sizeof(**devs));
+	if (!*devs) {
+		close(fd);
+		return -1;
+	}
+	len = read(fd, *devs, hdr.n * sizeof(**devs));
+	if (len != (ssize_t)(hdr.n * sizeof(**devs)) ||
+	    fnv(FNV_OFFSET, *devs, len) != hdr.check)
+		goto bad;
+	close(fd);
+
+	j->gen = hdr.gen;
+	*n = hdr.n;
+	return 0;
+
+bad:
+	hid_log_warn(j->snap_path, "bad snapshot, starting from scratch");
+	close(fd);
+	free(*devs);
+	*devs = NULL;
+	return 0;
+}
+
+static int map_log(struct journal *j)
+{
+	size_t size = sizeof(struct journal_log) +
+		      JOURNAL_RECORDS * sizeof(struct journal_record);
+	struct stat st;
+
+	j->fd = open(j->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (j->fd < 0)
+		return -1;
+	if (fstat(j->fd, &st) ||
+	    ((size_t)st.st_size != size && ftruncate(j->fd, size)))
+		return -1;
+	j->log = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, j->fd, 0);
+	if (j->log == MAP_FAILED) {
+		j->log = NULL;
+		return -1;
+	}
+
+	if (memcmp(j->log->magic, LOG_MAGIC, 8) ||
+	    j->log->capacity != JOURNAL_RECORDS) {
+		memset(j->log, 0, size);
+		memcpy(j->log->magic, LOG_MAGIC, 8);
+		j->log->capacity = JOURNAL_RECORDS;
+	}
+
+	return 0;
+}
+
+/* Apply the log records of the snapshot's generation, in order. */
+static void replay(struct journal *j, struct journal_dev *devs, unsigned n)
+{
+	const struct journal_record *r;
+
+	j->seq = 0;
+	if (j->log->gen != j->gen)
+		return;
+
+	for (; j->seq < JOURNAL_RECORDS; j->seq++) {
+		r = &j->log->rec[j->seq];
+		if (r->seq != j->seq + 1 || r->gen != j->gen ||
+		    r->check != record_check(r, r->seq))
+			break;
+		if (r->dev < n)
+			apply(&devs[r->dev], r->value, r->care);
+		j->replayed++;
+	}
+}
+
+int journal_open(struct journal *j, const char *path, struct journal_dev **devs,
+		 unsigned *n)
+{
+	memset(j, 0, sizeof(*j));
+	j->fd = -1;
+	j->path = strdup(path);
+	if (!j->path || asprintf(&j->snap_path, "%s.snap", path) < 0) {
+		j->snap_path = NULL;
+		goto err;
+	}
+
+	if (load_snapshot(j, devs, n))
+		goto err;
+	if (map_log(j)) {
+		free(*devs);
+		*devs = NULL;
+		goto err;
+	}
+	replay(j, *devs, *n);
+
+	/* Until the next snapshot, records refer to the loaded slots. */
+	j->slots = *n;
+
+	return 0;
+
+err:
+	journal_close(j);
+	return -1;
+}
+
+int journal_snapshot(struct journal *j, const char *const *keys,
+		     const uint8_t *desired, const uint8_t *want, unsigned n)
+{
+	struct journal_snap hdr = { .magic = SNAP_MAGIC, .n = n };
+	struct journal_dev *devs;
+	uint64_t start = now_ns();
+	char *tmp = NULL;
+	unsigned i;
+	int fd = -1, ret = -1;
+
+	/*
+	 * Past the log's generation too: without its snapshot (lost or
+	 * damaged) we start from gen 0, and reusing a generation would let
+	 * its old records replay onto the new slots.
+	 */
+	hdr.gen = (j->gen > j->log->gen ? j->gen : j->log->gen) + 1;
+
+	devs = calloc(n ? n : 1, sizeof(*devs));
+	if (!devs || asprintf(&tmp, "%s.tmp", j->snap_path) < 0) {
+		tmp = NULL;
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		strncpy(devs[i].key, keys[i], JOURNAL_KEY_LEN - 1);
+		devs[i].desired = desired[i];
+		devs[i].want = want[i];
+	}
+	hdr.check = fnv(FNV_OFFSET, devs, n * sizeof(*devs));
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0 ||
+	    write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, devs, n * sizeof(*devs)) != (ssize_t)(n * sizeof(*devs)) ||
+	    close(fd)) {
+		if (fd >= 0)
+			unlink(tmp);
+		goto out;
+	}
+	fd = -1;
+	if (rename(tmp, j->snap_path)) {
+		unlink(tmp);
+		goto out;
+	}
+
+	/* Only now may the log move on: it refers to the new slots. */
+	__atomic_store_n(&j->log->gen, hdr.gen, __ATOMIC_RELEASE);
+	j->gen = hdr.gen;
+	j->seq = 0;
+	j->slots = n;
+	j->snapshots++;
+	j->snapshot_ns = now_ns() - start;
+	ret = 0;
+
+out:
+	free(tmp);
+	free(devs);
+	return ret;
+}
+
+int journal_append(struct journal *j, unsigned dev, uint8_t value,
+		   uint8_t care)
+{
+	struct journal_record *r;
+
+	if (dev >= j->slots)
+		return 0;
+	if (j->seq == JOURNAL_RECORDS)
+		return -1;
+
+	r = &j->log->rec[j->seq];
+	r->gen = j->gen;
+	r->dev = dev;
+	r->value = value;
+	r->care = care;
+	r->check = record_check(r, j->seq + 1);
+	/* The sequence number makes the record valid, so it goes last. */
+	__atomic_store_n(&r->seq, j->seq + 1, __ATOMIC_RELEASE);
+	j->seq++;
+	j->appends++;
+
+	return j->seq >= JOURNAL_SNAPSHOT_AT;
+}
+
+void journal_close(struct journal *j)
+{
+	if (j->log)
+		munmap(j->log, sizeof(struct journal_log) +
+		       JOURNAL_RECORDS * sizeof(struct journal_record));
+	if (j->fd >= 0)
+		close(j->fd);
+	free(j->snap_path);
+	free(j->path);
+	memset(j, 0, sizeof(*j));
+	j->fd = -1;
+}
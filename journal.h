@@ -0,0 +1,81 @@
+/*
+ * Desired-state journal: lets a restarted daemon recover the outlet states
+ * clients asked for without having been told again.
+ *
+ * Two files make up a journal at <path>:
+ *
+ *   <path>.snap  the desired and wanted masks of every device, keyed by
+ *                serial number (or path), for one generation; replaced as
+ *                a whole through rename() so it is never seen half written
+ *   <path>       an mmap()ed log of the changes made since that snapshot,
+ *                16 byte records tagged with the generation and a sequence
+ *                number, referring to devices by their snapshot slot
+ *
+ * Appending is a store into the shared mapping, which the kernel keeps if
+ * the process dies, so it costs no system call.  Once the log fills up to
+ * JOURNAL_SNAPSHOT_AT the owner takes a new snapshot, which starts the next
+ * generation with an empty log.  Recovery loads the snapshot and replays
+ * the log records of its generation up to the first missing, torn or stale
+ * one.  Nothing is synced to disk: the journal outlives the process, not
+ * the machine.
+ */
+
+#ifndef JOURNAL_H__
+#define JOURNAL_H__
+
+#include <stdint.h>
+
+#define JOURNAL_KEY_LEN		56
+#define JOURNAL_RECORDS		65536	/* log capacity */
+#define JOURNAL_SNAPSHOT_AT	(JOURNAL_RECORDS / 4 * 3)
+
+/* A device's recovered desired state. */
+struct journal_dev {
+	char key[JOURNAL_KEY_LEN];
+	uint8_t desired;
+	uint8_t want;
+};
+
+struct journal_log;
+
+struct journal {
+	char *path;
+	char *snap_path;
+	int fd;
+	struct journal_log *log;	/* mapping of <path> */
+	uint32_t gen;
+	uint32_t seq;			/* next record */
+	unsigned slots;			/* devices of this generation */
+
+	uint64_t appends;
+	uint64_t snapshots;
+	uint64_t snapshot_ns;		/* time the last snapshot took */
+	unsigned replayed;		/* log records applied by recovery */
+};
+
+/*
+ * Open or create the journal at @path and recover its desired state into
+ * *@devs (*@n entries, free() it).  Returns 0, or -1 with errno set.
+ */
+int journal_open(struct journal *j, const char *path, struct journal_dev **devs,
+		 unsigned *n);
+
+/*
+ * Start a new generation whose slots are the devices @keys[0..@n): write
+ * their @desired and @want masks as the snapshot and empty the log.
+ */
+int journal_snapshot(struct journal *j, const char *const *keys,
+		     const uint8_t *desired, const uint8_t *want, unsigned n);
+
+/*
+ * Record that the outlets in @care of slot @dev were requested to follow
+ * @value.  Returns 0, 1 once the log holds JOURNAL_SNAPSHOT_AT records,
+ * or -1 if it is full and the record was dropped; either way a snapshot
+ * is due, at once in the latter case.
+ */
+int journal_append(struct journal *j, unsigned dev, uint8_t value,
+		   uint8_t care);
+
+void journal_close(struct journal *j);
+
+#endif
@@ -0,0 +1,83 @@
+#include <string.h>
+#include "pool.h"
+
+void pool_init(struct pool *p, unsigned capacity, unsigned idle_ms)
+{
+	memset(p, 0, sizeof(*p));
+	p->lru.prev = p->lru.next = &p->lru;
+	p->capacity = capacity;
+	p->idle_ns = idle_ms * 1000000ull;
+}
+
+static void unlink_entry(struct pool_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void link_front(struct pool *p, struct pool_entry *e)
+{
+	e->prev = &p->lru;
+	e->next = p->lru.next;
+	p->lru.next->prev = e;
+	p->lru.next = e;
+}
+
+void pool_hit(struct pool *p, struct pool_entry *e, uint64_t now)
+{
+	p->hits++;
+	e->last_used = now;
+	unlink_entry(e);
+	link_front(p, e);
+}
+
+void pool_opened(struct pool *p, struct pool_entry *e, uint64_t now,
+		 uint64_t open_ns, bool reopen)
+{
+	if (reopen) {
+		p->misses++;
+		hist_add(&p->reopen, open_ns);
+	}
+	e->open = true;
+	e->last_used = now;
+	link_front(p, e);
+	p->open++;
+}
+
+void pool_closed(struct pool *p, struct pool_entry *e, bool evicted)
+{
+	if (!e->open)
+		return;
+	unlink_entry(e);
+	e->open = false;
+	p->open--;
+	if (evicted)
+		p->evictions++;
+	else
+		p->idle_closes++;
+}
+
+void pool_drop(struct pool *p, struct pool_entry *e)
+{
+	if (!e->open)
+		return;
+	unlink_entry(e);
+	e->open = false;
+	p->open--;
+}
+
+struct pool_entry *pool_victim(struct pool *p,
+			       bool (*idle)(struct pool_entry *, void *),
+			       void *arg)
+{
+	struct pool_entry *e;
+
+	if (!p->capacity || p->open <= p->capacity)
+		return NULL;
+
+	for (e = p->lru.prev; e != &p->lru; e = e->prev)
+		if (idle(e, arg))
+			return e;
+
+	return NULL;
+}
@@ -0,0 +1,75 @@
+/*
+ * Pool of open device handles for large fleets.
+ *
+ * Keeping every hidraw descriptor open does not fit tight descriptor and
+ * memory budgets, while reopening for every operation repeats
+ * hid_open_path()'s descriptor ioctls.  The pool keeps the open devices in
+ * LRU order: once more than @capacity are open the least recently used
+ * idle one is closed, and the owner closes devices unused for @idle_ms.
+ * Closed devices are reopened on demand from their cached path, counting
+ * a miss and the time the reopen took.
+ *
+ * Entries are embedded in the owner's device structures; the pool never
+ * opens or closes anything itself.
+ */
+
+#ifndef POOL_H__
+#define POOL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hist.h"
+
+struct pool_entry {
+	struct pool_entry *prev;	/* LRU list, most recent first */
+	struct pool_entry *next;
+	uint64_t last_used;		/* ns */
+	bool open;
+};
+
+struct pool {
+	struct pool_entry lru;		/* list head */
+	unsigned open;
+	unsigned capacity;		/* 0 for no limit */
+	uint64_t idle_ns;		/* 0 to keep idle devices open */
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t idle_closes;
+	struct hist reopen;		/* ns, misses only */
+};
+
+void pool_init(struct pool *p, unsigned capacity, unsigned idle_ms);
+
+/* @e is about to be used while open. */
+void pool_hit(struct pool *p, struct pool_entry *e, uint64_t now);
+
+/*
+ * @e has just been opened, after @open_ns spent opening it.  A reopen
+ * counts as a miss; the first open of a device does not.
+ */
+void pool_opened(struct pool *p, struct pool_entry *e, uint64_t now,
+		 uint64_t open_ns, bool reopen);
+
+/* @e has been closed, because of capacity when @evicted. */
+void pool_closed(struct pool *p, struct pool_entry *e, bool evicted);
+
+/* @e's device went away; its handle is gone without counting a close. */
+void pool_drop(struct pool *p, struct pool_entry *e);
+
+/*
+ * While more than capacity devices are open, the least recently used one
+ * @idle accepts, to be closed; NULL if none is over or none is idle.
+ */
+struct pool_entry *pool_victim(struct pool *p,
+			       bool (*idle)(struct pool_entry *, void *),
+			       void *arg);
+
+/* Whether @e has been unused for idle_ms at @now. */
+static inline bool pool_expired(const struct pool *p,
+				const struct pool_entry *e, uint64_t now)
+{
+	return p->idle_ns && now - e->last_used >= p->idle_ns;
+}
+
+#endif
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include "hidapi.h"
+#include "hid_capture.h"
+#include "hid_log.h"
+#include "bellwin.h"
+#include "sim.h"
+#include "replay.h"
+#include "timeutil.h"
+
+struct replay_dev {
+	struct bellwin_sim *sim;
+	hid_device *handle;
+	uint64_t last_out_ns;
+	int awaiting_reply;
+};
+
+static void sleep_until(uint64_t deadline_ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline_ns / 1000000000ull;
+	ts.tv_nsec = deadline_ns % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double p)
+{
+	size_t idx;
+
+	if (!n)
+		return 0;
+	idx = (size_t)(p * (n - 1) + 0.5);
+	return sorted[idx] / 1000.0;
+}
+
+/* The first recorded status reply tells us what state the relays were in. */
+static unsigned char initial_mask(const struct hid_capture_record *recs,
+				  size_t n, unsigned dev_id)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (recs[i].dev_id == dev_id && recs[i].dir == HID_CAPTURE_IN &&
+		    recs[i].payload[0] == BELLWIN_CMD_STATUS)
+			return recs[i].payload[BELLWIN_STATUS_MASK];
+	}
+
+	return 0;
+}
+
+int replay_run(const char *filename, const struct replay_opts *opts, FILE *out)
+{
+	struct hid_capture_record *recs;
+	struct replay_dev *devs = NULL;
+	uint64_t *lat = NULL;
+	size_t nrecs, nlat = 0, i;
+	unsigned ndevs = 0;
+	unsigned writes = 0, replies = 0, timeouts = 0, mismatches = 0;
+	uint64_t start, elapsed;
+	int ret = 1;
+
+	if (hid_capture_load(filename, &recs, &nrecs)) {
+		hid_log_error(filename, "Unable to load capture: %m");
+		return 1;
+	}
+
+	for (i = 0; i < nrecs; i++)
+		if (recs[i].dev_id >= ndevs)
+			ndevs = recs[i].dev_id + 1;
+
+	devs = calloc(ndevs ? ndevs : 1, sizeof(*devs));
+	lat = malloc((nrecs ? nrecs : 1) * sizeof(*lat));
+	if (!devs || !lat) {
+		hid_log_error(NULL, "Out of memory");
+		goto out;
+	}
+
+	start = now_ns();
+	for (i = 0; i < nrecs; i++) {
+		const struct hid_capture_record *rec = &recs[i];
+		struct replay_dev *d = &devs[rec->dev_id];
+		unsigned char buf[BELLWIN_REPORT_SIZE];
+		int res;
+
+		if (!d->handle) {
+			d->sim = bellwin_sim_start(initial_mask(recs, nrecs, rec->dev_id),
+						   opts->latency_us, &d->handle);
+			if (!d->sim) {
+				hid_log_error(NULL, "Unable to start simulated device");
+				goto out;
+			}
+		}
+
+		/* Replies are read as soon as they arrive, only writes are paced. */
+		if (opts->speed > 0 && rec->dir == HID_CAPTURE_OUT)
+			sleep_until(start + (uint64_t)(rec->ts_ns / opts->speed));
+
+		switch (rec->dir) {
+		case HID_CAPTURE_OUT:
+			if (hid_write(d->handle, rec->payload, rec->len) < 0) {
+				hid_log_error(NULL, "Unable to write() to simulated device");
+				goto out;
+			}
+			writes++;
+			d->last_out_ns = now_ns();
+			d->awaiting_reply = rec->payload[0] == BELLWIN_CMD_STATUS;
+			break;
+		case HID_CAPTURE_IN:
+			/* Only status queries are answered by the model. */
+			if (!d->awaiting_reply)
+				break;
+			d->awaiting_reply = 0;
+			res = hid_read_timeout(d->handle, buf, sizeof(buf),
+					       opts->timeout_ms);
+			if (res <= 0) {
+				timeouts++;
+				break;
+			}
+			replies++;
+			lat[nlat++] = now_ns() - d->last_out_ns;
+			if (buf[BELLWIN_STATUS_MASK] != rec->payload[BELLWIN_STATUS_MASK])
+				mismatches++;
+			break;
+		default:
+			break;
+		}
+	}
+	elapsed = now_ns() - start;
+
+	qsort(lat, nlat, sizeof(*lat), cmp_u64);
+
+	fprintf(out, "Replayed %zu records from %u device(s) in %.3f ms\n",
+		nrecs, ndevs, elapsed / 1e6);
+	fprintf(out, "  writes:     %u (%.0f reports/s)\n", writes,
+		elapsed ? writes * 1e9 / elapsed : 0);
+	fprintf(out, "  replies:    %u, timeouts: %u, mask mismatches: %u\n",
+		replies, timeouts, mismatches);
+	fprintf(out, "  latency us: p50 %.1f  p95 %.1f  p99 %.1f  max %.1f\n",
+		percentile_us(lat, nlat, 0.50), percentile_us(lat, nlat, 0.95),
+		percentile_us(lat, nlat, 0.99), percentile_us(lat, nlat, 1.0));
+
+	ret = (timeouts || mismatches) ? 1 : 0;
+out:
+	for (i = 0; devs && i < ndevs; i++) {
+		hid_close(devs[i].handle);
+		bellwin_sim_stop(devs[i].sim);
+	}
+	free(devs);
+	free(lat);
+	free(recs);
+
+	return ret;
+}
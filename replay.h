@@ -0,0 +1,23 @@
+/*
+ * Replay of captured HID sessions against simulated devices.
+ */
+
+#ifndef REPLAY_H__
+#define REPLAY_H__
+
+#include <stdio.h>
+
+struct replay_opts {
+	double speed;		/* 1.0 keeps recorded timing, 0 replays back to back */
+	unsigned latency_us;	/* reply latency of the simulated devices */
+	int timeout_ms;		/* deadline for each expected reply */
+};
+
+/*
+ * Feed the capture in @filename through one simulated device per recorded
+ * device and print throughput and reply latency to @out.  Returns 0 when
+ * every expected reply arrived and matched the recorded outlet mask.
+ */
+int replay_run(const char *filename, const struct replay_opts *opts, FILE *out);
+
+#endif
@@ -0,0 +1,92 @@
+#include <stddef.h>
+#include <string.h>
+#include "sched.h"
+
+void sched_init(struct sched *s, unsigned max_depth, unsigned max_flow_depth)
+{
+	unsigned i;
+
+	for (i = 0; i < SCHED_CLASSES; i++)
+		s->active[i] = NULL;
+	s->depth = 0;
+	s->max_depth = max_depth;
+	s->max_flow_depth = max_flow_depth;
+	s->rejected = 0;
+	memset(s->qwait, 0, sizeof(s->qwait));
+}
+
+/*
+ * Active flows of a class form a ring; active[cls] points at its tail, so
+ * tail->next is served next and new flows join at the end of the round.
+ */
+int sched_enqueue(struct sched_flow *f, struct sched_item *it, uint64_t now)
+{
+	struct sched *s = f->sched;
+	struct sched_flow *tail;
+
+	if (f->depth >= s->max_flow_depth ||
+	    (f->cls != SCHED_EMERGENCY && s->depth >= s->max_depth)) {
+		s->rejected++;
+		return -1;
+	}
+
+	it->next = NULL;
+	it->enqueued_ns = now;
+	if (f->tail)
+		f->tail->next = it;
+	else
+		f->head = it;
+	f->tail = it;
+	s->depth++;
+
+	if (f->depth++)
+		return 0;
+
+	tail = s->active[f->cls];
+	if (tail) {
+		f->next = tail->next;
+		tail->next = f;
+	} else {
+		f->next = f;
+	}
+	s->active[f->cls] = f;
+
+	return 0;
+}
+
+struct sched_item *sched_dequeue(struct sched *s, uint64_t now,
+				 enum sched_class *cls)
+{
+	struct sched_flow *tail, *f;
+	struct sched_item *it;
+	unsigned c;
+
+	for (c = 0; c < SCHED_CLASSES; c++) {
+		tail = s->active[c];
+		if (tail)
+			break;
+	}
+	if (c == SCHED_CLASSES)
+		return NULL;
+
+	f = tail->next;
+	it = f->head;
+	f->head = it->next;
+	if (!f->head)
+		f->tail = NULL;
+	f->depth--;
+	s->depth--;
+
+	if (f->depth)
+		s->active[c] = f;		/* served, move to the end */
+	else if (f == tail)
+		s->active[c] = NULL;		/* last active flow */
+	else
+		tail->next = f->next;		/* drop out of the ring */
+
+	hist_add(&s->qwait[c], now - it->enqueued_ns);
+	if (cls)
+		*cls = c;
+
+	return it;
+}
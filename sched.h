@@ -0,0 +1,65 @@
+/*
+ * Per-device request scheduler.
+ *
+ * Requests are queued in priority classes served strictly in order; within a
+ * class every client has its own FIFO (a flow) and active flows are served
+ * round robin, one request per turn, so a client flooding status polls only
+ * delays itself.  Queues are bounded per device and per flow; a full queue
+ * rejects new work so the caller can push back on the client.
+ */
+
+#ifndef SCHED_H__
+#define SCHED_H__
+
+#include <stdint.h>
+#include "hist.h"
+
+enum sched_class {
+	SCHED_EMERGENCY,	/* emergency power off */
+	SCHED_CONTROL,		/* set and mask */
+	SCHED_MONITOR,		/* status polls */
+
+	SCHED_CLASSES,
+};
+
+struct sched_item {
+	struct sched_item *next;
+	uint64_t enqueued_ns;
+};
+
+struct sched;
+
+struct sched_flow {
+	struct sched *sched;
+	enum sched_class cls;
+	struct sched_flow *next;	/* ring of active flows */
+	struct sched_item *head, *tail;
+	unsigned depth;
+	struct sched_flow *owner_next;	/* owner's list of flows */
+};
+
+struct sched {
+	struct sched_flow *active[SCHED_CLASSES];	/* tail of each flow ring */
+	unsigned depth;
+	unsigned max_depth;
+	unsigned max_flow_depth;
+	uint64_t rejected;
+	struct hist qwait[SCHED_CLASSES];		/* ns */
+};
+
+void sched_init(struct sched *s, unsigned max_depth, unsigned max_flow_depth);
+
+/*
+ * Queue @it on @f.  Returns 0, or -1 when the flow or the device queue is
+ * full.  Emergency requests are only bounded by the flow limit.
+ */
+int sched_enqueue(struct sched_flow *f, struct sched_item *it, uint64_t now);
+
+/*
+ * Take the next request: highest class first, round robin across flows.
+ * Records the queue wait of the request.  Returns NULL when idle.
+ */
+struct sched_item *sched_dequeue(struct sched *s, uint64_t now,
+				 enum sched_class *cls);
+
+#endif
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "bellwin.h"
+#include "sim.h"
+
+struct bellwin_sim {
+	int fd;
+	pthread_t thread;
+	unsigned latency_us;
+	unsigned char mask;
+	char name[32];
+	int running;			/* thread to join */
+};
+
+static unsigned sim_count;
+
+static void *sim_thread(void *arg)
+{
+	struct bellwin_sim *sim = arg;
+	unsigned char buf[BELLWIN_REPORT_SIZE];
+	unsigned char reply[BELLWIN_REPORT_SIZE];
+	unsigned char mask;
+	ssize_t n;
+
+	for (;;) {
+		n = recv(sim->fd, buf, sizeof(buf), 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		if (sim->latency_us)
+			usleep(sim->latency_us);
+
+		switch (buf[0]) {
+		case BELLWIN_CMD_STATUS:
+			memset(reply, BELLWIN_REPORT_PAD, sizeof(reply));
+			memset(reply, 0, BELLWIN_CMD_LEN);
+			reply[0] = BELLWIN_CMD_STATUS;
+			reply[BELLWIN_STATUS_MASK] =
+				__atomic_load_n(&sim->mask, __ATOMIC_RELAXED);
+			if (send(sim->fd, reply, sizeof(reply), MSG_NOSIGNAL) < 0)
+				goto out;
+			break;
+		case BELLWIN_CMD_SET:
+			if (n <= BELLWIN_SET_VALUE ||
+			    buf[BELLWIN_SET_INDEX] >= POWER_SWITCH_COUNT)
+				break;
+			mask = __atomic_load_n(&sim->mask, __ATOMIC_RELAXED);
+			if (buf[BELLWIN_SET_VALUE])
+				mask |= BIT(buf[BELLWIN_SET_INDEX]);
+			else
+				mask &= ~BIT(buf[BELLWIN_SET_INDEX]);
+			__atomic_store_n(&sim->mask, mask, __ATOMIC_RELAXED);
+			break;
+		default:
+			break;
+		}
+	}
+out:
+	return NULL;
+}
+
+/* Connect a fresh socketpair to @sim and start its thread. */
+static hid_device *sim_connect(struct bellwin_sim *sim)
+{
+	hid_device *handle;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+		return NULL;
+
+	handle = hid_open_fd(sv[0], sim->name);
+	if (!handle) {
+		close(sv[0]);
+		close(sv[1]);
+		return NULL;
+	}
+
+	sim->fd = sv[1];
+	if (pthread_create(&sim->thread, NULL, sim_thread, sim)) {
+		hid_close(handle);
+		close(sv[1]);
+		sim->fd = -1;
+		return NULL;
+	}
+	sim->running = 1;
+
+	return handle;
+}
+
+struct bellwin_sim *bellwin_sim_start(unsigned char mask, unsigned latency_us,
+				      hid_device **handle)
+{
+	struct bellwin_sim *sim;
+
+	sim = calloc(1, sizeof(*sim));
+	if (!sim)
+		return NULL;
+
+	sim->fd = -1;
+	sim->latency_us = latency_us;
+	sim->mask = mask & POWER_SWITCH_ALL;
+	snprintf(sim->name, sizeof(sim->name), "sim:%u",
+		 __atomic_fetch_add(&sim_count, 1, __ATOMIC_RELAXED));
+
+	*handle = sim_connect(sim);
+	if (!*handle) {
+		free(sim);
+		return NULL;
+	}
+
+	return sim;
+}
+
+static void sim_disconnect(struct bellwin_sim *sim)
+{
+	if (!sim->running)
+		return;
+	shutdown(sim->fd, SHUT_RDWR);
+	pthread_join(sim->thread, NULL);
+	close(sim->fd);
+	sim->fd = -1;
+	sim->running = 0;
+}
+
+hid_device *bellwin_sim_reopen(struct bellwin_sim *sim)
+{
+	sim_disconnect(sim);
+	return sim_connect(sim);
+}
+
+void bellwin_sim_stop(struct bellwin_sim *sim)
+{
+	if (!sim)
+		return;
+
+	sim_disconnect(sim);
+	free(sim);
+}
+
+unsigned char bellwin_sim_mask(struct bellwin_sim *sim)
+{
+	return __atomic_load_n(&sim->mask, __ATOMIC_RELAXED);
+}
+
+void bellwin_sim_unplug(struct bellwin_sim *sim)
+{
+	if (sim->running)
+		shutdown(sim->fd, SHUT_RDWR);
+}
@@ -0,0 +1,52 @@
+/*
+ * Simulated Bellwin splitter.
+ *
+ * A relay model served by a thread on one end of a SOCK_SEQPACKET
+ * socketpair; the other end is wrapped with hid_open_fd() so the regular
+ * hid_write()/hid_read_timeout() path drives it exactly like a hidraw node.
+ */
+
+#ifndef SIM_H__
+#define SIM_H__
+
+#include "hidapi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct bellwin_sim;
+
+/*
+ * Start a simulated device with the given initial outlet @mask, answering
+ * each report after @latency_us.  On success returns the simulator and a
+ * device handle in *handle, which the caller releases with hid_close().
+ */
+struct bellwin_sim *bellwin_sim_start(unsigned char mask, unsigned latency_us,
+				      hid_device **handle);
+
+/*
+ * Reconnect a simulator after hid_close() of its handle, as a device would
+ * be reopened by path.  The relay state is kept.  Returns the new handle,
+ * NULL on failure, after which only bellwin_sim_stop() may be called.
+ */
+hid_device *bellwin_sim_reopen(struct bellwin_sim *sim);
+
+/* Stop the simulator thread.  Safe before or after hid_close(). */
+void bellwin_sim_stop(struct bellwin_sim *sim);
+
+/* Current relay state of the model. */
+unsigned char bellwin_sim_mask(struct bellwin_sim *sim);
+
+/*
+ * Unplug the device: the simulator hangs up, so writes and reads on its
+ * handle fail from now on until bellwin_sim_reopen().  Reports already
+ * written may still be handled.
+ */
+void bellwin_sim_unplug(struct bellwin_sim *sim);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
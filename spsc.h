@@ -0,0 +1,81 @@
+/*
+ * Lock-free single-producer/single-consumer ring of fixed size elements.
+ *
+ * The producer owns tail, the consumer owns head; each only reads the other
+ * index with acquire ordering, so a push or pop is a copy plus one release
+ * store.  The capacity must be a power of two.
+ */
+
+#ifndef SPSC_H__
+#define SPSC_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct spsc {
+	_Alignas(64) atomic_size_t head;	/* consumer */
+	_Alignas(64) atomic_size_t tail;	/* producer */
+	_Alignas(64) size_t mask;
+	size_t elem_size;
+	unsigned char *slots;
+};
+
+static inline int spsc_init(struct spsc *r, size_t capacity, size_t elem_size)
+{
+	if (!capacity || capacity & (capacity - 1))
+		return -1;
+
+	r->slots = calloc(capacity, elem_size);
+	if (!r->slots)
+		return -1;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	r->mask = capacity - 1;
+	r->elem_size = elem_size;
+
+	return 0;
+}
+
+static inline void spsc_free(struct spsc *r)
+{
+	free(r->slots);
+	r->slots = NULL;
+}
+
+static inline bool spsc_push(struct spsc *r, const void *elem)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	if (tail - head > r->mask)
+		return false;
+
+	memcpy(r->slots + (tail & r->mask) * r->elem_size, elem, r->elem_size);
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+
+	return true;
+}
+
+static inline bool spsc_pop(struct spsc *r, void *elem)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	if (head == tail)
+		return false;
+
+	memcpy(elem, r->slots + (head & r->mask) * r->elem_size, r->elem_size);
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+	return true;
+}
+
+static inline bool spsc_empty(struct spsc *r)
+{
+	return atomic_load_explicit(&r->head, memory_order_acquire) ==
+	       atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * Minimal test support for "make check".
+ *
+ * Each test program is a main() calling its test functions; CHECK() reports
+ * a failed condition with its location and carries on, check_done() prints
+ * the outcome and gives the exit status.
+ */
+
+#ifndef CHECK_H__
+#define CHECK_H__
+
+#include <stdio.h>
+
+static unsigned check_failures;
+static unsigned check_count;
+
+#define CHECK(cond)							\
+	do {								\
+		check_count++;						\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s: check failed: %s\n",	\
+				__FILE__, __LINE__, __func__, #cond);	\
+			check_failures++;				\
+		}							\
+	} while (0)
+
+/* CHECK(a == b) printing both values, for integers. */
+#define CHECK_EQ(a, b)							\
+	do {								\
+		unsigned long long a_ = (a), b_ = (b);			\
+		check_count++;						\
+		if (a_ != b_) {						\
+			fprintf(stderr, "%s:%d: %s: %s == %s: %llu != %llu\n", \
+				__FILE__, __LINE__, __func__, #a, #b, a_, b_); \
+			check_failures++;				\
+		}							\
+	} while (0)
+
+static inline int check_done(const char *name)
+{
+	if (check_failures) {
+		fprintf(stderr, "%s: %u of %u checks failed\n", name,
+			check_failures, check_count);
+		return 1;
+	}
+	printf("%s: %u checks passed\n", name, check_count);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * coalesce.c: last-writer-wins folding of set requests and the reports a
+ * flush sends.
+ */
+
+#include <string.h>
+
+#include "bellwin.h"
+#include "coalesce.h"
+#include "check.h"
+
+/* The outlets switched by @n reports in @cmds, and to which state. */
+static void decode(char cmds[POWER_SWITCH_COUNT][BELLWIN_CMD_LEN], int n,
+		   unsigned char *sent, unsigned char *on)
+{
+	int i;
+
+	*sent = 0;
+	*on = 0;
+	for (i = 0; i < n; i++) {
+		CHECK_EQ((unsigned char)cmds[i][0], BELLWIN_CMD_SET);
+		CHECK(cmds[i][BELLWIN_SET_INDEX] < POWER_SWITCH_COUNT);
+		*sent |= BIT(cmds[i][BELLWIN_SET_INDEX]);
+		if (cmds[i][BELLWIN_SET_VALUE])
+			*on |= BIT(cmds[i][BELLWIN_SET_INDEX]);
+	}
+}
+
+static void test_last_writer_wins(void)
+{
+	struct coalesce c = { 0 };
+
+	coalesce_add(&c, 0x01, 0x01);		/* 1 on */
+	coalesce_add(&c, 0x06, 0x06);		/* 2, 3 on */
+	coalesce_add(&c, 0x00, 0x03);		/* 1, 2 off */
+	CHECK_EQ(c.care, 0x07);
+	CHECK_EQ(c.value, 0x04);
+
+	/* Untouched outlets keep their current state. */
+	CHECK_EQ(coalesce_final(0x18, c.value, c.care), 0x1c);
+}
+
+static void test_flush_only_changes(void)
+{
+	char cmds[POWER_SWITCH_COUNT][BELLWIN_CMD_LEN];
+	struct coalesce c = { 0 };
+	unsigned char final, sent, on;
+	int n;
+
+	/* On then off again: nothing to send for an outlet that is off. */
+	coalesce_add(&c, 0x01, 0x01);
+	coalesce_add(&c, 0x00, 0x01);
+	c.deadline_ns = 1;
+	n = coalesce_flush(&c, 0x00, POWER_SWITCH_ALL, &final, cmds);
+	CHECK_EQ(n, 0);
+	CHECK_EQ(final, 0x00);
+
+	/* Only outlets whose state changes are sent. */
+	coalesce_add(&c, 0x13, 0x1f);
+	n = coalesce_flush(&c, 0x11, POWER_SWITCH_ALL, &final, cmds);
+	CHECK_EQ(n, 1);
+	CHECK_EQ(final, 0x13);
+	decode(cmds, n, &sent, &on);
+	CHECK_EQ(sent, 0x02);
+	CHECK_EQ(on, 0x02);
+}
+
+static void test_flush_unknown(void)
+{
+	char cmds[POWER_SWITCH_COUNT][BELLWIN_CMD_LEN];
+	struct coalesce c = { 0 };
+	unsigned char final, sent, on;
+	int n;
+
+	/* Touched outlets of unknown state are always sent, others never. */
+	coalesce_add(&c, 0x01, 0x05);
+	n = coalesce_flush(&c, 0x01, 0x01, &final, cmds);
+	CHECK_EQ(final, 0x01);
+	decode(cmds, n, &sent, &on);
+	CHECK_EQ(n, 1);
+	CHECK_EQ(sent, 0x04);
+	CHECK_EQ(on, 0x00);
+}
+
+static void test_flush_resets(void)
+{
+	char cmds[POWER_SWITCH_COUNT][BELLWIN_CMD_LEN];
+	struct coalesce c = { 0 };
+	unsigned char final;
+	int n;
+
+	coalesce_add(&c, POWER_SWITCH_ALL, POWER_SWITCH_ALL);
+	c.deadline_ns = 42;
+	n = coalesce_flush(&c, 0x00, POWER_SWITCH_ALL, &final, cmds);
+	CHECK_EQ(n, POWER_SWITCH_COUNT);
+	CHECK_EQ(final, POWER_SWITCH_ALL);
+	CHECK_EQ(c.value, 0);
+	CHECK_EQ(c.care, 0);
+	CHECK_EQ(c.deadline_ns, 0);
+
+	/* An empty window sends nothing and keeps the device as it is. */
+	n = coalesce_flush(&c, 0x0a, 0x00, &final, cmds);
+	CHECK_EQ(n, 0);
+	CHECK_EQ(final, 0x0a);
+}
+
+/* Every sequence of requests over two outlets against a brute force fold. */
+static void test_exhaustive(void)
+{
+	char cmds[POWER_SWITCH_COUNT][BELLWIN_CMD_LEN];
+	unsigned seq, cur, i;
+
+	for (cur = 0; cur < 4; cur++) {
+		for (seq = 0; seq < 4 * 4 * 4 * 4; seq++) {
+			struct coalesce c = { 0 };
+			unsigned char want = cur, final, sent, on;
+			int n;
+
+			/* Three requests, each (value, care) of two bits. */
+			for (i = 0; i < 3; i++) {
+				unsigned v = seq >> (2 * i) & 3;
+				unsigned k = (seq >> 2 * (i + 1) & 3) | 1;
+
+				coalesce_add(&c, v, k);
+				want = (want & ~k) | (v & k);
+			}
+			n = coalesce_flush(&c, cur, POWER_SWITCH_ALL, &final, cmds);
+			CHECK_EQ(final, want);
+			decode(cmds, n, &sent, &on);
+			CHECK_EQ(sent, (unsigned char)(cur ^ want));
+			CHECK_EQ(on, want & (cur ^ want));
+		}
+	}
+}
+
+int main(void)
+{
+	test_last_writer_wins();
+	test_flush_only_changes();
+	test_flush_unknown();
+	test_flush_resets();
+	test_exhaustive();
+
+	return check_done("coalesce");
+}
@@ -0,0 +1,233 @@
+/*
+ * fanout.c against simulated splitters: transactions switch all devices
+ * or none, and roll back the ones already switched when a device is
+ * unplugged halfway.
+ *
+ * Linked with --wrap for bellwin_sim_start(), bellwin_sim_stop() and
+ * hid_write(), so that the simulators fanout_set() starts for SIM<n> get
+ * an initial mask from the test, are unplugged on a chosen write and keep
+ * their final mask once stopped.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+
+#include "sim.h"
+#include "fanout.h"
+#include "check.h"
+
+#define MAX_SIMS	8
+#define PLUGGED		-1
+
+struct sim_setup {
+	unsigned char mask;		/* initial */
+	int unplug_after;		/* writes, or PLUGGED */
+};
+
+static struct sim_setup setup[MAX_SIMS];
+static struct bellwin_sim *sims[MAX_SIMS];
+static hid_device *handles[MAX_SIMS];
+static unsigned writes[MAX_SIMS];
+static unsigned char final[MAX_SIMS];
+static unsigned started;
+
+struct bellwin_sim *__real_bellwin_sim_start(unsigned char mask,
+					     unsigned latency_us,
+					     hid_device **handle);
+void __real_bellwin_sim_stop(struct bellwin_sim *sim);
+int __real_hid_write(hid_device *dev, const unsigned char *data,
+		     size_t length);
+
+/* fanout_set() opens its targets in order, so SIM<n> of target k is sims[k]. */
+struct bellwin_sim *__wrap_bellwin_sim_start(unsigned char mask,
+					     unsigned latency_us,
+					     hid_device **handle)
+{
+	struct bellwin_sim *sim;
+	unsigned k = started++;
+
+	if (k >= MAX_SIMS)
+		return NULL;
+	sim = __real_bellwin_sim_start(setup[k].mask, latency_us, handle);
+	sims[k] = sim;
+	handles[k] = sim ? *handle : NULL;
+
+	return sim;
+}
+
+/*
+ * Reports still queued are handled before the simulator thread exits, so
+ * the mask is read once reopening has drained them.
+ */
+void __wrap_bellwin_sim_stop(struct bellwin_sim *sim)
+{
+	hid_device *hid;
+	unsigned k;
+
+	for (k = 0; sim && k < started && k < MAX_SIMS; k++) {
+		if (sims[k] != sim)
+			continue;
+		hid = bellwin_sim_reopen(sim);
+		final[k] = bellwin_sim_mask(sim);
+		if (hid)
+			hid_close(hid);
+	}
+	__real_bellwin_sim_stop(sim);
+}
+
+/* Unplug a simulator just before its setup[].unplug_after + 1'th write. */
+int __wrap_hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	unsigned k;
+
+	for (k = 0; k < started && k < MAX_SIMS; k++) {
+		if (handles[k] != dev)
+			continue;
+		if (setup[k].unplug_after == (int)writes[k]++)
+			bellwin_sim_unplug(sims[k]);
+	}
+
+	return __real_hid_write(dev, data, length);
+}
+
+static void reset(void)
+{
+	unsigned k;
+
+	for (k = 0; k < MAX_SIMS; k++) {
+		setup[k].mask = 0;
+		setup[k].unplug_after = PLUGGED;
+		sims[k] = NULL;
+		handles[k] = NULL;
+		writes[k] = 0;
+		final[k] = 0;
+	}
+	started = 0;
+}
+
+static int run(struct fanout_target *t, unsigned n, int transaction)
+{
+	const struct fanout_opts opts = {
+		.simulate = MAX_SIMS,
+		.sim_latency_us = 200,
+		.transaction = transaction,
+	};
+
+	return fanout_set(t, n, &opts);
+}
+
+static void check_error(const struct fanout_target *t, const char *msg)
+{
+	if (strcmp(t->error, msg))
+		fprintf(stderr, "%s: expected \"%s\", got \"%s\"\n",
+			t->device, msg, t->error);
+	CHECK(!strcmp(t->error, msg));
+}
+
+static void test_commit(void)
+{
+	struct fanout_target t[] = {
+		{ .device = "SIM0", .value = 0x03, .care = 0x03 },
+		{ .device = "SIM1", .value = 0x10, .care = 0x18 },
+		{ .device = "SIM2", .value = 0x00, .care = 0x01 },
+	};
+
+	reset();
+	setup[1].mask = 0x0c;
+	setup[2].mask = 0x1e;
+	CHECK_EQ(run(t, 3, 1), 0);
+	CHECK_EQ(started, 3);
+	CHECK_EQ(t[0].result, 0);
+	CHECK_EQ(t[1].result, 0);
+	CHECK_EQ(t[2].result, 0);
+	CHECK_EQ(t[0].before, 0x00);
+	CHECK_EQ(t[1].before, 0x0c);
+	CHECK_EQ(t[2].before, 0x1e);
+	CHECK_EQ(final[0], 0x03);
+	CHECK_EQ(final[1], 0x14);
+	CHECK_EQ(final[2], 0x1e);
+}
+
+/*
+ * SIM1 answers the status read and is unplugged before the switch: the
+ * others are switched back to where they were and every target fails.
+ */
+static void test_rollback(void)
+{
+	struct fanout_target t[] = {
+		{ .device = "SIM0", .value = 0x1f, .care = 0x1f },
+		{ .device = "SIM1", .value = 0x01, .care = 0x01 },
+		{ .device = "SIM2", .value = 0x00, .care = 0x06 },
+	};
+
+	reset();
+	setup[0].mask = 0x10;
+	setup[1].unplug_after = 1;
+	setup[2].mask = 0x0f;
+	CHECK_EQ(run(t, 3, 1), 3);
+	CHECK_EQ(t[0].result, -1);
+	CHECK_EQ(t[1].result, -1);
+	CHECK_EQ(t[2].result, -1);
+	CHECK_EQ(t[0].before, 0x10);
+	CHECK_EQ(t[2].before, 0x0f);
+	check_error(&t[0], "rolled back");
+	check_error(&t[1], "outlet 1 write failed, rollback failed");
+	check_error(&t[2], "rolled back");
+	CHECK_EQ(final[0], 0x10);
+	CHECK_EQ(final[1], 0x00);
+	CHECK_EQ(final[2], 0x0f);
+}
+
+/* A device that cannot report its state aborts before anything switches. */
+static void test_abort(void)
+{
+	struct fanout_target t[] = {
+		{ .device = "SIM0", .value = 0x01, .care = 0x01 },
+		{ .device = "SIM1", .value = 0x01, .care = 0x01 },
+	};
+
+	reset();
+	setup[0].unplug_after = 0;
+	CHECK_EQ(run(t, 2, 1), 2);
+	CHECK_EQ(t[0].result, -1);
+	CHECK_EQ(t[1].result, -1);
+	check_error(&t[0], "status read failed");
+	check_error(&t[1], "aborted");
+	CHECK_EQ(final[0], 0x00);
+	CHECK_EQ(final[1], 0x00);
+}
+
+/* Without a transaction the devices that worked stay switched. */
+static void test_partial(void)
+{
+	struct fanout_target t[] = {
+		{ .device = "SIM0", .value = 0x01, .care = 0x01 },
+		{ .device = "SIM1", .value = 0x01, .care = 0x01 },
+		{ .device = "SIM2", .value = 0x01, .care = 0x01 },
+	};
+
+	reset();
+	setup[1].unplug_after = 0;
+	CHECK_EQ(run(t, 3, 0), 1);
+	CHECK_EQ(t[0].result, 0);
+	CHECK_EQ(t[1].result, -1);
+	CHECK_EQ(t[2].result, 0);
+	check_error(&t[1], "outlet 1 write failed");
+	CHECK_EQ(final[0], 0x01);
+	CHECK_EQ(final[1], 0x00);
+	CHECK_EQ(final[2], 0x01);
+}
+
+int main(void)
+{
+	/* Writes to an unplugged simulator must fail, not kill the test. */
+	signal(SIGPIPE, SIG_IGN);
+
+	test_commit();
+	test_rollback();
+	test_abort();
+	test_partial();
+
+	return check_done("fanout");
+}
@@ -0,0 +1,208 @@
+/*
+ * groups.c: parsing, flattening of nested groups, error reporting and the
+ * perfect hash lookup.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "groups.h"
+#include "check.h"
+
+static char path[] = "/tmp/bellwin-test-groups-XXXXXX";
+
+/* Write @text as the config file and load it. */
+static struct groups *load(const char *text, char *err, size_t errlen)
+{
+	FILE *f = fopen(path, "w");
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	fputs(text, f);
+	fclose(f);
+	err[0] = '\0';
+
+	return groups_load(path, err, errlen);
+}
+
+/* Mask the entry @name has on device @device, 0 if none. */
+static unsigned mask_of(const struct groups *g, const char *name,
+			const char *device)
+{
+	const struct group_entry *e = groups_lookup(g, name);
+	unsigned i;
+
+	if (!e)
+		return 0;
+	for (i = 0; i < e->ntargets; i++)
+		if (!strcmp(g->devices[e->targets[i].dev], device))
+			return e->targets[i].mask;
+
+	return 0;
+}
+
+static void test_flatten(void)
+{
+	const struct group_entry *e;
+	struct groups *g;
+	char err[256];
+	unsigned i;
+
+	/* rack-7 uses web-psu and the group "all" before they are defined. */
+	g = load("# name          device      outlets\n"
+		 "outlet web-1    A1B2C3      1\n"
+		 "group  rack-7   web-1 web-psu sw-1 D4E5F6:4\n"
+		 "\n"
+		 "outlet web-psu  A1B2C3      2,3   # both supplies\n"
+		 "outlet sw-1     /dev/hidraw4 5\n"
+		 "group  all      rack-7 extra\n"
+		 "outlet extra    D4E5F6      1,4\n", err, sizeof(err));
+	CHECK(g != NULL);
+	if (!g) {
+		fprintf(stderr, "%s\n", err);
+		return;
+	}
+
+	CHECK_EQ(g->ndevices, 3);
+	CHECK_EQ(g->nentries, 6);
+	CHECK_EQ(mask_of(g, "web-1", "A1B2C3"), 0x01);
+	CHECK_EQ(mask_of(g, "web-psu", "A1B2C3"), 0x06);
+	CHECK_EQ(mask_of(g, "rack-7", "A1B2C3"), 0x07);
+	CHECK_EQ(mask_of(g, "rack-7", "/dev/hidraw4"), 0x10);
+	CHECK_EQ(mask_of(g, "rack-7", "D4E5F6"), 0x08);
+	CHECK_EQ(mask_of(g, "all", "D4E5F6"), 0x09);
+	CHECK_EQ(mask_of(g, "all", "A1B2C3"), 0x07);
+
+	/* One target per device, sorted by device. */
+	e = groups_lookup(g, "all");
+	CHECK(e && e->ntargets == 3);
+	for (i = 1; e && i < e->ntargets; i++)
+		CHECK(e->targets[i - 1].dev < e->targets[i].dev);
+
+	CHECK(groups_lookup(g, "web") == NULL);
+	CHECK(groups_lookup(g, "web-10") == NULL);
+	CHECK(groups_lookup(g, "") == NULL);
+	groups_free(g);
+}
+
+static void expect_error(const char *text, const char *msg)
+{
+	struct groups *g;
+	char err[256];
+
+	g = load(text, err, sizeof(err));
+	CHECK(g == NULL);
+	if (g) {
+		groups_free(g);
+		return;
+	}
+	if (!strstr(err, msg)) {
+		fprintf(stderr, "expected \"%s\", got \"%s\"\n", msg, err);
+		CHECK(strstr(err, msg) != NULL);
+	}
+}
+
+static void test_errors(void)
+{
+	expect_error("outlet a X 1\n"
+		     "group b a c\n"
+		     "group c b\n", "group b is part of a cycle");
+	expect_error("group self self\n", "is part of a cycle");
+	expect_error("outlet a X 1\n"
+		     "outlet a Y 2\n", "line 2: a defined twice");
+	expect_error("outlet a X 1\n"
+		     "group b a nope\n", "line 2: unknown outlet or group nope");
+	expect_error("outlet a X 6\n", "line 1: usage: outlet");
+	expect_error("outlet a X 1,\n", "line 1: usage: outlet");
+	expect_error("\n\noutlet a X\n", "line 3: usage: outlet");
+	expect_error("group g\n", "line 1: usage: group");
+	expect_error("socket a X 1\n", "line 1: unknown keyword socket");
+	expect_error("outlet a X 1\n"
+		     "group 7th-floor a\n", "line 2: name 7th-floor starts with a digit");
+}
+
+static void test_empty(void)
+{
+	struct groups *g;
+	char err[256];
+
+	g = load("# nothing here\n\n", err, sizeof(err));
+	CHECK(g != NULL);
+	CHECK(groups_lookup(g, "anything") == NULL);
+	groups_free(g);
+}
+
+/* Every name of a large file is found, and nothing else is. */
+static void test_perfect_hash(void)
+{
+	const unsigned outlets = 20000, groups = 2000;
+	struct groups *g;
+	char err[256], name[64];
+	FILE *f = fopen(path, "w");
+	unsigned i;
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	for (i = 0; i < outlets; i++)
+		fprintf(f, "outlet host-%u SER%05u %u\n", i, i / 5, i % 5 + 1);
+	for (i = 0; i < groups; i++)
+		fprintf(f, "group rack-%u host-%u host-%u host-%u\n", i,
+			i * 10, i * 10 + 1, i * 10 + 5);
+	fclose(f);
+
+	g = groups_load(path, err, sizeof(err));
+	CHECK(g != NULL);
+	if (!g) {
+		fprintf(stderr, "%s\n", err);
+		return;
+	}
+	CHECK_EQ(g->nentries, outlets + groups);
+	CHECK_EQ(g->ndevices, outlets / 5);
+
+	for (i = 0; i < outlets; i++) {
+		const struct group_entry *e;
+
+		snprintf(name, sizeof(name), "host-%u", i);
+		e = groups_lookup(g, name);
+		CHECK(e && !strcmp(e->name, name) && e->ntargets == 1 &&
+		      e->targets[0].mask == 1u << (i % 5));
+
+		snprintf(name, sizeof(name), "host-%u", outlets + i);
+		CHECK(groups_lookup(g, name) == NULL);
+	}
+	for (i = 0; i < groups; i++) {
+		const struct group_entry *e;
+
+		snprintf(name, sizeof(name), "rack-%u", i);
+		e = groups_lookup(g, name);
+		/* host-10i and host-10i+1 share a device, host-10i+5 is next. */
+		CHECK(e && e->ntargets == 2 && e->targets[0].mask == 0x03 &&
+		      e->targets[1].mask == 0x01);
+	}
+	groups_free(g);
+}
+
+int main(void)
+{
+	int fd = mkstemp(path);
+
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	test_flatten();
+	test_errors();
+	test_empty();
+	test_perfect_hash();
+	unlink(path);
+
+	return check_done("groups");
+}
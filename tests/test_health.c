@@ -0,0 +1,162 @@
+/*
+ * health.c: quarantine on consecutive timeouts or a high error rate, probe
+ * backoff and reinstatement.
+ */
+
+#include <string.h>
+
+#include "health.h"
+#include "check.h"
+
+#define MS	1000000ull
+
+static void test_timeouts(void)
+{
+	struct health h;
+	unsigned i;
+
+	health_init(&h);
+	for (i = 0; i < HEALTH_MAX_TIMEOUTS - 1; i++)
+		health_failure(&h, true, 0);
+	CHECK(health_usable(&h));
+
+	/* A success in between starts the count again. */
+	health_success(&h, 1000, 0);
+	for (i = 0; i < HEALTH_MAX_TIMEOUTS - 1; i++)
+		health_failure(&h, true, 0);
+	CHECK(health_usable(&h));
+
+	health_failure(&h, true, 5 * MS);
+	CHECK(!health_usable(&h));
+	CHECK_EQ(h.state, HEALTH_QUARANTINED);
+	CHECK_EQ(h.quarantines, 1);
+	CHECK_EQ(health_next_probe(&h), 5 * MS + HEALTH_PROBE_MS * MS);
+}
+
+static void test_error_rate(void)
+{
+	struct health h;
+	unsigned i;
+
+	/* Errors that are not timeouts only count through the error rate. */
+	health_init(&h);
+	for (i = 0; i < 100 && health_usable(&h); i++) {
+		health_failure(&h, false, 0);
+		health_success(&h, 1000, 0);
+		health_success(&h, 1000, 0);
+		health_success(&h, 1000, 0);
+	}
+	CHECK(health_usable(&h));
+
+	for (i = 0; i < 100 && health_usable(&h); i++)
+		health_failure(&h, false, 0);
+	CHECK(!health_usable(&h));
+	CHECK(h.samples >= HEALTH_MIN_SAMPLES);
+	CHECK(h.err_rate >> HEALTH_EWMA_SHIFT > HEALTH_MAX_ERR_RATE);
+
+	/* Too few samples to judge a device by its error rate. */
+	health_init(&h);
+	health_failure(&h, false, 0);
+	health_failure(&h, false, 0);
+	CHECK(health_usable(&h));
+}
+
+static void quarantine(struct health *h, uint64_t now)
+{
+	unsigned i;
+
+	for (i = 0; i < HEALTH_MAX_TIMEOUTS; i++)
+		health_failure(h, true, now);
+}
+
+static void test_probe_backoff(void)
+{
+	struct health h;
+	uint64_t now = 0, interval = HEALTH_PROBE_MS;
+
+	health_init(&h);
+	quarantine(&h, now);
+	CHECK(!health_probe_due(&h, now));
+
+	/* Every failed probe doubles the interval, up to the maximum. */
+	while (interval < HEALTH_PROBE_MAX_MS) {
+		CHECK_EQ(h.probe_interval_ms, interval);
+		now += interval * MS;
+		CHECK(!health_probe_due(&h, now - 1));
+		CHECK(health_probe_due(&h, now));
+		CHECK_EQ(h.state, HEALTH_PROBING);
+		CHECK_EQ(health_next_probe(&h), UINT64_MAX);
+		CHECK(!health_probe_due(&h, now));
+		health_failure(&h, true, now);
+		interval *= 2;
+		if (interval > HEALTH_PROBE_MAX_MS)
+			interval = HEALTH_PROBE_MAX_MS;
+	}
+	CHECK_EQ(h.probe_interval_ms, HEALTH_PROBE_MAX_MS);
+	health_failure(&h, true, now);
+	CHECK_EQ(h.probe_interval_ms, HEALTH_PROBE_MAX_MS);
+	CHECK_EQ(h.quarantines, 1);
+}
+
+static void test_reinstate(void)
+{
+	struct health h;
+	uint64_t now = 0;
+	unsigned i;
+
+	health_init(&h);
+	quarantine(&h, now);
+	health_failure(&h, true, now);		/* a failed probe */
+
+	/* HEALTH_PROBE_OK good probes in a row, each due at once. */
+	now += 2 * HEALTH_PROBE_MS * MS;
+	for (i = 0; i < HEALTH_PROBE_OK; i++) {
+		CHECK(health_probe_due(&h, now));
+		health_success(&h, 1000, now);
+		CHECK_EQ(health_usable(&h), i + 1 == HEALTH_PROBE_OK);
+	}
+	CHECK_EQ(h.err_rate, 0);
+	CHECK_EQ(h.probe_interval_ms, HEALTH_PROBE_MS);
+
+	/* A failure between good probes starts the confirmation over. */
+	quarantine(&h, now);
+	now += HEALTH_PROBE_MS * MS;
+	CHECK(health_probe_due(&h, now));
+	health_success(&h, 1000, now);
+	CHECK(health_probe_due(&h, now));
+	health_failure(&h, true, now);
+	CHECK(!health_usable(&h));
+	now += 2 * HEALTH_PROBE_MS * MS;
+	CHECK(health_probe_due(&h, now));
+	health_success(&h, 1000, now);
+	CHECK(!health_usable(&h));
+}
+
+static void test_format(void)
+{
+	struct health h;
+	char buf[512];
+
+	health_init(&h);
+	health_success(&h, 2000000, 0);
+	health_format(&h, 0, buf, sizeof(buf));
+	CHECK(!strncmp(buf, "state=ok err_rate=0.000 ", 24));
+	CHECK(strstr(buf, " p50_us=") != NULL);
+	CHECK(strstr(buf, "probe_in_ms") == NULL);
+
+	quarantine(&h, 0);
+	health_format(&h, 250 * MS, buf, sizeof(buf));
+	CHECK(!strncmp(buf, "state=quarantined ", 18));
+	CHECK(strstr(buf, " probe_in_ms=750") != NULL);
+}
+
+int main(void)
+{
+	test_timeouts();
+	test_error_rate();
+	test_probe_backoff();
+	test_reinstate();
+	test_format();
+
+	return check_done("health");
+}
@@ -0,0 +1,86 @@
+/*
+ * hist.c: percentiles are exact for small values, within 12.5% above, and
+ * never exceed the largest sample.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "hist.h"
+#include "check.h"
+
+static void test_empty(void)
+{
+	struct hist h;
+
+	memset(&h, 0, sizeof(h));
+	CHECK_EQ(hist_percentile(&h, 0.5), 0);
+	CHECK_EQ(hist_percentile(&h, 1.0), 0);
+}
+
+static void test_small_exact(void)
+{
+	struct hist h;
+	unsigned v;
+
+	memset(&h, 0, sizeof(h));
+	for (v = 0; v < 8; v++)
+		hist_add(&h, v);
+	CHECK_EQ(h.count, 8);
+	CHECK_EQ(h.max, 7);
+	CHECK_EQ(hist_percentile(&h, 0.0), 0);
+	CHECK_EQ(hist_percentile(&h, 0.5), 4);
+	CHECK_EQ(hist_percentile(&h, 0.99), 7);
+	CHECK_EQ(hist_percentile(&h, 1.0), 7);
+}
+
+/* A single sample of any size is reported within 12.5%, never above. */
+static void test_precision(void)
+{
+	uint64_t v, p;
+	unsigned shift, i;
+
+	for (shift = 0; shift < 60; shift++) {
+		for (i = 0; i < 16; i++) {
+			struct hist h;
+
+			v = (1ull << shift) + i * ((1ull << shift) / 16 + 1);
+			memset(&h, 0, sizeof(h));
+			hist_add(&h, v);
+			p = hist_percentile(&h, 0.5);
+			CHECK(p <= v);
+			CHECK(p >= v - v / 8);
+			CHECK_EQ(hist_percentile(&h, 1.0), v);
+		}
+	}
+}
+
+static void test_percentiles(void)
+{
+	struct hist h;
+	uint64_t p50, p99;
+	unsigned i;
+
+	/* 1..1000 us in ns. */
+	memset(&h, 0, sizeof(h));
+	for (i = 1; i <= 1000; i++)
+		hist_add(&h, i * 1000ull);
+
+	p50 = hist_percentile(&h, 0.5);
+	p99 = hist_percentile(&h, 0.99);
+	CHECK(p50 >= 500000 - 500000 / 8 && p50 <= 501000);
+	CHECK(p99 >= 990000 - 990000 / 8 && p99 <= 991000);
+	CHECK(p50 <= p99);
+	CHECK(p99 <= hist_percentile(&h, 1.0));
+	CHECK_EQ(hist_percentile(&h, 1.0), 1000000);
+}
+
+int main(void)
+{
+	test_empty();
+	test_small_exact();
+	test_precision();
+	test_percentiles();
+
+	return check_done("hist");
+}
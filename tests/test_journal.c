@@ -0,0 +1,313 @@
+/*
+ * journal.c: recovery from snapshot and log, generations, and torn or
+ * stale records.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "check.h"
+
+/* Log layout, see journal.c: a 64 byte header, then 16 byte records. */
+#define LOG_HEADER	64
+#define RECORD_SIZE	16
+#define RECORD_VALUE	12
+
+static char dir[] = "/tmp/bellwin-test-journal-XXXXXX";
+static char path[64];
+
+static const char *const keys[] = { "SER0", "SER1", "/dev/hidraw7" };
+
+static void cleanup(void)
+{
+	char name[80];
+
+	snprintf(name, sizeof(name), "%s.snap", path);
+	unlink(name);
+	unlink(path);
+}
+
+/* Reopen the journal, returning the recovered state of @keys[0..3). */
+static struct journal_dev *reopen(struct journal *j, unsigned *n)
+{
+	struct journal_dev *devs;
+
+	journal_close(j);
+	if (journal_open(j, path, &devs, n)) {
+		perror(path);
+		exit(1);
+	}
+
+	return devs;
+}
+
+static void test_fresh(void)
+{
+	struct journal j;
+	struct journal_dev *devs;
+	unsigned n;
+
+	cleanup();
+	CHECK_EQ(journal_open(&j, path, &devs, &n), 0);
+	CHECK_EQ(n, 0);
+	CHECK_EQ(j.replayed, 0);
+	free(devs);
+
+	/* Without a snapshot there are no slots to log against. */
+	CHECK_EQ(journal_append(&j, 0, 1, 1), 0);
+	CHECK_EQ(j.appends, 0);
+	journal_close(&j);
+}
+
+static void test_recover(void)
+{
+	const uint8_t desired[] = { 0x01, 0x00, 0x1f }, want[] = { 0x03, 0, 0x1f };
+	struct journal j;
+	struct journal_dev *devs;
+	unsigned n;
+
+	cleanup();
+	journal_open(&j, path, &devs, &n);
+	free(devs);
+	CHECK_EQ(journal_snapshot(&j, keys, desired, want, 3), 0);
+	CHECK_EQ(j.gen, 1);
+
+	CHECK_EQ(journal_append(&j, 0, 0x02, 0x02), 0);	/* 2 on */
+	CHECK_EQ(journal_append(&j, 1, 0x10, 0x18), 0);	/* 4 off, 5 on */
+	CHECK_EQ(journal_append(&j, 0, 0x00, 0x01), 0);	/* 1 off */
+	CHECK_EQ(journal_append(&j, 3, 0x01, 0x01), 0);	/* no such slot */
+	CHECK_EQ(j.appends, 3);
+
+	devs = reopen(&j, &n);
+	CHECK_EQ(n, 3);
+	CHECK_EQ(j.replayed, 3);
+	CHECK_EQ(j.gen, 1);
+	CHECK(!strcmp(devs[2].key, "/dev/hidraw7"));
+	CHECK_EQ(devs[0].desired, 0x02);
+	CHECK_EQ(devs[0].want, 0x03);
+	CHECK_EQ(devs[1].desired, 0x10);
+	CHECK_EQ(devs[1].want, 0x18);
+	CHECK_EQ(devs[2].desired, 0x1f);
+	CHECK_EQ(devs[2].want, 0x1f);
+	free(devs);
+
+	/* Records appended after recovery follow on from the replayed ones. */
+	CHECK_EQ(journal_append(&j, 2, 0x00, 0x04), 0);
+	devs = reopen(&j, &n);
+	CHECK_EQ(j.replayed, 4);
+	CHECK_EQ(devs[2].desired, 0x1b);
+	free(devs);
+	journal_close(&j);
+}
+
+/* Records of an older generation are not applied to a newer snapshot. */
+static void test_generations(void)
+{
+	const uint8_t zero[3] = { 0 };
+	uint8_t desired[3] = { 0 }, want[3] = { 0 };
+	struct journal j;
+	struct journal_dev *devs;
+	unsigned n, i;
+
+	cleanup();
+	journal_open(&j, path, &devs, &n);
+	free(devs);
+	journal_snapshot(&j, keys, zero, zero, 3);
+	for (i = 0; i < 5; i++)
+		journal_append(&j, 1, 0x1f, 0x1f);
+
+	/* The daemon folds the log into its snapshot and starts afresh. */
+	desired[1] = want[1] = 0x1f;
+	CHECK_EQ(journal_snapshot(&j, keys, desired, want, 3), 0);
+	CHECK_EQ(j.gen, 2);
+	journal_append(&j, 1, 0x00, 0x01);
+	journal_append(&j, 0, 0x04, 0x04);
+
+	devs = reopen(&j, &n);
+	CHECK_EQ(j.gen, 2);
+	CHECK_EQ(j.replayed, 2);
+	CHECK_EQ(devs[0].desired, 0x04);
+	CHECK_EQ(devs[1].desired, 0x1e);
+	CHECK_EQ(devs[1].want, 0x1f);
+	free(devs);
+	journal_close(&j);
+}
+
+/* Flip a byte of record @idx, as a crash halfway through an append would. */
+static void tear(unsigned idx)
+{
+	int fd = open(path, O_RDWR);
+	unsigned char b;
+	off_t off = LOG_HEADER + idx * RECORD_SIZE + RECORD_VALUE;
+
+	if (fd < 0 || pread(fd, &b, 1, off) != 1) {
+		perror(path);
+		exit(1);
+	}
+	b ^= 0x40;
+	if (pwrite(fd, &b, 1, off) != 1) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+}
+
+static void test_torn(void)
+{
+	const uint8_t zero[3] = { 0 };
+	struct journal j;
+	struct journal_dev *devs;
+	unsigned n, i;
+
+	cleanup();
+	journal_open(&j, path, &devs, &n);
+	free(devs);
+	journal_snapshot(&j, keys, zero, zero, 3);
+	for (i = 0; i < 5; i++)
+		journal_append(&j, 0, 1u << i, 1u << i);
+	journal_close(&j);
+
+	/* Replay stops at the torn record, the last one written. */
+	tear(4);
+	devs = reopen(&j, &n);
+	CHECK_EQ(j.replayed, 4);
+	CHECK_EQ(devs[0].desired, 0x0f);
+	CHECK_EQ(devs[0].want, 0x0f);
+	free(devs);
+
+	/* The next record takes its place and is recovered. */
+	CHECK_EQ(journal_append(&j, 2, 0x04, 0x04), 0);
+	devs = reopen(&j, &n);
+	CHECK_EQ(j.replayed, 5);
+	CHECK_EQ(devs[0].desired, 0x0f);
+	CHECK_EQ(devs[2].desired, 0x04);
+	free(devs);
+	journal_close(&j);
+}
+
+static void test_bad_snapshot(void)
+{
+	const uint8_t ones[3] = { 1, 1, 1 };
+	struct journal j;
+	struct journal_dev *devs;
+	char name[80];
+	unsigned n;
+	FILE *f;
+
+	cleanup();
+	journal_open(&j, path, &devs, &n);
+	free(devs);
+	journal_snapshot(&j, keys, ones, ones, 3);
+	journal_append(&j, 0, 0, 1);
+	journal_close(&j);
+
+	/* A damaged snapshot is ignored, and with it the log. */
+	snprintf(name, sizeof(name), "%s.snap", path);
+	f = fopen(name, "r+");
+	CHECK(f != NULL);
+	if (!f)
+		return;
+	fseek(f, -1, SEEK_END);		/* the last device's want */
+	fputc('X', f);
+	fclose(f);
+
+	CHECK_EQ(journal_open(&j, path, &devs, &n), 0);
+	CHECK_EQ(n, 0);
+	CHECK_EQ(j.replayed, 0);
+	free(devs);
+	journal_close(&j);
+}
+
+/*
+ * Without its snapshot the log's records are not replayed now, nor once a
+ * new snapshot reuses slot numbers for other devices.
+ */
+static void test_lost_snapshot(void)
+{
+	static const char *const others[] = { "NEW-B" };
+	const uint8_t zero[3] = { 0 };
+	struct journal j;
+	struct journal_dev *devs;
+	char name[80];
+	unsigned n;
+
+	cleanup();
+	journal_open(&j, path, &devs, &n);
+	free(devs);
+	journal_snapshot(&j, keys, zero, zero, 3);
+	journal_append(&j, 0, 0x1f, 0x1f);
+	journal_close(&j);
+
+	snprintf(name, sizeof(name), "%s.snap", path);
+	unlink(name);
+	devs = reopen(&j, &n);
+	CHECK_EQ(n, 0);
+	CHECK_EQ(j.replayed, 0);
+	free(devs);
+
+	CHECK_EQ(journal_snapshot(&j, others, zero, zero, 1), 0);
+	CHECK_EQ(j.gen, 2);
+	devs = reopen(&j, &n);
+	CHECK_EQ(n, 1);
+	CHECK(!strcmp(devs[0].key, "NEW-B"));
+	CHECK_EQ(j.replayed, 0);
+	CHECK_EQ(devs[0].desired, 0);
+	CHECK_EQ(devs[0].want, 0);
+	free(devs);
+	journal_close(&j);
+}
+
+static void test_full(void)
+{
+	const uint8_t zero[1] = { 0 };
+	struct journal j;
+	struct journal_dev *devs;
+	unsigned n, i;
+	int ret = 0;
+
+	cleanup();
+	journal_open(&j, path, &devs, &n);
+	free(devs);
+	journal_snapshot(&j, keys, zero, zero, 1);
+
+	for (i = 1; i < JOURNAL_SNAPSHOT_AT && !ret; i++)
+		ret = journal_append(&j, 0, i & 1, 1);
+	CHECK_EQ(ret, 0);
+	CHECK_EQ(journal_append(&j, 0, 0, 1), 1);	/* snapshot due */
+	for (i = JOURNAL_SNAPSHOT_AT; i < JOURNAL_RECORDS; i++)
+		ret = journal_append(&j, 0, 0, 1);
+	CHECK_EQ(ret, 1);
+	CHECK_EQ(journal_append(&j, 0, 1, 1), -1);	/* dropped */
+
+	devs = reopen(&j, &n);
+	CHECK_EQ(j.replayed, JOURNAL_RECORDS);
+	CHECK_EQ(devs[0].desired, 0);
+	free(devs);
+	journal_close(&j);
+}
+
+int main(void)
+{
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/journal", dir);
+
+	test_fresh();
+	test_recover();
+	test_generations();
+	test_torn();
+	test_bad_snapshot();
+	test_lost_snapshot();
+	test_full();
+
+	cleanup();
+	rmdir(dir);
+
+	return check_done("journal");
+}
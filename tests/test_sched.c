@@ -0,0 +1,183 @@
+/*
+ * sched.c: strict priority between classes, round robin between flows of
+ * a class, queue bounds and queue wait accounting.
+ */
+
+#include <string.h>
+
+#include "sched.h"
+#include "check.h"
+
+struct item {
+	struct sched_item it;	/* first, items are cast back */
+	unsigned flow;
+	unsigned seq;
+};
+
+static void flow_init(struct sched_flow *f, struct sched *s,
+		      enum sched_class cls)
+{
+	memset(f, 0, sizeof(*f));
+	f->sched = s;
+	f->cls = cls;
+}
+
+static struct item *next(struct sched *s, enum sched_class *cls)
+{
+	return (struct item *)sched_dequeue(s, 0, cls);
+}
+
+static void test_priority(void)
+{
+	struct sched s;
+	struct sched_flow mon, ctl, em;
+	struct item items[3] = { { .flow = 0 }, { .flow = 1 }, { .flow = 2 } };
+	enum sched_class cls;
+
+	sched_init(&s, 16, 16);
+	flow_init(&mon, &s, SCHED_MONITOR);
+	flow_init(&ctl, &s, SCHED_CONTROL);
+	flow_init(&em, &s, SCHED_EMERGENCY);
+
+	/* Queued lowest class first, served highest first. */
+	CHECK_EQ(sched_enqueue(&mon, &items[0].it, 0), 0);
+	CHECK_EQ(sched_enqueue(&ctl, &items[1].it, 0), 0);
+	CHECK_EQ(sched_enqueue(&em, &items[2].it, 0), 0);
+	CHECK_EQ(s.depth, 3);
+
+	CHECK(next(&s, &cls) == &items[2]);
+	CHECK_EQ(cls, SCHED_EMERGENCY);
+	CHECK(next(&s, &cls) == &items[1]);
+	CHECK_EQ(cls, SCHED_CONTROL);
+	CHECK(next(&s, &cls) == &items[0]);
+	CHECK_EQ(cls, SCHED_MONITOR);
+	CHECK(next(&s, NULL) == NULL);
+	CHECK_EQ(s.depth, 0);
+}
+
+/* A flow with a deep backlog only gets every other turn. */
+static void test_round_robin(void)
+{
+	struct sched s;
+	struct sched_flow hog, a, b;
+	struct item hi[8], ai[2], bi[2];
+	unsigned order[12], i, n = 0;
+	struct item *it;
+
+	sched_init(&s, 64, 64);
+	flow_init(&hog, &s, SCHED_MONITOR);
+	flow_init(&a, &s, SCHED_MONITOR);
+	flow_init(&b, &s, SCHED_MONITOR);
+
+	for (i = 0; i < 8; i++) {
+		hi[i] = (struct item){ .flow = 0, .seq = i };
+		sched_enqueue(&hog, &hi[i].it, 0);
+	}
+	for (i = 0; i < 2; i++) {
+		ai[i] = (struct item){ .flow = 1, .seq = i };
+		bi[i] = (struct item){ .flow = 2, .seq = i };
+		sched_enqueue(&a, &ai[i].it, 0);
+		sched_enqueue(&b, &bi[i].it, 0);
+	}
+
+	while ((it = next(&s, NULL)) && n < 12)
+		order[n++] = it->flow * 100 + it->seq;
+	CHECK_EQ(n, 12);
+
+	/* hog, a, b take turns while all three have work, FIFO within. */
+	CHECK_EQ(order[0], 0);
+	CHECK_EQ(order[1], 100);
+	CHECK_EQ(order[2], 200);
+	CHECK_EQ(order[3], 1);
+	CHECK_EQ(order[4], 101);
+	CHECK_EQ(order[5], 201);
+	for (i = 6; i < 12; i++)
+		CHECK_EQ(order[i], i - 4);
+}
+
+/* A flow that empties and comes back joins the end of the round. */
+static void test_rejoin(void)
+{
+	struct sched s;
+	struct sched_flow a, b;
+	struct item a1 = { .flow = 1 }, a2 = { .flow = 1, .seq = 1 };
+	struct item b1 = { .flow = 2 }, b2 = { .flow = 2, .seq = 1 };
+
+	sched_init(&s, 16, 16);
+	flow_init(&a, &s, SCHED_CONTROL);
+	flow_init(&b, &s, SCHED_CONTROL);
+
+	sched_enqueue(&a, &a1.it, 0);
+	sched_enqueue(&b, &b1.it, 0);
+	sched_enqueue(&b, &b2.it, 0);
+	CHECK(next(&s, NULL) == &a1);
+	sched_enqueue(&a, &a2.it, 0);
+	CHECK(next(&s, NULL) == &b1);
+	CHECK(next(&s, NULL) == &a2);
+	CHECK(next(&s, NULL) == &b2);
+	CHECK(next(&s, NULL) == NULL);
+}
+
+static void test_bounds(void)
+{
+	struct sched s;
+	struct sched_flow a, b, em;
+	struct item items[8];
+	unsigned i;
+
+	sched_init(&s, 4, 3);
+	flow_init(&a, &s, SCHED_MONITOR);
+	flow_init(&b, &s, SCHED_CONTROL);
+	flow_init(&em, &s, SCHED_EMERGENCY);
+
+	/* The flow limit comes first... */
+	for (i = 0; i < 3; i++)
+		CHECK_EQ(sched_enqueue(&a, &items[i].it, 0), 0);
+	CHECK_EQ(sched_enqueue(&a, &items[3].it, 0), (unsigned long long)-1);
+
+	/* ...then the device limit across flows. */
+	CHECK_EQ(sched_enqueue(&b, &items[4].it, 0), 0);
+	CHECK_EQ(sched_enqueue(&b, &items[5].it, 0), (unsigned long long)-1);
+	CHECK_EQ(s.rejected, 2);
+
+	/* Emergency requests get past a full device queue. */
+	CHECK_EQ(sched_enqueue(&em, &items[6].it, 0), 0);
+	CHECK_EQ(s.depth, 5);
+	CHECK(next(&s, NULL) == &items[6]);
+
+	/* Room again once something was served. */
+	next(&s, NULL);
+	next(&s, NULL);
+	CHECK_EQ(sched_enqueue(&b, &items[5].it, 0), 0);
+}
+
+static void test_qwait(void)
+{
+	struct sched s;
+	struct sched_flow a;
+	struct item items[4];
+	unsigned i;
+
+	sched_init(&s, 16, 16);
+	flow_init(&a, &s, SCHED_CONTROL);
+
+	for (i = 0; i < 4; i++)
+		sched_enqueue(&a, &items[i].it, i * 1000);
+	for (i = 0; i < 4; i++)
+		sched_dequeue(&s, 10000, NULL);
+
+	CHECK_EQ(s.qwait[SCHED_CONTROL].count, 4);
+	CHECK_EQ(s.qwait[SCHED_CONTROL].max, 10000);
+	CHECK_EQ(s.qwait[SCHED_MONITOR].count, 0);
+}
+
+int main(void)
+{
+	test_priority();
+	test_round_robin();
+	test_rejoin();
+	test_bounds();
+	test_qwait();
+
+	return check_done("sched");
+}
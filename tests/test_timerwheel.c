@@ -0,0 +1,250 @@
+/*
+ * timerwheel.c: timers fire on the tick they are due, never early, across
+ * every wheel level, cascades and re-arms from callbacks.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timerwheel.h"
+#include "check.h"
+
+#define MS	TW_TICK_NS
+#define START	(123 * 1000000000ull + 456789)	/* not on a tick */
+
+struct clock {
+	uint64_t now;		/* passed to timer_wheel_run() */
+	uint64_t prev;		/* previous run */
+};
+
+struct tt {
+	struct timer t;
+	uint64_t due;		/* ns */
+	uint64_t fired;		/* ns, 0 if not yet */
+	uint64_t prev;		/* the run before the one it fired in */
+	unsigned count;
+	uint64_t period;	/* re-arm from the callback */
+	struct timer_wheel *w;
+};
+
+static void fire(void *ctx, void *arg)
+{
+	struct clock *c = ctx;
+	struct tt *tt = arg;
+
+	tt->fired = c->now;
+	tt->prev = c->prev;
+	tt->count++;
+	if (tt->period) {
+		tt->due += tt->period;
+		timer_add(tt->w, &tt->t, tt->due);
+	}
+}
+
+/* The tick a timer due at @due fires on, as a time. */
+static uint64_t tick_of(uint64_t due)
+{
+	return START + (due - START + MS - 1) / MS * MS;
+}
+
+/* Run the wheel from one timer_wheel_next() to the next until it is empty. */
+static void run_all(struct timer_wheel *w, struct clock *c)
+{
+	uint64_t next;
+
+	while ((next = timer_wheel_next(w)) != UINT64_MAX) {
+		CHECK(next >= c->now);
+		c->prev = c->now;
+		c->now = next;
+		timer_wheel_run(w, next, c);
+	}
+}
+
+/* Distances at and around every level boundary fire exactly on time. */
+static void test_levels(void)
+{
+	static const uint64_t delta_ms[] = {
+		1, 2, 63, 64, 65, 127, 128, 4095, 4096, 4097, 200000,
+		262143, 262144, 262145, 16777215, 16777216, 16777217,
+		1073741823,
+	};
+	const unsigned n = sizeof(delta_ms) / sizeof(delta_ms[0]);
+	struct timer_wheel w;
+	struct clock c = { .now = START };
+	struct tt tt[2 * sizeof(delta_ms) / sizeof(delta_ms[0])];
+	unsigned i;
+
+	timer_wheel_init(&w, START);
+	/* Start off a slot boundary so cascades are not aligned with adds. */
+	c.now = START + 37 * MS;
+	timer_wheel_run(&w, c.now, &c);
+
+	memset(tt, 0, sizeof(tt));
+	for (i = 0; i < 2 * n; i++) {
+		/* Each distance exactly on a tick and just after one. */
+		tt[i].due = c.now + delta_ms[i / 2] * MS + (i & 1);
+		timer_init(&tt[i].t, fire, &tt[i]);
+		timer_add(&w, &tt[i].t, tt[i].due);
+		CHECK_EQ(timer_expires_ns(&w, &tt[i].t), tick_of(tt[i].due));
+	}
+	CHECK_EQ(w.count, 2 * n);
+
+	run_all(&w, &c);
+	CHECK_EQ(w.count, 0);
+	for (i = 0; i < 2 * n; i++) {
+		CHECK_EQ(tt[i].count, 1);
+		CHECK_EQ(tt[i].fired, tick_of(tt[i].due));
+		CHECK(!timer_pending(&tt[i].t));
+	}
+}
+
+/* Farther out than the last wheel: parked, then moved down in time. */
+static void test_beyond_range(void)
+{
+	struct timer_wheel w;
+	struct clock c = { .now = START };
+	struct tt tt = { 0 };
+
+	timer_wheel_init(&w, START);
+	tt.due = START + 3 * (1ull << (TW_BITS * TW_LEVELS)) * MS + 5 * MS;
+	timer_init(&tt.t, fire, &tt);
+	timer_add(&w, &tt.t, tt.due);
+	run_all(&w, &c);
+	CHECK_EQ(tt.count, 1);
+	CHECK_EQ(tt.fired, tt.due);
+}
+
+/*
+ * Random timers, some cancelled or re-armed, run at random steps: each
+ * fires once, at the first run at or after its tick, and cancelled ones
+ * never do.
+ */
+static void test_random(void)
+{
+	enum { N = 20000 };
+	struct timer_wheel w;
+	struct clock c = { .now = START };
+	struct tt *tt = calloc(N, sizeof(*tt));
+	uint64_t end = START;
+	unsigned i, cancelled = 0;
+
+	if (!tt)
+		abort();
+	srandom(1);
+	timer_wheel_init(&w, START);
+	for (i = 0; i < N; i++) {
+		/* Log-uniform up to about 18 hours. */
+		uint64_t range = 1ull << (random() % 27);
+
+		tt[i].due = START + (random() % range) * MS + random() % MS;
+		timer_init(&tt[i].t, fire, &tt[i]);
+		timer_add(&w, &tt[i].t, tt[i].due);
+	}
+	for (i = 0; i < N; i += 7) {
+		if (i % 2) {
+			timer_del(&w, &tt[i].t);
+			tt[i].due = 0;
+			cancelled++;
+		} else {
+			tt[i].due += random() % (1000 * MS);
+			timer_add(&w, &tt[i].t, tt[i].due);
+		}
+	}
+	timer_del(&w, &tt[7].t);		/* already cancelled */
+	CHECK_EQ(w.count, N - cancelled);
+
+	for (i = 0; i < N; i++)
+		if (tt[i].due > end)
+			end = tt[i].due;
+	while (c.now <= end + MS) {
+		c.prev = c.now;
+		c.now += random() % (1ull << (random() % 30));
+		timer_wheel_run(&w, c.now, &c);
+	}
+	CHECK_EQ(w.count, 0);
+	for (i = 0; i < N; i++) {
+		CHECK_EQ(tt[i].count, tt[i].due ? 1 : 0);
+		if (!tt[i].due)
+			continue;
+		CHECK(tick_of(tt[i].due) <= tt[i].fired);
+		CHECK(tick_of(tt[i].due) > tt[i].prev);
+	}
+	free(tt);
+}
+
+/* A timer re-armed from its callback keeps its period. */
+static void test_periodic(void)
+{
+	struct timer_wheel w;
+	struct clock c = { .now = START };
+	struct tt tt = { 0 };
+	uint64_t t;
+
+	timer_wheel_init(&w, START);
+	tt.w = &w;
+	tt.period = 10 * MS;
+	tt.due = START + tt.period;
+	timer_init(&tt.t, fire, &tt);
+	timer_add(&w, &tt.t, tt.due);
+
+	/* One run per millisecond for a second. */
+	for (t = START + MS; t <= START + 1000 * MS; t += MS) {
+		c.prev = c.now;
+		c.now = t;
+		timer_wheel_run(&w, t, &c);
+	}
+	CHECK_EQ(tt.count, 100);
+	CHECK_EQ(tt.fired, START + 1000 * MS);
+	CHECK_EQ(tt.prev, START + 999 * MS);
+	CHECK(timer_pending(&tt.t));
+	CHECK_EQ(timer_wheel_next(&w), tick_of(START + 1010 * MS));
+	timer_del(&w, &tt.t);
+	CHECK_EQ(timer_wheel_next(&w), UINT64_MAX);
+	CHECK_EQ(w.count, 0);
+}
+
+/* timer_wheel_next() is never later than the earliest timer. */
+static void test_next(void)
+{
+	struct timer_wheel w;
+	struct clock c = { .now = START };
+	struct tt a = { 0 }, b = { 0 };
+
+	timer_wheel_init(&w, START);
+	CHECK_EQ(timer_wheel_next(&w), UINT64_MAX);
+
+	timer_init(&a.t, fire, &a);
+	timer_init(&b.t, fire, &b);
+	timer_add(&w, &a.t, START + 5000 * MS);
+	timer_add(&w, &b.t, START + 70 * MS);
+	CHECK(timer_wheel_next(&w) <= START + 70 * MS);
+
+	/* Re-arming moves it. */
+	timer_add(&w, &b.t, START + 3 * MS);
+	CHECK_EQ(timer_wheel_next(&w), START + 3 * MS);
+	timer_del(&w, &b.t);
+	CHECK(timer_wheel_next(&w) <= START + 5000 * MS);
+	CHECK(timer_wheel_next(&w) > START + 3 * MS);
+
+	/* In the past: fires on the next run. */
+	c.now = START + 10 * MS;
+	timer_wheel_run(&w, c.now, &c);
+	timer_add(&w, &b.t, START);
+	CHECK(timer_wheel_next(&w) <= c.now + MS);
+	c.now += MS;
+	timer_wheel_run(&w, c.now, &c);
+	CHECK_EQ(b.count, 1);
+	CHECK_EQ(a.count, 0);
+}
+
+int main(void)
+{
+	test_levels();
+	test_beyond_range();
+	test_random();
+	test_periodic();
+	test_next();
+
+	return check_done("timerwheel");
+}
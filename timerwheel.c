@@ -0,0 +1,176 @@
+#include <string.h>
+#include "timerwheel.h"
+
+#define LEVEL_SHIFT(l)	((l) * TW_BITS)
+#define SPAN(l)		(1ull << LEVEL_SHIFT(l))	/* ticks per slot */
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now_ns)
+{
+	memset(w, 0, sizeof(*w));
+	w->start_ns = now_ns;
+}
+
+static void link_timer(struct timer_wheel *w, struct timer *t)
+{
+	uint64_t expires = t->expires, delta;
+	unsigned level = 0, idx;
+
+	if (expires < w->now)
+		expires = w->now;
+	delta = expires - w->now;
+
+	while (level < TW_LEVELS && delta >> LEVEL_SHIFT(level + 1))
+		level++;
+	if (level == TW_LEVELS) {
+		/* Park in the farthest slot, moved down again from there. */
+		level = TW_LEVELS - 1;
+		expires = w->now + SPAN(TW_LEVELS) - 1;
+	}
+	idx = (expires >> LEVEL_SHIFT(level)) & (TW_SLOTS - 1);
+
+	t->next = w->slots[level][idx];
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = &w->slots[level][idx];
+	w->slots[level][idx] = t;
+	w->occupied[level] |= 1ull << idx;
+}
+
+static void unlink_timer(struct timer_wheel *w, struct timer *t)
+{
+	struct timer **head = t->pprev;
+	struct timer **first = &w->slots[0][0];
+
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+
+	/* Last timer of a wheel slot, rather than of a detached list. */
+	if (head >= first && head < first + TW_LEVELS * TW_SLOTS && !*head) {
+		size_t n = head - first;
+
+		w->occupied[n / TW_SLOTS] &= ~(1ull << (n % TW_SLOTS));
+	}
+}
+
+void timer_add(struct timer_wheel *w, struct timer *t, uint64_t expires_ns)
+{
+	if (timer_pending(t))
+		unlink_timer(w, t);
+	else
+		w->count++;
+
+	/* Round up: a timer never fires early. */
+	t->expires = expires_ns > w->start_ns ?
+		(expires_ns - w->start_ns + TW_TICK_NS - 1) / TW_TICK_NS : 0;
+	link_timer(w, t);
+}
+
+void timer_del(struct timer_wheel *w, struct timer *t)
+{
+	if (!timer_pending(t))
+		return;
+	unlink_timer(w, t);
+	w->count--;
+}
+
+uint64_t timer_expires_ns(const struct timer_wheel *w, const struct timer *t)
+{
+	return timer_pending(t) ? w->start_ns + t->expires * TW_TICK_NS : 0;
+}
+
+static inline uint64_t ror64(uint64_t x, unsigned n)
+{
+	n &= 63;
+	return n ? x >> n | x << (64 - n) : x;
+}
+
+/* First tick at which an occupied slot is due, UINT64_MAX if none. */
+static uint64_t next_tick(const struct timer_wheel *w)
+{
+	uint64_t next = UINT64_MAX;
+	unsigned level;
+
+	for (level = 0; level < TW_LEVELS; level++) {
+		uint64_t span = SPAN(level), base, rot, tick;
+
+		if (!w->occupied[level])
+			continue;
+
+		/* Slots come round at multiples of their span. */
+		base = (w->now + span - 1) & ~(span - 1);
+		rot = ror64(w->occupied[level], base >> LEVEL_SHIFT(level));
+		tick = base + __builtin_ctzll(rot) * span;
+		if (tick < next)
+			next = tick;
+	}
+
+	return next;
+}
+
+/* Take the whole list of a slot, so that callbacks cannot extend it. */
+static struct timer *detach(struct timer_wheel *w, unsigned level,
+			    unsigned idx, struct timer **list)
+{
+	*list = w->slots[level][idx];
+	w->slots[level][idx] = NULL;
+	w->occupied[level] &= ~(1ull << idx);
+	if (*list)
+		(*list)->pprev = list;
+
+	return *list;
+}
+
+unsigned timer_wheel_run(struct timer_wheel *w, uint64_t now_ns, void *ctx)
+{
+	uint64_t target;
+	unsigned fired = 0;
+
+	if (now_ns < w->start_ns)
+		return 0;
+	target = (now_ns - w->start_ns) / TW_TICK_NS;
+
+	while (w->now <= target) {
+		uint64_t tick = next_tick(w);
+		struct timer *list, *t;
+		int level;
+
+		if (tick > target) {
+			w->now = target + 1;
+			break;
+		}
+		w->now = tick;
+
+		/* Move due coarse slots down, coarsest first. */
+		for (level = TW_LEVELS - 1; level > 0; level--) {
+			if (tick & (SPAN(level) - 1))
+				continue;
+			detach(w, level,
+			       (tick >> LEVEL_SHIFT(level)) & (TW_SLOTS - 1), &list);
+			while ((t = list)) {
+				unlink_timer(w, t);
+				link_timer(w, t);
+			}
+		}
+
+		w->now = tick + 1;
+		detach(w, 0, tick & (TW_SLOTS - 1), &list);
+		while ((t = list)) {
+			unlink_timer(w, t);
+			w->count--;
+			fired++;
+			t->fn(ctx, t->arg);
+		}
+	}
+
+	return fired;
+}
+
+uint64_t timer_wheel_next(const struct timer_wheel *w)
+{
+	uint64_t tick = next_tick(w);
+
+	return tick == UINT64_MAX ? UINT64_MAX : w->start_ns + tick * TW_TICK_NS;
+}
@@ -0,0 +1,82 @@
+/*
+ * Hierarchical timer wheel with millisecond ticks.
+ *
+ * TW_LEVELS wheels of 64 slots each cover 64 ms, 4 s, 4.4 min, 4.7 h and
+ * 12.4 days; a timer lives in the slot of the coarsest wheel its remaining
+ * time needs and moves down a level each time that slot comes round, so
+ * adding, re-arming and cancelling are O(1) however many timers are
+ * pending.  Timers further out than the last wheel wait in its farthest
+ * slot.  A bitmap per wheel finds the next occupied slot without scanning,
+ * which lets the owner sleep on one timerfd until timer_wheel_next().
+ *
+ * Timers are embedded in their owner's structures and never allocated by
+ * the wheel.
+ */
+
+#ifndef TIMERWHEEL_H__
+#define TIMERWHEEL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TW_BITS		6
+#define TW_SLOTS	(1 << TW_BITS)
+#define TW_LEVELS	5
+#define TW_TICK_NS	1000000ull
+
+struct timer {
+	struct timer *next;
+	struct timer **pprev;		/* NULL while not pending */
+	uint64_t expires;		/* tick */
+	void (*fn)(void *ctx, void *arg);
+	void *arg;
+};
+
+struct timer_wheel {
+	uint64_t start_ns;
+	uint64_t now;			/* next tick to process */
+	unsigned count;
+	uint64_t occupied[TW_LEVELS];
+	struct timer *slots[TW_LEVELS][TW_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now_ns);
+
+static inline void timer_init(struct timer *t, void (*fn)(void *, void *),
+			      void *arg)
+{
+	t->next = NULL;
+	t->pprev = NULL;
+	t->expires = 0;
+	t->fn = fn;
+	t->arg = arg;
+}
+
+static inline bool timer_pending(const struct timer *t)
+{
+	return t->pprev != NULL;
+}
+
+/* (Re)arm @t to fire at or after @expires_ns (CLOCK_MONOTONIC). */
+void timer_add(struct timer_wheel *w, struct timer *t, uint64_t expires_ns);
+
+/* Disarm @t if pending. */
+void timer_del(struct timer_wheel *w, struct timer *t);
+
+/* When @t fires, or 0 if it is not pending. */
+uint64_t timer_expires_ns(const struct timer_wheel *w, const struct timer *t);
+
+/*
+ * Fire every timer due at @now_ns, passing @ctx to the callbacks, which may
+ * add and delete timers.  Returns the number fired.
+ */
+unsigned timer_wheel_run(struct timer_wheel *w, uint64_t now_ns, void *ctx);
+
+/*
+ * Time by which timer_wheel_run() must be called next, UINT64_MAX if no
+ * timer is pending.  May be earlier than the next expiry when a coarse
+ * slot has to be moved down first.
+ */
+uint64_t timer_wheel_next(const struct timer_wheel *w);
+
+#endif
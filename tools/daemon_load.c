@@ -0,0 +1,397 @@
+/*
+ * Contention benchmark for daemon mode.
+ *
+ *   daemon_load [-c <clients>] [-t <seconds>] [-d <depth>] [-D <devices>]
+ *               [-m <status>:<set>:<cycle>] [-C <cycle ms>] [-s <seed>]
+ *               <socket>
+ *
+ * Opens <clients> connections to the daemon socket and keeps <depth>
+ * requests in flight on each for <seconds>, drawing every request from
+ * the given mix (percent weights, default 70:25:5) over devices 0 to
+ * <devices>-1 with random outlets and states.  Then prints the request
+ * rate, end-to-end latency per command and overall, the daemon's own
+ * qwait_us, the error replies by reason, and how evenly the clients were
+ * served: Jain's index over the per-client completion counts (1.0 when
+ * equal, 1/<clients> when one client got everything).
+ *
+ * Waits up to five seconds for the socket to appear, so it can be started
+ * together with the daemon; see "make bench".
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "hist.h"
+#include "timeutil.h"
+
+#define MAX_DEPTH	64
+#define CONNECT_WAIT_NS	5000000000ull
+
+enum op { OP_STATUS, OP_SET, OP_CYCLE, OP_COUNT };
+
+static const char *const op_names[OP_COUNT] = { "status", "set", "cycle" };
+
+struct inflight {
+	uint64_t sent_ns;
+	enum op op;
+};
+
+struct conn {
+	int fd;
+	unsigned inflight;
+	unsigned head;
+	struct inflight ring[MAX_DEPTH];
+	unsigned long done;
+	char in[8192];
+	size_t in_len;
+};
+
+struct load {
+	unsigned depth;
+	unsigned devices;
+	unsigned mix[OP_COUNT];		/* cumulative percent */
+	unsigned cycle_ms;
+	unsigned seed;
+	int stopping;
+	unsigned long done;
+	unsigned long errors;
+	unsigned long busy;
+	unsigned long quarantined;
+	unsigned long other_errors;
+	struct hist e2e;
+	struct hist qwait;
+	struct hist op_e2e[OP_COUNT];
+};
+
+static int connect_to(const char *path)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	uint64_t deadline = now_ns() + CONNECT_WAIT_NS;
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+
+	for (;;) {
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
+		if (!connect(fd, (struct sockaddr *)&sun, sizeof(sun)))
+			return fd;
+		close(fd);
+		if ((errno != ENOENT && errno != ECONNREFUSED) ||
+		    now_ns() > deadline)
+			return -1;
+		usleep(50000);
+	}
+}
+
+static enum op pick_op(struct load *l)
+{
+	unsigned r = rand_r(&l->seed) % 100;
+	enum op op;
+
+	for (op = 0; op < OP_COUNT - 1; op++)
+		if (r < l->mix[op])
+			break;
+
+	return op;
+}
+
+static size_t format_request(struct load *l, enum op op, char *buf, size_t size)
+{
+	unsigned dev = rand_r(&l->seed) % l->devices;
+	unsigned outlet = 1 + rand_r(&l->seed) % 5;
+
+	switch (op) {
+	case OP_SET:
+		return snprintf(buf, size, "set %u %u=%u\n", dev, outlet,
+				rand_r(&l->seed) & 1);
+	case OP_CYCLE:
+		return snprintf(buf, size, "cycle %u %u %u\n", dev, outlet,
+				l->cycle_ms);
+	default:
+		return snprintf(buf, size, "status %u\n", dev);
+	}
+}
+
+/* Top the connection up to the pipeline depth, as one write. */
+static int fill(struct load *l, struct conn *c)
+{
+	char buf[MAX_DEPTH * 64];
+	size_t len = 0, off = 0;
+	uint64_t now = now_ns();
+
+	while (!l->stopping && c->inflight < l->depth) {
+		struct inflight *f = &c->ring[(c->head + c->inflight) % MAX_DEPTH];
+
+		f->op = pick_op(l);
+		f->sent_ns = now;
+		len += format_request(l, f->op, buf + len, sizeof(buf) - len);
+		c->inflight++;
+	}
+
+	while (off < len) {
+		ssize_t n = write(c->fd, buf + off, len - off);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		off += n;
+	}
+
+	return 0;
+}
+
+static void account(struct load *l, const struct inflight *f,
+		    const char *line, uint64_t now)
+{
+	const char *q;
+
+	if (!strncmp(line, "err", 3)) {
+		l->errors++;
+		if (strstr(line, "busy"))
+			l->busy++;
+		else if (strstr(line, "quarantined"))
+			l->quarantined++;
+		else
+			l->other_errors++;
+		return;
+	}
+
+	hist_add(&l->e2e, now - f->sent_ns);
+	hist_add(&l->op_e2e[f->op], now - f->sent_ns);
+	q = strstr(line, " qwait_us=");
+	if (q)
+		hist_add(&l->qwait, strtoull(q + 10, NULL, 10) * 1000);
+}
+
+/* Consume every complete reply line in the input buffer. */
+static int drain(struct load *l, struct conn *c)
+{
+	uint64_t now = now_ns();
+	char *line = c->in, *nl;
+
+	while ((nl = memchr(line, '\n', c->in + c->in_len - line))) {
+		*nl = '\0';
+		/* Unsolicited lines are events; this client never subscribes. */
+		if (!strncmp(line, "ok", 2) || !strncmp(line, "err", 3)) {
+			if (!c->inflight)
+				return -1;
+			account(l, &c->ring[c->head], line, now);
+			c->head = (c->head + 1) % MAX_DEPTH;
+			c->inflight--;
+			c->done++;
+			l->done++;
+		}
+		line = nl + 1;
+	}
+
+	c->in_len -= line - c->in;
+	memmove(c->in, line, c->in_len);
+
+	return c->in_len == sizeof(c->in) ? -1 : 0;
+}
+
+static double jain_index(const struct conn *conns, unsigned n,
+			 unsigned long *min, unsigned long *max)
+{
+	double sum = 0, sum_sq = 0;
+	unsigned i;
+
+	*min = ~0ul;
+	*max = 0;
+	for (i = 0; i < n; i++) {
+		double x = conns[i].done;
+
+		sum += x;
+		sum_sq += x * x;
+		if (conns[i].done < *min)
+			*min = conns[i].done;
+		if (conns[i].done > *max)
+			*max = conns[i].done;
+	}
+
+	return sum_sq ? sum * sum / (n * sum_sq) : 0;
+}
+
+static void print_hist(const char *name, const struct hist *h)
+{
+	printf("%s n=%llu p50=%llu p90=%llu p99=%llu max=%llu\n", name,
+	       (unsigned long long)h->count,
+	       (unsigned long long)hist_percentile(h, 0.50) / 1000,
+	       (unsigned long long)hist_percentile(h, 0.90) / 1000,
+	       (unsigned long long)hist_percentile(h, 0.99) / 1000,
+	       (unsigned long long)h->max / 1000);
+}
+
+static int parse_mix(const char *arg, unsigned *mix)
+{
+	unsigned w[OP_COUNT], i;
+
+	if (sscanf(arg, "%u:%u:%u", &w[0], &w[1], &w[2]) != OP_COUNT ||
+	    w[0] + w[1] + w[2] != 100)
+		return -1;
+	for (i = 0; i < OP_COUNT; i++)
+		mix[i] = w[i] + (i ? mix[i - 1] : 0);
+
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: daemon_load [-c <clients>] [-t <seconds>] [-d <depth>] "
+		"[-D <devices>] [-m <status>:<set>:<cycle>] [-C <cycle ms>] "
+		"[-s <seed>] <socket>\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct load l = {
+		.depth = 1, .devices = 1, .mix = { 70, 95, 100 },
+		.cycle_ms = 20, .seed = 1,
+	};
+	unsigned nclients = 16, seconds = 5, i;
+	unsigned long min, max, outstanding;
+	uint64_t start, end, elapsed;
+	struct conn *conns;
+	double jain;
+	int epfd, opt;
+	enum op op;
+
+	while ((opt = getopt(argc, argv, "c:t:d:D:m:C:s:")) != -1) {
+		switch (opt) {
+		case 'c':
+			nclients = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			l.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			l.devices = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			if (parse_mix(optarg, l.mix))
+				usage();
+			break;
+		case 'C':
+			l.cycle_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			l.seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || !nclients || !seconds || !l.devices ||
+	    !l.depth || l.depth > MAX_DEPTH)
+		usage();
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	conns = calloc(nclients, sizeof(*conns));
+	if (epfd < 0 || !conns) {
+		perror("daemon_load");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < nclients; i++) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &conns[i] };
+
+		conns[i].fd = connect_to(argv[optind]);
+		if (conns[i].fd < 0 ||
+		    epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev)) {
+			perror(argv[optind]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	start = now_ns();
+	end = start + seconds * 1000000000ull;
+	for (i = 0; i < nclients; i++) {
+		if (fill(&l, &conns[i])) {
+			perror(argv[optind]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* Stop issuing at the deadline, then collect what is in flight. */
+	do {
+		struct epoll_event events[64];
+		int n;
+
+		if (now_ns() >= end)
+			l.stopping = 1;
+
+		n = epoll_wait(epfd, events, 64, 5000);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			fprintf(stderr, "daemon_load: no progress\n");
+			return EXIT_FAILURE;
+		}
+
+		for (i = 0; i < (unsigned)n; i++) {
+			struct conn *c = events[i].data.ptr;
+			ssize_t got = read(c->fd, c->in + c->in_len,
+					   sizeof(c->in) - c->in_len);
+
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0) {
+				fprintf(stderr, "daemon_load: connection closed\n");
+				return EXIT_FAILURE;
+			}
+			c->in_len += got;
+			if (drain(&l, c) || fill(&l, c)) {
+				fprintf(stderr, "daemon_load: protocol error\n");
+				return EXIT_FAILURE;
+			}
+		}
+
+		for (outstanding = 0, i = 0; i < nclients; i++)
+			outstanding += conns[i].inflight;
+	} while (!l.stopping || outstanding);
+	elapsed = now_ns() - start;
+
+	jain = jain_index(conns, nclients, &min, &max);
+
+	printf("clients=%u devices=%u depth=%u mix=%u:%u:%u elapsed_ms=%llu "
+	       "requests=%lu rate=%.0f/s\n",
+	       nclients, l.devices, l.depth, l.mix[0], l.mix[1] - l.mix[0],
+	       l.mix[2] - l.mix[1], (unsigned long long)elapsed / 1000000,
+	       l.done, l.done * 1e9 / elapsed);
+	printf("errors=%lu busy=%lu quarantined=%lu other=%lu\n",
+	       l.errors, l.busy, l.quarantined, l.other_errors);
+	print_hist("e2e_us", &l.e2e);
+	print_hist("qwait_us", &l.qwait);
+	for (op = 0; op < OP_COUNT; op++) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "%s_us", op_names[op]);
+		print_hist(name, &l.op_e2e[op]);
+	}
+	printf("fairness jain=%.4f min=%lu max=%lu\n", jain, min, max);
+
+	for (i = 0; i < nclients; i++)
+		close(conns[i].fd);
+	free(conns);
+	close(epfd);
+
+	return l.other_errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
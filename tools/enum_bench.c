@@ -0,0 +1,185 @@
+/*
+ * Enumeration scaling benchmark.
+ *
+ *   enum_bench [-n <iterations>] [<dir>]
+ *
+ * Times hid_enumerate() for the splitter's VID/PID and for every device,
+ * and opening the last splitter by serial the way device_open_serial()
+ * does, over <iterations> rounds.  With <dir> the library enumerates the
+ * tree made by hidraw_tree instead of asking udev; run it for a range of
+ * node counts to see how the lookup grows.  Allocations are counted by
+ * interposing malloc() and friends, including those made inside libc and
+ * libudev.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "bellwin.h"
+#include "hidapi.h"
+#include "hid_log.h"
+#include "hist.h"
+#include "timeutil.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long alloc_count;
+static unsigned long alloc_bytes;
+
+void *malloc(size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += n * size;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+struct measure {
+	struct hist time;
+	unsigned long allocs;
+	unsigned long bytes;
+	unsigned found;
+};
+
+static unsigned count_devices(struct hid_device_info *devs)
+{
+	unsigned n = 0;
+
+	for (; devs; devs = devs->next)
+		n++;
+
+	return n;
+}
+
+static void enumerate(struct measure *m, unsigned short vid, unsigned short pid)
+{
+	unsigned long allocs = alloc_count, bytes = alloc_bytes;
+	struct hid_device_info *devs;
+	uint64_t start = now_ns();
+
+	devs = hid_enumerate(vid, pid);
+	hist_add(&m->time, now_ns() - start);
+	m->allocs += alloc_count - allocs;
+	m->bytes += alloc_bytes - bytes;
+	m->found = count_devices(devs);
+	hid_free_enumeration(devs);
+}
+
+static void open_serial(struct measure *m, const wchar_t *serial)
+{
+	unsigned long allocs = alloc_count, bytes = alloc_bytes;
+	uint64_t start = now_ns();
+	hid_device *hid;
+
+	hid = hid_open(BELLWIN_VENDOR, BELLWIN_PRODUCT, serial);
+	hist_add(&m->time, now_ns() - start);
+	m->allocs += alloc_count - allocs;
+	m->bytes += alloc_bytes - bytes;
+	if (hid) {
+		m->found++;
+		hid_close(hid);
+	}
+}
+
+static void report(const char *name, const struct measure *m, unsigned iters)
+{
+	printf("%s found=%u us_p50=%.1f us_p99=%.1f allocs=%lu bytes=%lu\n",
+	       name, m->found,
+	       hist_percentile(&m->time, 0.50) / 1e3,
+	       hist_percentile(&m->time, 0.99) / 1e3,
+	       m->allocs / iters, m->bytes / iters);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: enum_bench [-n <iterations>] [<dir>]\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct measure bw = { 0 }, all = { 0 }, by_serial = { 0 };
+	struct hid_device_info *devs, *last = NULL, *cur;
+	unsigned iters = 100, i;
+	wchar_t *serial = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iters = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc - 1 || !iters)
+		usage();
+
+	if (optind == argc - 1) {
+		char sysfs[PATH_MAX], devfs[PATH_MAX];
+
+		snprintf(sysfs, sizeof(sysfs), "%s/sys", argv[optind]);
+		snprintf(devfs, sizeof(devfs), "%s/dev", argv[optind]);
+		if (hid_set_sysfs_root(sysfs, devfs)) {
+			perror(sysfs);
+			return EXIT_FAILURE;
+		}
+	}
+	hid_init();
+
+	devs = hid_enumerate(BELLWIN_VENDOR, BELLWIN_PRODUCT);
+	for (cur = devs; cur; cur = cur->next)
+		last = cur;
+	if (last && last->serial_number)
+		serial = wcsdup(last->serial_number);
+	hid_free_enumeration(devs);
+
+	/* Fake nodes are plain files: silence hid_open_path()'s ioctl warnings. */
+	hid_log_level = HID_LOG_ERROR;
+
+	for (i = 0; i < iters; i++) {
+		enumerate(&bw, BELLWIN_VENDOR, BELLWIN_PRODUCT);
+		enumerate(&all, 0, 0);
+		if (serial)
+			open_serial(&by_serial, serial);
+	}
+
+	printf("nodes=%u bellwin=%u iterations=%u\n", all.found, bw.found, iters);
+	report("enumerate_bellwin", &bw, iters);
+	report("enumerate_all", &all, iters);
+	if (serial) {
+		by_serial.found /= iters;
+		report("open_serial", &by_serial, iters);
+	}
+
+	free(serial);
+	hid_exit();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,264 @@
+/*
+ * Fabricate a sysfs/devfs tree of hidraw nodes for enumeration benchmarks.
+ *
+ *   hidraw_tree [-f <bellwin fraction>] [-b <bluetooth fraction>]
+ *               [-s <seed>] <dir> <nodes>
+ *
+ * Creates <dir>/sys laid out like the kernel's: each hidraw node sits below
+ * its HID device, whose uevent carries HID_ID, HID_NAME and HID_UNIQ; USB
+ * devices hang off a usb_device directory with idVendor, manufacturer,
+ * product and bcdDevice and an interface with bInterfaceNumber; Bluetooth
+ * ones have no USB parent.  <dir>/sys/class/hidraw links to every node and
+ * <dir>/dev holds an empty file per node.  Point the library at it with
+ * hid_set_sysfs_root("<dir>/sys", "<dir>/dev").
+ *
+ * The given fraction of the nodes (default 0.1, spread evenly) are Bellwin
+ * splitters with serials BW000000, BW000001, ...; the rest are a mix of
+ * common USB HID devices, some sharing the splitter's vendor id, and
+ * Bluetooth devices.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bellwin.h"
+
+#define BUS_USB		0x03
+#define BUS_BLUETOOTH	0x05
+#define HIDRAW_MAJOR	241
+#define PORTS_PER_BUS	127
+
+struct model {
+	unsigned short vid;
+	unsigned short pid;
+	const char *manufacturer;
+	const char *product;
+};
+
+static const struct model others[] = {
+	{ 0x046d, 0xc52b, "Logitech", "USB Receiver" },
+	{ 0x045e, 0x07a5, "Microsoft", "Microsoft 2.4GHz Transceiver v9.0" },
+	{ 0x1050, 0x0407, "Yubico", "YubiKey OTP+FIDO+CCID" },
+	{ 0x0764, 0x0501, "CPS", "CP1500PFCLCD" },
+	{ 0x04d8, 0x003f, "Microchip Technology Inc.", "Simple HID Device Demo" },
+	{ 0x0451, 0x82ff, "Texas Instruments", "TUSB8041 HID" },
+};
+
+static const struct model bellwin = {
+	BELLWIN_VENDOR, BELLWIN_PRODUCT, "Bellwin", "UP516EU",
+};
+
+static int mkdir_p(char *path)
+{
+	char *p;
+
+	for (p = path + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+
+	return mkdir(path, 0755) && errno != EEXIST ? -1 : 0;
+}
+
+static int write_file(const char *dir, const char *name, const char *fmt, ...)
+{
+	char path[PATH_MAX];
+	va_list ap;
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	va_start(ap, fmt);
+	ret = vfprintf(f, fmt, ap) < 0;
+	va_end(ap);
+
+	return fclose(f) || ret ? -1 : 0;
+}
+
+/* The device directory of node @i, relative to <dir>/sys. */
+static void node_paths(unsigned i, int bus, unsigned short vid,
+		       unsigned short pid, char *usb, char *hid, size_t size)
+{
+	unsigned busnum = 1 + i / PORTS_PER_BUS, port = 1 + i % PORTS_PER_BUS;
+
+	if (bus == BUS_BLUETOOTH) {
+		usb[0] = '\0';
+		snprintf(hid, size,
+			 "devices/virtual/bluetooth/hci0/hci0:%u/%04X:%04X:%04X.%04X",
+			 256 + i, bus, vid, pid, i + 1);
+		return;
+	}
+
+	snprintf(usb, size, "devices/pci0000:00/0000:00:14.0/usb%u/%u-%u",
+		 busnum, busnum, port);
+	snprintf(hid, size, "%s/%u-%u:1.0/%04X:%04X:%04X.%04X",
+		 usb, busnum, port, bus, vid, pid, i + 1);
+}
+
+static int make_node(const char *root, unsigned i, int bus,
+		     const struct model *m, const char *serial)
+{
+	char usb[PATH_MAX / 2], hid[PATH_MAX / 2];
+	char dir[PATH_MAX], target[PATH_MAX], link[PATH_MAX + 16];
+	const char *hid_name;
+	int fd;
+
+	node_paths(i, bus, m->vid, m->pid, usb, hid, sizeof(usb));
+	hid_name = strrchr(hid, '/') + 1;
+
+	if (usb[0]) {
+		snprintf(dir, sizeof(dir), "%s/sys/%s", root, usb);
+		if (mkdir_p(dir) ||
+		    write_file(dir, "idVendor", "%04x\n", m->vid) ||
+		    write_file(dir, "idProduct", "%04x\n", m->pid) ||
+		    write_file(dir, "manufacturer", "%s\n", m->manufacturer) ||
+		    write_file(dir, "product", "%s\n", m->product) ||
+		    write_file(dir, "bcdDevice", "0100\n") ||
+		    write_file(dir, "serial", "%s\n", serial))
+			return -1;
+
+		/* The interface, between the usb_device and the HID device. */
+		*strrchr(hid, '/') = '\0';
+		snprintf(dir, sizeof(dir), "%s/sys/%s", root, hid);
+		hid[strlen(hid)] = '/';
+		if (mkdir_p(dir) ||
+		    write_file(dir, "bInterfaceNumber", "00\n"))
+			return -1;
+	}
+
+	snprintf(dir, sizeof(dir), "%s/sys/%s", root, hid);
+	if (mkdir_p(dir) ||
+	    write_file(dir, "uevent",
+		       "DRIVER=hid-generic\n"
+		       "HID_ID=%04X:%08X:%08X\n"
+		       "HID_NAME=%s %s\n"
+		       "HID_PHYS=%s-%u/input0\n"
+		       "HID_UNIQ=%s\n"
+		       "MODALIAS=hid:b%04Xg0001v%08Xp%08X\n",
+		       bus, m->vid, m->pid, m->manufacturer, m->product,
+		       bus == BUS_USB ? "usb-0000:00:14.0" : "bt", i,
+		       serial, bus, m->vid, m->pid))
+		return -1;
+
+	snprintf(dir, sizeof(dir), "%s/sys/%s/hidraw/hidraw%u", root, hid, i);
+	snprintf(target, sizeof(target), "../../../%s", hid_name);
+	snprintf(link, sizeof(link), "%s/device", dir);
+	if (mkdir_p(dir) ||
+	    write_file(dir, "uevent", "MAJOR=%u\nMINOR=%u\nDEVNAME=hidraw%u\n",
+		       HIDRAW_MAJOR, i, i) ||
+	    symlink(target, link))
+		return -1;
+
+	snprintf(target, sizeof(target), "../../%s/hidraw/hidraw%u", hid, i);
+	snprintf(link, sizeof(link), "%s/sys/class/hidraw/hidraw%u", root, i);
+	if (symlink(target, link))
+		return -1;
+
+	snprintf(link, sizeof(link), "%s/dev/hidraw%u", root, i);
+	fd = open(link, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return -1;
+	close(fd);
+
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: hidraw_tree [-f <bellwin fraction>] "
+		"[-b <bluetooth fraction>] [-s <seed>] <dir> <nodes>\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	double bw_fraction = 0.1, bt_fraction = 0.05;
+	unsigned seed = 1, nodes, i, nbw = 0, nbt = 0;
+	char path[PATH_MAX];
+	const char *root;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:b:s:")) != -1) {
+		switch (opt) {
+		case 'f':
+			bw_fraction = strtod(optarg, NULL);
+			break;
+		case 'b':
+			bt_fraction = strtod(optarg, NULL);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 2 || bw_fraction < 0 || bw_fraction > 1 ||
+	    bt_fraction < 0 || bt_fraction > 1)
+		usage();
+	root = argv[optind];
+	nodes = strtoul(argv[optind + 1], NULL, 0);
+
+	snprintf(path, sizeof(path), "%s/sys/class/hidraw", root);
+	if (mkdir_p(path)) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	snprintf(path, sizeof(path), "%s/dev", root);
+	if (mkdir_p(path)) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < nodes; i++) {
+		const struct model *m;
+		char serial[32];
+		int bus = BUS_USB;
+
+		/* Spread the splitters evenly, so any prefix has its share. */
+		if ((unsigned)((i + 1) * bw_fraction) > (unsigned)(i * bw_fraction)) {
+			m = &bellwin;
+			snprintf(serial, sizeof(serial), "BW%06u", nbw++);
+		} else {
+			m = &others[rand_r(&seed) % (sizeof(others) / sizeof(others[0]))];
+			if (rand_r(&seed) < bt_fraction * ((double)RAND_MAX + 1)) {
+				bus = BUS_BLUETOOTH;
+				nbt++;
+				snprintf(serial, sizeof(serial),
+					 "%02x:%02x:%02x:%02x:%02x:%02x",
+					 rand_r(&seed) & 0xff, rand_r(&seed) & 0xff,
+					 rand_r(&seed) & 0xff, rand_r(&seed) & 0xff,
+					 (i >> 8) & 0xff, i & 0xff);
+			} else {
+				snprintf(serial, sizeof(serial), "%08X",
+					 (unsigned)rand_r(&seed));
+			}
+		}
+
+		if (make_node(root, i, bus, m, serial)) {
+			fprintf(stderr, "hidraw_tree: node %u: %s\n", i,
+				strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("nodes=%u bellwin=%u bluetooth=%u sysfs=%s/sys devfs=%s/dev\n",
+	       nodes, nbw, nbt, root, root);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,265 @@
+/*
+ * Load generator for the daemon's HTTP front end.
+ *
+ *   http_load [-c <conns>] [-n <requests>] [-d <depth>] [-p <path>]
+ *             [-b <json body>] <[host:]port|socket path>
+ *
+ * Opens <conns> persistent connections and keeps <depth> pipelined
+ * requests in flight on each until <requests> have been answered, then
+ * prints the request rate and latency percentiles.  With -b the requests
+ * are POSTs carrying that body, otherwise GETs.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "hist.h"
+#include "http.h"
+#include "timeutil.h"
+
+#define MAX_DEPTH	256
+
+struct conn {
+	int fd;
+	unsigned inflight;
+	uint64_t sent_ns[MAX_DEPTH];	/* ring of request send times */
+	unsigned head;
+	char in[65536];
+	size_t in_len;
+};
+
+struct load {
+	const char *request;
+	size_t request_len;
+	unsigned depth;
+	unsigned long total;
+	unsigned long sent;
+	unsigned long done;
+	unsigned long errors;
+	struct hist latency;
+};
+
+static int connect_to(const char *addr)
+{
+	int one = 1;
+	int fd;
+
+	if (addr[0] == '/') {
+		struct sockaddr_un sun = { .sun_family = AF_UNIX };
+
+		if (strlen(addr) >= sizeof(sun.sun_path))
+			return -1;
+		strcpy(sun.sun_path, addr);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0 || connect(fd, (struct sockaddr *)&sun, sizeof(sun)))
+			return -1;
+	} else {
+		struct sockaddr_in sin;
+
+		if (http_parse_addr(addr, &sin))
+			return -1;
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0 || connect(fd, (struct sockaddr *)&sin, sizeof(sin)))
+			return -1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	return fd;
+}
+
+/* Top the connection up to the pipeline depth, as one write. */
+static int fill(struct load *l, struct conn *c)
+{
+	char buf[MAX_DEPTH * 512];
+	size_t len = 0, off = 0;
+	uint64_t now = now_ns();
+
+	while (c->inflight < l->depth && l->sent < l->total &&
+	       len + l->request_len <= sizeof(buf)) {
+		memcpy(buf + len, l->request, l->request_len);
+		len += l->request_len;
+		c->sent_ns[(c->head + c->inflight) % MAX_DEPTH] = now;
+		c->inflight++;
+		l->sent++;
+	}
+
+	while (off < len) {
+		ssize_t n = write(c->fd, buf + off, len - off);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		off += n;
+	}
+
+	return 0;
+}
+
+/* Consume every complete response in the input buffer. */
+static int drain(struct load *l, struct conn *c)
+{
+	uint64_t now = now_ns();
+
+	for (;;) {
+		char *end = memmem(c->in, c->in_len, "\r\n\r\n", 4);
+		char *cl;
+		size_t head, body;
+
+		if (!end)
+			return 0;
+		head = end - c->in + 4;
+		*end = '\0';
+		cl = strcasestr(c->in, "Content-Length:");
+		body = cl ? strtoul(cl + 15, NULL, 10) : 0;
+		if (c->in_len < head + body) {
+			*end = '\r';
+			return 0;
+		}
+		if (!c->inflight)
+			return -1;
+
+		if (strncmp(c->in, "HTTP/1.1 200", 12))
+			l->errors++;
+		hist_add(&l->latency, now - c->sent_ns[c->head]);
+		c->head = (c->head + 1) % MAX_DEPTH;
+		c->inflight--;
+		l->done++;
+
+		memmove(c->in, c->in + head + body, c->in_len - head - body);
+		c->in_len -= head + body;
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: http_load [-c <conns>] [-n <requests>] [-d <depth>] "
+		"[-p <path>] [-b <json body>] <[host:]port|socket path>\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct load l = { .depth = 8, .total = 100000 };
+	const char *path = "/devices/0/status", *body = NULL;
+	unsigned nconns = 4, i;
+	struct conn *conns;
+	char request[1024];
+	uint64_t start, elapsed;
+	int epfd, opt;
+
+	while ((opt = getopt(argc, argv, "c:n:d:p:b:")) != -1) {
+		switch (opt) {
+		case 'c':
+			nconns = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			l.total = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			l.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			path = optarg;
+			break;
+		case 'b':
+			body = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || !nconns || !l.depth || l.depth > MAX_DEPTH)
+		usage();
+
+	if (body)
+		l.request_len = snprintf(request, sizeof(request),
+					 "POST %s HTTP/1.1\r\nHost: bellwin\r\n"
+					 "Content-Type: application/json\r\n"
+					 "Content-Length: %zu\r\n\r\n%s",
+					 path, strlen(body), body);
+	else
+		l.request_len = snprintf(request, sizeof(request),
+					 "GET %s HTTP/1.1\r\nHost: bellwin\r\n\r\n",
+					 path);
+	if (l.request_len >= sizeof(request) || l.request_len > 512)
+		usage();
+	l.request = request;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	conns = calloc(nconns, sizeof(*conns));
+	if (epfd < 0 || !conns) {
+		perror("http_load");
+		return EXIT_FAILURE;
+	}
+
+	start = now_ns();
+	for (i = 0; i < nconns; i++) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &conns[i] };
+
+		conns[i].fd = connect_to(argv[optind]);
+		if (conns[i].fd < 0 ||
+		    epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev) ||
+		    fill(&l, &conns[i])) {
+			perror(argv[optind]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	while (l.done < l.total) {
+		struct epoll_event events[64];
+		int n = epoll_wait(epfd, events, 64, 5000);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			fprintf(stderr, "http_load: no progress, %lu of %lu answered\n",
+				l.done, l.total);
+			return EXIT_FAILURE;
+		}
+
+		for (i = 0; i < (unsigned)n; i++) {
+			struct conn *c = events[i].data.ptr;
+			ssize_t got = read(c->fd, c->in + c->in_len,
+					   sizeof(c->in) - c->in_len);
+
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0) {
+				fprintf(stderr, "http_load: connection closed\n");
+				return EXIT_FAILURE;
+			}
+			c->in_len += got;
+			if (drain(&l, c) || fill(&l, c)) {
+				fprintf(stderr, "http_load: protocol error\n");
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	elapsed = now_ns() - start;
+
+	printf("requests=%lu errors=%lu conns=%u depth=%u elapsed_ms=%llu rate=%.0f/s\n",
+	       l.done, l.errors, nconns, l.depth,
+	       (unsigned long long)elapsed / 1000000, l.done * 1e9 / elapsed);
+	printf("latency_us p50=%llu p90=%llu p99=%llu max=%llu\n",
+	       (unsigned long long)hist_percentile(&l.latency, 0.50) / 1000,
+	       (unsigned long long)hist_percentile(&l.latency, 0.90) / 1000,
+	       (unsigned long long)hist_percentile(&l.latency, 0.99) / 1000,
+	       (unsigned long long)l.latency.max / 1000);
+
+	for (i = 0; i < nconns; i++)
+		close(conns[i].fd);
+	free(conns);
+	close(epfd);
+
+	return l.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,291 @@
+/*
+ * Virtual UP516EU devices through the kernel's /dev/uhid.
+ *
+ *   uhid_bellwin [-n <devices>] [-s <serial prefix>] [-l <latency us>]
+ *                [-m <initial mask>]
+ *
+ * Creates <devices> HID devices on the USB bus with the splitter's VID/PID
+ * and a vendor defined 64 byte report descriptor, so that they show up as
+ * hidraw nodes and go through the same udev enumeration and hidraw I/O as
+ * the real thing.  Each answers status queries (0x08) with its outlet mask
+ * and applies set reports (0x0b) after <latency us>, like the in-process
+ * simulator (sim.c).  Runs until interrupted, then prints the reports each
+ * device handled.  Needs write access to /dev/uhid, usually root.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+#include "bellwin.h"
+
+/* Microchip generic HID: one 64 byte input and one 64 byte output report. */
+static const unsigned char report_desc[] = {
+	0x06, 0x00, 0xff,	/* Usage Page (Vendor Defined 0xFF00) */
+	0x09, 0x01,		/* Usage (0x01) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x15, 0x00,		/*   Logical Minimum (0) */
+	0x26, 0xff, 0x00,	/*   Logical Maximum (255) */
+	0x75, 0x08,		/*   Report Size (8) */
+	0x95, BELLWIN_REPORT_SIZE,	/*   Report Count (64) */
+	0x09, 0x01,		/*   Usage (0x01) */
+	0x81, 0x02,		/*   Input (Data, Var, Abs) */
+	0x95, BELLWIN_REPORT_SIZE,	/*   Report Count (64) */
+	0x09, 0x01,		/*   Usage (0x01) */
+	0x91, 0x02,		/*   Output (Data, Var, Abs) */
+	0xc0,			/* End Collection */
+};
+
+struct vdev {
+	int fd;
+	pthread_t thread;
+	unsigned index;
+	unsigned latency_us;
+	unsigned char mask;
+	unsigned long status;
+	unsigned long sets;
+	unsigned long ignored;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static int uhid_write(int fd, const struct uhid_event *ev)
+{
+	ssize_t n;
+
+	do
+		n = write(fd, ev, sizeof(*ev));
+	while (n < 0 && errno == EINTR);
+
+	return n == sizeof(*ev) ? 0 : -1;
+}
+
+static int vdev_create(struct vdev *v, const char *serial_prefix)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name),
+		 "Bellwin UP516EU (uhid %u)", v->index);
+	snprintf((char *)ev.u.create2.phys, sizeof(ev.u.create2.phys),
+		 "uhid_bellwin/%u", v->index);
+	snprintf((char *)ev.u.create2.uniq, sizeof(ev.u.create2.uniq),
+		 "%s%04u", serial_prefix, v->index);
+	memcpy(ev.u.create2.rd_data, report_desc, sizeof(report_desc));
+	ev.u.create2.rd_size = sizeof(report_desc);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = BELLWIN_VENDOR;
+	ev.u.create2.product = BELLWIN_PRODUCT;
+
+	return uhid_write(v->fd, &ev);
+}
+
+static int vdev_reply_status(struct vdev *v)
+{
+	struct uhid_event ev;
+	unsigned char *reply = ev.u.input2.data;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = BELLWIN_REPORT_SIZE;
+	memset(reply, BELLWIN_REPORT_PAD, BELLWIN_REPORT_SIZE);
+	memset(reply, 0, BELLWIN_CMD_LEN);
+	reply[0] = BELLWIN_CMD_STATUS;
+	reply[BELLWIN_STATUS_MASK] = v->mask;
+
+	return uhid_write(v->fd, &ev);
+}
+
+/* Refuse GET_REPORT/SET_REPORT: the splitter only uses interrupt reports. */
+static int vdev_refuse(struct vdev *v, const struct uhid_event *req)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	if (req->type == UHID_GET_REPORT) {
+		ev.type = UHID_GET_REPORT_REPLY;
+		ev.u.get_report_reply.id = req->u.get_report.id;
+		ev.u.get_report_reply.err = EIO;
+	} else {
+		ev.type = UHID_SET_REPORT_REPLY;
+		ev.u.set_report_reply.id = req->u.set_report.id;
+		ev.u.set_report_reply.err = EIO;
+	}
+
+	return uhid_write(v->fd, &ev);
+}
+
+static void vdev_output(struct vdev *v, const unsigned char *buf, size_t n)
+{
+	if (!n) {
+		v->ignored++;
+		return;
+	}
+
+	if (v->latency_us)
+		usleep(v->latency_us);
+
+	switch (buf[0]) {
+	case BELLWIN_CMD_STATUS:
+		if (vdev_reply_status(v))
+			fprintf(stderr, "uhid_bellwin: %u: reply: %s\n",
+				v->index, strerror(errno));
+		v->status++;
+		break;
+	case BELLWIN_CMD_SET:
+		if (n <= BELLWIN_SET_VALUE ||
+		    buf[BELLWIN_SET_INDEX] >= POWER_SWITCH_COUNT) {
+			v->ignored++;
+			break;
+		}
+		if (buf[BELLWIN_SET_VALUE])
+			v->mask |= BIT(buf[BELLWIN_SET_INDEX]);
+		else
+			v->mask &= ~BIT(buf[BELLWIN_SET_INDEX]);
+		v->sets++;
+		break;
+	default:
+		v->ignored++;
+		break;
+	}
+}
+
+static void *vdev_thread(void *arg)
+{
+	struct vdev *v = arg;
+	struct uhid_event ev;
+	ssize_t n;
+
+	while (!stop) {
+		n = read(v->fd, &ev, sizeof(ev));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		switch (ev.type) {
+		case UHID_OUTPUT:
+			vdev_output(v, ev.u.output.data, ev.u.output.size);
+			break;
+		case UHID_GET_REPORT:
+		case UHID_SET_REPORT:
+			vdev_refuse(v, &ev);
+			break;
+		default:
+			/* START, STOP, OPEN, CLOSE */
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: uhid_bellwin [-n <devices>] [-s <serial prefix>] "
+		"[-l <latency us>] [-m <initial mask>]\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	const char *prefix = "UHID";
+	unsigned count = 1, latency_us = 0, mask = 0, i;
+	struct sigaction sa = { .sa_handler = on_signal };
+	struct uhid_event destroy = { .type = UHID_DESTROY };
+	struct vdev *devs;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:l:m:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			prefix = optarg;
+			break;
+		case 'l':
+			latency_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			mask = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || !count)
+		usage();
+
+	devs = calloc(count, sizeof(*devs));
+	if (!devs) {
+		perror("uhid_bellwin");
+		return EXIT_FAILURE;
+	}
+
+	/* No SA_RESTART: the device threads' reads must see the signal. */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	for (i = 0; i < count; i++) {
+		struct vdev *v = &devs[i];
+
+		v->index = i;
+		v->latency_us = latency_us;
+		v->mask = mask & POWER_SWITCH_ALL;
+		v->fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+		if (v->fd < 0 || vdev_create(v, prefix)) {
+			perror("/dev/uhid");
+			return EXIT_FAILURE;
+		}
+		if (pthread_create(&v->thread, NULL, vdev_thread, v)) {
+			fprintf(stderr, "uhid_bellwin: cannot start device %u\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+	printf("created %u devices %04x:%04x serial %s%04u..%s%04u\n", count,
+	       BELLWIN_VENDOR, BELLWIN_PRODUCT, prefix, 0, prefix, count - 1);
+	fflush(stdout);
+
+	while (!stop)
+		pause();
+
+	for (i = 0; i < count; i++) {
+		struct vdev *v = &devs[i];
+		struct timespec ts;
+
+		/* Interrupt read() until the thread notices, then tear down. */
+		do {
+			pthread_kill(v->thread, SIGINT);
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 10000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+		} while (pthread_timedjoin_np(v->thread, NULL, &ts) == ETIMEDOUT);
+		uhid_write(v->fd, &destroy);
+		close(v->fd);
+		printf("dev=%u serial=%s%04u mask=0x%02x status=%lu sets=%lu ignored=%lu\n",
+		       i, prefix, i, v->mask, v->status, v->sets, v->ignored);
+	}
+	free(devs);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "hidapi.h"
+#include "bellwin.h"
+#include "device.h"
+#include "spsc.h"
+#include "timeutil.h"
+#include "worker.h"
+
+struct bw_worker {
+	hid_device *hid;
+	pthread_t thread;
+	struct spsc ops;		/* owner -> worker */
+	struct spsc done;		/* worker -> owner */
+	int wake_fd;
+	int done_fd;
+	atomic_bool sleeping;
+	atomic_bool stop;
+	int reply_timeout_ms;
+	unsigned depth;
+	unsigned inflight;		/* owner only */
+};
+
+void bw_op_status(struct bw_op *op, uint64_t tag)
+{
+	memset(op->report, BELLWIN_REPORT_PAD, sizeof(op->report));
+	memset(op->report, 0, BELLWIN_CMD_LEN);
+	op->report[0] = BELLWIN_CMD_STATUS;
+	op->expect_reply = 1;
+	op->tag = tag;
+}
+
+void bw_op_set(struct bw_op *op, int idx, bool on, uint64_t tag)
+{
+	memset(op->report, BELLWIN_REPORT_PAD, sizeof(op->report));
+	memset(op->report, 0, BELLWIN_CMD_LEN);
+	op->report[0] = BELLWIN_CMD_SET;
+	op->report[BELLWIN_SET_INDEX] = idx - 1;
+	op->report[BELLWIN_SET_VALUE] = !!on;
+	op->expect_reply = 0;
+	op->tag = tag;
+}
+
+static void run_op(struct bw_worker *w, const struct bw_op *op,
+		   struct bw_completion *c)
+{
+	unsigned char buf[BELLWIN_REPORT_SIZE];
+	uint64_t start, deadline, now;
+	int res;
+
+	c->tag = op->tag;
+	c->result = 0;
+	c->mask = 0;
+
+	/* The worker owns the device, so anything queued is a late reply. */
+	if (op->expect_reply)
+		while (hid_read_timeout(w->hid, buf, sizeof(buf), 0) > 0)
+			;
+
+	start = now_ns();
+	if (send_command(w->hid, (const char *)op->report,
+			 sizeof(op->report)) < 0) {
+		c->result = -1;
+	} else if (op->expect_reply) {
+		deadline = start + w->reply_timeout_ms * 1000000ull;
+		c->result = -1;
+		while ((now = now_ns()) < deadline) {
+			res = hid_read_timeout(w->hid, buf, sizeof(buf),
+					       (deadline - now + 999999) / 1000000);
+			if (res < 0)
+				break;
+			/* Short reports and echoes of sets are not the reply. */
+			if (res <= BELLWIN_STATUS_MASK ||
+			    buf[0] != BELLWIN_CMD_STATUS)
+				continue;
+			c->mask = buf[BELLWIN_STATUS_MASK] & POWER_SWITCH_ALL;
+			c->result = 0;
+			break;
+		}
+	}
+	c->latency_ns = now_ns() - start;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct bw_worker *w = arg;
+	struct bw_completion c;
+	struct bw_op op;
+	eventfd_t val;
+	bool produced;
+
+	for (;;) {
+		produced = false;
+		while (spsc_pop(&w->ops, &op)) {
+			run_op(w, &op, &c);
+			/* Cannot fail: the owner never has more than depth in flight. */
+			spsc_push(&w->done, &c);
+			produced = true;
+		}
+		if (produced)
+			eventfd_write(w->done_fd, 1);
+
+		if (atomic_load(&w->stop) && spsc_empty(&w->ops))
+			break;
+
+		/* Pairs with the fence in bw_worker_submit(). */
+		atomic_store(&w->sleeping, true);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (spsc_empty(&w->ops) && !atomic_load(&w->stop))
+			eventfd_read(w->wake_fd, &val);
+		atomic_store(&w->sleeping, false);
+	}
+
+	return NULL;
+}
+
+struct bw_worker *bw_worker_start(hid_device *hid, unsigned depth,
+				  int reply_timeout_ms)
+{
+	struct bw_worker *w;
+	unsigned cap = 1;
+
+	while (cap < depth)
+		cap <<= 1;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+
+	w->hid = hid;
+	w->depth = cap;
+	w->reply_timeout_ms = reply_timeout_ms;
+	w->wake_fd = eventfd(0, EFD_CLOEXEC);
+	w->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	atomic_init(&w->sleeping, false);
+	atomic_init(&w->stop, false);
+
+	if (w->wake_fd < 0 || w->done_fd < 0 ||
+	    spsc_init(&w->ops, cap, sizeof(struct bw_op)) ||
+	    spsc_init(&w->done, cap, sizeof(struct bw_completion)))
+		goto err;
+
+	if (pthread_create(&w->thread, NULL, worker_thread, w))
+		goto err;
+
+	return w;
+
+err:
+	spsc_free(&w->ops);
+	spsc_free(&w->done);
+	if (w->wake_fd >= 0)
+		close(w->wake_fd);
+	if (w->done_fd >= 0)
+		close(w->done_fd);
+	free(w);
+	return NULL;
+}
+
+bool bw_worker_submit(struct bw_worker *w, const struct bw_op *op)
+{
+	if (w->inflight >= w->depth || !spsc_push(&w->ops, op))
+		return false;
+	w->inflight++;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&w->sleeping))
+		eventfd_write(w->wake_fd, 1);
+
+	return true;
+}
+
+bool bw_worker_reap(struct bw_worker *w, struct bw_completion *c)
+{
+	eventfd_t val;
+
+	if (!spsc_pop(&w->done, c)) {
+		/* Clear the eventfd, then look again in case we raced the worker. */
+		eventfd_read(w->done_fd, &val);
+		if (!spsc_pop(&w->done, c))
+			return false;
+	}
+	w->inflight--;
+
+	return true;
+}
+
+int bw_worker_fd(struct bw_worker *w)
+{
+	return w->done_fd;
+}
+
+void bw_worker_stop(struct bw_worker *w)
+{
+	if (!w)
+		return;
+
+	atomic_store(&w->stop, true);
+	eventfd_write(w->wake_fd, 1);
+	pthread_join(w->thread, NULL);
+
+	spsc_free(&w->ops);
+	spsc_free(&w->done);
+	close(w->wake_fd);
+	close(w->done_fd);
+	free(w);
+}
@@ -0,0 +1,71 @@
+/*
+ * Thread-per-device execution model.
+ *
+ * A worker owns one open device and runs pre-encoded reports from a
+ * lock-free SPSC ring, posting results to a second ring and signalling an
+ * eventfd.  Workers share nothing, so operations on different splitters run
+ * fully in parallel without locks.
+ *
+ * Each worker has a single owner thread which both submits and reaps; use
+ * one worker per device rather than sharing a worker between threads.
+ */
+
+#ifndef WORKER_H__
+#define WORKER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hidapi.h"
+#include "bellwin.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct bw_op {
+	unsigned char report[BELLWIN_REPORT_SIZE];
+	uint8_t expect_reply;		/* wait for an input report */
+	uint64_t tag;			/* returned in the completion */
+};
+
+struct bw_completion {
+	uint64_t tag;
+	int result;			/* 0 on success, -1 on write error or timeout */
+	unsigned char mask;		/* outlet mask when a reply was expected */
+	uint64_t latency_ns;		/* write to completion */
+};
+
+struct bw_worker;
+
+/* Encode a status query or a set of outlet @idx (1 based). */
+void bw_op_status(struct bw_op *op, uint64_t tag);
+void bw_op_set(struct bw_op *op, int idx, bool on, uint64_t tag);
+
+/*
+ * Start a worker thread driving @hid, with room for @depth operations in
+ * flight (rounded up to a power of two).  @hid stays the caller's: it must
+ * stay open until bw_worker_stop() returns, and be closed by the caller.
+ */
+struct bw_worker *bw_worker_start(hid_device *hid, unsigned depth,
+				  int reply_timeout_ms);
+
+/* Queue @op.  Returns false when @depth operations are already in flight. */
+bool bw_worker_submit(struct bw_worker *w, const struct bw_op *op);
+
+/* Reap one completion.  Returns false when none is ready. */
+bool bw_worker_reap(struct bw_worker *w, struct bw_completion *c);
+
+/*
+ * eventfd that becomes readable when completions are ready, for poll() or
+ * epoll.  bw_worker_reap() clears it.
+ */
+int bw_worker_fd(struct bw_worker *w);
+
+/* Finish queued operations and stop the thread; the device is left open. */
+void bw_worker_stop(struct bw_worker *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif